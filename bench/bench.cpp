@@ -0,0 +1,897 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "expression_tree.h"
+#include "logger.h"
+#include "trace.h"
+#include "bench.h"
+
+const size_t POINTS_AMOUNT = 200000;
+const size_t LOADS_AMOUNT = 2000;
+const char* SERIAL_PATH = "/tmp/bench_tree.bin";
+const char* CACHE_DIR = "/tmp/bench_diff_cache";
+const size_t CACHE_MAX_BYTES = 1 << 24;
+const size_t CACHE_ORDERS[] = {1, 3};
+const size_t MEMO_MAX_ORDER = 4;
+const size_t CANONICAL_MAX_ORDER = 3;
+const size_t EGRAPH_MAX_ORDER = 2;
+const size_t JIT_ORDER = 2;
+const char* CODEGEN_PATH = "/tmp/bench_codegen";
+const size_t CODEGEN_VARS_AMOUNT = 3;
+const size_t CODEGEN_POINTS_AMOUNT = 1000;
+const double POWER_EXPONENTS[] = {2, 3, -1, -2, 7, 0.5, -0.5, 2.5};
+const size_t POWER_ORDER = 3;
+const size_t LOG_BURSTS_AMOUNT = 200;
+const size_t LOG_BURST_LEN = 512;
+const size_t LOG_SITES_ITERATIONS = 10000000;
+const size_t BATCH_MAX_THREADS = 4;
+const size_t BATCH_THREADS[] = {1, 2, BATCH_MAX_THREADS};
+const size_t BATCH_EXPRESSIONS_AMOUNT = 400;
+const size_t BATCH_ORDER = 3;
+const size_t TRACE_SPANS_AMOUNT = 20000;
+const size_t TRACE_REPEATS = 50;
+const char* TRACE_PATH = "/tmp/bench_trace.bin";
+
+const char* BENCH_FORMULAS[] = {
+    "x^3 + sin(x*2) - 5/x $",
+    "sin(cos(x^2)) * ln(x + 3) $",
+    "(x^2 + 1) / (x^3 - 2*x + 7) * sh(x) $",
+    "arctg(x) * arcsin(x/10) + ch(x/3) ^ 2 $",
+    "x^x + x^5 - 3*x^4 + 2*x^3 - x^2 + 7*x - 1 $",
+};
+
+const size_t BENCH_FORMULAS_AMOUNT = sizeof(BENCH_FORMULAS) / sizeof(BENCH_FORMULAS[0]);
+
+// Constant subtrees whose own derivative is NaN: arcch'(1) and arcsin'(1) divide by zero.
+const char* DUAL_FORMULAS[] = {
+    "x^(x + arcch(1)) $",
+    "x^(arcsin(1) * x) + arcsin(1) * x $",
+};
+
+const size_t DUAL_FORMULAS_AMOUNT = sizeof(DUAL_FORMULAS) / sizeof(DUAL_FORMULAS[0]);
+
+const char* CANONICAL_FORMULAS[] = {
+    "2*x*3 $",
+    "x+1+(-1) $",
+    "x*x*x + x + x $",
+    "y*x + x*y - 2*x*y $",
+};
+
+const size_t CANONICAL_FORMULAS_AMOUNT = sizeof(CANONICAL_FORMULAS) / sizeof(CANONICAL_FORMULAS[0]);
+
+const char* POLY_FORMULAS[] = {
+    "x^5 + 3*x^4 - 2*x $",
+    "x^7 - 4*x^5 + x^3 * (2*x^2 - 1) + 9 $",
+    "(x - 1)^6 + x/4 $",
+};
+
+const size_t POLY_FORMULAS_AMOUNT = sizeof(POLY_FORMULAS) / sizeof(POLY_FORMULAS[0]);
+
+// Every formula uses exactly CODEGEN_VARS_AMOUNT variables.
+const char* CODEGEN_FORMULAS[] = {
+    "x^3 * y + sin(x*y) / (y^2 + 1) - z^4 $",
+    "ch(x*z) * ln(x + y*y + 1) + x^5 * z^2 $",
+    "(x*y - z)^3 / (x^2 + y^2 + 1) + sin(x*y - z) $",
+};
+
+const size_t CODEGEN_FORMULAS_AMOUNT = sizeof(CODEGEN_FORMULAS) / sizeof(CODEGEN_FORMULAS[0]);
+
+typedef double (*codegen_func_t)(const double* vars, double* grad);
+
+static double get_time_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static double point(size_t i) {
+    return 0.5 + 4.0 * (double) i / (double) POINTS_AMOUNT;
+}
+
+static void bench_dual_vs_symbolic(FILE* null_ostream, const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    double start = get_time_ns();
+    node_t* derivative = tree.differentiate_expression(null_ostream);
+    derivative = tree.optimize(derivative);
+    double build_ns = get_time_ns() - start;
+
+    double symbolic_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        symbolic_sum += tree.evaluate(derivative, &x);
+    }
+    double symbolic_ns = get_time_ns() - start;
+
+    double dual_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        dual_sum += tree.evaluate_dual(tree.root(), &x, 0).der;
+    }
+    double dual_ns = get_time_ns() - start;
+
+    printf("%-45s build %9.0f ns | symbolic %7.1f ns/pt | dual %7.1f ns/pt | rel diff %.1e\n",
+           formula, build_ns,
+           symbolic_ns / (double) POINTS_AMOUNT, dual_ns / (double) POINTS_AMOUNT,
+           fabs(symbolic_sum - dual_sum) / fmax(fabs(symbolic_sum), 1));
+
+    tree.delete_tree(derivative);
+    tree.dtor();
+}
+
+static void bench_cse_bytecode(FILE* null_ostream, const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    node_t* derivative = tree.optimize(tree.differentiate_expression(null_ostream));
+
+    program_t program = {};
+    double start = get_time_ns();
+    tree.compile(derivative, &program);
+    double compile_ns = get_time_ns() - start;
+
+    double tree_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        tree_sum += tree.evaluate(derivative, &x);
+    }
+    double tree_ns = get_time_ns() - start;
+
+    double program_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        program_sum += tree.execute(&program, &x);
+    }
+    double program_ns = get_time_ns() - start;
+
+    printf("%-45s %4zu nodes -> %4zu instrs (compile %7.0f ns) | tree %7.1f ns/pt | bytecode %7.1f ns/pt | rel diff %.1e\n",
+           formula, tree.count_nodes_r(derivative), program.size, compile_ns,
+           tree_ns / (double) POINTS_AMOUNT, program_ns / (double) POINTS_AMOUNT,
+           fabs(tree_sum - program_sum) / fmax(fabs(tree_sum), 1));
+
+    program_dtor(&program);
+    tree.delete_tree(derivative);
+    tree.dtor();
+}
+
+static void bench_jit(const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    node_t* derivative = tree.nth_derivative(tree.root(), 0, JIT_ORDER, nullptr);
+
+    program_t program = {};
+    double start = get_time_ns();
+    tree.compile(derivative, &program);
+    double compile_ns = get_time_ns() - start;
+
+    jit_t jit = {};
+    start = get_time_ns();
+    tree.jit_compile(derivative, &jit);
+    double jit_compile_ns = get_time_ns() - start;
+
+    double program_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        program_sum += tree.execute(&program, &x);
+    }
+    double program_ns = get_time_ns() - start;
+
+    double jit_sum = 0;
+    start = get_time_ns();
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        jit_sum += tree.jit_execute(&jit, &x);
+    }
+    double jit_ns = get_time_ns() - start;
+
+    printf("%-45s %4zu instrs -> %5zu bytes | compile %7.0f ns, jit %7.0f ns | bytecode %6.1f ns/pt | jit %6.1f ns/pt"
+           " | x%.1f | rel diff %.1e\n",
+           formula, program.size, jit.code_size, compile_ns, jit_compile_ns, program_ns / (double) POINTS_AMOUNT,
+           jit_ns / (double) POINTS_AMOUNT, program_ns / jit_ns, fabs(program_sum - jit_sum) / fmax(fabs(program_sum), 1));
+
+    jit_dtor(&jit);
+    program_dtor(&program);
+    tree.delete_tree(derivative);
+    tree.dtor();
+}
+
+// Writes f and its gradient as C, builds them with the system compiler at -O3 and checks the
+// loaded function against the tree interpreter.
+static void bench_codegen(const char* formula, size_t index) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    char source_path[FILENAME_MAX] = "";
+    char library_path[FILENAME_MAX] = "";
+    snprintf(source_path, sizeof(source_path), "%s%zu.c", CODEGEN_PATH, index);
+    snprintf(library_path, sizeof(library_path), "%s%zu.so", CODEGEN_PATH, index);
+
+    FILE* source = fopen(source_path, "w");
+    if (source == nullptr) {
+        LOG(ERROR, "Failed to open %s\n", source_path);
+        tree.dtor();
+        return;
+    }
+    double start = get_time_ns();
+    err_t error = tree.print_to_c(source, tree.root(), "f");
+    double codegen_ns = get_time_ns() - start;
+    fclose(source);
+
+    // Two paths do not fit under -Wlarger-than on the stack.
+    char* command = (char*) calloc(3 * FILENAME_MAX, sizeof(char));
+    if (command != nullptr) {
+        snprintf(command, 3 * FILENAME_MAX, "cc -O3 -shared -fPIC -o %s %s -lm", library_path, source_path);
+    }
+    start = get_time_ns();
+    void* library = (error == NO_ERR && command != nullptr && system(command) == 0) ? dlopen(library_path, RTLD_NOW) : nullptr;
+    free(command);
+    double cc_ms = (get_time_ns() - start) / 1e6;
+    codegen_func_t func = (library != nullptr) ? (codegen_func_t) dlsym(library, "f") : nullptr;
+    if (func == nullptr) {
+        printf("%-45s failed to build %s\n", formula, source_path);
+        if (library != nullptr) dlclose(library);
+        tree.dtor();
+        return;
+    }
+
+    node_t* gradient[CODEGEN_VARS_AMOUNT] = {};
+    for (size_t i = 0; i < CODEGEN_VARS_AMOUNT; i++) {
+        gradient[i] = tree.nth_derivative(tree.root(), i, 1, nullptr);
+    }
+
+    double max_rel_diff = 0;
+    double tree_ns = 0;
+    double compiled_ns = 0;
+    for (size_t i = 0; i < CODEGEN_POINTS_AMOUNT; i++) {
+        double vars[CODEGEN_VARS_AMOUNT] = {};
+        for (size_t j = 0; j < CODEGEN_VARS_AMOUNT; j++) {
+            vars[j] = point((i * 7919 + j * 104729) % POINTS_AMOUNT);
+        }
+
+        double expected[CODEGEN_VARS_AMOUNT + 1] = {};
+        start = get_time_ns();
+        expected[0] = tree.evaluate(tree.root(), vars);
+        for (size_t j = 0; j < CODEGEN_VARS_AMOUNT; j++) {
+            expected[j + 1] = tree.evaluate(gradient[j], vars);
+        }
+        tree_ns += get_time_ns() - start;
+
+        double actual[CODEGEN_VARS_AMOUNT + 1] = {};
+        start = get_time_ns();
+        actual[0] = func(vars, actual + 1);
+        compiled_ns += get_time_ns() - start;
+
+        for (size_t j = 0; j <= CODEGEN_VARS_AMOUNT; j++) {
+            max_rel_diff = fmax(max_rel_diff, fabs(actual[j] - expected[j]) / fmax(fabs(expected[j]), 1));
+        }
+    }
+
+    printf("%-45s codegen %7.0f ns, cc -O3 %5.0f ms | f + grad: tree %7.1f ns/pt | compiled %5.1f ns/pt | max rel diff %.1e\n",
+           formula, codegen_ns, cc_ms, tree_ns / (double) CODEGEN_POINTS_AMOUNT,
+           compiled_ns / (double) CODEGEN_POINTS_AMOUNT, max_rel_diff);
+
+    for (size_t i = 0; i < CODEGEN_VARS_AMOUNT; i++) {
+        tree.delete_tree(gradient[i]);
+    }
+    dlclose(library);
+    remove(source_path);
+    remove(library_path);
+    tree.dtor();
+}
+
+static void bench_power(double exponent) {
+    double start = get_time_ns();
+    double pow_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        pow_sum += pow(point(i), exponent);
+    }
+    double pow_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    double fast_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        fast_sum += fast_pow(point(i), exponent);
+    }
+    double fast_ns = get_time_ns() - start;
+
+    printf("x^%-4g pow() %5.1f ns | fast_pow() %5.1f ns | rel diff %.1e\n", exponent, pow_ns / (double) POINTS_AMOUNT,
+           fast_ns / (double) POINTS_AMOUNT, fabs(pow_sum - fast_sum) / fmax(fabs(pow_sum), 1));
+}
+
+// Non-finite exponents must go straight to pow(): fast_pow() used to loop forever on NaN.
+static void bench_power_nonfinite() {
+    const double exponents[] = {NAN, INFINITY, -INFINITY};
+    const double bases[] = {0.5, 1, 2, -3};
+    size_t checks_amount = 0;
+    size_t mismatches_amount = 0;
+    for (size_t i = 0; i < sizeof(exponents) / sizeof(exponents[0]); i++) {
+        for (size_t j = 0; j < sizeof(bases) / sizeof(bases[0]); j++) {
+            double expected = pow(bases[j], exponents[i]);
+            double got = fast_pow(bases[j], exponents[i]);
+            bool same = isnan(expected) ? isnan(got) : !(expected < got || expected > got);
+            checks_amount++;
+            if (!same) {
+                mismatches_amount++;
+                printf("x^%g at x = %g: pow() %g, fast_pow() %g\n", exponents[i], bases[j], expected, got);
+            }
+        }
+    }
+    printf("x^nan, x^inf, x^-inf: %zu of %zu fast_pow() results match pow()\n", checks_amount - mismatches_amount,
+           checks_amount);
+}
+
+static size_t count_powers_r(node_t* node) {
+    if (node == nullptr) return 0;
+
+    bool power = node->type == OP && (int) node->value == POW;
+    return (power ? 1 : 0) + count_powers_r(node->left) + count_powers_r(node->right);
+}
+
+static void bench_derivative_powers(const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    node_t* derivative = tree.nth_derivative(tree.root(), 0, POWER_ORDER, nullptr);
+    jit_t jit = {};
+    tree.jit_compile(derivative, &jit);
+
+    double start = get_time_ns();
+    double tree_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        tree_sum += tree.evaluate(derivative, &x);
+    }
+    double tree_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    double jit_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        jit_sum += tree.jit_execute(&jit, &x);
+    }
+    double jit_ns = get_time_ns() - start;
+
+    printf("%-45s %4zu nodes, %3zu powers | tree %7.1f ns/pt | jit %6.1f ns/pt | rel diff %.1e\n", formula,
+           tree.count_nodes_r(derivative), count_powers_r(derivative), tree_ns / (double) POINTS_AMOUNT,
+           jit_ns / (double) POINTS_AMOUNT, fabs(tree_sum - jit_sum) / fmax(fabs(tree_sum), 1));
+
+    jit_dtor(&jit);
+    tree.delete_tree(derivative);
+    tree.dtor();
+}
+
+static void bench_serialization(FILE* null_ostream, const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+    node_t* derivative = tree.optimize(tree.differentiate_expression(null_ostream));
+
+    bytes_t tree_bytes = {};
+    bytes_t dag_bytes = {};
+    tree.serialize(derivative, false, &tree_bytes);
+    tree.serialize(derivative, true, &dag_bytes);
+    tree.store(SERIAL_PATH, tree.root(), false);
+
+    double start = get_time_ns();
+    for (size_t i = 0; i < LOADS_AMOUNT; i++) {
+        exp_tree_t parsed = {};
+        parsed.init(formula);
+        parsed.dtor();
+    }
+    double parse_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    for (size_t i = 0; i < LOADS_AMOUNT; i++) {
+        exp_tree_t loaded = {};
+        loaded.load(SERIAL_PATH);
+        loaded.dtor();
+    }
+    double load_ns = get_time_ns() - start;
+
+    bytes_t root_bytes = {};
+    tree.serialize(tree.root(), false, &root_bytes);
+    start = get_time_ns();
+    for (size_t i = 0; i < LOADS_AMOUNT; i++) {
+        exp_tree_t loaded = {};
+        node_t* root = nullptr;
+        loaded.deserialize(root_bytes.data, root_bytes.size, &root);
+        loaded.delete_tree(root);
+        loaded.dtor();
+    }
+    double deserialize_ns = get_time_ns() - start;
+    bytes_dtor(&root_bytes);
+
+    printf("%-45s parse %6.0f ns | load %6.0f ns | deserialize %6.0f ns | f' %4zu nodes: %5zu bytes tree, %5zu bytes dag\n",
+           formula, parse_ns / (double) LOADS_AMOUNT, load_ns / (double) LOADS_AMOUNT, deserialize_ns / (double) LOADS_AMOUNT,
+           tree.count_nodes_r(derivative), tree_bytes.size, dag_bytes.size);
+
+    bytes_dtor(&tree_bytes);
+    bytes_dtor(&dag_bytes);
+    tree.delete_tree(derivative);
+    tree.dtor();
+}
+
+static void bench_diff_memo(const char* formula, size_t* total_hits, size_t* total_misses) {
+    printf("%-45s", formula);
+
+    for (size_t order = 1; order <= MEMO_MAX_ORDER; order++) {
+        exp_tree_t tree = {};
+        tree.init(formula);
+
+        node_t* derivative = tree.nth_derivative(tree.root(), 0, order, nullptr);
+        size_t hits = 0;
+        size_t misses = 0;
+        tree.diff_memo_stats(&hits, &misses);
+
+        printf(" | order %zu: %4zu/%-4zu", order, hits, hits + misses);
+        *total_hits += hits;
+        *total_misses += misses;
+
+        tree.delete_tree(derivative);
+        tree.dtor();
+    }
+    printf("\n");
+}
+
+static void bench_diff_cache(diff_cache_t* cache, const char* formula, size_t order) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    double start = get_time_ns();
+    node_t* computed = tree.nth_derivative(tree.root(), 0, order, nullptr);
+    double compute_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    node_t* missed = tree.cached_derivative(cache, tree.root(), 0, order);
+    double miss_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    node_t* hit = tree.cached_derivative(cache, tree.root(), 0, order);
+    double hit_ns = get_time_ns() - start;
+
+    double x = point(POINTS_AMOUNT / 3);
+    printf("%-45s order %zu: %5zu nodes | compute %9.0f ns | miss %9.0f ns | hit %9.0f ns | rel diff %.1e\n",
+           formula, order, tree.count_nodes_r(computed), compute_ns, miss_ns, hit_ns,
+           fabs(tree.evaluate(hit, &x) - tree.evaluate(computed, &x)) / fmax(fabs(tree.evaluate(computed, &x)), 1));
+
+    tree.delete_tree(computed);
+    tree.delete_tree(missed);
+    tree.delete_tree(hit);
+    tree.dtor();
+}
+
+static void bench_canonical(const char* formula) {
+    printf("%-45s", formula);
+
+    for (size_t order = 1; order <= CANONICAL_MAX_ORDER; order++) {
+        exp_tree_t tree = {};
+        tree.init(formula);
+
+        node_t* derivative = tree.nth_derivative(tree.root(), 0, order, nullptr);
+        double start = get_time_ns();
+        node_t* canonical = tree.canonicalize(derivative);
+        double canonical_ns = get_time_ns() - start;
+
+        double x = point(POINTS_AMOUNT / 3);
+        double rel_diff = fabs(tree.evaluate(canonical, &x) - tree.evaluate(derivative, &x)) /
+                          fmax(fabs(tree.evaluate(derivative, &x)), 1);
+        printf(" | order %zu: %4zu -> %-4zu %7.0f ns %.0e", order, tree.count_nodes_r(derivative),
+               tree.count_nodes_r(canonical), canonical_ns, rel_diff);
+
+        tree.delete_tree(derivative);
+        tree.delete_tree(canonical);
+        tree.dtor();
+    }
+    printf("\n");
+}
+
+static void bench_polynomial(const char* formula) {
+    exp_tree_t tree = {};
+    tree.init(formula);
+
+    poly_t poly = {};
+    if (!tree.to_polynomial(tree.root(), 0, &poly)) {
+        tree.dtor();
+        return;
+    }
+
+    double start = get_time_ns();
+    double tree_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        double x = point(i);
+        tree_sum += tree.evaluate(tree.root(), &x);
+    }
+    double tree_ns = get_time_ns() - start;
+
+    start = get_time_ns();
+    double horner_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT; i++) {
+        horner_sum += poly_evaluate(&poly, point(i));
+    }
+    double horner_ns = get_time_ns() - start;
+
+    node_t* horner_tree = tree.polynomial_tree(&poly, 0);
+    start = get_time_ns();
+    double horner_tree_sum = 0;
+    for (size_t i = 0; i < POINTS_AMOUNT && horner_tree != nullptr; i++) {
+        double x = point(i);
+        horner_tree_sum += tree.evaluate(horner_tree, &x);
+    }
+    double horner_tree_ns = get_time_ns() - start;
+
+    node_t* derivative = tree.nth_derivative(tree.root(), 0, 3, nullptr);
+    printf("%-45s degree %zu | tree %6.1f ns/pt | horner %5.1f ns/pt | horner tree %5.1f ns/pt | "
+           "rel diff %.0e %.0e | f''' %3zu nodes\n",
+           formula, poly.degree, tree_ns / (double) POINTS_AMOUNT, horner_ns / (double) POINTS_AMOUNT,
+           horner_tree_ns / (double) POINTS_AMOUNT, fabs(horner_sum - tree_sum) / fmax(fabs(tree_sum), 1),
+           fabs(horner_tree_sum - tree_sum) / fmax(fabs(tree_sum), 1), tree.count_nodes_r(derivative));
+
+    tree.delete_tree(horner_tree);
+    tree.delete_tree(derivative);
+    poly_dtor(&poly);
+    tree.dtor();
+}
+
+static void bench_egraph(const char* formula) {
+    printf("%-45s", formula);
+
+    for (size_t order = 1; order <= EGRAPH_MAX_ORDER; order++) {
+        exp_tree_t tree = {};
+        tree.init(formula);
+
+        node_t* derivative = tree.nth_derivative(tree.root(), 0, order, nullptr);
+        double start = get_time_ns();
+        node_t* optimized = tree.optimize_egraph(derivative);
+        double egraph_ms = (get_time_ns() - start) / 1e6;
+
+        double x = point(POINTS_AMOUNT / 3);
+        double rel_diff = fabs(tree.evaluate(optimized, &x) - tree.evaluate(derivative, &x)) /
+                          fmax(fabs(tree.evaluate(derivative, &x)), 1);
+        printf(" | order %zu: cost %4.0f -> %-4.0f %5.1f ms %.0e", order, tree.expression_cost(derivative),
+               tree.expression_cost(optimized), egraph_ms, rel_diff);
+
+        tree.delete_tree(derivative);
+        tree.delete_tree(optimized);
+        tree.dtor();
+    }
+    printf("\n");
+}
+
+// Bursts of LOG_BURST_LEN records fit into the default ring, only the calls are timed.
+static double bench_log_calls(const char* formula) {
+    double total_ns = 0;
+    for (size_t burst = 0; burst < LOG_BURSTS_AMOUNT; burst++) {
+        double start = get_time_ns();
+        for (size_t i = 0; i < LOG_BURST_LEN; i++) {
+            LOG(INFO, "record %zu of %s: x = %lf\n", i, formula, point(i));
+        }
+        total_ns += get_time_ns() - start;
+        LoggerFlush();
+    }
+    return total_ns / (double) (LOG_BURSTS_AMOUNT * LOG_BURST_LEN);
+}
+
+// The caller of LOG only pays for the enqueue in the async mode, the write happens on the logger thread.
+static void bench_logger(FILE* null_ostream, const char* formula) {
+    LoggerSetFile(null_ostream);
+    LoggerSetLevel(INFO);
+
+    double sync_ns = bench_log_calls(formula);
+    double async_ns = NAN;
+    if (LoggerStartAsync(0, LOG_BLOCK)) {
+        async_ns = bench_log_calls(formula);
+        LoggerStopAsync();
+    }
+
+    LoggerSetFile(stderr);
+    LoggerSetLevel(ERROR);
+    printf("LOG() call: sync %6.1f ns | async %6.1f ns | speedup %.1fx\n", sync_ns, async_ns, sync_ns / async_ns);
+}
+
+// The same loop with a DEBUG site: enabled at compile time but off at runtime, compiled
+// out by LOG_MIN_LEVEL, and without the site. The argument is never evaluated in the first two.
+static double log_site_argument(double x) {
+    return sin(x) * exp(x);
+}
+
+static double bench_log_site_runtime() {
+    double sum = 0;
+    for (size_t i = 0; i < LOG_SITES_ITERATIONS; i++) {
+        sum += (double) i * 0.5;
+        LOG(DEBUG, "i = %zu, f = %lf\n", i, log_site_argument(sum));
+    }
+    return sum;
+}
+
+#pragma push_macro("LOG_MIN_LEVEL")
+#undef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL WARNING
+static double bench_log_site_stripped() {
+    double sum = 0;
+    for (size_t i = 0; i < LOG_SITES_ITERATIONS; i++) {
+        sum += (double) i * 0.5;
+        LOG(DEBUG, "i = %zu, f = %lf\n", i, log_site_argument(sum));
+    }
+    return sum;
+}
+#pragma pop_macro("LOG_MIN_LEVEL")
+
+static double bench_log_site_none() {
+    double sum = 0;
+    for (size_t i = 0; i < LOG_SITES_ITERATIONS; i++) {
+        sum += (double) i * 0.5;
+    }
+    return sum;
+}
+
+static void bench_log_sites() {
+    double (*loops[])() = {bench_log_site_runtime, bench_log_site_stripped, bench_log_site_none};
+    const char* names[] = {"disabled at runtime", "LOG_MIN_LEVEL=WARNING", "no LOG site"};
+
+    for (size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+        double start = get_time_ns();
+        volatile double sum = loops[i]();
+        (void) sum;
+        printf("LOG(DEBUG) %-22s %.2f ns/iteration\n", names[i], (get_time_ns() - start) / (double) LOG_SITES_ITERATIONS);
+    }
+}
+
+typedef struct {
+    size_t first;
+    size_t step;
+    bool context;
+} batch_worker_t;
+
+// Differentiates every step-th expression of the batch, logging at INFO with its own context.
+static void* batch_worker(void* arg) {
+    batch_worker_t* worker = (batch_worker_t*) arg;
+    if (worker->context) {
+        LoggerThreadBegin(worker->first);
+    }
+
+    for (size_t i = worker->first; i < BATCH_EXPRESSIONS_AMOUNT; i += worker->step) {
+        LoggerSetExpression(i);
+        exp_tree_t tree = {};
+        tree.init(BENCH_FORMULAS[i % BENCH_FORMULAS_AMOUNT]);
+        node_t* derivative = tree.nth_derivative(tree.root(), 0, BATCH_ORDER, nullptr);
+        tree.delete_tree(derivative);
+        tree.dtor();
+    }
+
+    if (worker->context) {
+        LoggerThreadEnd();
+    }
+    return nullptr;
+}
+
+static double bench_batch(size_t threads_amount, bool context) {
+    pthread_t threads[BATCH_MAX_THREADS] = {};
+    batch_worker_t workers[BATCH_MAX_THREADS] = {};
+
+    double start = get_time_ns();
+    for (size_t i = 0; i < threads_amount; i++) {
+        workers[i] = {i, threads_amount, context};
+        pthread_create(&threads[i], nullptr, batch_worker, &workers[i]);
+    }
+    for (size_t i = 0; i < threads_amount; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    return (get_time_ns() - start) / 1e6;
+}
+
+static void bench_batch_logging(FILE* null_ostream) {
+    for (size_t i = 0; i < sizeof(BATCH_THREADS) / sizeof(BATCH_THREADS[0]); i++) {
+        LoggerSetLevel(ERROR);
+        double quiet_ms = bench_batch(BATCH_THREADS[i], false);
+
+        LoggerSetFile(null_ostream);
+        LoggerSetLevel(INFO);
+        double shared_ms = bench_batch(BATCH_THREADS[i], false);
+        double context_ms = bench_batch(BATCH_THREADS[i], true);
+        LoggerSetFile(stderr);
+        LoggerSetLevel(ERROR);
+
+        printf("%zu threads: logging off %7.1f ms | shared sink %7.1f ms | per-thread contexts %7.1f ms\n",
+               BATCH_THREADS[i], quiet_ms, shared_ms, context_ms);
+    }
+}
+
+// Spans of an empty scope: recorded, skipped at runtime after trace_stop(), and no span.
+static double bench_trace_loop(bool span) {
+    double total_ns = 0;
+    volatile size_t sink = 0;
+    for (size_t repeat = 0; repeat < TRACE_REPEATS; repeat++) {
+        if (TRACE_ACTIVE.load()) {
+            trace_start();
+        }
+        double start = get_time_ns();
+        for (size_t i = 0; i < TRACE_SPANS_AMOUNT; i++) {
+            if (span) {
+                trace_span_t trace_span("bench_span");
+                sink = sink + i;
+            }
+            else {
+                sink = sink + i;
+            }
+        }
+        total_ns += get_time_ns() - start;
+    }
+    return total_ns / (double) (TRACE_SPANS_AMOUNT * TRACE_REPEATS);
+}
+
+static void bench_trace() {
+    trace_start();
+    double enabled_ns = bench_trace_loop(true);
+    trace_stop();
+    double disabled_ns = bench_trace_loop(true);
+    double none_ns = bench_trace_loop(false);
+
+    printf("span: enabled %.1f ns | disabled at runtime %.1f ns | no span %.1f ns\n", enabled_ns, disabled_ns, none_ns);
+
+    trace_start();
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        trace_set_expression(i);
+        exp_tree_t tree = {};
+        tree.init(BENCH_FORMULAS[i]);
+        tree.delete_tree(tree.optimize(tree.differentiate(tree.root(), 0)));
+        tree.dtor();
+    }
+    trace_stop();
+
+    FILE* null_ostream = fopen("/dev/null", "w");
+    if (trace_write(TRACE_PATH) && null_ostream != nullptr) {
+        double start = get_time_ns();
+        bool exported = trace_export_chrome(TRACE_PATH, null_ostream);
+        printf("parse + differentiate + optimize of %zu formulas traced, Chrome export %s in %.0f us\n",
+               BENCH_FORMULAS_AMOUNT, exported ? "done" : "failed", (get_time_ns() - start) / 1e3);
+    }
+    if (null_ostream != nullptr) {
+        fclose(null_ostream);
+    }
+    remove(TRACE_PATH);
+}
+
+// bench --json <path> runs only the corpus suite and stores its results.
+int main(int argc, char** argv) {
+    LoggerSetFile(stderr);
+    LoggerSetLevel(ERROR);
+
+    if (argc == 3 && strcmp(argv[1], "--json") == 0) {
+        FILE* json_ostream = fopen(argv[2], "w");
+        if (json_ostream == nullptr) {
+            LOG(ERROR, "Failed to open %s\n", argv[2]);
+            return 1;
+        }
+        run_suite(json_ostream);
+        fclose(json_ostream);
+        return 0;
+    }
+
+    FILE* null_ostream = fopen("/dev/null", "w");
+    if (null_ostream == nullptr) {
+        LOG(ERROR, "Failed to open /dev/null\n");
+        return 1;
+    }
+
+    printf("f'(x) at %zu points: symbolic derivative tree vs forward-mode dual numbers\n", POINTS_AMOUNT);
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_dual_vs_symbolic(null_ostream, BENCH_FORMULAS[i]);
+    }
+    for (size_t i = 0; i < DUAL_FORMULAS_AMOUNT; i++) {
+        bench_dual_vs_symbolic(null_ostream, DUAL_FORMULAS[i]);
+    }
+
+    printf("\nf'(x) at %zu points: tree walk vs CSE'd bytecode of the optimized derivative\n", POINTS_AMOUNT);
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_cse_bytecode(null_ostream, BENCH_FORMULAS[i]);
+    }
+
+    printf("\nd^%zu f/dx^%zu at %zu points: bytecode interpreter vs native SSE2 code from jit_compile()\n",
+           JIT_ORDER, JIT_ORDER, POINTS_AMOUNT);
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_jit(BENCH_FORMULAS[i]);
+    }
+
+    printf("\nf and its gradient at %zu points: tree interpreter vs C code from print_to_c() built with cc -O3\n",
+           CODEGEN_POINTS_AMOUNT);
+    for (size_t i = 0; i < CODEGEN_FORMULAS_AMOUNT; i++) {
+        bench_codegen(CODEGEN_FORMULAS[i], i);
+    }
+
+    printf("\nx^n at %zu points: pow() vs fast_pow() (multiply chains, sqrt, reciprocals)\n", POINTS_AMOUNT);
+    for (size_t i = 0; i < sizeof(POWER_EXPONENTS) / sizeof(POWER_EXPONENTS[0]); i++) {
+        bench_power(POWER_EXPONENTS[i]);
+    }
+    bench_power_nonfinite();
+    printf("d^%zu f/dx^%zu at %zu points with specialized powers\n", POWER_ORDER, POWER_ORDER, POINTS_AMOUNT);
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_derivative_powers(BENCH_FORMULAS[i]);
+    }
+
+    size_t memo_hits = 0;
+    size_t memo_misses = 0;
+    printf("\nDerivative memo inside differentiate(): hits/lookups of shared subtrees, orders 1..%zu\n", MEMO_MAX_ORDER);
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_diff_memo(BENCH_FORMULAS[i], &memo_hits, &memo_misses);
+    }
+    printf("memo: %zu hits, %zu misses, hit rate %.0f%%\n", memo_hits, memo_misses,
+           100.0 * (double) memo_hits / (double) fmax((double) (memo_hits + memo_misses), 1));
+
+    printf("\nf(x) parsed from text vs loaded from the binary format, f'(x) serialized as a tree and as a DAG\n");
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_serialization(null_ostream, BENCH_FORMULAS[i]);
+    }
+    remove(SERIAL_PATH);
+
+    char rm_command[FILENAME_MAX] = "";
+    snprintf(rm_command, sizeof(rm_command), "rm -rf %s", CACHE_DIR);
+    system(rm_command);
+
+    diff_cache_t cache = {};
+    if (diff_cache_ctor(&cache, CACHE_DIR, CACHE_MAX_BYTES) == NO_ERR) {
+        printf("\nd^n f/dx^n: nth_derivative vs on-disk cache, cold (miss + store) and warm (hit)\n");
+        for (size_t i = 0; i < sizeof(CACHE_ORDERS) / sizeof(CACHE_ORDERS[0]); i++) {
+            for (size_t j = 0; j < BENCH_FORMULAS_AMOUNT; j++) {
+                bench_diff_cache(&cache, BENCH_FORMULAS[j], CACHE_ORDERS[i]);
+            }
+        }
+        printf("cache: %zu hits, %zu misses, hit rate %.0f%%\n", cache.hits, cache.misses,
+               100.0 * (double) cache.hits / (double) (cache.hits + cache.misses));
+        diff_cache_dtor(&cache);
+    }
+    system(rm_command);
+
+    printf("\nd^n f/dx^n: optimized nodes -> canonical form nodes, canonicalize() time, rel diff\n");
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_canonical(BENCH_FORMULAS[i]);
+    }
+    for (size_t i = 0; i < CANONICAL_FORMULAS_AMOUNT; i++) {
+        exp_tree_t tree = {};
+        tree.init(CANONICAL_FORMULAS[i]);
+        node_t* canonical = tree.canonicalize(tree.root());
+        printf("%-45s -> ", CANONICAL_FORMULAS[i]);
+        tree.print_exp_to_tex(stdout, canonical);
+        tree.delete_tree(canonical);
+        tree.dtor();
+    }
+
+    printf("\nPolynomials at %zu points: tree walk vs Horner's scheme over the coefficient vector and as a tree\n", POINTS_AMOUNT);
+    for (size_t i = 0; i < POLY_FORMULAS_AMOUNT; i++) {
+        bench_polynomial(POLY_FORMULAS[i]);
+    }
+
+    printf("\nd^n f/dx^n: cost of optimize() -> cost after optimize_egraph(), e-graph time, rel diff\n");
+    for (size_t i = 0; i < BENCH_FORMULAS_AMOUNT; i++) {
+        bench_egraph(BENCH_FORMULAS[i]);
+    }
+
+    printf("\n%zu bursts of %zu log records to /dev/null: LOG() in the caller thread vs the async ring buffer\n",
+           LOG_BURSTS_AMOUNT, LOG_BURST_LEN);
+    bench_logger(null_ostream, BENCH_FORMULAS[0]);
+
+    printf("\n%zu iterations of a loop with a LOG(DEBUG) site, runtime level ERROR\n", LOG_SITES_ITERATIONS);
+    bench_log_sites();
+
+    printf("\nd^%zu f/dx^%zu of %zu expressions split between threads, INFO records to /dev/null\n",
+           BATCH_ORDER, BATCH_ORDER, BATCH_EXPRESSIONS_AMOUNT);
+    bench_batch_logging(null_ostream);
+
+    printf("\n%zu x %zu tracing spans around an empty scope\n", TRACE_REPEATS, TRACE_SPANS_AMOUNT);
+    bench_trace();
+
+    printf("\nGenerated corpus, %s\n", "medians of repeated runs from the text on");
+    run_suite(nullptr);
+
+    fclose(null_ostream);
+    return 0;
+}
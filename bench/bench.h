@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+void run_suite(FILE* json_ostream);
+
+#endif /* BENCH_H */
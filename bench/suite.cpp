@@ -0,0 +1,374 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "expression_tree.h"
+#include "logger.h"
+#include "bench.h"
+
+const uint64_t CORPUS_SEED = 0x5eed2024u;
+const size_t SUITE_REPEATS = 15;
+const size_t SUITE_EVAL_POINTS = 256;
+const size_t SUITE_MAX_VARS = 32;
+
+typedef enum {
+    SHAPE_DEEP       = 0,
+    SHAPE_WIDE_SUM   = 1,
+    SHAPE_PRODUCT    = 2,
+    SHAPE_TOWER      = 3,
+    SHAPE_MANY_VARS  = 4,
+    SHAPE_FUNCTIONS  = 5,
+} shape_t;
+
+typedef struct {
+    shape_t shape;
+    const char* name;
+    size_t size;
+} corpus_entry_t;
+
+const corpus_entry_t CORPUS[] = {
+    {SHAPE_DEEP,      "deep",      16},
+    {SHAPE_DEEP,      "deep",      64},
+    {SHAPE_WIDE_SUM,  "wide_sum",  32},
+    {SHAPE_WIDE_SUM,  "wide_sum",  256},
+    {SHAPE_PRODUCT,   "product",   8},
+    {SHAPE_PRODUCT,   "product",   32},
+    {SHAPE_TOWER,     "tower",     2},
+    {SHAPE_TOWER,     "tower",     4},
+    {SHAPE_MANY_VARS, "many_vars", 8},
+    {SHAPE_MANY_VARS, "many_vars", 32},
+    {SHAPE_FUNCTIONS, "functions", 18},
+    {SHAPE_FUNCTIONS, "functions", 72},
+};
+
+const size_t CORPUS_SIZE = sizeof(CORPUS) / sizeof(CORPUS[0]);
+
+typedef enum {
+    STAGE_TOKENIZE      = 0,
+    STAGE_PARSE         = 1,
+    STAGE_DIFFERENTIATE = 2,
+    STAGE_OPTIMIZE      = 3,
+    STAGE_EVALUATE      = 4,
+    STAGE_PRINT         = 5,
+    STAGE_PIPELINE      = 6,
+    STAGES_AMOUNT       = 7,
+} stage_t;
+
+const char* STAGE_NAMES[STAGES_AMOUNT] = {
+    "tokenize_text", "get_g", "differentiate", "optimize", "evaluate", "print_tex", "pipeline"
+};
+
+typedef struct {
+    size_t nodes;
+    size_t derivative_nodes;
+    size_t optimized_nodes;
+    double min_ns[STAGES_AMOUNT];
+    double median_ns[STAGES_AMOUNT];
+} suite_result_t;
+
+static uint64_t next_random(uint64_t* state);
+static size_t random_below(uint64_t* state, size_t n);
+static bool generate_expression(uint64_t* state, shape_t shape, size_t size, bytes_t* expression);
+static bool append_str(bytes_t* bytes, const char* str);
+static bool append_function(uint64_t* state, bytes_t* bytes, const char* arg);
+static bool append_leaf(uint64_t* state, bytes_t* bytes);
+static bool run_entry(const char* expression, suite_result_t* result);
+static double get_time_ns();
+static int cmp_doubles(const void* a, const void* b);
+
+//===================================CORPUS======================================================
+// splitmix64 with a fixed seed: the corpus is the same on every machine and every run.
+// Only integer constants are generated, log(a, b) is left out since the grammar has no
+// two-argument calls, and a function is never raised to a power directly: the parser
+// reads f(x)^2 as f(x^2).
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+static size_t random_below(uint64_t* state, size_t n) {
+    return (size_t) (next_random(state) % n);
+}
+
+static bool append_str(bytes_t* bytes, const char* str) {
+    return bytes_append(bytes, str, strlen(str)) == NO_ERR;
+}
+
+static bool append_leaf(uint64_t* state, bytes_t* bytes) {
+    char leaf[MAX_NAME_LEN] = "";
+    if (random_below(state, 2) == 0) {
+        snprintf(leaf, sizeof(leaf), "x");
+    }
+    else {
+        snprintf(leaf, sizeof(leaf), "%zu", random_below(state, 9) + 1);
+    }
+    return append_str(bytes, leaf);
+}
+
+// Any function of func_name_table but the arithmetic and log.
+static bool append_function(uint64_t* state, bytes_t* bytes, const char* arg) {
+    size_t index = 0;
+    do {
+        index = random_below(state, func_name_table_len);
+    } while (func_name_table[index].code <= LOG);
+
+    return append_str(bytes, func_name_table[index].name) && append_str(bytes, "(") &&
+           append_str(bytes, arg) && append_str(bytes, ")");
+}
+
+static bool generate_expression(uint64_t* state, shape_t shape, size_t size, bytes_t* expression) {
+    const char* ops[] = {" + ", " - ", " * ", " / "};
+    bytes_t inner = {};
+    bool ok = true;
+    char term[MAX_OP_LEN * 8] = "";
+
+    switch (shape) {
+        case SHAPE_DEEP:
+            ok = append_str(expression, "x");
+            for (size_t i = 0; i < size && ok; i++) {
+                bytes_dtor(&inner);
+                ok = bytes_append(&inner, expression->data, expression->size) == NO_ERR &&
+                     bytes_append(&inner, "", 1) == NO_ERR;
+                expression->size = 0;
+
+                switch (random_below(state, 3)) {
+                    case 0:
+                        ok = ok && append_function(state, expression, (const char*) inner.data);
+                        break;
+                    case 1:
+                        ok = ok && append_str(expression, "(") && append_str(expression, (const char*) inner.data) &&
+                             append_str(expression, ops[random_below(state, 4)]) && append_leaf(state, expression) &&
+                             append_str(expression, ")");
+                        break;
+                    default:
+                        ok = ok && append_str(expression, "(") && append_leaf(state, expression) &&
+                             append_str(expression, ops[random_below(state, 3)]) &&
+                             append_str(expression, (const char*) inner.data) && append_str(expression, ")");
+                        break;
+                }
+            }
+            break;
+        case SHAPE_WIDE_SUM:
+            for (size_t i = 0; i < size && ok; i++) {
+                if (i != 0) ok = append_str(expression, ops[random_below(state, 2)]);
+                switch (random_below(state, 3)) {
+                    case 0:
+                        snprintf(term, sizeof(term), "%zu*x^%zu", random_below(state, 9) + 1, random_below(state, 6) + 1);
+                        ok = ok && append_str(expression, term);
+                        break;
+                    case 1:
+                        snprintf(term, sizeof(term), "%zu*", random_below(state, 9) + 1);
+                        ok = ok && append_str(expression, term) && append_function(state, expression, "x");
+                        break;
+                    default:
+                        snprintf(term, sizeof(term), "x/%zu", random_below(state, 9) + 1);
+                        ok = ok && append_str(expression, term);
+                        break;
+                }
+            }
+            break;
+        case SHAPE_PRODUCT:
+            for (size_t i = 0; i < size && ok; i++) {
+                if (i != 0) ok = append_str(expression, (random_below(state, 4) == 0) ? " / " : " * ");
+                switch (random_below(state, 3)) {
+                    case 0:
+                        snprintf(term, sizeof(term), "(x + %zu)", random_below(state, 9) + 1);
+                        ok = ok && append_str(expression, term);
+                        break;
+                    case 1:
+                        ok = ok && append_function(state, expression, "x");
+                        break;
+                    default:
+                        snprintf(term, sizeof(term), "x^%zu", random_below(state, 4) + 2);
+                        ok = ok && append_str(expression, term);
+                        break;
+                }
+            }
+            break;
+        case SHAPE_TOWER:
+            ok = append_str(expression, "x");
+            for (size_t i = 0; i < size && ok; i++) {
+                snprintf(term, sizeof(term), "(x + %zu)^(", random_below(state, 9) + 1);
+                bytes_dtor(&inner);
+                ok = append_str(&inner, term) && bytes_append(&inner, expression->data, expression->size) == NO_ERR &&
+                     append_str(&inner, ")");
+                expression->size = 0;
+                ok = ok && bytes_append(expression, inner.data, inner.size) == NO_ERR;
+            }
+            break;
+        case SHAPE_MANY_VARS:
+            for (size_t i = 0; i < size && ok; i++) {
+                size_t next = (i + 1 + random_below(state, size)) % size;
+                if (i != 0) ok = append_str(expression, ops[random_below(state, 2)]);
+                if (random_below(state, 2) == 0) {
+                    snprintf(term, sizeof(term), "v%zu*v%zu", i, next);
+                    ok = ok && append_str(expression, term);
+                }
+                else {
+                    snprintf(term, sizeof(term), "v%zu + v%zu", i, next);
+                    ok = ok && append_function(state, expression, term);
+                }
+            }
+            break;
+        case SHAPE_FUNCTIONS:
+            for (size_t i = 0; i < size && ok; i++) {
+                if (i != 0) ok = append_str(expression, ops[random_below(state, 2)]);
+                snprintf(term, sizeof(term), "x/%zu", random_below(state, 9) + 1);
+                bytes_dtor(&inner);
+                ok = ok && append_function(state, &inner, term) && bytes_append(&inner, "", 1) == NO_ERR &&
+                     append_function(state, expression, (const char*) inner.data);
+            }
+            break;
+        default:
+            ok = false;
+            break;
+    }
+
+    bytes_dtor(&inner);
+    return ok && append_str(expression, " $") && bytes_append(expression, "", 1) == NO_ERR;
+}
+
+//===================================SUITE=======================================================
+// Every corpus entry is run SUITE_REPEATS times from the text on; min and median are kept.
+// tokenize_text and get_g are private, their times come from the phase timers of stats().
+// So is print_inorder, it is timed through print_exp_to_tex() as the print_tex stage.
+// calculate_expression() asks for variable values on stdin, so evaluate() is measured.
+
+static bool run_entry(const char* expression, suite_result_t* result) {
+    double samples[STAGES_AMOUNT][SUITE_REPEATS] = {};
+    double vars[MAX_VARS_AMOUNT] = {};
+
+    FILE* null_ostream = fopen("/dev/null", "w");
+    if (null_ostream == nullptr) {
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t repeat = 0; repeat <= SUITE_REPEATS && ok; repeat++) {
+        double start = get_time_ns();
+        exp_tree_t tree = {};
+        if (tree.init(expression) != NO_ERR || tree.root() == nullptr) {
+            ok = false;
+            break;
+        }
+
+        double differentiate_start = get_time_ns();
+        node_t* derivative = tree.differentiate(tree.root(), 0);
+        double optimize_start = get_time_ns();
+        node_t* optimized = tree.optimize(derivative);
+        double print_start = get_time_ns();
+        tree.print_exp_to_tex(null_ostream, optimized);
+        double pipeline_ns = get_time_ns() - start;
+
+        double evaluate_start = get_time_ns();
+        volatile double sum = 0;
+        for (size_t i = 0; i < SUITE_EVAL_POINTS; i++) {
+            for (size_t j = 0; j < SUITE_MAX_VARS; j++) {
+                vars[j] = 0.1 + (double) ((i + j) % 17) / 17;
+            }
+            sum = sum + tree.evaluate(optimized, vars);
+        }
+        double evaluate_ns = (get_time_ns() - evaluate_start) / (double) SUITE_EVAL_POINTS;
+
+        // The first run warms the caches and the rule trie up.
+        if (repeat != 0) {
+            const exp_stats_t* stats = tree.stats();
+            size_t i = repeat - 1;
+            samples[STAGE_TOKENIZE][i] = stats->phase_ms[PHASE_TOKENIZE] * 1e6;
+            samples[STAGE_PARSE][i] = stats->phase_ms[PHASE_PARSE] * 1e6;
+            samples[STAGE_DIFFERENTIATE][i] = optimize_start - differentiate_start;
+            samples[STAGE_OPTIMIZE][i] = print_start - optimize_start;
+            samples[STAGE_EVALUATE][i] = evaluate_ns;
+            samples[STAGE_PRINT][i] = stats->phase_ms[PHASE_TEX] * 1e6;
+            samples[STAGE_PIPELINE][i] = pipeline_ns;
+
+            result->nodes = stats->nodes_parsed;
+            result->derivative_nodes = stats->nodes_differentiated;
+            result->optimized_nodes = stats->nodes_optimized;
+        }
+
+        tree.delete_tree(optimized);
+        tree.dtor();
+    }
+    fclose(null_ostream);
+
+    for (size_t stage = 0; stage < STAGES_AMOUNT && ok; stage++) {
+        qsort(samples[stage], SUITE_REPEATS, sizeof(double), cmp_doubles);
+        result->min_ns[stage] = samples[stage][0];
+        result->median_ns[stage] = samples[stage][SUITE_REPEATS / 2];
+    }
+    return ok;
+}
+
+// One line per corpus entry, stable keys, so two runs can be compared with diff or jq.
+void run_suite(FILE* json_ostream) {
+    uint64_t state = CORPUS_SEED;
+
+    printf("%-14s %6s %7s %7s |", "expression", "nodes", "d/dx", "opt");
+    for (size_t stage = 0; stage < STAGES_AMOUNT; stage++) {
+        printf(" %13s", STAGE_NAMES[stage]);
+    }
+    printf("   (median ns)\n");
+
+    if (json_ostream != nullptr) {
+        fprintf(json_ostream, "{\"seed\": %" PRIu64 ", \"repeats\": %zu, \"eval_points\": %zu, \"compiler\": \"%s\", \"results\": [\n",
+                CORPUS_SEED, SUITE_REPEATS, SUITE_EVAL_POINTS, __VERSION__);
+    }
+
+    bool first = true;
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        bytes_t expression = {};
+        suite_result_t result = {};
+        char name[MAX_NAME_LEN * 2] = "";
+        snprintf(name, sizeof(name), "%s_%zu", CORPUS[i].name, CORPUS[i].size);
+
+        if (!generate_expression(&state, CORPUS[i].shape, CORPUS[i].size, &expression) ||
+            !run_entry((const char*) expression.data, &result)) {
+            LOG(ERROR, "Failed to run %s\n", name);
+            bytes_dtor(&expression);
+            continue;
+        }
+        bytes_dtor(&expression);
+
+        printf("%-14s %6zu %7zu %7zu |", name, result.nodes, result.derivative_nodes, result.optimized_nodes);
+        for (size_t stage = 0; stage < STAGES_AMOUNT; stage++) {
+            printf(" %13.0f", result.median_ns[stage]);
+        }
+        printf("\n");
+
+        if (json_ostream != nullptr) {
+            fprintf(json_ostream, "%s{\"name\": \"%s\", \"shape\": \"%s\", \"size\": %zu, \"nodes\": %zu, "
+                                  "\"derivative_nodes\": %zu, \"optimized_nodes\": %zu",
+                    first ? "" : ",\n", name, CORPUS[i].name, CORPUS[i].size, result.nodes,
+                    result.derivative_nodes, result.optimized_nodes);
+            for (size_t stage = 0; stage < STAGES_AMOUNT; stage++) {
+                fprintf(json_ostream, ", \"%s\": {\"min_ns\": %.0f, \"median_ns\": %.0f}", STAGE_NAMES[stage],
+                        result.min_ns[stage], result.median_ns[stage]);
+            }
+            fprintf(json_ostream, "}");
+            first = false;
+        }
+    }
+
+    if (json_ostream != nullptr) {
+        fprintf(json_ostream, "\n]}\n");
+    }
+}
+
+static double get_time_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int cmp_doubles(const void* a, const void* b) {
+    double lhs = *(const double*) a;
+    double rhs = *(const double*) b;
+    return (lhs > rhs) - (lhs < rhs);
+}
@@ -2,20 +2,117 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <atomic>
 #include "logger.h"
 #include "define_colors.h"
 
 static const char* LogMessageTypePrint(enum LogLevel level, bool color);
-static void TimePrint(FILE *out);
 static void AestheticizeString(const char *src, char *dst, size_t max_len);
 
-const size_t MAXLINE = 100;
+const size_t LOG_MAX_ARGS = 16;
+const size_t LOG_STRINGS_LEN = 192;
+const size_t LOG_MESSAGE_LEN = 512;
+const size_t LOG_LINE_LEN = 1024;
+const size_t LOG_SPEC_LEN = 48;
+const size_t LOG_DEFAULT_CAPACITY = 1024;
+const size_t LOG_CONTEXT_BUFFER_LEN = 16384;
+const long LOG_IDLE_NS = 500000;
+const long LOG_WAIT_NS = 50000;
+
+typedef enum {
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_INTMAX,
+    ARG_PTRDIFF,
+    ARG_DOUBLE,
+    ARG_LDOUBLE,
+    ARG_PTR,
+    ARG_STRING,
+    ARG_NONE
+} log_arg_kind_t;
+
+typedef struct {
+    size_t len;
+    log_arg_kind_t kind;
+    bool is_unsigned;
+    size_t stars;
+    char conversion;
+} log_spec_t;
+
+// %ll conversions are stored and printed as 64-bit integers, which long long is on every
+// target the logger is built for; the type is not named, -Wlong-long is on.
+typedef union {
+    int64_t integer;
+    uint64_t uinteger;
+    double real;
+    long double long_real;
+    const void* pointer;
+    size_t offset;
+} log_arg_t;
+
+typedef struct {
+    std::atomic<size_t> sequence;
+    enum LogLevel level;
+    const char* file;
+    size_t line;
+    const char* func;
+    const char* fmt;
+    size_t thread_id;
+    size_t expression_id;
+    struct timespec time;
+    size_t args_amount;
+    log_arg_t args[LOG_MAX_ARGS];
+    char strings[LOG_STRINGS_LEN];
+} log_record_t;
+
+typedef struct {
+    log_record_t* records;
+    size_t mask;
+    enum LogOverflow policy;
+    std::atomic<size_t> enqueue_pos;
+    std::atomic<size_t> dequeue_pos;
+    std::atomic<size_t> dropped;
+    std::atomic<bool> active;
+    std::atomic<bool> running;
+    pthread_t thread;
+} log_queue_t;
+
+typedef struct {
+    size_t thread_id;
+    size_t expression_id;
+    size_t len;
+    char buffer[LOG_CONTEXT_BUFFER_LEN];
+} log_context_t;
+
+static log_queue_t* GetQueue();
+static void LogAsync(enum LogLevel status, const char* file, size_t line, const char* func, const char* fmt, va_list args);
+static void* LogThread(void* arg);
+static void WriteRecord(log_record_t* record);
+static void CaptureArgs(log_record_t* record, const char* fmt, va_list args);
+static size_t RenderMessage(const log_record_t* record, char* dst, size_t size);
+static size_t RenderArg(const log_record_t* record, const log_spec_t* spec, const char* fmt, size_t* arg, char* dst, size_t size);
+static log_spec_t ParseSpec(const char* fmt);
+static void SleepNs(long ns);
+static log_context_t* GetContext();
+static void DestroyContext(void* context);
+static void CreateContextKey();
+static void WriteContext(log_context_t* context);
+static size_t FormatRecord(char* dst, size_t size, enum LogLevel level, const char* file, size_t line, const char* func,
+                           const struct timespec* time, size_t thread_id, size_t expression_id, const char* message);
 
 //----------------------------------------------------------------------------------------------
 
+logger_t LoggerState = {};
+
 static logger_t* GetLogger() {
-    static logger_t logger = {};
-    return &logger;
+    return &LoggerState;
 }
 
 void LoggerSetFile(FILE* out) {
@@ -34,6 +131,9 @@ void LoggerSetLevel(enum LogLevel level) {
 
 //----------------------------------------------------------------------------------------------
 
+// Every record is formatted in full and written with a single fwrite, so records of
+// different threads never interleave. A thread with a context appends them to its own
+// buffer instead and hands the buffer to the sink only when it is full.
 void Log(enum LogLevel status, const char* file, size_t line, const char* func, const char *fmt, ...) {
     assert(fmt != nullptr);
 
@@ -41,23 +141,553 @@ void Log(enum LogLevel status, const char* file, size_t line, const char* func,
         return;
     }
 
-    char dst[MAXLINE] = "";
-    AestheticizeString(fmt, dst, MAXLINE);
-
     va_list args;
     va_start (args, fmt);
 
-    bool color = GetLogger()->file_out == stderr || GetLogger()->file_out == stdout;
-    fprintf(GetLogger()->file_out, "%s:%zu (%s)\n", file, line, func);
-    fprintf(GetLogger()->file_out, "%s", LogMessageTypePrint (status, color));
-    TimePrint(GetLogger()->file_out);
+    if (GetQueue()->active.load(std::memory_order_acquire)) {
+        LogAsync(status, file, line, func, fmt, args);
+        va_end (args);
+        return;
+    }
 
+    char message[LOG_MESSAGE_LEN] = "";
+    char aestheticized[LOG_MESSAGE_LEN] = "";
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-nonliteral"
-    vfprintf (GetLogger()->file_out, dst, args);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    vsnprintf(message, sizeof(message), fmt, args);
+#pragma GCC diagnostic pop
 #pragma clang diagnostic pop
-
     va_end (args);
+    AestheticizeString(message, aestheticized, sizeof(aestheticized) - 1);
+
+    struct timespec time = {};
+    clock_gettime(CLOCK_REALTIME, &time);
+
+    log_context_t* context = GetContext();
+    char record[LOG_LINE_LEN] = "";
+    size_t len = FormatRecord(record, sizeof(record), status, file, line, func, &time,
+                              (context != nullptr) ? context->thread_id : 0,
+                              (context != nullptr) ? context->expression_id : 0, aestheticized);
+
+    if (context == nullptr) {
+        if (GetLogger()->file_out != nullptr) {
+            fwrite(record, 1, len, GetLogger()->file_out);
+        }
+        return;
+    }
+
+    if (context->len + len > LOG_CONTEXT_BUFFER_LEN) {
+        WriteContext(context);
+    }
+    memcpy(context->buffer + context->len, record, len);
+    context->len += len;
+}
+
+//----------------------------------------------------------------------------------------------
+// Per-thread contexts: a worker calls LoggerThreadBegin() and its records are tagged with a
+// thread number and the id of the expression it works on, and collected in a thread-local
+// buffer. Whole buffers go to the sink, one FILE* lock per LOG_CONTEXT_BUFFER_LEN bytes.
+// A thread that exits without LoggerThreadEnd() is flushed by the key destructor.
+
+static pthread_key_t ContextKey;
+static pthread_once_t ContextKeyOnce = PTHREAD_ONCE_INIT;
+static std::atomic<size_t> ThreadsAmount(0);
+static thread_local log_context_t* Context = nullptr;
+
+bool LoggerThreadBegin(size_t expression_id) {
+    pthread_once(&ContextKeyOnce, CreateContextKey);
+
+    log_context_t* context = GetContext();
+    if (context == nullptr) {
+        context = (log_context_t*) calloc(1, sizeof(log_context_t));
+        if (context == nullptr) {
+            return false;
+        }
+        context->thread_id = ThreadsAmount.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (pthread_setspecific(ContextKey, context) != 0) {
+            free(context);
+            return false;
+        }
+        Context = context;
+    }
+    context->expression_id = expression_id;
+    return true;
+}
+
+void LoggerSetExpression(size_t expression_id) {
+    log_context_t* context = GetContext();
+    if (context != nullptr) {
+        context->expression_id = expression_id;
+    }
+}
+
+void LoggerThreadFlush() {
+    log_context_t* context = GetContext();
+    if (context != nullptr) {
+        WriteContext(context);
+    }
+}
+
+void LoggerThreadEnd() {
+    log_context_t* context = GetContext();
+    if (context != nullptr) {
+        pthread_setspecific(ContextKey, nullptr);
+        Context = nullptr;
+        DestroyContext(context);
+    }
+}
+
+static log_context_t* GetContext() {
+    return Context;
+}
+
+static void CreateContextKey() {
+    pthread_key_create(&ContextKey, DestroyContext);
+}
+
+static void DestroyContext(void* context) {
+    WriteContext((log_context_t*) context);
+    free(context);
+}
+
+static void WriteContext(log_context_t* context) {
+    if (context->len != 0 && GetLogger()->file_out != nullptr) {
+        fwrite(context->buffer, 1, context->len, GetLogger()->file_out);
+    }
+    context->len = 0;
+}
+
+// file:line (func), the level, the time, the context tag (none for thread 0) and the message.
+static size_t FormatRecord(char* dst, size_t size, enum LogLevel level, const char* file, size_t line, const char* func,
+                           const struct timespec* time, size_t thread_id, size_t expression_id, const char* message) {
+    struct tm local = {};
+    localtime_r(&time->tv_sec, &local);
+
+    char tag[LOG_SPEC_LEN] = "";
+    if (thread_id != 0) {
+        snprintf(tag, sizeof(tag), "[thread %zu, expression %zu] ", thread_id, expression_id);
+    }
+
+    FILE* out = GetLogger()->file_out;
+    bool color = out == stderr || out == stdout;
+    int len = snprintf(dst, size, "%s:%zu (%s)\n%s%02d.%02d.%d %02d:%02d:%02d %s%s",
+                       file, line, func, LogMessageTypePrint(level, color),
+                       local.tm_mday, local.tm_mon + 1, local.tm_year + 1900, local.tm_hour, local.tm_min, local.tm_sec,
+                       tag, message);
+    if (len < 0) {
+        return 0;
+    }
+    return ((size_t) len < size) ? (size_t) len : size - 1;
+}
+
+//----------------------------------------------------------------------------------------------
+// Asynchronous mode: Log() only claims a slot of a bounded multi-producer ring (one CAS on
+// enqueue_pos, no locks), stores the format pointer, the time and the raw arguments, and
+// returns. %s arguments are copied, since the strings may not outlive the call. A
+// background thread formats the records and writes each one with a single fwrite.
+// A full ring either drops the message (counted, reported later) or makes the caller
+// wait. LoggerStopAsync() drains the ring and is registered with atexit().
+
+static log_queue_t* GetQueue() {
+    static log_queue_t queue = {};
+    return &queue;
+}
+
+bool LoggerStartAsync(size_t capacity, enum LogOverflow policy) {
+    log_queue_t* queue = GetQueue();
+    if (queue->active.load()) {
+        return true;
+    }
+
+    size_t size = 1;
+    while (size < ((capacity == 0) ? LOG_DEFAULT_CAPACITY : capacity)) size *= 2;
+
+    queue->records = (log_record_t*) calloc(size, sizeof(log_record_t));
+    if (queue->records == nullptr) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        queue->records[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue->mask = size - 1;
+    queue->policy = policy;
+    queue->enqueue_pos.store(0);
+    queue->dequeue_pos.store(0);
+    queue->dropped.store(0);
+    queue->running.store(true);
+
+    if (pthread_create(&queue->thread, nullptr, LogThread, queue) != 0) {
+        free(queue->records);
+        queue->records = nullptr;
+        return false;
+    }
+    queue->active.store(true, std::memory_order_release);
+
+    static bool registered = false;
+    if (!registered) {
+        registered = (atexit(LoggerStopAsync) == 0);
+    }
+    return true;
+}
+
+void LoggerFlush() {
+    LoggerThreadFlush();
+
+    log_queue_t* queue = GetQueue();
+    if (!queue->active.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    size_t target = queue->enqueue_pos.load(std::memory_order_acquire);
+    while (queue->dequeue_pos.load(std::memory_order_acquire) < target) {
+        SleepNs(LOG_WAIT_NS);
+    }
+    if (GetLogger()->file_out != nullptr) {
+        fflush(GetLogger()->file_out);
+    }
+}
+
+// Has to be called when no other thread logs anymore, e.g. before the log file is closed.
+void LoggerStopAsync() {
+    log_queue_t* queue = GetQueue();
+    if (!queue->active.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    queue->active.store(false, std::memory_order_release);
+    queue->running.store(false, std::memory_order_release);
+    pthread_join(queue->thread, nullptr);
+
+    free(queue->records);
+    queue->records = nullptr;
+}
+
+size_t LoggerDropped() {
+    return GetQueue()->dropped.load(std::memory_order_relaxed);
+}
+
+static void LogAsync(enum LogLevel status, const char* file, size_t line, const char* func, const char* fmt, va_list args) {
+    log_queue_t* queue = GetQueue();
+
+    log_record_t* record = nullptr;
+    size_t pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        record = &queue->records[pos & queue->mask];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        int64_t diff = (int64_t) sequence - (int64_t) pos;
+
+        if (diff == 0) {
+            if (queue->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            if (queue->policy == LOG_DROP) {
+                queue->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            SleepNs(LOG_WAIT_NS);
+            pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+        }
+        else {
+            pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->level = status;
+    record->file = file;
+    record->line = line;
+    record->func = func;
+    record->fmt = fmt;
+    log_context_t* context = GetContext();
+    record->thread_id = (context != nullptr) ? context->thread_id : 0;
+    record->expression_id = (context != nullptr) ? context->expression_id : 0;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    CaptureArgs(record, fmt, args);
+
+    record->sequence.store(pos + 1, std::memory_order_release);
+}
+
+static void* LogThread(void* arg) {
+    log_queue_t* queue = (log_queue_t*) arg;
+    size_t reported_dropped = 0;
+
+    while (true) {
+        size_t pos = queue->dequeue_pos.load(std::memory_order_relaxed);
+        log_record_t* record = &queue->records[pos & queue->mask];
+
+        if (record->sequence.load(std::memory_order_acquire) == pos + 1) {
+            WriteRecord(record);
+            record->sequence.store(pos + queue->mask + 1, std::memory_order_release);
+            queue->dequeue_pos.store(pos + 1, std::memory_order_release);
+            continue;
+        }
+
+        size_t dropped = queue->dropped.load(std::memory_order_relaxed);
+        if (dropped != reported_dropped && GetLogger()->file_out != nullptr) {
+            fprintf(GetLogger()->file_out, "[WARNING] %zu log messages dropped, the ring buffer is full\n",
+                    dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+
+        if (!queue->running.load(std::memory_order_acquire) &&
+            queue->enqueue_pos.load(std::memory_order_acquire) == pos) {
+            break;
+        }
+        SleepNs(LOG_IDLE_NS);
+    }
+    return nullptr;
+}
+
+static void WriteRecord(log_record_t* record) {
+    FILE* out = GetLogger()->file_out;
+    if (out == nullptr) {
+        return;
+    }
+
+    char message[LOG_MESSAGE_LEN] = "";
+    char aestheticized[LOG_MESSAGE_LEN] = "";
+    RenderMessage(record, message, sizeof(message));
+    AestheticizeString(message, aestheticized, sizeof(aestheticized) - 1);
+
+    char line[LOG_LINE_LEN] = "";
+    size_t len = FormatRecord(line, sizeof(line), record->level, record->file, record->line, record->func, &record->time,
+                              record->thread_id, record->expression_id, aestheticized);
+    fwrite(line, 1, len, out);
+}
+
+//----------------------------------------------------------------------------------------------
+
+// Walks the conversions of fmt and takes every argument with va_arg of its real type.
+static void CaptureArgs(log_record_t* record, const char* fmt, va_list args) {
+    size_t strings_len = 0;
+    record->args_amount = 0;
+
+    for (const char* p = strchr(fmt, '%'); p != nullptr; p = strchr(p, '%')) {
+        log_spec_t spec = ParseSpec(p);
+        p += spec.len;
+        if (spec.conversion == '%') continue;
+
+        for (size_t i = 0; i < spec.stars && record->args_amount < LOG_MAX_ARGS; i++) {
+            record->args[record->args_amount++].integer = va_arg(args, int);
+        }
+        if (record->args_amount == LOG_MAX_ARGS) {
+            return;
+        }
+
+        log_arg_t* arg = &record->args[record->args_amount++];
+        switch (spec.kind) {
+            case ARG_INT:
+                if (spec.is_unsigned) arg->uinteger = va_arg(args, unsigned);
+                else                  arg->integer = va_arg(args, int);
+                break;
+            case ARG_LONG:
+                if (spec.is_unsigned) arg->uinteger = va_arg(args, unsigned long);
+                else                  arg->integer = va_arg(args, long);
+                break;
+            case ARG_LLONG:
+                if (spec.is_unsigned) arg->uinteger = va_arg(args, uint64_t);
+                else                  arg->integer = va_arg(args, int64_t);
+                break;
+            case ARG_SIZE:    arg->uinteger = va_arg(args, size_t);          break;
+            case ARG_INTMAX:  arg->integer = va_arg(args, intmax_t);         break;
+            case ARG_PTRDIFF: arg->integer = va_arg(args, ptrdiff_t);        break;
+            case ARG_DOUBLE:  arg->real = va_arg(args, double);              break;
+            case ARG_LDOUBLE: arg->long_real = va_arg(args, long double);    break;
+            case ARG_PTR:     arg->pointer = va_arg(args, void*);            break;
+            case ARG_STRING: {
+                const char* str = va_arg(args, const char*);
+                if (str == nullptr) str = "(null)";
+
+                size_t room = LOG_STRINGS_LEN - 1 - strings_len;
+                size_t len = strnlen(str, room);
+                arg->offset = strings_len;
+                memcpy(record->strings + strings_len, str, len);
+                record->strings[strings_len + len] = '\0';
+                strings_len += (len < room) ? len + 1 : len;
+                break;
+            }
+            case ARG_NONE:
+            default:
+                record->args_amount--;
+                break;
+        }
+    }
+}
+
+static size_t RenderMessage(const log_record_t* record, char* dst, size_t size) {
+    size_t len = 0;
+    size_t arg = 0;
+
+    for (const char* p = record->fmt; *p != '\0' && len + 1 < size;) {
+        if (*p != '%') {
+            dst[len++] = *p++;
+            continue;
+        }
+
+        log_spec_t spec = ParseSpec(p);
+        len += RenderArg(record, &spec, p, &arg, dst + len, size - len);
+        p += spec.len;
+    }
+    dst[(len < size) ? len : size - 1] = '\0';
+    return len;
+}
+
+// Prints one conversion with its own stored argument: the spec is copied with the '*'
+// widths replaced by their values and passed to snprintf with the argument cast back.
+static size_t RenderArg(const log_record_t* record, const log_spec_t* spec, const char* fmt, size_t* arg, char* dst, size_t size) {
+    if (spec->conversion == '%') {
+        dst[0] = '%';
+        return 1;
+    }
+    if (spec->kind == ARG_NONE || *arg + spec->stars >= record->args_amount || spec->len >= LOG_SPEC_LEN) {
+        // Arguments past LOG_MAX_ARGS were not captured, the conversion is kept as text.
+        size_t len = (spec->len < size - 1) ? spec->len : size - 1;
+        memcpy(dst, fmt, len);
+        return len;
+    }
+
+    char format[LOG_SPEC_LEN] = "";
+    size_t format_len = 0;
+    for (size_t i = 0; i < spec->len && format_len + 12 < LOG_SPEC_LEN; i++) {
+        if (fmt[i] == '*') {
+            format_len += (size_t) snprintf(format + format_len, LOG_SPEC_LEN - format_len, "%" PRId64,
+                                            record->args[(*arg)++].integer);
+        }
+        else {
+            format[format_len++] = fmt[i];
+        }
+    }
+    format[format_len] = '\0';
+
+    const log_arg_t* value = &record->args[(*arg)++];
+    int len = 0;
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    switch (spec->kind) {
+        case ARG_INT:
+            len = spec->is_unsigned ? snprintf(dst, size, format, (unsigned) value->uinteger)
+                                    : snprintf(dst, size, format, (int) value->integer);
+            break;
+        case ARG_LONG:
+            len = spec->is_unsigned ? snprintf(dst, size, format, (unsigned long) value->uinteger)
+                                    : snprintf(dst, size, format, (long) value->integer);
+            break;
+        case ARG_LLONG:
+            len = spec->is_unsigned ? snprintf(dst, size, format, value->uinteger)
+                                    : snprintf(dst, size, format, value->integer);
+            break;
+        case ARG_SIZE:
+            len = snprintf(dst, size, format, (size_t) value->uinteger);
+            break;
+        case ARG_INTMAX:
+            len = snprintf(dst, size, format, (intmax_t) value->integer);
+            break;
+        case ARG_PTRDIFF:
+            len = snprintf(dst, size, format, (ptrdiff_t) value->integer);
+            break;
+        case ARG_DOUBLE:
+            len = snprintf(dst, size, format, value->real);
+            break;
+        case ARG_LDOUBLE:
+            len = snprintf(dst, size, format, value->long_real);
+            break;
+        case ARG_PTR:
+            len = (spec->conversion == 'n') ? 0 : snprintf(dst, size, format, value->pointer);
+            break;
+        case ARG_STRING:
+            len = snprintf(dst, size, format, record->strings + value->offset);
+            break;
+        case ARG_NONE:
+        default:
+            break;
+    }
+#pragma GCC diagnostic pop
+#pragma clang diagnostic pop
+
+    if (len < 0) {
+        return 0;
+    }
+    return ((size_t) len < size) ? (size_t) len : size - 1;
+}
+
+// fmt points to '%': flags, width, precision, length modifier and conversion.
+static log_spec_t ParseSpec(const char* fmt) {
+    log_spec_t spec = {};
+    spec.kind = ARG_NONE;
+
+    size_t i = 1;
+    while (fmt[i] != '\0' && strchr("-+ #0", fmt[i]) != nullptr) i++;
+    if (fmt[i] == '*') {
+        spec.stars++;
+        i++;
+    }
+    while (fmt[i] >= '0' && fmt[i] <= '9') i++;
+    if (fmt[i] == '.') {
+        i++;
+        if (fmt[i] == '*') {
+            spec.stars++;
+            i++;
+        }
+        while (fmt[i] >= '0' && fmt[i] <= '9') i++;
+    }
+
+    log_arg_kind_t integer_kind = ARG_INT;
+    bool long_double = false;
+    switch (fmt[i]) {
+        case 'h':
+            i += (fmt[i + 1] == 'h') ? 2 : 1;
+            break;
+        case 'l':
+            integer_kind = (fmt[i + 1] == 'l') ? ARG_LLONG : ARG_LONG;
+            i += (fmt[i + 1] == 'l') ? 2 : 1;
+            break;
+        case 'z': integer_kind = ARG_SIZE;    i++; break;
+        case 'j': integer_kind = ARG_INTMAX;  i++; break;
+        case 't': integer_kind = ARG_PTRDIFF; i++; break;
+        case 'L': long_double = true;         i++; break;
+        default:
+            break;
+    }
+
+    spec.conversion = fmt[i];
+    switch (fmt[i]) {
+        case 'd': case 'i': case 'c':
+            spec.kind = integer_kind;
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            spec.kind = integer_kind;
+            spec.is_unsigned = true;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec.kind = long_double ? ARG_LDOUBLE : ARG_DOUBLE;
+            break;
+        case 's':
+            spec.kind = ARG_STRING;
+            break;
+        case 'p': case 'n':
+            spec.kind = ARG_PTR;
+            break;
+        case '%':
+            break;
+        case '\0':
+            spec.len = i;
+            return spec;
+        default:
+            break;
+    }
+    spec.len = i + 1;
+    return spec;
+}
+
+static void SleepNs(long ns) {
+    struct timespec delay = {0, ns};
+    nanosleep(&delay, nullptr);
 }
 
 //----------------------------------------------------------------------------------------------
@@ -81,6 +711,7 @@ static const char* LogMessageTypePrint(const enum LogLevel level, const bool col
             ADD_COLOR_(COLOR_BLUE, "[INFO] ");
         case DEBUG:
             ADD_COLOR_(COLOR_GREEN, "[DEBUG] ");
+        case SILENT:
         default:
             ADD_COLOR_(COLOR_RED, "!ERROR! ");
             break;
@@ -89,17 +720,6 @@ static const char* LogMessageTypePrint(const enum LogLevel level, const bool col
 
 #undef ADD_COLOR_
 
-static void TimePrint(FILE *out) {
-    assert(out != nullptr);
-
-    time_t mytime = time(NULL);
-    struct tm *time = localtime(&mytime);
-
-    fprintf(out, "%02d.%02d.%d %02d:%02d:%02d ",
-            time->tm_mday, time->tm_mon + 1, time->tm_year + 1900,
-            time->tm_hour, time->tm_min,     time->tm_sec);
-}
-
 static void AestheticizeString(const char *src, char *dst, const size_t max_len) {
     assert(src != nullptr);
     assert(dst != nullptr);
@@ -9,7 +9,13 @@ enum LogLevel {
     DEBUG   = 0,
     INFO    = 1,
     WARNING = 2,
-    ERROR   = 3
+    ERROR   = 3,
+    SILENT  = 4     // for LoggerSetLevel() only: nothing is logged
+};
+
+enum LogOverflow {
+    LOG_DROP  = 0,
+    LOG_BLOCK = 1
 };
 
 typedef struct {
@@ -23,9 +29,40 @@ void LoggerSetFile(FILE* out);
 
 void LoggerSetLevel(enum LogLevel level);
 
-#define LOG(status, ...)                                        \
-    do {                                                        \
-        Log(status, __FILE__, __LINE__, __func__, __VA_ARGS__); \
+bool LoggerStartAsync(size_t capacity, enum LogOverflow policy);
+
+void LoggerFlush();
+
+void LoggerStopAsync();
+
+size_t LoggerDropped();
+
+bool LoggerThreadBegin(size_t expression_id);
+
+void LoggerSetExpression(size_t expression_id);
+
+void LoggerThreadFlush();
+
+void LoggerThreadEnd();
+
+// Levels below LOG_MIN_LEVEL are compiled out: the condition is a constant and the
+// whole call, arguments included, is dropped (build with -DLOG_MIN_LEVEL=WARNING).
+// Levels below the runtime level are skipped before the arguments are evaluated.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+extern logger_t LoggerState;
+
+static inline bool LoggerEnabled(enum LogLevel level) {
+    return level >= LoggerState.min_level;
+}
+
+#define LOG(status, ...)                                                                \
+    do {                                                                                \
+        if ((status) >= LOG_MIN_LEVEL && __builtin_expect(LoggerEnabled(status), 0)) {  \
+            Log(status, __FILE__, __LINE__, __func__, __VA_ARGS__);                     \
+        }                                                                               \
     } while(0)
 
 #endif /* LOGGER_H */
@@ -101,3 +101,28 @@ void get_text_symbols(text_t* text, FILE* istream) {
     text->symbols[text->symbols_amount - 1] = '\0';
     LOG(INFO, "TEXT WAS SUCCESSFULLY READ\n");
 }
+
+//----------------------------------------------------------------------------------------------
+
+// A JSON string literal: quotes and backslashes are escaped, control characters become
+// \u00XX, everything else, UTF-8 included, is written as is.
+void print_json_string(FILE* ostream, const char* str) {
+    assert(ostream != nullptr);
+    assert(str != nullptr);
+
+    fputc('"', ostream);
+    for (; *str != '\0'; str++) {
+        unsigned char c = (unsigned char) *str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', ostream);
+            fputc(c, ostream);
+        }
+        else if (c < ' ') {
+            fprintf(ostream, "\\u%04x", c);
+        }
+        else {
+            fputc(c, ostream);
+        }
+    }
+    fputc('"', ostream);
+}
@@ -24,5 +24,7 @@ ssize_t find_file_size(FILE* istream);
 
 void get_text_symbols(text_t* text, FILE* istream);
 
+void print_json_string(FILE* ostream, const char* str);
+
 #endif /* TEXT_LIB_H */
 
@@ -0,0 +1,310 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+#include "logger.h"
+#include "text_lib.h"
+
+const size_t TRACE_BUFFER_EVENTS = 1 << 15;
+const size_t TRACE_MAX_NAME_LEN = 256;
+const uint64_t TRACE_MIN_CALIBRATION_NS = 1000000;
+const uint32_t TRACE_MAGIC = 0x43525444; // "DTRC" on little-endian hosts
+const uint32_t TRACE_VERSION = 1;
+
+typedef struct {
+    uint32_t thread_id;
+    size_t size;
+    size_t dropped;
+    trace_event_t* events;
+} trace_buffer_t;
+
+// File layout: the header, names_amount names (uint32_t length + bytes), then for every
+// thread its uint32_t id, uint64_t events amount and the events.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    double ticks_per_ns;
+    uint64_t base;
+    uint32_t names_amount;
+    uint32_t threads_amount;
+} trace_header_t;
+
+typedef struct {
+    uint64_t begin;
+    uint64_t end;
+    uint64_t expression;
+    uint32_t name_id;
+    uint32_t reserved;
+} trace_file_event_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    trace_buffer_t** buffers;
+    size_t buffers_amount;
+    size_t buffers_capacity;
+    uint64_t base_ticks;
+    uint64_t base_ns;
+} trace_registry_t;
+
+std::atomic<bool> TRACE_ACTIVE(false);
+
+static trace_registry_t REGISTRY = {PTHREAD_MUTEX_INITIALIZER, nullptr, 0, 0, 0, 0};
+static thread_local trace_buffer_t* BUFFER = nullptr;
+static thread_local size_t EXPRESSION = 0;
+
+static trace_buffer_t* register_buffer();
+static uint64_t get_time_ns();
+static size_t name_id(const char** names, size_t* names_amount, const char* name);
+
+//===================================RECORDING===================================================
+// A span costs two reads of the time stamp counter and one store into the buffer of its
+// thread; nothing is shared between threads after the first span of a thread registers
+// its buffer. A full buffer drops the events and counts them.
+
+void trace_start() {
+    pthread_mutex_lock(&REGISTRY.mutex);
+    for (size_t i = 0; i < REGISTRY.buffers_amount; i++) {
+        REGISTRY.buffers[i]->size = 0;
+        REGISTRY.buffers[i]->dropped = 0;
+    }
+    REGISTRY.base_ticks = trace_clock();
+    REGISTRY.base_ns = get_time_ns();
+    pthread_mutex_unlock(&REGISTRY.mutex);
+
+    TRACE_ACTIVE.store(true, std::memory_order_relaxed);
+}
+
+void trace_stop() {
+    TRACE_ACTIVE.store(false, std::memory_order_relaxed);
+}
+
+void trace_set_expression(size_t expression) {
+    EXPRESSION = expression;
+}
+
+void trace_record(const char* name, uint64_t begin, uint64_t end) {
+    trace_buffer_t* buffer = BUFFER;
+    if (buffer == nullptr) {
+        buffer = register_buffer();
+        if (buffer == nullptr) {
+            return;
+        }
+    }
+    if (buffer->size == TRACE_BUFFER_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+
+    trace_event_t* event = &buffer->events[buffer->size++];
+    event->name = name;
+    event->begin = begin;
+    event->end = end;
+    event->expression = EXPRESSION;
+}
+
+// The first span of a thread allocates its buffer and adds it to the registry.
+static trace_buffer_t* register_buffer() {
+    trace_buffer_t* buffer = (trace_buffer_t*) calloc(1, sizeof(trace_buffer_t));
+    trace_event_t* events = (trace_event_t*) calloc(TRACE_BUFFER_EVENTS, sizeof(trace_event_t));
+    if (buffer == nullptr || events == nullptr) {
+        free(buffer);
+        free(events);
+        return nullptr;
+    }
+    buffer->events = events;
+
+    pthread_mutex_lock(&REGISTRY.mutex);
+    if (REGISTRY.buffers_amount == REGISTRY.buffers_capacity) {
+        size_t capacity = (REGISTRY.buffers_capacity == 0) ? 8 : REGISTRY.buffers_capacity * 2;
+        trace_buffer_t** buffers = (trace_buffer_t**) realloc(REGISTRY.buffers, capacity * sizeof(trace_buffer_t*));
+        if (buffers == nullptr) {
+            pthread_mutex_unlock(&REGISTRY.mutex);
+            free(events);
+            free(buffer);
+            return nullptr;
+        }
+        REGISTRY.buffers = buffers;
+        REGISTRY.buffers_capacity = capacity;
+    }
+    buffer->thread_id = (uint32_t) REGISTRY.buffers_amount + 1;
+    REGISTRY.buffers[REGISTRY.buffers_amount++] = buffer;
+    pthread_mutex_unlock(&REGISTRY.mutex);
+
+    BUFFER = buffer;
+    return buffer;
+}
+
+//===================================BINARY FILE=================================================
+// Has to be called when no other thread records spans. The counter is calibrated against
+// CLOCK_MONOTONIC over the time since trace_start().
+
+bool trace_write(const char* path) {
+    assert(path != nullptr);
+
+    FILE* ostream = fopen(path, "wb");
+    if (ostream == nullptr) {
+        LOG(ERROR, "Failed to open %s" STRERROR(errno), path);
+        return false;
+    }
+
+    pthread_mutex_lock(&REGISTRY.mutex);
+
+    while (get_time_ns() - REGISTRY.base_ns < TRACE_MIN_CALIBRATION_NS) {}
+    uint64_t ticks = trace_clock() - REGISTRY.base_ticks;
+    uint64_t ns = get_time_ns() - REGISTRY.base_ns;
+
+    size_t events_amount = 0;
+    size_t dropped = 0;
+    for (size_t i = 0; i < REGISTRY.buffers_amount; i++) {
+        events_amount += REGISTRY.buffers[i]->size;
+        dropped += REGISTRY.buffers[i]->dropped;
+    }
+
+    size_t names_amount = 0;
+    const char** names = (const char**) calloc(events_amount + 1, sizeof(const char*));
+    if (names == nullptr) {
+        pthread_mutex_unlock(&REGISTRY.mutex);
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        fclose(ostream);
+        return false;
+    }
+    for (size_t i = 0; i < REGISTRY.buffers_amount; i++) {
+        for (size_t j = 0; j < REGISTRY.buffers[i]->size; j++) {
+            name_id(names, &names_amount, REGISTRY.buffers[i]->events[j].name);
+        }
+    }
+
+    trace_header_t header = {};
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.ticks_per_ns = (double) ticks / (double) ns;
+    header.base = REGISTRY.base_ticks;
+    header.names_amount = (uint32_t) names_amount;
+    header.threads_amount = (uint32_t) REGISTRY.buffers_amount;
+    fwrite(&header, sizeof(header), 1, ostream);
+
+    for (size_t i = 0; i < names_amount; i++) {
+        uint32_t len = (uint32_t) strnlen(names[i], TRACE_MAX_NAME_LEN);
+        fwrite(&len, sizeof(len), 1, ostream);
+        fwrite(names[i], 1, len, ostream);
+    }
+
+    for (size_t i = 0; i < REGISTRY.buffers_amount; i++) {
+        trace_buffer_t* buffer = REGISTRY.buffers[i];
+        uint64_t size = buffer->size;
+        fwrite(&buffer->thread_id, sizeof(buffer->thread_id), 1, ostream);
+        fwrite(&size, sizeof(size), 1, ostream);
+
+        for (size_t j = 0; j < buffer->size; j++) {
+            trace_file_event_t event = {};
+            event.begin = buffer->events[j].begin;
+            event.end = buffer->events[j].end;
+            event.expression = buffer->events[j].expression;
+            event.name_id = (uint32_t) name_id(names, &names_amount, buffer->events[j].name);
+            fwrite(&event, sizeof(event), 1, ostream);
+        }
+    }
+    pthread_mutex_unlock(&REGISTRY.mutex);
+
+    free(names);
+    if (dropped != 0) {
+        LOG(WARNING, "%zu trace events dropped, the thread buffers are full\n", dropped);
+    }
+    LOG(INFO, "Trace: %zu events of %zu threads written to %s\n", events_amount, (size_t) header.threads_amount, path);
+
+    if (ferror(ostream) != 0) {
+        LOG(ERROR, "Failed to write %s\n", path);
+        fclose(ostream);
+        return false;
+    }
+    return fclose(ostream) == 0;
+}
+
+// Spans share a handful of static names, a linear search over the distinct ones is enough.
+static size_t name_id(const char** names, size_t* names_amount, const char* name) {
+    for (size_t i = 0; i < *names_amount; i++) {
+        if (names[i] == name || strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    names[*names_amount] = name;
+    return (*names_amount)++;
+}
+
+static uint64_t get_time_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+//===================================CHROME EXPORT===============================================
+// Complete ("X") events in microseconds since trace_start(), one tid per recording thread,
+// the expression id in args. Opens in chrome://tracing and Perfetto.
+
+bool trace_export_chrome(const char* binary_path, FILE* ostream) {
+    assert(binary_path != nullptr);
+    assert(ostream != nullptr);
+
+    FILE* istream = fopen(binary_path, "rb");
+    if (istream == nullptr) {
+        LOG(ERROR, "Failed to open %s" STRERROR(errno), binary_path);
+        return false;
+    }
+
+    trace_header_t header = {};
+    if (fread(&header, sizeof(header), 1, istream) != 1 || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || !(header.ticks_per_ns > 0)) {
+        LOG(ERROR, "%s is not a trace file\n", binary_path);
+        fclose(istream);
+        return false;
+    }
+
+    char* names = (char*) calloc((size_t) header.names_amount + 1, TRACE_MAX_NAME_LEN + 1);
+    if (names == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        fclose(istream);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < header.names_amount && ok; i++) {
+        uint32_t len = 0;
+        ok = fread(&len, sizeof(len), 1, istream) == 1 && len <= TRACE_MAX_NAME_LEN &&
+             fread(names + i * (TRACE_MAX_NAME_LEN + 1), 1, len, istream) == len;
+    }
+
+    fprintf(ostream, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    bool first = true;
+    for (size_t i = 0; i < header.threads_amount && ok; i++) {
+        uint32_t thread_id = 0;
+        uint64_t size = 0;
+        ok = fread(&thread_id, sizeof(thread_id), 1, istream) == 1 && fread(&size, sizeof(size), 1, istream) == 1;
+
+        for (uint64_t j = 0; j < size && ok; j++) {
+            trace_file_event_t event = {};
+            ok = fread(&event, sizeof(event), 1, istream) == 1 && event.name_id < header.names_amount;
+            if (!ok) break;
+
+            double ts = (double) (event.begin - header.base) / header.ticks_per_ns / 1000;
+            double dur = (double) (event.end - event.begin) / header.ticks_per_ns / 1000;
+            fprintf(ostream, "%s{\"name\": ", first ? "" : ",\n");
+            print_json_string(ostream, names + event.name_id * (TRACE_MAX_NAME_LEN + 1));
+            fprintf(ostream, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                             "\"args\": {\"expression\": %" PRIu64 "}}",
+                    thread_id, ts, dur, event.expression);
+            first = false;
+        }
+    }
+    fprintf(ostream, "\n]}\n");
+
+    if (!ok) {
+        LOG(ERROR, "%s is truncated\n", binary_path);
+    }
+    free(names);
+    fclose(istream);
+    return ok;
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// Spans are compiled in with -DTRACE_SPANS and recorded after trace_start(). Every thread
+// writes complete events into its own buffer, trace_write() stores all of them in a binary
+// file, trace_export_chrome() turns that file into Chrome trace-event JSON.
+
+typedef struct {
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t expression;
+} trace_event_t;
+
+extern std::atomic<bool> TRACE_ACTIVE;
+
+void trace_start();
+void trace_stop();
+void trace_set_expression(size_t expression);
+void trace_record(const char* name, uint64_t begin, uint64_t end);
+bool trace_write(const char* path);
+bool trace_export_chrome(const char* binary_path, FILE* ostream);
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+
+static inline uint64_t trace_clock() {
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline uint64_t trace_clock() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+struct trace_span_t {
+    const char* name;
+    uint64_t begin;
+
+    explicit trace_span_t(const char* span_name) :
+        name(span_name), begin(TRACE_ACTIVE.load(std::memory_order_relaxed) ? trace_clock() : 0) {}
+
+    ~trace_span_t() {
+        if (begin != 0) {
+            trace_record(name, begin, trace_clock());
+        }
+    }
+
+    trace_span_t(const trace_span_t&) = delete;
+    trace_span_t& operator=(const trace_span_t&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_NAME_(line) TRACE_CONCAT_(trace_span_, line)
+
+#ifdef TRACE_SPANS
+#define TRACE_SPAN(name) trace_span_t TRACE_NAME_(__LINE__)(name)
+#else
+#define TRACE_SPAN(name) do {} while (0)
+#endif
+
+#define TRACE_FUNCTION() TRACE_SPAN(__func__)
+
+#endif /* TRACE_H */
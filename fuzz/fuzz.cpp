@@ -0,0 +1,662 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include "expression_tree.h"
+#include "logger.h"
+
+const uint64_t FUZZ_DEFAULT_SEED = 0xd1ff2024u;
+const size_t FUZZ_DEFAULT_CASES = 100000;
+const size_t FUZZ_DEFAULT_DEPTH = 4;
+const size_t FUZZ_MAX_DEPTH = 6;
+const size_t FUZZ_MAX_NODES = 1 << (FUZZ_MAX_DEPTH + 1);
+const size_t FUZZ_MAX_THREADS = 256;
+const size_t FUZZ_TEXT_LEN = 4096;
+const size_t FUZZ_POINTS = 6;
+const size_t FUZZ_MAX_FAILURES = 16;
+const size_t FUZZ_CLOCK_PERIOD = 64;
+const double FUZZ_MAX_X = 3;
+const double FUZZ_MAX_VALUE = 1e8;
+const double FUZZ_MIN_VALUE = 1e-150;
+const double FUZZ_CANCELLATION = 1e-10;
+const double FUZZ_TOLERANCE = 1e-5;
+const double FUZZ_ROUNDOFF = 1e-14;
+const double FUZZ_STEP = 1e-3;
+const size_t NIL = SIZE_MAX;
+
+typedef struct {
+    type_t type;
+    int value;
+    size_t left;
+    size_t right;
+} gen_node_t;
+
+// A generated expression: nodes refer to each other by index, so a copy is a memcpy and
+// a subtree can be replaced in place while shrinking.
+typedef struct {
+    gen_node_t nodes[FUZZ_MAX_NODES];
+    size_t size;
+    size_t root;
+} gen_tree_t;
+
+typedef enum {
+    CASE_PASSED = 0,
+    CASE_SKIPPED = 1,
+    CASE_DERIVATIVE_ERR = 2,
+    CASE_OPTIMIZE_ERR = 3,
+    CASE_VERIFY_ERR = 4,
+} verdict_t;
+
+typedef struct {
+    verdict_t verdict;
+    uint64_t points_seed;
+    char expression[FUZZ_TEXT_LEN];
+    char shrunk[FUZZ_TEXT_LEN];
+    double x;
+    double y;
+    double expected;
+    double got;
+} fuzz_failure_t;
+
+typedef struct {
+    uint64_t seed;
+    size_t cases;
+    size_t depth;
+    double seconds;
+    double start_ns;
+
+    std::atomic<size_t> next_case;
+    std::atomic<size_t> done;
+    std::atomic<size_t> passed;
+    std::atomic<size_t> skipped;
+    std::atomic<size_t> failed;
+    std::atomic<bool> timed_out;
+
+    pthread_mutex_t mutex;
+    fuzz_failure_t* failures;
+    size_t failures_amount;
+} fuzz_t;
+
+static thread_local const char* CURRENT_CASE = nullptr;
+
+static uint64_t next_random(uint64_t* state);
+static size_t random_below(uint64_t* state, size_t n);
+static double random_double(uint64_t* state, double min, double max);
+static size_t generate_r(uint64_t* state, gen_tree_t* tree, size_t depth);
+static size_t add_node(gen_tree_t* tree, type_t type, int value, size_t left, size_t right);
+static bool has_x(const gen_tree_t* tree);
+static bool print_r(const gen_tree_t* tree, size_t index, char* dst, size_t size, size_t* pos);
+static bool print_expression(const gen_tree_t* tree, char* dst, size_t size);
+static verdict_t check_expression(const char* expression, uint64_t points_seed, fuzz_failure_t* failure);
+static void set_failure(fuzz_failure_t* failure, verdict_t verdict, uint64_t points_seed, double x, double y,
+                        double expected, double got);
+static bool is_singular_r(exp_tree_t* tree, node_t* node, const double* vars, size_t var_id);
+static bool is_ill_conditioned_r(exp_tree_t* tree, node_t* node, const double* vars, size_t var_id, bool argument);
+static double central_difference(exp_tree_t* tree, node_t* root, double* vars, size_t var_id, double step);
+static double extrapolated_difference(exp_tree_t* tree, node_t* root, double* vars, size_t var_id, double step);
+static void shrink(gen_tree_t* tree, uint64_t points_seed, fuzz_failure_t* failure);
+static void record_failure(fuzz_t* fuzz, const fuzz_failure_t* failure);
+static void* fuzz_worker(void* arg);
+static void crash_handler(int signal_number);
+static void print_failure(const fuzz_failure_t* failure);
+static double get_time_ns();
+
+//===================================GENERATOR===================================================
+// splitmix64 seeded with the seed and the case index: case i is the same expression with
+// the same points whatever the amount of threads. Only integer constants are generated,
+// log(a, b) is left out since the grammar has no two-argument calls, and every call is
+// parenthesized: the parser reads f(x)^2 as f(x^2).
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15u);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+    return z ^ (z >> 31);
+}
+
+static size_t random_below(uint64_t* state, size_t n) {
+    return (size_t) (next_random(state) % n);
+}
+
+static double random_double(uint64_t* state, double min, double max) {
+    return min + (max - min) * (double) (next_random(state) >> 11) / (double) (UINT64_C(1) << 53);
+}
+
+static size_t add_node(gen_tree_t* tree, type_t type, int value, size_t left, size_t right) {
+    assert(tree->size < FUZZ_MAX_NODES);
+
+    tree->nodes[tree->size] = {type, value, left, right};
+    return tree->size++;
+}
+
+// x is twice as likely as y, powers mostly have a small constant exponent.
+static size_t generate_r(uint64_t* state, gen_tree_t* tree, size_t depth) {
+    if (depth == 0 || random_below(state, 4) == 0) {
+        switch (random_below(state, 6)) {
+            case 0:
+            case 1:
+                return add_node(tree, VAR, 0, NIL, NIL);
+            case 2:
+                return add_node(tree, VAR, 1, NIL, NIL);
+            default:
+                return add_node(tree, NUM, (int) random_below(state, 9) + 1, NIL, NIL);
+        }
+    }
+
+    size_t kind = random_below(state, 10);
+    if (kind < 4) {
+        size_t left = generate_r(state, tree, depth - 1);
+        size_t right = generate_r(state, tree, depth - 1);
+        return add_node(tree, OP, ADD + (int) kind, left, right);
+    }
+    if (kind == 4) {
+        size_t base = generate_r(state, tree, depth - 1);
+        size_t exponent = (random_below(state, 4) != 0) ? add_node(tree, NUM, (int) random_below(state, 4) + 1, NIL, NIL) :
+                                                           generate_r(state, tree, (depth > 1) ? depth - 2 : 0);
+        return add_node(tree, OP, POW, base, exponent);
+    }
+
+    size_t index = 0;
+    do {
+        index = random_below(state, func_name_table_len);
+    } while (func_name_table[index].code <= LOG);
+
+    size_t arg = generate_r(state, tree, depth - 1);
+    return add_node(tree, OP, func_name_table[index].code, arg, NIL);
+}
+
+// A freshly generated tree has no unreachable nodes.
+static bool has_x(const gen_tree_t* tree) {
+    for (size_t i = 0; i < tree->size; i++) {
+        if (tree->nodes[i].type == VAR && tree->nodes[i].value == 0) return true;
+    }
+    return false;
+}
+
+static bool print_expression(const gen_tree_t* tree, char* dst, size_t size) {
+    size_t pos = 0;
+    return print_r(tree, tree->root, dst, size, &pos) && pos + 2 < size && snprintf(dst + pos, size - pos, " $") == 2;
+}
+
+static bool print_r(const gen_tree_t* tree, size_t index, char* dst, size_t size, size_t* pos) {
+    const gen_node_t* node = &tree->nodes[index];
+    const char* ops = "+-*/^";
+    int len = 0;
+
+    switch (node->type) {
+        case NUM:
+            len = snprintf(dst + *pos, size - *pos, "%d", node->value);
+            break;
+        case VAR:
+            len = snprintf(dst + *pos, size - *pos, "%c", (node->value == 0) ? 'x' : 'y');
+            break;
+        case OP:
+            if (node->value > POW) {
+                const char* name = "";
+                for (size_t i = 0; i < func_name_table_len; i++) {
+                    if (func_name_table[i].code == node->value) name = func_name_table[i].name;
+                }
+                len = snprintf(dst + *pos, size - *pos, "(%s(", name);
+                if (len < 0 || (size_t) len >= size - *pos) return false;
+                *pos += (size_t) len;
+
+                if (!print_r(tree, node->left, dst, size, pos)) return false;
+                len = snprintf(dst + *pos, size - *pos, "))");
+                break;
+            }
+
+            len = snprintf(dst + *pos, size - *pos, "(");
+            if (len < 0 || (size_t) len >= size - *pos) return false;
+            *pos += (size_t) len;
+
+            if (!print_r(tree, node->left, dst, size, pos)) return false;
+            len = snprintf(dst + *pos, size - *pos, " %c ", ops[node->value]);
+            if (len < 0 || (size_t) len >= size - *pos) return false;
+            *pos += (size_t) len;
+
+            if (!print_r(tree, node->right, dst, size, pos)) return false;
+            len = snprintf(dst + *pos, size - *pos, ")");
+            break;
+        default:
+            return false;
+    }
+
+    if (len < 0 || (size_t) len >= size - *pos) return false;
+    *pos += (size_t) len;
+    return true;
+}
+
+//===================================ORACLE======================================================
+// The derivative by x is checked at FUZZ_POINTS random points of [-3, 3]^2 against central
+// differences with Richardson extrapolation, which are exact to O(h^4), and against forward
+// mode where the differences are ill-conditioned. A point where two step sizes disagree is
+// singular or out of the domain and is skipped, so is a point where f is not finite. The
+// optimized derivative is checked only where the raw one is right, both pass verify() first.
+
+static verdict_t check_expression(const char* expression, uint64_t points_seed, fuzz_failure_t* failure) {
+    CURRENT_CASE = expression;
+
+    exp_tree_t tree = {};
+    if (tree.init(expression) != NO_ERR || tree.root() == nullptr) {
+        tree.dtor();
+        CURRENT_CASE = nullptr;
+        return CASE_SKIPPED;
+    }
+
+    size_t x_id = 0;
+    size_t y_id = 0;
+    if (!tree.find_var("x", &x_id)) {
+        tree.dtor();
+        CURRENT_CASE = nullptr;
+        return CASE_SKIPPED;
+    }
+    bool has_y = tree.find_var("y", &y_id);
+
+    double vars[MAX_VARS_AMOUNT] = {};
+    double points[FUZZ_POINTS][2] = {};
+    double tolerances[FUZZ_POINTS] = {};
+    double derivative_values[FUZZ_POINTS] = {};
+    bool valid[FUZZ_POINTS] = {};
+
+    // A malformed tree is left allocated, freeing it may crash.
+    node_t* derivative = tree.differentiate(tree.root(), x_id);
+    if (tree.verify(derivative) != NO_ERR) {
+        set_failure(failure, CASE_VERIFY_ERR, points_seed, NAN, NAN, NAN, NAN);
+        CURRENT_CASE = nullptr;
+        return CASE_VERIFY_ERR;
+    }
+
+    uint64_t state = points_seed;
+    size_t valid_amount = 0;
+    verdict_t verdict = CASE_PASSED;
+    for (size_t i = 0; i < FUZZ_POINTS; i++) {
+        points[i][0] = random_double(&state, -FUZZ_MAX_X, FUZZ_MAX_X);
+        points[i][1] = random_double(&state, -FUZZ_MAX_X, FUZZ_MAX_X);
+        vars[x_id] = points[i][0];
+        if (has_y) vars[y_id] = points[i][1];
+
+        double step = FUZZ_STEP * fmax(1, fabs(points[i][0]));
+        double value = tree.evaluate(tree.root(), vars);
+        double coarse = extrapolated_difference(&tree, tree.root(), vars, x_id, step);
+        double fine = extrapolated_difference(&tree, tree.root(), vars, x_id, step / 2);
+        double tolerance = FUZZ_TOLERANCE * (1 + fabs(fine)) + FUZZ_ROUNDOFF * fabs(value) / step;
+        if (!isfinite(value) || !isfinite(coarse) || !isfinite(fine) || fabs(value) > FUZZ_MAX_VALUE ||
+            fabs(fine) > FUZZ_MAX_VALUE || fabs(coarse - fine) > tolerance) {
+            continue;
+        }
+
+        double got = tree.evaluate(derivative, vars);
+        if (!isfinite(got) && is_singular_r(&tree, tree.root(), vars, x_id)) {
+            continue;
+        }
+        if (!(fabs(got - fine) <= tolerance)) {
+            // Differences lose every digit where f saturates or oscillates fast, as in
+            // cos(x + exp(9)); forward mode has no step, agreeing with it is enough there.
+            // Neither is trusted at an ill-conditioned point.
+            double dual = tree.evaluate_dual(tree.root(), vars, x_id).der;
+            if (!isfinite(dual) || is_ill_conditioned_r(&tree, tree.root(), vars, x_id, false) ||
+                is_ill_conditioned_r(&tree, derivative, vars, x_id, false)) {
+                continue;
+            }
+            tolerance = FUZZ_TOLERANCE * (1 + fabs(dual));
+            if (!(fabs(got - dual) <= tolerance)) {
+                verdict = CASE_DERIVATIVE_ERR;
+                set_failure(failure, verdict, points_seed, points[i][0], points[i][1], fine, got);
+                break;
+            }
+        }
+
+        valid[i] = true;
+        tolerances[i] = tolerance;
+        derivative_values[i] = got;
+        valid_amount++;
+    }
+
+    node_t* optimized = (verdict == CASE_PASSED) ? tree.optimize(derivative) : derivative;
+    if (tree.verify(optimized) != NO_ERR) {
+        set_failure(failure, CASE_VERIFY_ERR, points_seed, NAN, NAN, NAN, NAN);
+        CURRENT_CASE = nullptr;
+        return CASE_VERIFY_ERR;
+    }
+    for (size_t i = 0; i < FUZZ_POINTS && verdict == CASE_PASSED; i++) {
+        if (!valid[i]) continue;
+
+        vars[x_id] = points[i][0];
+        if (has_y) vars[y_id] = points[i][1];
+        double got = tree.evaluate(optimized, vars);
+        if (!(fabs(got - derivative_values[i]) <= tolerances[i]) &&
+            !is_ill_conditioned_r(&tree, tree.root(), vars, x_id, false)) {
+            verdict = CASE_OPTIMIZE_ERR;
+            set_failure(failure, verdict, points_seed, points[i][0], points[i][1], derivative_values[i], got);
+        }
+    }
+
+    tree.delete_tree(optimized);
+    tree.dtor();
+    CURRENT_CASE = nullptr;
+
+    if (verdict == CASE_PASSED && valid_amount == 0) {
+        return CASE_SKIPPED;
+    }
+    return verdict;
+}
+
+// Filled in place: a fuzz_failure_t holds two texts and is too big to pass around by value.
+static void set_failure(fuzz_failure_t* failure, verdict_t verdict, uint64_t points_seed, double x, double y,
+                        double expected, double got) {
+    failure->verdict = verdict;
+    failure->points_seed = points_seed;
+    failure->expression[0] = '\0';
+    failure->shrunk[0] = '\0';
+    failure->x = x;
+    failure->y = y;
+    failure->expected = expected;
+    failure->got = got;
+}
+
+// The chain rule breaks down where f is smooth if an inner derivative is not finite, as in
+// arcsin(x/x), or if u <= 0 in u^v with v depending on x, as in y^(x/x): the rule
+// u^v * (v' ln(u) + v u' / u) has no value there.
+static bool is_singular_r(exp_tree_t* tree, node_t* node, const double* vars, size_t var_id) {
+    if (node == nullptr || (node->var_mask & ((uint64_t) 1 << var_id)) == 0) return false;
+
+    if (!isfinite(tree->evaluate_dual(node, vars, var_id).der)) {
+        return true;
+    }
+    if (node->type == OP && (int) node->value == POW && node->right != nullptr &&
+        (node->right->var_mask & ((uint64_t) 1 << var_id)) != 0 && tree->evaluate(node->left, vars) <= 0) {
+        return true;
+    }
+    return is_singular_r(tree, node->left, vars, var_id) || is_singular_r(tree, node->right, vars, var_id);
+}
+
+// Ill-conditioned are points where a subexpression is not finite, as exp(exp(9)) in
+// ln(exp(exp(9))), where a value depending on x or an argument of a function is huge or
+// tiny, as in tg(exp(9) * y), and where a sum cancels out to its rounding error, as in
+// x - ln(exp(x)) or in 1/x - x/x^2, the derivative of x/x.
+static bool is_ill_conditioned_r(exp_tree_t* tree, node_t* node, const double* vars, size_t var_id, bool argument) {
+    if (node == nullptr) return false;
+
+    double value = tree->evaluate(node, vars);
+    if (!isfinite(value)) {
+        return true;
+    }
+    if ((argument || (node->var_mask & ((uint64_t) 1 << var_id)) != 0) &&
+        (fabs(value) > FUZZ_MAX_VALUE || (fabs(value) > 0 && fabs(value) < FUZZ_MIN_VALUE))) {
+        return true;
+    }
+    if (node->type == OP && ((int) node->value == ADD || (int) node->value == SUB) && node->left != nullptr &&
+        fabs(value) > 0 && fabs(value) < FUZZ_CANCELLATION * (fabs(tree->evaluate(node->left, vars)) +
+                                                              fabs(tree->evaluate(node->right, vars)))) {
+        return true;
+    }
+
+    bool function = node->type == OP && (int) node->value > LOG;
+    return is_ill_conditioned_r(tree, node->left, vars, var_id, function) ||
+           is_ill_conditioned_r(tree, node->right, vars, var_id, function);
+}
+
+static double central_difference(exp_tree_t* tree, node_t* root, double* vars, size_t var_id, double step) {
+    double x = vars[var_id];
+
+    vars[var_id] = x + step;
+    double forward = tree->evaluate(root, vars);
+    vars[var_id] = x - step;
+    double backward = tree->evaluate(root, vars);
+    vars[var_id] = x;
+
+    return (forward - backward) / (2 * step);
+}
+
+static double extrapolated_difference(exp_tree_t* tree, node_t* root, double* vars, size_t var_id, double step) {
+    return (4 * central_difference(tree, root, vars, var_id, step / 2) - central_difference(tree, root, vars, var_id, step)) / 3;
+}
+
+//===================================SHRINK======================================================
+// Greedy: a node is replaced by one of its children, by x or by 1, and a constant by 1,
+// as long as the expression still fails the same way at the same points. Every accepted
+// step makes the text shorter or the constants smaller, so it ends.
+
+static void shrink(gen_tree_t* tree, uint64_t points_seed, fuzz_failure_t* failure) {
+    char text[FUZZ_TEXT_LEN] = "";
+    gen_tree_t candidate = {};
+    fuzz_failure_t* candidate_failure = (fuzz_failure_t*) calloc(1, sizeof(fuzz_failure_t));
+    if (candidate_failure == nullptr) return;
+
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t i = 0; i < tree->size && !progress; i++) {
+            const gen_node_t node = tree->nodes[i];
+            gen_node_t replacements[4] = {};
+            size_t replacements_amount = 0;
+
+            if (node.left != NIL) replacements[replacements_amount++] = tree->nodes[node.left];
+            if (node.right != NIL) replacements[replacements_amount++] = tree->nodes[node.right];
+            if (node.type == OP) {
+                replacements[replacements_amount++] = {VAR, 0, NIL, NIL};
+                replacements[replacements_amount++] = {NUM, 1, NIL, NIL};
+            }
+            else if (node.type == NUM && node.value > 1) {
+                replacements[replacements_amount++] = {NUM, 1, NIL, NIL};
+            }
+
+            for (size_t j = 0; j < replacements_amount && !progress; j++) {
+                candidate = *tree;
+                candidate.nodes[i] = replacements[j];
+                if (!print_expression(&candidate, text, sizeof(text)) || strcmp(text, failure->shrunk) == 0) {
+                    continue;
+                }
+
+                if (check_expression(text, points_seed, candidate_failure) == failure->verdict) {
+                    *tree = candidate;
+                    failure->x = candidate_failure->x;
+                    failure->y = candidate_failure->y;
+                    failure->expected = candidate_failure->expected;
+                    failure->got = candidate_failure->got;
+                    snprintf(failure->shrunk, sizeof(failure->shrunk), "%s", text);
+                    progress = true;
+                }
+            }
+        }
+    }
+    free(candidate_failure);
+}
+
+//===================================RUN=========================================================
+
+static void* fuzz_worker(void* arg) {
+    fuzz_t* fuzz = (fuzz_t*) arg;
+    char expression[FUZZ_TEXT_LEN] = "";
+    gen_tree_t tree = {};
+    fuzz_failure_t* failure = (fuzz_failure_t*) calloc(1, sizeof(fuzz_failure_t));
+    if (failure == nullptr) {
+        LOG(ERROR, "Memory allocation error\n");
+        return nullptr;
+    }
+
+    for (size_t i = fuzz->next_case++; i < fuzz->cases && !fuzz->timed_out; i = fuzz->next_case++) {
+        uint64_t state = fuzz->seed ^ (i * 0xa0761d6478bd642fu);
+        do {
+            tree.size = 0;
+            tree.root = generate_r(&state, &tree, fuzz->depth);
+        } while (!has_x(&tree));
+        uint64_t points_seed = next_random(&state);
+
+        verdict_t verdict = CASE_SKIPPED;
+        if (print_expression(&tree, expression, sizeof(expression))) {
+            verdict = check_expression(expression, points_seed, failure);
+        }
+
+        switch (verdict) {
+            case CASE_PASSED:
+                fuzz->passed++;
+                break;
+            case CASE_SKIPPED:
+                fuzz->skipped++;
+                break;
+            case CASE_DERIVATIVE_ERR:
+            case CASE_OPTIMIZE_ERR:
+            case CASE_VERIFY_ERR:
+                fuzz->failed++;
+                snprintf(failure->expression, sizeof(failure->expression), "%s", expression);
+                snprintf(failure->shrunk, sizeof(failure->shrunk), "%s", expression);
+                shrink(&tree, points_seed, failure);
+                record_failure(fuzz, failure);
+                break;
+            default:
+                break;
+        }
+
+        if (++fuzz->done % FUZZ_CLOCK_PERIOD == 0 && fuzz->seconds > 0 &&
+            get_time_ns() - fuzz->start_ns > fuzz->seconds * 1e9) {
+            fuzz->timed_out = true;
+        }
+    }
+    free(failure);
+    return nullptr;
+}
+
+// Failures are kept once per shrunk expression, most of them shrink to a handful of cases.
+static void record_failure(fuzz_t* fuzz, const fuzz_failure_t* failure) {
+    pthread_mutex_lock(&fuzz->mutex);
+    bool known = false;
+    for (size_t i = 0; i < fuzz->failures_amount && !known; i++) {
+        known = strcmp(fuzz->failures[i].shrunk, failure->shrunk) == 0;
+    }
+    if (!known && fuzz->failures_amount < FUZZ_MAX_FAILURES) {
+        fuzz->failures[fuzz->failures_amount++] = *failure;
+    }
+    pthread_mutex_unlock(&fuzz->mutex);
+}
+
+// A crash can not be shrunk in process, the expression is printed for -e instead.
+static void crash_handler(int signal_number) {
+    const char* prefix = "fuzz: crashed on ";
+    if (write(STDERR_FILENO, prefix, strlen(prefix)) >= 0 && CURRENT_CASE != nullptr &&
+        write(STDERR_FILENO, CURRENT_CASE, strlen(CURRENT_CASE)) >= 0) {
+        if (write(STDERR_FILENO, "\n", 1)) {}
+    }
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+static void print_failure(const fuzz_failure_t* failure) {
+    if (failure->verdict == CASE_VERIFY_ERR) {
+        printf("malformed tree, see the log\n");
+    }
+    else {
+        printf("%s at x = %.17g, y = %.17g: expected %.17g, got %.17g\n",
+               (failure->verdict == CASE_DERIVATIVE_ERR) ? "wrong derivative" : "optimize changed the derivative",
+               failure->x, failure->y, failure->expected, failure->got);
+    }
+    if (failure->expression[0] != '\0') {
+        printf("    generated: %s\n", failure->expression);
+    }
+    printf("    shrunk:    %s\n", failure->shrunk);
+    printf("    replay:    fuzz -s 0x%" PRIx64 " -e \"%s\"\n", failure->points_seed, failure->shrunk);
+}
+
+static double get_time_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+// fuzz [-j threads] [-n cases] [-t seconds] [-s seed] [-d depth] [-e expression]
+// -e checks one expression, e.g. a shrunk one, with the points of seed -s.
+int main(int argc, char** argv) {
+    LoggerSetFile(stderr);
+    LoggerSetLevel(ERROR);
+
+    fuzz_t* fuzz = new fuzz_t();
+    fuzz->seed = FUZZ_DEFAULT_SEED;
+    fuzz->cases = FUZZ_DEFAULT_CASES;
+    fuzz->depth = FUZZ_DEFAULT_DEPTH;
+    pthread_mutex_init(&fuzz->mutex, nullptr);
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads_amount = (online > 0) ? (size_t) online : 1;
+    const char* expression = nullptr;
+
+    int option = 0;
+    while ((option = getopt(argc, argv, "j:n:t:s:d:e:")) != -1) {
+        switch (option) {
+            case 'j': threads_amount = strtoul(optarg, nullptr, 10);  break;
+            case 'n': fuzz->cases = strtoul(optarg, nullptr, 10);     break;
+            case 't': fuzz->seconds = strtod(optarg, nullptr);
+                      fuzz->cases = SIZE_MAX;                         break;
+            case 's': fuzz->seed = strtoull(optarg, nullptr, 0);      break;
+            case 'd': fuzz->depth = strtoul(optarg, nullptr, 10);     break;
+            case 'e': expression = optarg;                            break;
+            default:
+                fprintf(stderr, "usage: %s [-j threads] [-n cases] [-t seconds] [-s seed] [-d depth] [-e expression]\n", argv[0]);
+                delete fuzz;
+                return 2;
+        }
+    }
+    if (threads_amount == 0 || threads_amount > FUZZ_MAX_THREADS || fuzz->depth > FUZZ_MAX_DEPTH) {
+        fprintf(stderr, "threads have to be in [1, %zu], depth in [0, %zu]\n", FUZZ_MAX_THREADS, FUZZ_MAX_DEPTH);
+        delete fuzz;
+        return 2;
+    }
+
+    signal(SIGSEGV, crash_handler);
+    signal(SIGFPE, crash_handler);
+    signal(SIGABRT, crash_handler);
+    signal(SIGBUS, crash_handler);
+
+    fuzz->failures = (fuzz_failure_t*) calloc(FUZZ_MAX_FAILURES, sizeof(fuzz_failure_t));
+    if (fuzz->failures == nullptr) {
+        fprintf(stderr, "Memory allocation error\n");
+        delete fuzz;
+        return 1;
+    }
+
+    if (expression != nullptr) {
+        fuzz_failure_t* failure = &fuzz->failures[0];
+        verdict_t verdict = check_expression(expression, fuzz->seed, failure);
+        if (verdict == CASE_DERIVATIVE_ERR || verdict == CASE_OPTIMIZE_ERR || verdict == CASE_VERIFY_ERR) {
+            snprintf(failure->shrunk, sizeof(failure->shrunk), "%s", expression);
+            print_failure(failure);
+        }
+        else {
+            printf("%s\n", (verdict == CASE_PASSED) ? "passed" : "skipped: no point of the domain could be checked");
+        }
+        free(fuzz->failures);
+        delete fuzz;
+        return (verdict == CASE_PASSED || verdict == CASE_SKIPPED) ? 0 : 1;
+    }
+
+    pthread_t threads[FUZZ_MAX_THREADS] = {};
+    fuzz->start_ns = get_time_ns();
+    for (size_t i = 0; i < threads_amount; i++) {
+        pthread_create(&threads[i], nullptr, fuzz_worker, fuzz);
+    }
+    for (size_t i = 0; i < threads_amount; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    double seconds = (get_time_ns() - fuzz->start_ns) / 1e9;
+
+    size_t done = fuzz->passed + fuzz->skipped + fuzz->failed;
+    printf("%zu cases of depth %zu in %.1f s on %zu threads: %.0f cases/s, %.1f M cases/hour\n",
+           done, fuzz->depth, seconds, threads_amount, (double) done / seconds, (double) done / seconds * 3600 / 1e6);
+    printf("%zu passed, %zu skipped (no point in the domain), %zu failed, seed 0x%" PRIx64 "\n",
+           (size_t) fuzz->passed, (size_t) fuzz->skipped, (size_t) fuzz->failed, fuzz->seed);
+
+    for (size_t i = 0; i < fuzz->failures_amount; i++) {
+        print_failure(&fuzz->failures[i]);
+    }
+
+    int status = (fuzz->failed == 0) ? 0 : 1;
+    free(fuzz->failures);
+    delete fuzz;
+    return status;
+}
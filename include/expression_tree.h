@@ -3,10 +3,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "text_lib.h"
 
 #define MAX_OP_LEN 10
 #define MAX_NAME_LEN 11
+#define MAX_VARS_AMOUNT 100
+#define VAR_MASK_BITS 64
+#define NUM_EPSILON 1e-12
+#define MAX_INT_POWER 64
+#define MAX_PATTERN_TOKENS 32
+#define MAX_PATTERN_CAPTURES 8
+#define MAX_REWRITE_RULES 64
 
 typedef enum {
     NUM = 0,
@@ -57,8 +65,16 @@ struct node_t {
 
     type_t type;
     double value;
+
+    uint64_t var_mask;
+    uint64_t hash;
 };
 
+typedef struct {
+    double val;
+    double der;
+} dual_t;
+
 typedef enum {
     NO_ERR             = 0,
     SYNTAX_ERR         = 1,
@@ -70,6 +86,11 @@ typedef enum {
     ADD_SYNTAX_ERR     = 7,
     INVALID_ROOT_ERR   = 8,
     CYCLIC_LINKING_ERR = 9,
+    FILE_ERR           = 10,
+    FORMAT_ERR         = 11,
+    SHARED_NODE_ERR    = 12,
+    PARENT_LINK_ERR    = 13,
+    INVALID_VALUE_ERR  = 14,
 } err_t;
 
 typedef enum {
@@ -111,11 +132,247 @@ const func_name_table_t func_name_table[] = {
 
 const size_t func_name_table_len = sizeof(func_name_table) / sizeof(func_name_table[0]);
 
+typedef struct {
+    uint64_t hash;
+    node_t* key;
+    size_t var_id;
+    node_t* value;
+    size_t count;
+    size_t index;
+} node_table_entry_t;
+
+typedef struct {
+    node_table_entry_t* entries;
+    size_t capacity;
+    size_t size;
+} node_table_t;
+
+double fast_pow(double base, double exponent);
+
+uint64_t node_hash(node_t* node);
+uint64_t node_hash_r(node_t* node);
+bool node_equal_r(node_t* node1, node_t* node2);
+
+err_t node_table_ctor(node_table_t* table, size_t capacity);
+void node_table_dtor(node_table_t* table);
+node_table_entry_t* node_table_find(node_table_t* table, node_t* key, size_t var_id);
+node_table_entry_t* node_table_insert(node_table_t* table, node_t* key, size_t var_id);
+
+typedef struct {
+    node_table_t table;
+    node_t** nodes;
+    size_t nodes_amount;
+    size_t* temp_ids;
+    size_t temps_amount;
+} cse_t;
+
+err_t cse_ctor(cse_t* cse, node_t* root);
+err_t cse_ctor_roots(cse_t* cse, node_t** roots, size_t roots_amount);
+void cse_dtor(cse_t* cse);
+size_t cse_index(cse_t* cse, node_t* node);
+size_t cse_temp_id(cse_t* cse, node_t* node);
+
+typedef struct {
+    type_t type;
+    double value;
+    size_t dst;
+    size_t lhs;
+    size_t rhs;
+} instr_t;
+
+typedef struct {
+    instr_t* code;
+    size_t size;
+    double* slots;
+    size_t slots_amount;
+    size_t result;
+} program_t;
+
+void program_dtor(program_t* program);
+
+typedef double (*jit_func_t)(const double* vars, double* slots);
+
+typedef struct {
+    program_t program;
+    unsigned char* code;
+    size_t code_capacity;
+    size_t code_size;
+    jit_func_t func;
+} jit_t;
+
+void jit_dtor(jit_t* jit);
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} bytes_t;
+
+void bytes_dtor(bytes_t* bytes);
+err_t bytes_append(bytes_t* bytes, const void* data, size_t size);
+
+typedef struct {
+    double coef;
+    node_t* node;
+} ac_term_t;
+
+typedef struct {
+    ac_term_t* terms;
+    size_t size;
+    size_t capacity;
+    double constant;
+} ac_sum_t;
+
+typedef struct {
+    node_t* base;
+    node_t* exp;
+} ac_factor_t;
+
+typedef struct {
+    ac_factor_t* factors;
+    size_t size;
+    size_t capacity;
+    double coef;
+} ac_product_t;
+
+typedef enum {
+    PATTERN_NIL = 0,
+    PATTERN_NUM = 1,
+    PATTERN_ANY = 2,
+    PATTERN_OP  = 3,
+} pattern_kind_t;
+
+typedef struct {
+    pattern_kind_t kind;
+    double value;
+} pattern_token_t;
+
+typedef struct {
+    const char* pattern;
+    const char* replacement;
+} rewrite_rule_t;
+
+extern const rewrite_rule_t REWRITE_RULES[];
+extern const size_t REWRITE_RULES_AMOUNT;
+
+bool parse_pattern(const char* str, pattern_token_t* tokens, size_t* size);
+
+typedef struct {
+    type_t type;
+    double value;
+    size_t children[2];
+    bool dead;
+} enode_t;
+
+typedef struct {
+    enode_t* nodes;
+    size_t* parents;
+    bool* has_constant;
+    double* constants;
+    size_t size;
+    size_t capacity;
+
+    size_t* table;
+    size_t table_capacity;
+
+    size_t* class_nodes;
+    size_t* class_start;
+} egraph_t;
+
+typedef struct {
+    size_t max_nodes;
+    size_t max_iterations;
+    double max_time_ms;
+} egraph_budget_t;
+
+typedef struct {
+    double* coefs;
+    size_t degree;
+} poly_t;
+
+err_t poly_ctor(poly_t* poly, size_t degree);
+void poly_dtor(poly_t* poly);
+err_t poly_derivative(const poly_t* poly, poly_t* derivative);
+double poly_evaluate(const poly_t* poly, double x);
+
+typedef struct {
+    char dir[FILENAME_MAX];
+    size_t max_bytes;
+    size_t bytes;
+    size_t hits;
+    size_t misses;
+    size_t stores;
+    size_t evictions;
+} diff_cache_t;
+
+err_t diff_cache_ctor(diff_cache_t* cache, const char* dir, size_t max_bytes);
+void diff_cache_dtor(diff_cache_t* cache);
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool failed;
+    node_t** records;
+    size_t* record_nodes;
+    node_t* arena;
+    size_t records_amount;
+    size_t records_size;
+    size_t nodes_amount;
+    size_t* var_ids;
+    size_t vars_amount;
+} serial_reader_t;
+
+typedef enum {
+    PHASE_TOKENIZE      = 0,
+    PHASE_PARSE         = 1,
+    PHASE_DIFFERENTIATE = 2,
+    PHASE_OPTIMIZE      = 3,
+    PHASE_TEX           = 4,
+    PHASE_DUMP          = 5,
+    PHASES_AMOUNT       = 6,
+} phase_t;
+
+// Counters of the runs since init() or reset_stats(). Live nodes are the ones allocated
+// by new_node() and not freed yet, the parsed tree lives in the token array. A phase is
+// timed once however deep it recurses, but phases may nest: TeX output written during
+// differentiation counts in both.
+typedef struct {
+    size_t tokens;
+    size_t nodes_parsed;
+    size_t nodes_differentiated;
+    size_t nodes_optimized;
+    size_t optimizer_passes;
+    size_t rule_rewrites[MAX_REWRITE_RULES];
+    size_t copy_subtree_calls;
+    size_t allocated_nodes;
+    size_t live_nodes;
+    size_t peak_live_nodes;
+    double phase_ms[PHASES_AMOUNT];
+    size_t phase_depth[PHASES_AMOUNT];
+} exp_stats_t;
+
+struct phase_timer_t {
+    exp_stats_t* stats;
+    phase_t phase;
+    double start_ms;
+
+    phase_timer_t(exp_stats_t* phase_stats, phase_t timed_phase);
+    ~phase_timer_t();
+
+    phase_timer_t(const phase_timer_t&) = delete;
+    phase_timer_t& operator=(const phase_timer_t&) = delete;
+};
+
 class exp_tree_t {
 public:
     err_t init(FILE* data_file);
+    err_t init(const char* expression);
     void dtor();
     void delete_tree(node_t* root);
+    node_t* root();
+    err_t reserve_nodes(size_t amount);
+    void release_nodes();
 
     void set_dump_ostream(FILE* ostream);
     void print_preorder_();
@@ -136,35 +393,142 @@ public:
     void calculate_expression_r(node_t* node);
     double calculate_expression(node_t* node);
 
+    double evaluate(node_t* node, const double* vars);
+    dual_t evaluate_dual(node_t* node, const double* vars, size_t var_id);
+
     void print_tree_to_tex(FILE* ostream, node_t* root);
     void print_exp_to_tex(FILE* ostream, node_t* node);
+    void print_cse_to_tex(FILE* ostream, node_t* root);
+    void print_tex_line(FILE* ostream, node_t* root, bool cse);
+    void print_infix(FILE* ostream, node_t* root);
+    err_t print_to_c(FILE* ostream, node_t* root, const char* name);
+
+    err_t compile(node_t* root, program_t* program);
+    double execute(program_t* program, const double* vars);
+    err_t jit_compile(node_t* root, jit_t* jit);
+    double jit_execute(jit_t* jit, const double* vars);
+
+    node_t* differentiate_expression(FILE* ostream, size_t var_id = 0);
+    node_t* differentiate(node_t* root, size_t var_id);
+    bool find_var(const char* name, size_t* var_id);
+
+    node_t* nth_derivative(node_t* root, size_t var_id, size_t order, size_t* node_counts);
+    node_t* mixed_derivative(node_t* root, const size_t* var_ids, size_t order);
+    err_t hessian(node_t* root, size_t vars_amount, node_t** hessian);
+    void clear_diff_memo();
+    void diff_memo_stats(size_t* hits, size_t* misses);
 
-    node_t* differentiate_expression(FILE* ostream);
+    node_t* update(const char* expression, size_t var_id);
+
+    err_t serialize(node_t* root, bool as_dag, bytes_t* bytes);
+    err_t deserialize(const uint8_t* data, size_t size, node_t** root);
+    err_t store(const char* path, node_t* root, bool as_dag);
+    err_t load(const char* path);
+
+    node_t* cached_derivative(diff_cache_t* cache, node_t* root, size_t var_id, size_t order = 1);
+    static size_t count_nodes_r(node_t* node);
 
     node_t* optimize(node_t* node);
+    node_t* canonicalize(node_t* root);
+    static bool is_function(double value);
+
+    node_t* optimize_egraph(node_t* root, const egraph_budget_t* budget = nullptr);
+    double expression_cost(node_t* root);
+
+    bool to_polynomial(node_t* node, size_t var_id, poly_t* poly);
+    node_t* polynomial_tree(const poly_t* poly, size_t var_id);
 
     err_t verify(node_t* root);
+    void set_verify_sampling(size_t period);
+
+    const exp_stats_t* stats();
+    void reset_stats();
+    void print_stats_json(FILE* ostream);
 private:
     void add_parents_rel_r(node_t* node, node_t* parent);
     node_t* new_node(type_t type, double value, node_t* left, node_t* right, node_t* parent, rel_t rel);
     void delete_subtree_r(node_t* node);
+    void free_node(node_t* node);
 
     int get_operator_precedence(int op);
     void print_to_tex(FILE* ostream, node_t* node);
+    void print_tex_formulas(FILE* ostream, node_t* root, bool cse, const char* separator);
     void print_operator(FILE* ostream, double value);
     void print_inorder(FILE* ostream, node_t* node, int parent_precedence);
+    void print_infix_r(FILE* ostream, node_t* node, int min_precedence);
 
     bool calculations_optimization_r(node_t* node);
-    node_t* basic_operations_optimization_r(node_t* node, rel_t rel, bool* flag);
-    node_t* one_val_optimization(node_t* node, rel_t rel, rel_t parent_rel, bool* flag);
-    node_t* null_val__optimization(node_t* node, rel_t rel, rel_t parent_rel, bool* flag);
+    node_t* rewrite_r(node_t* node, bool* flag);
+    node_t* apply_rule(node_t* node, size_t rule, node_t*** captures);
+    node_t* build_replacement_r(const pattern_token_t* tokens, size_t* pos, node_t** captured, bool* used);
 
-    bool is_var_present_r(node_t* node);
+    size_t egraph_add_tree_r(egraph_t* egraph, node_t* node);
+    err_t egraph_rebuild(egraph_t* egraph);
+    node_t* egraph_extract_r(egraph_t* egraph, size_t eclass, const size_t* best);
+    bool is_num_value(node_t* node, double value);
+
+    double apply_operation(double op_type, double val_l, double val_r);
+    dual_t apply_dual_operation(double op_type, dual_t val_l, dual_t val_r);
+
+    uint64_t var_bit(size_t var_id);
+    bool depends_on(node_t* node, size_t var_id);
+    uint64_t update_var_mask_r(node_t* node);
     void print_derivative_to_tex(FILE* ostream, node_t* node);
+    void print_c_r(FILE* ostream, cse_t* cse, const size_t* temps, node_t* node, bool definition);
+    void print_c_power(FILE* ostream, cse_t* cse, const size_t* temps, node_t* node, size_t temp);
 
     node_t* copy_subtree(node_t* node);
-    void differentiate_operation(FILE* ostream, node_t* node, node_t* op_node);
-    node_t* differentiate(FILE* ostream, node_t* node);
+    void differentiate_operation(FILE* ostream, node_t* node, node_t* op_node, size_t var_id);
+    node_t* differentiate(FILE* ostream, node_t* node, size_t var_id);
+    node_t* differentiate_as(FILE* ostream, node_t* node, op_t op, size_t var_id);
+
+    node_t* differentiate_memo(FILE* ostream, node_t* node, size_t var_id);
+    void count_subtrees_r(node_t* node, size_t var_id);
+    node_t* find_memo_derivative(node_t* node, size_t var_id);
+    void memoize_derivative(node_t* node, size_t var_id, node_t* derivative);
+    void purge_diff_memo();
+
+    node_t* canonicalize_r(node_t* node);
+    node_t* canonical_product(node_t* node, double* coef);
+    void collect_terms_r(node_t* node, double coef, ac_sum_t* sum);
+    void split_terms_r(node_t* node, double coef, ac_sum_t* sum);
+    void collect_factors_r(node_t* node, double sign, ac_product_t* product);
+    void split_factors_r(node_t* node, double sign, ac_product_t* product);
+    node_t* build_sum(ac_sum_t* sum);
+    node_t* build_product(ac_product_t* product, double* coef);
+    node_t* build_term(double coef, node_t* monomial);
+    node_t* build_power(node_t* base, node_t* exp);
+    node_t* add_exponents(node_t* exp1, node_t* exp2);
+    node_t* negate(node_t* node);
+
+    int find_polynomials_r(node_t* node, size_t var_id);
+    void add_poly_derivative(node_t* node, size_t var_id);
+    node_t* find_poly_derivative(node_t* node, size_t var_id);
+    void clear_poly_diff();
+    node_t* poly_op(double op, node_t* left, node_t* right);
+    node_t* poly_power(size_t var_id, size_t power);
+
+    node_t* find_changed_subtree(node_t* old_root, node_t* new_root, size_t* depth);
+    void delete_token_tree_r(node_t* node);
+
+    node_t* dag_intern(type_t type, double value, node_t* left, node_t* right);
+    node_t* dag_intern_r(node_t* node);
+    node_t* dag_make(double op, node_t* left, node_t* right);
+    node_t* dag_num(double value);
+    node_t* dag_derivative(node_t* node, size_t var_id);
+    node_t* dag_substitute_r(node_t* node, node_t* left, node_t* right);
+    node_t* dag_expand_r(node_t* node);
+    void clear_dag();
+
+    err_t deserialize(const uint8_t* data, size_t size, node_t** root, bool into_tokens);
+    err_t serialize_node_r(bytes_t* bytes, node_table_t* table, node_t* node, size_t* records_amount);
+    node_t* deserialize_node_r(serial_reader_t* reader);
+
+    err_t canonical_key(node_t* root, size_t var_id, size_t order, size_t* var_map, size_t* vars_amount, bytes_t* key);
+    err_t canonical_key_r(node_t* node, size_t* var_map, size_t* vars_amount, bytes_t* key);
+    uint64_t shape_hash_r(node_t* node);
+    bool is_commutative(node_t* node);
+    void remap_vars_r(node_t* node, const size_t* var_map);
 
 // Grammar
 
@@ -193,14 +557,40 @@ private:
     double index_in_nametable(char* name);
     void print_var_nametable();
 
-    bool is_tree_acyclic_r(node_t* node, node_t* parent);
-    err_t check_op_type_invariants_r(node_t* node);
+    err_t check_node(node_t* node);
 private:
-    name_t var_nametable_[100];
+    name_t var_nametable_[MAX_VARS_AMOUNT];
     size_t var_nametable_size_{0};
     node_t* root_;
     node_t* tokens_{nullptr};
     size_t tokens_array_size_{0};
+    bool syntax_failed_{false};
+
+    node_t* node_pool_{nullptr};
+    size_t node_pool_size_{0};
+    size_t node_pool_capacity_{0};
+
+    node_table_t diff_memo_{};
+    bool diff_memo_active_{false};
+    size_t diff_memo_nodes_{0};
+    size_t diff_memo_hits_{0};
+    size_t diff_memo_misses_{0};
+
+    node_table_t dag_{};
+    node_table_t dag_memo_{};
+    node_t* dag_root_{nullptr};
+
+    bool canonical_failed_{false};
+
+    node_table_t poly_diff_{};
+
+    cse_t* print_cse_{nullptr};
+    node_t* print_cse_root_{nullptr};
+
+    exp_stats_t stats_{};
+
+    size_t verify_period_{1};
+    size_t verify_calls_{0};
 };
 
 #endif /* EXPRESSION_TREE_H */
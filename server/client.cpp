@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "expression_tree.h"
+#include "protocol.h"
+
+const size_t CLIENT_MAX_CONNECTIONS = 256;
+const size_t CLIENT_MAX_PIPELINE = 256;
+const size_t CLIENT_MAX_EXPRESSIONS = 4096;
+const size_t CLIENT_VALUES_AMOUNT = 16;
+
+const char* CLIENT_EXPRESSIONS[] = {
+    "x^2 $",
+    "sin(x) * cos(x) $",
+    "ln(x^2 + 1) / (x + 2) $",
+    "x^3 * y + sin(x*y) / (y^2 + 1) $",
+    "ch(x) * th(x) - 3*x^4 + 2*x $",
+    "(x - 1)^6 + x/4 $",
+    "arctg(x) * (x + 1)^0.5 $",
+    "exp(sin(x) + x^2) * ln(x + 3) $",
+};
+
+const size_t CLIENT_EXPRESSIONS_AMOUNT = sizeof(CLIENT_EXPRESSIONS) / sizeof(CLIENT_EXPRESSIONS[0]);
+
+typedef struct {
+    const char* path;
+    const char* var;
+    double value;
+    const char* const* expressions;
+    size_t expressions_amount;
+    size_t requests;
+    size_t pipeline;
+
+    size_t index;
+    double* latencies_ns;
+    size_t errors;
+    bool ok;
+} connection_t;
+
+static int connect_socket(const char* path);
+static bool send_request(int fd, uint8_t* frame, uint32_t id, const char* var, double value, const char* expression);
+static bool recv_response(int fd, frame_header_t* header, uint8_t* payload);
+static bool send_all(int fd, const void* data, size_t size);
+static bool recv_all(int fd, void* data, size_t size);
+static void* run_connection(void* arg);
+static size_t read_expressions(const char* path, char*** lines);
+static double get_time_ns();
+static int cmp_doubles(const void* a, const void* b);
+
+//===================================CLIENT======================================================
+// diff_client [-x var] [-a value] [-c connections] [-n requests] [-p pipeline] [-e expression]
+//             socket [file]
+// With -e sends one request and prints the derivative and its value. Otherwise a load
+// test: every connection runs in its own thread and keeps up to pipeline requests in
+// flight, cycling through the expressions of the file, one a line, or a built-in list.
+// Variables are set to value. Latency is measured from send to response.
+
+int main(int argc, char** argv) {
+    connection_t settings = {nullptr, "x", 1.5, CLIENT_EXPRESSIONS, CLIENT_EXPRESSIONS_AMOUNT, 10000, 1,
+                             0, nullptr, 0, true};
+    size_t connections_amount = 1;
+    const char* expression = nullptr;
+
+    int option = 0;
+    while ((option = getopt(argc, argv, "x:a:c:n:p:e:")) != -1) {
+        switch (option) {
+            case 'x': settings.var = optarg;                                  break;
+            case 'a': settings.value = strtod(optarg, nullptr);               break;
+            case 'c': connections_amount = strtoul(optarg, nullptr, 10);      break;
+            case 'n': settings.requests = strtoul(optarg, nullptr, 10);       break;
+            case 'p': settings.pipeline = strtoul(optarg, nullptr, 10);       break;
+            case 'e': expression = optarg;                                    break;
+            default:
+                fprintf(stderr, "usage: %s [-x var] [-a value] [-c connections] [-n requests] [-p pipeline] "
+                                "[-e expression] socket [file]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind == argc || argc - optind > 2 || connections_amount == 0 || connections_amount > CLIENT_MAX_CONNECTIONS ||
+        settings.pipeline == 0 || settings.pipeline > CLIENT_MAX_PIPELINE || settings.requests == 0) {
+        fprintf(stderr, "usage: %s [-x var] [-a value] [-c connections in [1, %zu]] [-n requests] "
+                        "[-p pipeline in [1, %zu]] [-e expression] socket [file]\n",
+                        argv[0], CLIENT_MAX_CONNECTIONS, CLIENT_MAX_PIPELINE);
+        return 2;
+    }
+    settings.path = argv[optind];
+
+    if (expression != nullptr) {
+        int fd = connect_socket(settings.path);
+        if (fd == -1) return 1;
+
+        frame_header_t header = {};
+        uint8_t* frame = (uint8_t*) calloc(sizeof(frame_header_t) + SERVER_MAX_PAYLOAD, sizeof(uint8_t));
+        bool ok = frame != nullptr && send_request(fd, frame, 0, settings.var, settings.value, expression) &&
+                  recv_response(fd, &header, frame);
+        close(fd);
+
+        if (ok && header.status != NO_ERR) {
+            fprintf(stderr, "error %u\n", header.status);
+            ok = false;
+        }
+        if (ok) {
+            double value = 0;
+            memcpy(&value, frame, sizeof(value));
+            printf("%.*s\n%.17g\n", (int) (header.size - sizeof(value)), (const char*) frame + sizeof(value), value);
+        }
+        free(frame);
+        return ok ? 0 : 1;
+    }
+
+    char** lines = nullptr;
+    if (argc - optind == 2) {
+        settings.expressions_amount = read_expressions(argv[optind + 1], &lines);
+        settings.expressions = lines;
+        if (settings.expressions_amount == 0) {
+            fprintf(stderr, "No expressions in %s\n", argv[optind + 1]);
+            free(lines);
+            return 1;
+        }
+    }
+
+    connection_t* connections = (connection_t*) calloc(connections_amount, sizeof(connection_t));
+    pthread_t threads[CLIENT_MAX_CONNECTIONS] = {};
+    size_t total = 0;
+    bool ok = connections != nullptr;
+
+    double start = get_time_ns();
+    size_t started = 0;
+    for (; ok && started < connections_amount; started++) {
+        connections[started] = settings;
+        connections[started].index = started;
+        connections[started].requests = settings.requests / connections_amount +
+                                        (started < settings.requests % connections_amount);
+        if (pthread_create(&threads[started], nullptr, run_connection, &connections[started]) != 0) {
+            fprintf(stderr, "Failed to start connection %zu\n", started);
+            ok = false;
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], nullptr);
+        ok = ok && connections[i].ok;
+        total += connections[i].requests;
+    }
+    double elapsed_ns = get_time_ns() - start;
+
+    double* latencies_ns = (double*) calloc(total + 1, sizeof(double));
+    size_t errors = 0;
+    size_t filled = 0;
+    for (size_t i = 0; i < started; i++) {
+        if (latencies_ns != nullptr && connections[i].latencies_ns != nullptr) {
+            memcpy(latencies_ns + filled, connections[i].latencies_ns, connections[i].requests * sizeof(double));
+            filled += connections[i].requests;
+        }
+        errors += connections[i].errors;
+        free(connections[i].latencies_ns);
+    }
+
+    if (ok && latencies_ns != nullptr && filled == total) {
+        qsort(latencies_ns, total, sizeof(double), cmp_doubles);
+        printf("requests %zu, errors %zu, connections %zu, pipeline %zu\n", total, errors, started, settings.pipeline);
+        printf("%.0f req/s, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+               (double) total / elapsed_ns * 1e9,
+               latencies_ns[total / 2] / 1e3, latencies_ns[total * 9 / 10] / 1e3,
+               latencies_ns[total * 99 / 100] / 1e3, latencies_ns[total - 1] / 1e3);
+    }
+    else {
+        ok = false;
+    }
+
+    free(latencies_ns);
+    free(connections);
+    if (lines != nullptr) {
+        for (size_t i = 0; i < settings.expressions_amount; i++) {
+            free(lines[i]);
+        }
+        free(lines);
+    }
+    return (ok && errors == 0) ? 0 : 1;
+}
+
+// Ids are indices into the requests of the connection, so a response finds its send time
+// whatever order it comes in.
+static void* run_connection(void* arg) {
+    connection_t* conn = (connection_t*) arg;
+    double* sent_ns = (double*) calloc(conn->requests, sizeof(double));
+    conn->latencies_ns = (double*) calloc(conn->requests, sizeof(double));
+    uint8_t* frame = (uint8_t*) calloc(sizeof(frame_header_t) + SERVER_MAX_PAYLOAD, sizeof(uint8_t));
+
+    int fd = -1;
+    if (sent_ns == nullptr || conn->latencies_ns == nullptr || frame == nullptr ||
+        (fd = connect_socket(conn->path)) == -1) {
+        conn->ok = false;
+        free(sent_ns);
+        free(frame);
+        return nullptr;
+    }
+
+    size_t sent = 0;
+    size_t received = 0;
+    while (received < conn->requests && conn->ok) {
+        while (sent < conn->requests && sent - received < conn->pipeline) {
+            const char* expression = conn->expressions[(conn->index + sent) % conn->expressions_amount];
+            sent_ns[sent] = get_time_ns();
+            if (!send_request(fd, frame, (uint32_t) sent, conn->var, conn->value, expression)) {
+                conn->ok = false;
+                break;
+            }
+            sent++;
+        }
+
+        frame_header_t header = {};
+        if (!conn->ok || !recv_response(fd, &header, frame) || header.id >= sent) {
+            conn->ok = false;
+            break;
+        }
+        conn->latencies_ns[header.id] = get_time_ns() - sent_ns[header.id];
+        conn->errors += (header.status != NO_ERR);
+        received++;
+    }
+
+    close(fd);
+    free(sent_ns);
+    free(frame);
+    return nullptr;
+}
+
+//===================================PROTOCOL====================================================
+
+static int connect_socket(const char* path) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Values for the first CLIENT_VALUES_AMOUNT variables, the rest are 0.
+// frame holds a header and SERVER_MAX_PAYLOAD bytes.
+static bool send_request(int fd, uint8_t* frame, uint32_t id, const char* var, double value, const char* expression) {
+    size_t var_size = strlen(var) + 1;
+    size_t expression_size = strlen(expression);
+    size_t values_amount = CLIENT_VALUES_AMOUNT;
+    size_t size = values_amount * sizeof(double) + var_size + expression_size;
+    if (size > SERVER_MAX_PAYLOAD) {
+        fprintf(stderr, "Expression %s is too long\n", expression);
+        return false;
+    }
+
+    frame_header_t header = {(uint32_t) size, id, NO_ERR, (uint32_t) values_amount};
+    uint8_t* cursor = frame;
+    memcpy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+    for (size_t i = 0; i < values_amount; i++, cursor += sizeof(double)) {
+        memcpy(cursor, &value, sizeof(double));
+    }
+    memcpy(cursor, var, var_size);
+    memcpy(cursor + var_size, expression, expression_size);
+
+    return send_all(fd, frame, sizeof(header) + size);
+}
+
+static bool recv_response(int fd, frame_header_t* header, uint8_t* payload) {
+    if (!recv_all(fd, header, sizeof(*header))) return false;
+    if (header->size > SERVER_MAX_PAYLOAD || (header->status == NO_ERR && header->size < sizeof(double))) {
+        fprintf(stderr, "Malformed response of %u bytes\n", header->size);
+        return false;
+    }
+    return recv_all(fd, payload, header->size);
+}
+
+static bool send_all(int fd, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    while (size != 0) {
+        ssize_t len = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            return false;
+        }
+        bytes += len;
+        size -= (size_t) len;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size) {
+    uint8_t* bytes = (uint8_t*) data;
+    while (size != 0) {
+        ssize_t len = recv(fd, bytes, size, 0);
+        if (len == -1 && errno == EINTR) continue;
+        if (len <= 0) {
+            fprintf(stderr, "recv: %s\n", (len == 0) ? "connection closed" : strerror(errno));
+            return false;
+        }
+        bytes += len;
+        size -= (size_t) len;
+    }
+    return true;
+}
+
+//===================================HELPERS=====================================================
+
+static size_t read_expressions(const char* path, char*** lines) {
+    FILE* istream = fopen(path, "r");
+    if (istream == nullptr) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    *lines = (char**) calloc(CLIENT_MAX_EXPRESSIONS, sizeof(char*));
+    size_t amount = 0;
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t len = 0;
+    while (*lines != nullptr && amount < CLIENT_MAX_EXPRESSIONS && (len = getline(&line, &capacity, istream)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        const char* expression = line + strspn(line, " \t");
+        if (*expression == '\0' || *expression == '#') continue;
+
+        (*lines)[amount] = strdup(expression);
+        if ((*lines)[amount] == nullptr) break;
+        amount++;
+    }
+
+    free(line);
+    fclose(istream);
+    return amount;
+}
+
+static double get_time_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int cmp_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,25 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#define SERVER_MAX_PAYLOAD (1 << 14)
+
+// Frames over a local stream socket, in host byte order: a header, then size bytes of
+// payload. Requests of a connection are served in parallel, so responses may come out of
+// order; id is echoed to match them.
+//
+// A request: values_amount doubles, the values of the variables in the order they first
+// appear in the expression (missing ones are 0), the variable to differentiate by and a
+// zero byte, then the expression, '$' optional.
+//
+// A response: status is an err_t, on NO_ERR the payload is the value of the derivative
+// at those values as a double and the derivative as text that parses back.
+typedef struct {
+    uint32_t size;
+    uint32_t id;
+    uint32_t status;
+    uint32_t values_amount;
+} frame_header_t;
+
+#endif /* PROTOCOL_H */
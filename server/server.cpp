@@ -0,0 +1,682 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "expression_tree.h"
+#include "logger.h"
+#include "protocol.h"
+#include "trace.h"
+
+const size_t SERVER_MAX_WORKERS = 256;
+const size_t SERVER_MAX_CONNECTIONS = 1024;
+const size_t SERVER_MAX_JOBS = 256;
+const size_t SERVER_MAX_EVENTS = 64;
+const size_t SERVER_MAX_BUFFERED = 1 << 20;
+const size_t SERVER_READ_CHUNK = 4096;
+const size_t SERVER_POOL_NODES = 1 << 14;
+const int SERVER_BACKLOG = 128;
+const int SERVER_DRAIN_MS = 1000;
+
+// epoll data of the descriptors that are not connections.
+const uint64_t EVENT_LISTEN = SERVER_MAX_CONNECTIONS;
+const uint64_t EVENT_DONE   = SERVER_MAX_CONNECTIONS + 1;
+const uint64_t EVENT_SIGNAL = SERVER_MAX_CONNECTIONS + 2;
+
+typedef struct {
+    int fd;
+    uint32_t generation;
+    bytes_t in;
+    size_t in_pos;
+    bytes_t out;
+    size_t out_pos;
+    size_t pending;
+    bool eof;
+    uint32_t events;
+} conn_t;
+
+// A request in flight. The connection is named by its slot and generation: a connection
+// closed meanwhile bumps the generation and its responses are dropped.
+typedef struct {
+    size_t conn;
+    uint32_t generation;
+    frame_header_t request_header;
+    uint8_t request[SERVER_MAX_PAYLOAD + 1];
+    frame_header_t response_header;
+    uint8_t response[SERVER_MAX_PAYLOAD];
+} job_t;
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int done_fd;
+    int signal_fd;
+
+    conn_t* conns;
+    job_t* jobs;
+    job_t** free_jobs;
+    size_t free_jobs_amount;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    job_t** queue;
+    size_t queue_head;
+    size_t queue_size;
+    job_t** done;
+    size_t done_size;
+    bool stopping;
+
+    size_t served;
+} server_t;
+
+static bool server_ctor(server_t* server, const char* path);
+static void server_dtor(server_t* server, const char* path);
+static void run_loop(server_t* server);
+static void accept_connections(server_t* server);
+static void read_connection(server_t* server, size_t slot);
+static void dispatch_frames(server_t* server, size_t slot);
+static void flush_connection(server_t* server, size_t slot);
+static void update_connection(server_t* server, size_t slot);
+static void close_connection(server_t* server, size_t slot);
+static void collect_done(server_t* server);
+static void drain_responses(server_t* server);
+static void* worker_main(void* arg);
+static job_t* pop_job(server_t* server);
+static void serve(exp_tree_t* tree, job_t* job);
+
+typedef struct {
+    server_t* server;
+    size_t index;
+} worker_t;
+
+//===================================DAEMON======================================================
+// diff_server [-j workers] [-l log] socket
+// One thread runs the epoll loop: it accepts connections, reads frames and hands them to
+// the workers, and writes the responses back. Workers keep one exp_tree_t each for their
+// whole life, with a node pool, so a request allocates little besides its tokens. A
+// worker wakes the loop through an eventfd when it finishes a request. SIGINT and SIGTERM
+// stop the server after the requests in flight: the workers serve the queued ones and
+// their responses are sent before the connections close.
+
+int main(int argc, char** argv) {
+    size_t workers_amount = (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+    const char* log_path = nullptr;
+
+    int option = 0;
+    while ((option = getopt(argc, argv, "j:l:")) != -1) {
+        switch (option) {
+            case 'j': workers_amount = strtoul(optarg, nullptr, 10); break;
+            case 'l': log_path = optarg;                             break;
+            default:
+                fprintf(stderr, "usage: %s [-j workers] [-l log] socket\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind + 1 != argc || workers_amount == 0 || workers_amount > SERVER_MAX_WORKERS) {
+        fprintf(stderr, "usage: %s [-j workers] [-l log] socket, workers in [1, %zu]\n", argv[0], SERVER_MAX_WORKERS);
+        return 2;
+    }
+    const char* path = argv[optind];
+
+    // Blocked before any thread starts, the logger's too, so only the signalfd sees them.
+    sigset_t signals = {};
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE* logger = (log_path != nullptr) ? fopen(log_path, "w") : stderr;
+    if (logger == nullptr) {
+        fprintf(stderr, "Failed to open %s: %s\n", log_path, strerror(errno));
+        return 1;
+    }
+    LoggerSetFile(logger);
+    LoggerSetLevel((log_path != nullptr) ? INFO : SILENT);
+    if (log_path != nullptr) {
+        LoggerStartAsync(0, LOG_BLOCK);
+    }
+
+    server_t* server = (server_t*) calloc(1, sizeof(server_t));
+    if (server == nullptr || !server_ctor(server, path)) {
+        free(server);
+        if (log_path != nullptr) {
+            LoggerStopAsync();
+            fclose(logger);
+        }
+        return 1;
+    }
+
+    pthread_t threads[SERVER_MAX_WORKERS] = {};
+    worker_t workers[SERVER_MAX_WORKERS] = {};
+    size_t started = 0;
+    for (; started < workers_amount; started++) {
+        workers[started] = {server, started};
+        if (pthread_create(&threads[started], nullptr, worker_main, &workers[started]) != 0) {
+            fprintf(stderr, "Failed to start worker %zu\n", started);
+            break;
+        }
+    }
+
+    fprintf(stderr, "diff_server: %zu workers on %s\n", started, path);
+    if (started != 0) {
+        run_loop(server);
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->mutex);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    if (started != 0) {
+        drain_responses(server);
+    }
+
+    fprintf(stderr, "diff_server: %zu requests served\n", server->served);
+    server_dtor(server, path);
+    free(server);
+
+    if (log_path != nullptr) {
+        LoggerStopAsync();
+        fclose(logger);
+    }
+    return (started != 0) ? 0 : 1;
+}
+
+static bool server_ctor(server_t* server, const char* path) {
+    server->listen_fd = server->epoll_fd = server->done_fd = server->signal_fd = -1;
+    pthread_mutex_init(&server->mutex, nullptr);
+    pthread_cond_init(&server->cond, nullptr);
+
+    server->conns = (conn_t*) calloc(SERVER_MAX_CONNECTIONS, sizeof(conn_t));
+    server->jobs = (job_t*) calloc(SERVER_MAX_JOBS, sizeof(job_t));
+    server->free_jobs = (job_t**) calloc(SERVER_MAX_JOBS, sizeof(job_t*));
+    server->queue = (job_t**) calloc(SERVER_MAX_JOBS, sizeof(job_t*));
+    server->done = (job_t**) calloc(SERVER_MAX_JOBS, sizeof(job_t*));
+    if (server->conns == nullptr || server->jobs == nullptr || server->free_jobs == nullptr ||
+        server->queue == nullptr || server->done == nullptr) {
+        fprintf(stderr, "Memory allocation error: %s\n", strerror(errno));
+        server_dtor(server, nullptr);
+        return false;
+    }
+    for (size_t i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+        server->conns[i].fd = -1;
+    }
+    for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+        server->free_jobs[server->free_jobs_amount++] = &server->jobs[i];
+    }
+
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        server_dtor(server, nullptr);
+        return false;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    unlink(path);
+
+    sigset_t signals = {};
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server->listen_fd == -1 || server->epoll_fd == -1 || server->done_fd == -1 || server->signal_fd == -1 ||
+        bind(server->listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+        listen(server->listen_fd, SERVER_BACKLOG) == -1) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        server_dtor(server, nullptr);
+        return false;
+    }
+
+    int fds[] = {server->listen_fd, server->done_fd, server->signal_fd};
+    uint64_t data[] = {EVENT_LISTEN, EVENT_DONE, EVENT_SIGNAL};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = data[i];
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1) {
+            fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+            server_dtor(server, path);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void server_dtor(server_t* server, const char* path) {
+    if (server->conns != nullptr) {
+        for (size_t i = 0; i < SERVER_MAX_CONNECTIONS; i++) {
+            if (server->conns[i].fd != -1) close_connection(server, i);
+        }
+    }
+
+    int fds[] = {server->listen_fd, server->epoll_fd, server->done_fd, server->signal_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+    if (path != nullptr) {
+        unlink(path);
+    }
+
+    free(server->conns);
+    free(server->jobs);
+    free(server->free_jobs);
+    free(server->queue);
+    free(server->done);
+    pthread_mutex_destroy(&server->mutex);
+    pthread_cond_destroy(&server->cond);
+}
+
+//===================================EVENT LOOP==================================================
+// Level-triggered. A connection is read while less than SERVER_MAX_BUFFERED of it waits
+// to be parsed, and its frames are dispatched while free jobs last: a client that sends
+// faster than the workers serve is slowed down by its socket buffer, not by our memory.
+
+static void run_loop(server_t* server) {
+    struct epoll_event events[SERVER_MAX_EVENTS] = {};
+    bool stopping = false;
+
+    while (!stopping) {
+        int amount = epoll_wait(server->epoll_fd, events, (int) SERVER_MAX_EVENTS, -1);
+        if (amount == -1) {
+            if (errno == EINTR) continue;
+            LOG(ERROR, "epoll_wait" STRERROR(errno));
+            break;
+        }
+
+        for (size_t i = 0; i < (size_t) amount; i++) {
+            uint64_t data = events[i].data.u64;
+            if (data == EVENT_LISTEN) {
+                accept_connections(server);
+            }
+            else if (data == EVENT_DONE) {
+                collect_done(server);
+            }
+            else if (data == EVENT_SIGNAL) {
+                stopping = true;
+            }
+            else if (server->conns[data].fd != -1) {
+                if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+                    read_connection(server, data);
+                }
+                if (server->conns[data].fd != -1 && (events[i].events & EPOLLOUT) != 0) {
+                    flush_connection(server, data);
+                }
+                if (server->conns[data].fd != -1) {
+                    dispatch_frames(server, data);
+                    update_connection(server, data);
+                }
+            }
+        }
+    }
+}
+
+static void accept_connections(server_t* server) {
+    while (true) {
+        int fd = accept4(server->listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG(ERROR, "accept" STRERROR(errno));
+            }
+            return;
+        }
+
+        size_t slot = 0;
+        while (slot < SERVER_MAX_CONNECTIONS && server->conns[slot].fd != -1) slot++;
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = slot;
+        if (slot == SERVER_MAX_CONNECTIONS || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            LOG(WARNING, "Connection refused, %zu connections are open\n", SERVER_MAX_CONNECTIONS);
+            close(fd);
+            continue;
+        }
+
+        conn_t* conn = &server->conns[slot];
+        uint32_t generation = conn->generation;
+        *conn = {};
+        conn->fd = fd;
+        conn->generation = generation;
+        conn->events = EPOLLIN;
+    }
+}
+
+static void read_connection(server_t* server, size_t slot) {
+    conn_t* conn = &server->conns[slot];
+    uint8_t chunk[SERVER_READ_CHUNK] = {};
+
+    while (!conn->eof && conn->in.size - conn->in_pos < SERVER_MAX_BUFFERED) {
+        ssize_t len = recv(conn->fd, chunk, sizeof(chunk), 0);
+        if (len > 0) {
+            if (bytes_append(&conn->in, chunk, (size_t) len) != NO_ERR) {
+                close_connection(server, slot);
+                return;
+            }
+            continue;
+        }
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len == -1) {
+            close_connection(server, slot);
+            return;
+        }
+        conn->eof = true;
+    }
+}
+
+static void dispatch_frames(server_t* server, size_t slot) {
+    if (server->stopping) return;
+    conn_t* conn = &server->conns[slot];
+
+    size_t dispatched = 0;
+    while (server->free_jobs_amount != 0 && conn->in.size - conn->in_pos >= sizeof(frame_header_t)) {
+        frame_header_t header = {};
+        memcpy(&header, conn->in.data + conn->in_pos, sizeof(header));
+        if (header.size > SERVER_MAX_PAYLOAD) {
+            LOG(WARNING, "Frame of %u bytes, the connection is closed\n", header.size);
+            close_connection(server, slot);
+            return;
+        }
+        if (conn->in.size - conn->in_pos < sizeof(header) + header.size) break;
+
+        job_t* job = server->free_jobs[--server->free_jobs_amount];
+        job->conn = slot;
+        job->generation = conn->generation;
+        job->request_header = header;
+        memcpy(job->request, conn->in.data + conn->in_pos + sizeof(header), header.size);
+        conn->in_pos += sizeof(header) + header.size;
+        conn->pending++;
+
+        pthread_mutex_lock(&server->mutex);
+        server->queue[(server->queue_head + server->queue_size++) % SERVER_MAX_JOBS] = job;
+        pthread_mutex_unlock(&server->mutex);
+        dispatched++;
+    }
+    if (dispatched == 1) {
+        pthread_cond_signal(&server->cond);
+    }
+    else if (dispatched > 1) {
+        pthread_cond_broadcast(&server->cond);
+    }
+
+    if (conn->in_pos == conn->in.size) {
+        conn->in.size = conn->in_pos = 0;
+    }
+    else if (conn->in_pos > conn->in.size / 2) {
+        memmove(conn->in.data, conn->in.data + conn->in_pos, conn->in.size - conn->in_pos);
+        conn->in.size -= conn->in_pos;
+        conn->in_pos = 0;
+    }
+}
+
+static void flush_connection(server_t* server, size_t slot) {
+    conn_t* conn = &server->conns[slot];
+
+    while (conn->out_pos < conn->out.size) {
+        ssize_t len = send(conn->fd, conn->out.data + conn->out_pos, conn->out.size - conn->out_pos, MSG_NOSIGNAL);
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (len == -1) {
+            close_connection(server, slot);
+            return;
+        }
+        conn->out_pos += (size_t) len;
+    }
+    conn->out.size = conn->out_pos = 0;
+}
+
+// A connection the client has shut down is closed once its last response is sent. Until
+// then it waits unregistered if there is nothing to send: a peer that closed both ways is
+// reported EPOLLHUP whatever the mask, and the loop would spin on it. events is 0 exactly
+// while the descriptor is out of epoll.
+static void update_connection(server_t* server, size_t slot) {
+    conn_t* conn = &server->conns[slot];
+    if (conn->eof && conn->pending == 0 && conn->out_pos == conn->out.size) {
+        close_connection(server, slot);
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!conn->eof && !server->stopping && conn->in.size - conn->in_pos < SERVER_MAX_BUFFERED) events |= EPOLLIN;
+    if (conn->out_pos < conn->out.size) events |= EPOLLOUT;
+    if (events == conn->events) return;
+
+    int op = (events == 0) ? EPOLL_CTL_DEL : (conn->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.u64 = slot;
+    if (epoll_ctl(server->epoll_fd, op, conn->fd, &event) == -1) {
+        close_connection(server, slot);
+        return;
+    }
+    conn->events = events;
+}
+
+static void close_connection(server_t* server, size_t slot) {
+    conn_t* conn = &server->conns[slot];
+
+    if (conn->events != 0) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    close(conn->fd);
+    bytes_dtor(&conn->in);
+    bytes_dtor(&conn->out);
+
+    uint32_t generation = conn->generation + 1;
+    *conn = {};
+    conn->fd = -1;
+    conn->generation = generation;
+}
+
+// Responses go to the output buffers of their connections. The jobs they free may let
+// frames that waited for a job go, on any connection.
+static void collect_done(server_t* server) {
+    uint64_t counter = 0;
+    if (read(server->done_fd, &counter, sizeof(counter)) == -1 && errno != EAGAIN) {
+        LOG(ERROR, "eventfd" STRERROR(errno));
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    size_t done_size = server->done_size;
+    for (size_t i = 0; i < done_size; i++) {
+        server->free_jobs[server->free_jobs_amount + i] = server->done[i];
+    }
+    server->done_size = 0;
+    pthread_mutex_unlock(&server->mutex);
+
+    for (size_t i = 0; i < done_size; i++) {
+        job_t* job = server->free_jobs[server->free_jobs_amount + i];
+        conn_t* conn = &server->conns[job->conn];
+        if (conn->fd == -1 || conn->generation != job->generation) continue;
+
+        conn->pending--;
+        if (bytes_append(&conn->out, &job->response_header, sizeof(job->response_header)) != NO_ERR ||
+            bytes_append(&conn->out, job->response, job->response_header.size) != NO_ERR) {
+            close_connection(server, job->conn);
+        }
+    }
+    server->free_jobs_amount += done_size;
+    server->served += done_size;
+
+    for (size_t slot = 0; slot < SERVER_MAX_CONNECTIONS; slot++) {
+        if (server->conns[slot].fd == -1) continue;
+
+        flush_connection(server, slot);
+        if (server->conns[slot].fd == -1) continue;
+        dispatch_frames(server, slot);
+        if (server->conns[slot].fd == -1) continue;
+        update_connection(server, slot);
+    }
+}
+
+// Runs after the workers are joined, so nothing is dispatched and only writes are waited
+// for. A client that takes no response for SERVER_DRAIN_MS is left behind.
+static void drain_responses(server_t* server) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd, nullptr);
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->signal_fd, nullptr);
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->done_fd, nullptr);
+    collect_done(server);
+
+    struct epoll_event events[SERVER_MAX_EVENTS] = {};
+    while (true) {
+        size_t waiting = 0;
+        for (size_t slot = 0; slot < SERVER_MAX_CONNECTIONS; slot++) {
+            if (server->conns[slot].fd != -1 && server->conns[slot].out_pos < server->conns[slot].out.size) waiting++;
+        }
+        if (waiting == 0) return;
+
+        int amount = epoll_wait(server->epoll_fd, events, (int) SERVER_MAX_EVENTS, SERVER_DRAIN_MS);
+        if (amount == -1 && errno == EINTR) continue;
+        if (amount == -1) {
+            LOG(ERROR, "epoll_wait" STRERROR(errno));
+            return;
+        }
+        if (amount == 0) {
+            LOG(WARNING, "%zu connections did not take their responses\n", waiting);
+            return;
+        }
+
+        for (size_t i = 0; i < (size_t) amount; i++) {
+            uint64_t data = events[i].data.u64;
+            if (data >= SERVER_MAX_CONNECTIONS || server->conns[data].fd == -1) continue;
+
+            flush_connection(server, data);
+            if (server->conns[data].fd != -1) {
+                update_connection(server, data);
+            }
+        }
+    }
+}
+
+//===================================WORKERS=====================================================
+
+static void* worker_main(void* arg) {
+    worker_t* worker = (worker_t*) arg;
+    server_t* server = worker->server;
+    LoggerThreadBegin(worker->index);
+
+    exp_tree_t tree = {};
+    tree.reserve_nodes(SERVER_POOL_NODES);
+
+    job_t* job = nullptr;
+    while ((job = pop_job(server)) != nullptr) {
+        LoggerSetExpression(job->request_header.id);
+        trace_set_expression(job->request_header.id);
+        serve(&tree, job);
+
+        pthread_mutex_lock(&server->mutex);
+        server->done[server->done_size++] = job;
+        pthread_mutex_unlock(&server->mutex);
+
+        uint64_t one = 1;
+        if (write(server->done_fd, &one, sizeof(one)) == -1) {
+            LOG(ERROR, "eventfd" STRERROR(errno));
+        }
+    }
+
+    tree.release_nodes();
+    LoggerThreadEnd();
+    return nullptr;
+}
+
+static job_t* pop_job(server_t* server) {
+    pthread_mutex_lock(&server->mutex);
+    while (server->queue_size == 0 && !server->stopping) {
+        pthread_cond_wait(&server->cond, &server->mutex);
+    }
+
+    job_t* job = nullptr;
+    if (server->queue_size != 0) {
+        job = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % SERVER_MAX_JOBS;
+        server->queue_size--;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return job;
+}
+
+static void serve(exp_tree_t* tree, job_t* job) {
+    frame_header_t* header = &job->request_header;
+    frame_header_t* response = &job->response_header;
+    *response = {0, header->id, NO_ERR, 0};
+
+    size_t values_size = (size_t) header->values_amount * sizeof(double);
+    const char* var = (const char*) job->request + values_size;
+    if (values_size >= header->size || strnlen(var, header->size - values_size) == header->size - values_size) {
+        response->status = FORMAT_ERR;
+        return;
+    }
+    job->request[header->size] = '\0';
+    const char* expression = var + strlen(var) + 1;
+
+    double vars[MAX_VARS_AMOUNT] = {};
+    size_t values_amount = (header->values_amount < MAX_VARS_AMOUNT) ? header->values_amount : MAX_VARS_AMOUNT;
+    memcpy(vars, job->request, values_amount * sizeof(double));
+
+    if (tree->init(expression) != NO_ERR || tree->root() == nullptr) {
+        response->status = SYNTAX_ERR;
+        tree->dtor();
+        return;
+    }
+
+    node_t zero = {};
+    zero.type = NUM;
+
+    size_t var_id = 0;
+    node_t* derivative = &zero;
+    if (tree->find_var(var, &var_id)) {
+        derivative = tree->differentiate(tree->root(), var_id);
+        if (derivative != nullptr) {
+            derivative = tree->optimize(derivative);
+        }
+    }
+    if (derivative == nullptr) {
+        response->status = MEM_ALLOC_ERR;
+        tree->dtor();
+        return;
+    }
+
+    double value = tree->evaluate(derivative, vars);
+    memcpy(job->response, &value, sizeof(value));
+
+    // The text is written in place; one that does not fit is a FORMAT_ERR.
+    FILE* ostream = fmemopen(job->response + sizeof(value), SERVER_MAX_PAYLOAD - sizeof(value), "w");
+    if (ostream == nullptr) {
+        response->status = MEM_ALLOC_ERR;
+    }
+    else {
+        tree->print_infix(ostream, derivative);
+        long len = ftell(ostream);
+        bool fits = fflush(ostream) == 0 && ferror(ostream) == 0 && len >= 0 &&
+                    (size_t) len < SERVER_MAX_PAYLOAD - sizeof(value);
+        fclose(ostream);
+
+        response->status = fits ? NO_ERR : FORMAT_ERR;
+        response->size = fits ? (uint32_t) (sizeof(value) + (size_t) len) : 0;
+    }
+
+    if (derivative != &zero) {
+        tree->delete_tree(derivative);
+    }
+    tree->dtor();
+}
@@ -0,0 +1,462 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t AC_INIT_CAPACITY = 8;
+
+static int ac_compare_r(node_t* node1, node_t* node2);
+static int cmp_terms(const void* term1, const void* term2);
+static int cmp_factors(const void* factor1, const void* factor2);
+static bool push_term(ac_sum_t* sum, double coef, node_t* node);
+static bool push_factor(ac_product_t* product, node_t* base, node_t* exp);
+
+//===================================CANONICAL FORM==============================================
+// canonicalize() returns a new tree and leaves its argument alone. Chains of +/- are
+// flattened into a list of coef * monomial terms and chains of * and / into a list of
+// base ^ exp factors, which are sorted by ac_compare_r(); equal monomials add their
+// coefficients, equal bases add their exponents and constants are folded. The lists are
+// then rebuilt into left-deep binary chains, negative coefficients as '-' and negative
+// exponents as '/'. Results of canonicalize_r() only have the shapes built here, so
+// split_*_r() take them apart again when a canonical subtree is an operand of a chain.
+
+node_t* exp_tree_t::canonicalize(node_t* root) {
+    if (root == nullptr) return nullptr;
+
+    canonical_failed_ = false;
+    node_t* result = canonicalize_r(root);
+
+    if (canonical_failed_) {
+        LOG(ERROR, "Failed to canonicalize, returning a copy\n");
+        delete_subtree_r(result);
+        result = copy_subtree(root);
+    }
+    update_var_mask_r(result);
+    return result;
+}
+
+node_t* exp_tree_t::canonicalize_r(node_t* node) {
+    if (node == nullptr) return nullptr;
+
+    if (node->type != OP) {
+        return new_node(node->type, node->value, nullptr, nullptr, nullptr, ROOT);
+    }
+
+    switch ((int) node->value) {
+        case ADD:
+        case SUB: {
+            ac_sum_t sum = {};
+            collect_terms_r(node, 1, &sum);
+            return build_sum(&sum);
+        }
+        case MUL:
+        case DIV: {
+            double coef = 1;
+            node_t* monomial = canonical_product(node, &coef);
+            return build_term(coef, monomial);
+        }
+        case POW:
+            if (node->left != nullptr && node->right != nullptr) {
+                return build_power(canonicalize_r(node->left), canonicalize_r(node->right));
+            }
+            return new_node(OP, POW, canonicalize_r(node->left), canonicalize_r(node->right), nullptr, ROOT);
+        default:
+            return new_node(OP, node->value, canonicalize_r(node->left), canonicalize_r(node->right), nullptr, ROOT);
+    }
+}
+
+node_t* exp_tree_t::canonical_product(node_t* node, double* coef) {
+    assert(coef != nullptr);
+
+    ac_product_t product = {};
+    product.coef = 1;
+    collect_factors_r(node, 1, &product);
+    return build_product(&product, coef);
+}
+
+//===================================TERMS=======================================================
+
+void exp_tree_t::collect_terms_r(node_t* node, double coef, ac_sum_t* sum) {
+    if (node == nullptr) return;
+
+    if (node->type == OP && ((int) node->value == ADD || (int) node->value == SUB)) {
+        collect_terms_r(node->left, coef, sum);
+        collect_terms_r(node->right, ((int) node->value == SUB) ? -coef : coef, sum);
+        return;
+    }
+    if (node->type == OP && ((int) node->value == MUL || (int) node->value == DIV)) {
+        double product_coef = 1;
+        node_t* monomial = canonical_product(node, &product_coef);
+        if (monomial == nullptr) {
+            sum->constant += coef * product_coef;
+        }
+        else if (!push_term(sum, coef * product_coef, monomial)) {
+            delete_subtree_r(monomial);
+            canonical_failed_ = true;
+        }
+        return;
+    }
+    split_terms_r(canonicalize_r(node), coef, sum);
+}
+
+void exp_tree_t::split_terms_r(node_t* node, double coef, ac_sum_t* sum) {
+    if (node == nullptr) return;
+
+    if (node->type == NUM) {
+        sum->constant += coef * node->value;
+        free_node(node);
+        return;
+    }
+
+    if (node->type == OP) {
+        switch ((int) node->value) {
+            case ADD:
+            case SUB:
+                split_terms_r(node->left, coef, sum);
+                split_terms_r(node->right, ((int) node->value == SUB) ? -coef : coef, sum);
+                free_node(node);
+                return;
+            case MUL:
+                if (node->left->type == NUM) {
+                    node_t* monomial = node->right;
+                    coef *= node->left->value;
+                    free_node(node->left);
+                    free_node(node);
+                    node = monomial;
+                }
+                break;
+            case DIV:
+                if (node->left->type == NUM) {
+                    coef *= node->left->value;
+                    node->left->value = 1;
+                }
+                else if (node->left->type == OP && (int) node->left->value == MUL && node->left->left->type == NUM) {
+                    node_t* factor = node->left;
+                    coef *= factor->left->value;
+                    node->left = factor->right;
+                    node->left->parent = node;
+                    free_node(factor->left);
+                    free_node(factor);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!push_term(sum, coef, node)) {
+        delete_subtree_r(node);
+        canonical_failed_ = true;
+    }
+}
+
+node_t* exp_tree_t::build_sum(ac_sum_t* sum) {
+    assert(sum != nullptr);
+
+    if (sum->size > 1) {
+        qsort(sum->terms, sum->size, sizeof(ac_term_t), cmp_terms);
+    }
+
+    size_t merged = 0;
+    for (size_t i = 0; i < sum->size; i++) {
+        if (merged > 0 && ac_compare_r(sum->terms[merged - 1].node, sum->terms[i].node) == 0) {
+            sum->terms[merged - 1].coef += sum->terms[i].coef;
+            delete_subtree_r(sum->terms[i].node);
+        }
+        else {
+            sum->terms[merged++] = sum->terms[i];
+        }
+    }
+
+    node_t* result = nullptr;
+    for (size_t i = 0; i < merged; i++) {
+        ac_term_t* term = &sum->terms[i];
+        if (fabs(term->coef) < NUM_EPSILON) {
+            delete_subtree_r(term->node);
+        }
+        else if (result == nullptr) {
+            result = build_term(term->coef, term->node);
+        }
+        else if (term->coef < 0) {
+            result = new_node(OP, SUB, result, build_term(-term->coef, term->node), nullptr, ROOT);
+        }
+        else {
+            result = new_node(OP, ADD, result, build_term(term->coef, term->node), nullptr, ROOT);
+        }
+    }
+
+    if (result == nullptr) {
+        result = new_node(NUM, sum->constant, nullptr, nullptr, nullptr, ROOT);
+    }
+    else if (sum->constant <= -NUM_EPSILON) {
+        result = new_node(OP, SUB, result, new_node(NUM, -sum->constant, nullptr, nullptr, nullptr, ROOT), nullptr, ROOT);
+    }
+    else if (sum->constant >= NUM_EPSILON) {
+        result = new_node(OP, ADD, result, new_node(NUM, sum->constant, nullptr, nullptr, nullptr, ROOT), nullptr, ROOT);
+    }
+
+    free(sum->terms);
+    sum->terms = nullptr;
+    sum->size = 0;
+    return result;
+}
+
+node_t* exp_tree_t::build_term(double coef, node_t* monomial) {
+    if (monomial == nullptr) {
+        return new_node(NUM, coef, nullptr, nullptr, nullptr, ROOT);
+    }
+    if (fabs(coef) < NUM_EPSILON) {
+        delete_subtree_r(monomial);
+        return new_node(NUM, 0, nullptr, nullptr, nullptr, ROOT);
+    }
+    if (fabs(coef - 1) < NUM_EPSILON) {
+        return monomial;
+    }
+    if (fabs(coef + 1) < NUM_EPSILON) {
+        return new_node(OP, SUB, nullptr, monomial, nullptr, ROOT);
+    }
+
+    if (monomial->type == OP && (int) monomial->value == DIV) {
+        if (is_num_value(monomial->left, 1)) {
+            monomial->left->value = coef;
+        }
+        else {
+            new_node(OP, MUL, new_node(NUM, coef, nullptr, nullptr, nullptr, ROOT), monomial->left, monomial, LEFT);
+        }
+        return monomial;
+    }
+    return new_node(OP, MUL, new_node(NUM, coef, nullptr, nullptr, nullptr, ROOT), monomial, nullptr, ROOT);
+}
+
+node_t* exp_tree_t::negate(node_t* node) {
+    ac_sum_t sum = {};
+    split_terms_r(node, -1, &sum);
+    return build_sum(&sum);
+}
+
+//===================================FACTORS=====================================================
+
+void exp_tree_t::collect_factors_r(node_t* node, double sign, ac_product_t* product) {
+    if (node == nullptr) return;
+
+    if (node->type == OP && ((int) node->value == MUL || (int) node->value == DIV)) {
+        collect_factors_r(node->left, sign, product);
+        collect_factors_r(node->right, ((int) node->value == DIV) ? -sign : sign, product);
+        return;
+    }
+    split_factors_r(canonicalize_r(node), sign, product);
+}
+
+void exp_tree_t::split_factors_r(node_t* node, double sign, ac_product_t* product) {
+    if (node == nullptr) return;
+
+    node_t* base = node;
+    node_t* exp = nullptr;
+
+    if (node->type == NUM && (sign > 0 || !is_num_value(node, 0))) {
+        product->coef *= (sign > 0) ? node->value : 1 / node->value;
+        free_node(node);
+        return;
+    }
+
+    if (node->type == OP) {
+        switch ((int) node->value) {
+            case MUL:
+            case DIV:
+                split_factors_r(node->left, sign, product);
+                split_factors_r(node->right, ((int) node->value == DIV) ? -sign : sign, product);
+                free_node(node);
+                return;
+            case SUB:
+                if (node->left == nullptr) {
+                    product->coef = -product->coef;
+                    split_factors_r(node->right, sign, product);
+                    free_node(node);
+                    return;
+                }
+                break;
+            case POW:
+                if (node->left == nullptr || node->right == nullptr) {
+                    break;
+                }
+                base = node->left;
+                exp = node->right;
+                free_node(node);
+                if (exp->type == NUM) {
+                    exp->value *= sign;
+                }
+                else if (sign < 0) {
+                    exp = negate(exp);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (exp == nullptr) {
+        exp = new_node(NUM, sign, nullptr, nullptr, nullptr, ROOT);
+    }
+    if (!push_factor(product, base, exp)) {
+        delete_subtree_r(base);
+        delete_subtree_r(exp);
+        canonical_failed_ = true;
+    }
+}
+
+node_t* exp_tree_t::build_product(ac_product_t* product, double* coef) {
+    assert(product != nullptr);
+    assert(coef != nullptr);
+
+    if (product->size > 1) {
+        qsort(product->factors, product->size, sizeof(ac_factor_t), cmp_factors);
+    }
+
+    size_t merged = 0;
+    for (size_t i = 0; i < product->size; i++) {
+        if (merged > 0 && ac_compare_r(product->factors[merged - 1].base, product->factors[i].base) == 0) {
+            product->factors[merged - 1].exp = add_exponents(product->factors[merged - 1].exp, product->factors[i].exp);
+            delete_subtree_r(product->factors[i].base);
+        }
+        else {
+            product->factors[merged++] = product->factors[i];
+        }
+    }
+
+    node_t* numerator = nullptr;
+    node_t* denominator = nullptr;
+    for (size_t i = 0; i < merged; i++) {
+        ac_factor_t* factor = &product->factors[i];
+        node_t** chain = &numerator;
+
+        if (factor->exp->type == NUM && factor->exp->value < 0) {
+            factor->exp->value = -factor->exp->value;
+            chain = &denominator;
+        }
+
+        node_t* power = build_power(factor->base, factor->exp);
+        if (power->type == NUM && (chain == &numerator || !is_num_value(power, 0))) {
+            product->coef = (chain == &numerator) ? product->coef * power->value : product->coef / power->value;
+            free_node(power);
+            continue;
+        }
+        *chain = (*chain == nullptr) ? power : new_node(OP, MUL, *chain, power, nullptr, ROOT);
+    }
+
+    free(product->factors);
+    product->factors = nullptr;
+    product->size = 0;
+    *coef = product->coef;
+
+    if (denominator != nullptr) {
+        if (numerator == nullptr) {
+            numerator = new_node(NUM, 1, nullptr, nullptr, nullptr, ROOT);
+        }
+        return new_node(OP, DIV, numerator, denominator, nullptr, ROOT);
+    }
+    return numerator;
+}
+
+node_t* exp_tree_t::build_power(node_t* base, node_t* exp) {
+    if (base->type == NUM && exp->type == NUM) {
+        base->value = apply_operation(POW, base->value, exp->value);
+        free_node(exp);
+        return base;
+    }
+    if (is_num_value(exp, 0) || is_num_value(base, 1)) {
+        delete_subtree_r(base);
+        delete_subtree_r(exp);
+        return new_node(NUM, 1, nullptr, nullptr, nullptr, ROOT);
+    }
+    if (is_num_value(exp, 1)) {
+        free_node(exp);
+        return base;
+    }
+    if (is_num_value(exp, floor(exp->value)) && base->type == OP && (int) base->value == POW &&
+        base->right != nullptr && base->right->type == NUM) {
+        base->right->value *= exp->value;
+        free_node(exp);
+        return base;
+    }
+    return new_node(OP, POW, base, exp, nullptr, ROOT);
+}
+
+node_t* exp_tree_t::add_exponents(node_t* exp1, node_t* exp2) {
+    if (exp1->type == NUM && exp2->type == NUM) {
+        exp1->value += exp2->value;
+        free_node(exp2);
+        return exp1;
+    }
+
+    ac_sum_t sum = {};
+    split_terms_r(exp1, 1, &sum);
+    split_terms_r(exp2, 1, &sum);
+    return build_sum(&sum);
+}
+
+//===================================ORDER=======================================================
+// Total order used for sorting: NUM < VAR < OP, then by value, then by children.
+
+static int ac_compare_r(node_t* node1, node_t* node2) {
+    if (node1 == node2) return 0;
+    if (node1 == nullptr) return -1;
+    if (node2 == nullptr) return 1;
+
+    if (node1->type != node2->type) {
+        return (node1->type < node2->type) ? -1 : 1;
+    }
+    if (node1->value < node2->value) return -1;
+    if (node1->value > node2->value) return 1;
+
+    int cmp = ac_compare_r(node1->left, node2->left);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ac_compare_r(node1->right, node2->right);
+}
+
+static int cmp_terms(const void* term1, const void* term2) {
+    return ac_compare_r(((const ac_term_t*) term1)->node, ((const ac_term_t*) term2)->node);
+}
+
+static int cmp_factors(const void* factor1, const void* factor2) {
+    return ac_compare_r(((const ac_factor_t*) factor1)->base, ((const ac_factor_t*) factor2)->base);
+}
+
+static bool push_term(ac_sum_t* sum, double coef, node_t* node) {
+    if (sum->size == sum->capacity) {
+        size_t capacity = (sum->capacity == 0) ? AC_INIT_CAPACITY : sum->capacity * 2;
+        ac_term_t* terms = (ac_term_t*) realloc(sum->terms, capacity * sizeof(ac_term_t));
+        if (terms == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            return false;
+        }
+        sum->terms = terms;
+        sum->capacity = capacity;
+    }
+
+    sum->terms[sum->size].coef = coef;
+    sum->terms[sum->size].node = node;
+    sum->size++;
+    return true;
+}
+
+static bool push_factor(ac_product_t* product, node_t* base, node_t* exp) {
+    if (product->size == product->capacity) {
+        size_t capacity = (product->capacity == 0) ? AC_INIT_CAPACITY : product->capacity * 2;
+        ac_factor_t* factors = (ac_factor_t*) realloc(product->factors, capacity * sizeof(ac_factor_t));
+        if (factors == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            return false;
+        }
+        product->factors = factors;
+        product->capacity = capacity;
+    }
+
+    product->factors[product->size].base = base;
+    product->factors[product->size].exp = exp;
+    product->size++;
+    return true;
+}
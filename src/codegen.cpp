@@ -0,0 +1,281 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t C_NUMBER_LEN = 32;
+
+static bool is_int_power(node_t* node);
+static const char* c_function_prefix(int op);
+static void print_c_number(FILE* ostream, double value);
+
+//===================================C CODEGEN===================================================
+// Emits a C function double name(const double* vars, double* grad) that returns the value
+// of the tree and writes its gradient over all variables of the tree into grad. The value
+// and the gradient share one CSE DAG: every shared subtree is a const temporary computed
+// once, integer powers are expanded into multiplications by repeated squaring.
+
+err_t exp_tree_t::print_to_c(FILE* ostream, node_t* root, const char* name) {
+    assert(ostream != nullptr);
+    assert(root != nullptr);
+    assert(name != nullptr);
+
+    size_t outputs_amount = var_nametable_size_ + 1;
+    node_t** outputs = (node_t**) calloc(outputs_amount, sizeof(node_t*));
+    if (outputs == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+
+    err_t error = NO_ERR;
+    outputs[0] = root;
+    for (size_t i = 0; i < var_nametable_size_ && error == NO_ERR; i++) {
+        outputs[i + 1] = nth_derivative(root, i, 1, nullptr);
+        if (outputs[i + 1] == nullptr) {
+            error = MEM_ALLOC_ERR;
+        }
+    }
+
+    cse_t cse = {};
+    size_t* temps = nullptr;
+    if (error == NO_ERR) {
+        error = cse_ctor_roots(&cse, outputs, outputs_amount);
+    }
+    if (error == NO_ERR) {
+        temps = (size_t*) calloc(cse.nodes_amount, sizeof(size_t));
+        if (temps == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            error = MEM_ALLOC_ERR;
+        }
+    }
+
+    if (error == NO_ERR) {
+        // Shared operations and integer powers get temporaries, and so do the bases of
+        // the powers, which are used several times by the expansion.
+        for (size_t i = 0; i < cse.nodes_amount; i++) {
+            node_t* node = cse.nodes[i];
+            temps[i] = (cse.temp_ids[i] != SIZE_MAX || is_int_power(node)) ? 0 : SIZE_MAX;
+            if (is_int_power(node) && node->left->type == OP) {
+                temps[cse_index(&cse, node->left)] = 0;
+            }
+        }
+
+        fprintf(ostream, "#include <math.h>\n\n");
+        for (size_t i = 0; i < var_nametable_size_; i++) {
+            fprintf(ostream, "// vars[%zu] = %s, grad[%zu] = d/d%s\n", i, var_nametable_[i].name, i, var_nametable_[i].name);
+        }
+        fprintf(ostream, "double %s(const double* vars, double* grad) {\n", name);
+
+        size_t temps_amount = 0;
+        for (size_t i = 0; i < cse.nodes_amount; i++) {
+            if (temps[i] == SIZE_MAX) continue;
+
+            temps[i] = temps_amount++;
+            if (is_int_power(cse.nodes[i])) {
+                print_c_power(ostream, &cse, temps, cse.nodes[i], temps[i]);
+                continue;
+            }
+            fprintf(ostream, "    const double t%zu = ", temps[i]);
+            print_c_r(ostream, &cse, temps, cse.nodes[i], true);
+            fprintf(ostream, ";\n");
+        }
+
+        for (size_t i = 0; i < var_nametable_size_; i++) {
+            fprintf(ostream, "    grad[%zu] = ", i);
+            print_c_r(ostream, &cse, temps, outputs[i + 1], false);
+            fprintf(ostream, ";\n");
+        }
+        fprintf(ostream, "    return ");
+        print_c_r(ostream, &cse, temps, root, false);
+        fprintf(ostream, ";\n}\n");
+
+        LOG(DEBUG, "C code: %zu distinct nodes, %zu temporaries\n", cse.nodes_amount, temps_amount);
+    }
+
+    free(temps);
+    cse_dtor(&cse);
+    for (size_t i = 1; i < outputs_amount; i++) {
+        delete_subtree_r(outputs[i]);
+    }
+    free(outputs);
+    return error;
+}
+
+// With definition set a temporary is expanded instead of being referred to by name.
+void exp_tree_t::print_c_r(FILE* ostream, cse_t* cse, const size_t* temps, node_t* node, bool definition) {
+    if (node == nullptr) {
+        LOG(ERROR, "Missing operand in the tree\n");
+        fprintf(ostream, "NAN");
+        return;
+    }
+
+    size_t index = cse_index(cse, node);
+    if (!definition && index != SIZE_MAX && temps[index] != SIZE_MAX) {
+        fprintf(ostream, "t%zu", temps[index]);
+        return;
+    }
+
+    switch (node->type) {
+        case NUM:
+            print_c_number(ostream, node->value);
+            return;
+        case VAR:
+            fprintf(ostream, "vars[%zu]", (size_t) node->value);
+            return;
+        case OP:
+            break;
+        default:
+            fprintf(ostream, "NAN");
+            return;
+    }
+
+    int op = (int) node->value;
+    if (is_function(node->value) && op != LOG) {
+        node_t* arg = (node->left != nullptr) ? node->left : node->right;
+        bool inverse = (op == CTG || op == CTH || op == ARCCTG || op == ARCCTH);
+        fprintf(ostream, "%s", c_function_prefix(op));
+        print_c_r(ostream, cse, temps, arg, false);
+        fprintf(ostream, "%s", inverse ? "))" : ")");
+        return;
+    }
+
+    switch (op) {
+        case POW:
+            if (node->right != nullptr && node->right->type == NUM && fabs(fabs(node->right->value) - 0.5) < NUM_EPSILON) {
+                fprintf(ostream, (node->right->value > 0) ? "sqrt(" : "(1.0 / sqrt(");
+                print_c_r(ostream, cse, temps, node->left, false);
+                fprintf(ostream, (node->right->value > 0) ? ")" : "))");
+                return;
+            }
+            fprintf(ostream, "pow(");
+            print_c_r(ostream, cse, temps, node->left, false);
+            fprintf(ostream, ", ");
+            print_c_r(ostream, cse, temps, node->right, false);
+            fprintf(ostream, ")");
+            return;
+        case LOG:
+            fprintf(ostream, "(log(");
+            print_c_r(ostream, cse, temps, node->right, false);
+            fprintf(ostream, ") / log(");
+            print_c_r(ostream, cse, temps, node->left, false);
+            fprintf(ostream, "))");
+            return;
+        default:
+            break;
+    }
+
+    const char* operators = "+-*/";
+    if (op < ADD || op > DIV || node->right == nullptr || (node->left == nullptr && op != ADD && op != SUB)) {
+        LOG(ERROR, "Undefined operation %d\n", op);
+        fprintf(ostream, "NAN");
+        return;
+    }
+
+    fprintf(ostream, "(");
+    if (node->left != nullptr) {
+        print_c_r(ostream, cse, temps, node->left, false);
+        fprintf(ostream, " %c ", operators[op]);
+    }
+    else if (op == SUB) {
+        fprintf(ostream, "-");
+    }
+    print_c_r(ostream, cse, temps, node->right, false);
+    fprintf(ostream, ")");
+}
+
+// t<temp> = base^n: t<temp>_<2^k> are the squares, their product gives the power.
+void exp_tree_t::print_c_power(FILE* ostream, cse_t* cse, const size_t* temps, node_t* node, size_t temp) {
+    assert(is_int_power(node));
+
+    long exponent = lround(node->right->value);
+    size_t power = (size_t) labs(exponent);
+
+    size_t top = 1;
+    for (; top * 2 <= power; top *= 2) {
+        if (top * 2 == power && exponent > 0) {
+            fprintf(ostream, "    const double t%zu = ", temp);
+        }
+        else {
+            fprintf(ostream, "    const double t%zu_%zu = ", temp, top * 2);
+        }
+        for (size_t i = 0; i < 2; i++) {
+            if (top == 1) {
+                print_c_r(ostream, cse, temps, node->left, false);
+            }
+            else {
+                fprintf(ostream, "t%zu_%zu", temp, top);
+            }
+            fprintf(ostream, (i == 0) ? " * " : ";\n");
+        }
+    }
+
+    if (top == power && top > 1 && exponent > 0) {
+        return;
+    }
+
+    fprintf(ostream, "    const double t%zu = %s", temp, (exponent < 0) ? "1.0 / (" : "");
+    if (power == 0) {
+        fprintf(ostream, "1.0");
+    }
+    for (size_t bit = top, first = 1; bit > 0 && power > 0; bit /= 2) {
+        if ((power & bit) == 0) continue;
+
+        fprintf(ostream, "%s", first ? "" : " * ");
+        first = 0;
+        if (bit == 1) {
+            print_c_r(ostream, cse, temps, node->left, false);
+        }
+        else {
+            fprintf(ostream, "t%zu_%zu", temp, bit);
+        }
+    }
+    fprintf(ostream, "%s;\n", (exponent < 0) ? ")" : "");
+}
+
+static bool is_int_power(node_t* node) {
+    return node != nullptr && node->type == OP && (int) node->value == POW && node->left != nullptr &&
+           node->right != nullptr && node->right->type == NUM && fabs(node->right->value) <= MAX_INT_POWER &&
+           fabs(node->right->value - round(node->right->value)) < NUM_EPSILON;
+}
+
+static const char* c_function_prefix(int op) {
+    switch (op) {
+        case LN:     return "log(";
+        case EXP:    return "exp(";
+        case SIN:    return "sin(";
+        case COS:    return "cos(";
+        case TG:     return "tan(";
+        case CTG:    return "(1.0 / tan(";
+        case SH:     return "sinh(";
+        case CH:     return "cosh(";
+        case TH:     return "tanh(";
+        case CTH:    return "(1.0 / tanh(";
+        case ARCSIN: return "asin(";
+        case ARCCOS: return "acos(";
+        case ARCTG:  return "atan(";
+        case ARCCTG: return "(1.5707963267948966 - atan(";
+        case ARCSH:  return "asinh(";
+        case ARCCH:  return "acosh(";
+        case ARCTH:  return "atanh(";
+        case ARCCTH: return "atanh(1.0 / (";
+        default:     return "(";
+    }
+}
+
+static void print_c_number(FILE* ostream, double value) {
+    if (isnan(value)) {
+        fprintf(ostream, "NAN");
+        return;
+    }
+    if (isinf(value)) {
+        fprintf(ostream, (value > 0) ? "INFINITY" : "(-INFINITY)");
+        return;
+    }
+
+    char number[C_NUMBER_LEN] = "";
+    snprintf(number, sizeof(number), "%.17g", value);
+    const char* suffix = (strpbrk(number, ".e") == nullptr) ? ".0" : "";
+    fprintf(ostream, (value < 0) ? "(%s%s)" : "%s%s", number, suffix);
+}
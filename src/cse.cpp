@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+static void cse_collect_r(cse_t* cse, node_t* node);
+
+//===================================CSE=========================================================
+// Hash-conses the tree into a DAG: nodes[] holds every distinct subtree once, children
+// before parents, and entry->count is the number of DAG parents using it. Shared
+// operations (count >= 2) get temporary ids t_0, t_1, ... in the same order.
+
+err_t cse_ctor(cse_t* cse, node_t* root) {
+    assert(cse != nullptr);
+    assert(root != nullptr);
+
+    return cse_ctor_roots(cse, &root, 1);
+}
+
+// One DAG for several trees, e.g. a function and its gradient, so that subtrees shared
+// between them are computed once.
+err_t cse_ctor_roots(cse_t* cse, node_t** roots, size_t roots_amount) {
+    assert(cse != nullptr);
+    assert(roots != nullptr);
+
+    size_t nodes_amount = 0;
+    for (size_t i = 0; i < roots_amount; i++) {
+        assert(roots[i] != nullptr);
+
+        nodes_amount += exp_tree_t::count_nodes_r(roots[i]);
+        node_hash_r(roots[i]);
+    }
+
+    if (node_table_ctor(&cse->table, nodes_amount) != NO_ERR) {
+        return MEM_ALLOC_ERR;
+    }
+
+    cse->nodes = (node_t**) calloc(nodes_amount, sizeof(node_t*));
+    cse->temp_ids = (size_t*) calloc(nodes_amount, sizeof(size_t));
+    if (cse->nodes == nullptr || cse->temp_ids == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        cse_dtor(cse);
+        return MEM_ALLOC_ERR;
+    }
+
+    cse->nodes_amount = 0;
+    for (size_t i = 0; i < roots_amount; i++) {
+        cse_collect_r(cse, roots[i]);
+    }
+
+    cse->temps_amount = 0;
+    for (size_t i = 0; i < cse->nodes_amount; i++) {
+        node_table_entry_t* entry = node_table_find(&cse->table, cse->nodes[i], 0);
+        cse->temp_ids[i] = (cse->nodes[i]->type == OP && entry->count >= 2) ? cse->temps_amount++ : SIZE_MAX;
+    }
+
+    LOG(DEBUG, "CSE: %zu nodes, %zu distinct, %zu shared\n", nodes_amount, cse->nodes_amount, cse->temps_amount);
+    return NO_ERR;
+}
+
+void cse_dtor(cse_t* cse) {
+    assert(cse != nullptr);
+
+    node_table_dtor(&cse->table);
+
+    free(cse->nodes);
+    cse->nodes = nullptr;
+    free(cse->temp_ids);
+    cse->temp_ids = nullptr;
+
+    cse->nodes_amount = 0;
+    cse->temps_amount = 0;
+}
+
+size_t cse_index(cse_t* cse, node_t* node) {
+    assert(cse != nullptr);
+    assert(node != nullptr);
+
+    node_table_entry_t* entry = node_table_find(&cse->table, node, 0);
+    return (entry == nullptr) ? SIZE_MAX : entry->index;
+}
+
+size_t cse_temp_id(cse_t* cse, node_t* node) {
+    size_t index = cse_index(cse, node);
+    return (index == SIZE_MAX) ? SIZE_MAX : cse->temp_ids[index];
+}
+
+static void cse_collect_r(cse_t* cse, node_t* node) {
+    if (node == nullptr) return;
+
+    node_table_entry_t* entry = node_table_insert(&cse->table, node, 0);
+    if (entry == nullptr) return;
+
+    if (++entry->count > 1) return;
+
+    cse_collect_r(cse, node->left);
+    cse_collect_r(cse, node->right);
+
+    entry = node_table_find(&cse->table, node, 0);
+    entry->index = cse->nodes_amount;
+    cse->nodes[cse->nodes_amount++] = node;
+}
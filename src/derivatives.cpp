@@ -0,0 +1,226 @@
+#include <assert.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t DIFF_MEMO_INIT_CAPACITY = 256;
+const size_t DIFF_MEMO_MAX_NODES = 1 << 20;
+
+//===================================HIGHER ORDER================================================
+
+node_t* exp_tree_t::nth_derivative(node_t* root, size_t var_id, size_t order, size_t* node_counts) {
+    assert(root != nullptr);
+
+    if (node_counts != nullptr) {
+        node_counts[0] = count_nodes_r(root);
+    }
+
+    node_t* current = root;
+    for (size_t i = 1; i <= order; i++) {
+        node_t* derivative = optimize(differentiate(current, var_id));
+        if (current != root) {
+            delete_subtree_r(current);
+        }
+        if (derivative == nullptr) {
+            LOG(ERROR, "Failed to take derivative of order %zu\n", i);
+            return nullptr;
+        }
+        current = derivative;
+
+        size_t nodes_amount = count_nodes_r(current);
+        if (node_counts != nullptr) {
+            node_counts[i] = nodes_amount;
+        }
+        LOG(INFO, "Derivative of order %zu has %zu nodes\n", i, nodes_amount);
+    }
+    return (current == root) ? copy_subtree(root) : current;
+}
+
+node_t* exp_tree_t::mixed_derivative(node_t* root, const size_t* var_ids, size_t order) {
+    assert(root != nullptr);
+    assert(var_ids != nullptr || order == 0);
+
+    node_t* current = root;
+    for (size_t i = 0; i < order; i++) {
+        node_t* derivative = optimize(differentiate(current, var_ids[i]));
+        if (current != root) {
+            delete_subtree_r(current);
+        }
+        if (derivative == nullptr) {
+            LOG(ERROR, "Failed to take derivative by variable %zu\n", var_ids[i]);
+            return nullptr;
+        }
+        current = derivative;
+    }
+    return (current == root) ? copy_subtree(root) : current;
+}
+
+// Entries are filled in row order; on failure the filled ones are deleted and every entry
+// is left nullptr.
+err_t exp_tree_t::hessian(node_t* root, size_t vars_amount, node_t** hessian) {
+    assert(root != nullptr);
+    assert(hessian != nullptr);
+
+    size_t filled = 0;
+    for (size_t i = 0; i < vars_amount && filled == i * vars_amount; i++) {
+        node_t* gradient = optimize(differentiate(root, i));
+        if (gradient == nullptr) break;
+
+        for (size_t j = 0; j < vars_amount; j++) {
+            node_t* entry = (j < i) ? copy_subtree(hessian[j * vars_amount + i])
+                                    : optimize(differentiate(gradient, j));
+            if (entry == nullptr) break;
+
+            hessian[filled++] = entry;
+        }
+        delete_subtree_r(gradient);
+    }
+
+    if (filled == vars_amount * vars_amount) {
+        return NO_ERR;
+    }
+
+    LOG(ERROR, "Failed to build hessian entry %zu of %zu\n", filled, vars_amount * vars_amount);
+    for (size_t i = 0; i < vars_amount * vars_amount; i++) {
+        if (i < filled) {
+            delete_subtree_r(hessian[i]);
+        }
+        hessian[i] = nullptr;
+    }
+    return MEM_ALLOC_ERR;
+}
+
+size_t exp_tree_t::count_nodes_r(node_t* node) {
+    if (node == nullptr) return 0;
+
+    return 1 + count_nodes_r(node->left) + count_nodes_r(node->right);
+}
+
+//===================================MEMO========================================================
+// Every differentiate() run goes through the memo, which maps (subtree, var_id) to the
+// derivative of the subtree. Only subtrees that occur at least twice in the tree being
+// differentiated are stored, so each of them is differentiated once per run. The memo
+// survives between runs, so equal subtrees met in later orders are not differentiated
+// again either; keys and values are private copies, because the trees they came from get
+// optimized and deleted.
+
+node_t* exp_tree_t::differentiate_memo(FILE* ostream, node_t* node, size_t var_id) {
+    assert(node != nullptr);
+
+    if (diff_memo_active_ || (diff_memo_.entries == nullptr &&
+                              node_table_ctor(&diff_memo_, DIFF_MEMO_INIT_CAPACITY) != NO_ERR)) {
+        return differentiate(ostream, node, var_id);
+    }
+
+    node_hash_r(node);
+    count_subtrees_r(node, var_id);
+    if (find_polynomials_r(node, var_id) > 0) {
+        add_poly_derivative(node, var_id);
+    }
+
+    diff_memo_active_ = true;
+    node_t* diff_root = differentiate(ostream, node, var_id);
+    diff_memo_active_ = false;
+
+    clear_poly_diff();
+    purge_diff_memo();
+    return diff_root;
+}
+
+void exp_tree_t::diff_memo_stats(size_t* hits, size_t* misses) {
+    assert(hits != nullptr);
+    assert(misses != nullptr);
+
+    *hits = diff_memo_hits_;
+    *misses = diff_memo_misses_;
+}
+
+void exp_tree_t::count_subtrees_r(node_t* node, size_t var_id) {
+    if (node == nullptr || node->type != OP || !depends_on(node, var_id)) return;
+
+    node_table_entry_t* entry = node_table_insert(&diff_memo_, node, var_id);
+    if (entry != nullptr) {
+        entry->count++;
+    }
+
+    count_subtrees_r(node->left, var_id);
+    count_subtrees_r(node->right, var_id);
+}
+
+node_t* exp_tree_t::find_memo_derivative(node_t* node, size_t var_id) {
+    assert(node != nullptr);
+
+    node_table_entry_t* entry = node_table_find(&diff_memo_, node, var_id);
+    if (entry == nullptr) {
+        return nullptr;
+    }
+    if (entry->value == nullptr) {
+        if (entry->count >= 2) diff_memo_misses_++;
+        return nullptr;
+    }
+    diff_memo_hits_++;
+    return copy_subtree(entry->value);
+}
+
+void exp_tree_t::memoize_derivative(node_t* node, size_t var_id, node_t* derivative) {
+    assert(node != nullptr);
+    assert(derivative != nullptr);
+
+    node_table_entry_t* entry = node_table_find(&diff_memo_, node, var_id);
+    if (entry == nullptr || entry->value != nullptr || entry->count < 2) {
+        return;
+    }
+
+    size_t nodes_amount = count_nodes_r(node) + count_nodes_r(derivative);
+    if (diff_memo_nodes_ + nodes_amount > DIFF_MEMO_MAX_NODES) {
+        return;
+    }
+
+    node_t* key = copy_subtree(node);
+    node_t* value = copy_subtree(derivative);
+    if (key == nullptr || value == nullptr) {
+        delete_subtree_r(key);
+        delete_subtree_r(value);
+        return;
+    }
+
+    key->hash = entry->hash;
+    entry->key = key;
+    entry->value = value;
+    diff_memo_nodes_ += nodes_amount;
+}
+
+void exp_tree_t::purge_diff_memo() {
+    node_table_t old_memo = diff_memo_;
+
+    if (node_table_ctor(&diff_memo_, old_memo.size) != NO_ERR) {
+        diff_memo_ = old_memo;
+        clear_diff_memo();
+        return;
+    }
+
+    for (size_t i = 0; i < old_memo.capacity; i++) {
+        node_table_entry_t* old_entry = &old_memo.entries[i];
+        if (old_entry->key == nullptr || old_entry->value == nullptr) continue;
+
+        node_table_entry_t* entry = node_table_insert(&diff_memo_, old_entry->key, old_entry->var_id);
+        if (entry == nullptr) {
+            delete_subtree_r(old_entry->key);
+            delete_subtree_r(old_entry->value);
+            continue;
+        }
+        entry->value = old_entry->value;
+    }
+    node_table_dtor(&old_memo);
+}
+
+void exp_tree_t::clear_diff_memo() {
+    for (size_t i = 0; i < diff_memo_.capacity; i++) {
+        node_table_entry_t* entry = &diff_memo_.entries[i];
+        if (entry->key == nullptr || entry->value == nullptr) continue;
+
+        delete_subtree_r(entry->key);
+        delete_subtree_r(entry->value);
+    }
+    node_table_dtor(&diff_memo_);
+    diff_memo_nodes_ = 0;
+}
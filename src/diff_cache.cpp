@@ -0,0 +1,450 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const uint8_t CACHE_MAGIC[] = {'E', 'X', 'P', 'C'};
+const size_t CACHE_HEADER_SIZE = 12;
+const char* CACHE_SUFFIX = ".dc";
+const char* CACHE_LOCK_NAME = ".lock";
+const size_t CACHE_EVICT_PERCENT = 75;
+
+typedef struct {
+    char name[FILENAME_MAX];
+    size_t size;
+    struct timespec mtime;
+} cache_file_t;
+
+static uint64_t fnv1a(const uint8_t* data, size_t size);
+static void write_u64(uint8_t* dst, uint64_t value);
+static uint64_t read_u64(const uint8_t* src);
+static err_t write_all(int fd, const uint8_t* data, size_t size);
+static err_t read_all(int fd, uint8_t* data, size_t size);
+static err_t diff_cache_write(diff_cache_t* cache, const char* path, bytes_t* key, bytes_t* value);
+static void diff_cache_evict(diff_cache_t* cache);
+static int cmp_mtime(const void* a, const void* b);
+
+//===================================CACHE=======================================================
+// Entries live in cache->dir as <fnv1a(key)>.dc: "EXPC", key size (u64 LE), key, value.
+// The key is the canonical form of the tree plus the canonical id of the variable and the
+// order, the value is the serialized derivative over canonical variables v0, v1, ... Keys are compared in full,
+// so hash collisions are misses. Files are written to a temporary and renamed, so readers
+// never see a partial entry; eviction runs under flock() on the .lock file, oldest mtime
+// first, and a hit touches the entry's mtime.
+//
+// The directory is scanned when the cache is opened and then only when the size it had plus
+// the entries stored since passes max_bytes; the scan evicts down to CACHE_EVICT_PERCENT of
+// it, so the next one is that many bytes of stores away. Entries stored by other processes
+// meanwhile are counted at the next scan.
+
+err_t diff_cache_ctor(diff_cache_t* cache, const char* dir, size_t max_bytes) {
+    assert(cache != nullptr);
+    assert(dir != nullptr);
+
+    if (strlen(dir) + 32 >= sizeof(cache->dir)) {
+        LOG(ERROR, "Cache directory path is too long\n");
+        return FILE_ERR;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        LOG(ERROR, "Failed to create %s\n" STRERROR(errno), dir);
+        return FILE_ERR;
+    }
+
+    strncpy(cache->dir, dir, sizeof(cache->dir) - 1);
+    cache->max_bytes = max_bytes;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->stores = 0;
+    cache->evictions = 0;
+    diff_cache_evict(cache);
+    return NO_ERR;
+}
+
+void diff_cache_dtor(diff_cache_t* cache) {
+    assert(cache != nullptr);
+
+    LOG(INFO, "Derivative cache %s: %zu hits, %zu misses, %zu stores, %zu evictions\n",
+              cache->dir, cache->hits, cache->misses, cache->stores, cache->evictions);
+    cache->dir[0] = '\0';
+}
+
+node_t* exp_tree_t::cached_derivative(diff_cache_t* cache, node_t* root, size_t var_id, size_t order) {
+    assert(cache != nullptr);
+    assert(root != nullptr);
+
+    if (order == 0 || !depends_on(root, var_id)) {
+        return nth_derivative(root, var_id, order, nullptr);
+    }
+
+    size_t var_map[MAX_VARS_AMOUNT] = {};
+    size_t vars_amount = 0;
+    bytes_t key = {};
+    if (canonical_key(root, var_id, order, var_map, &vars_amount, &key) != NO_ERR) {
+        bytes_dtor(&key);
+        return nth_derivative(root, var_id, order, nullptr);
+    }
+
+    // Neither name should truncate, vars_amount <= MAX_VARS_AMOUNT and diff_cache_ctor()
+    // leaves room for the file name after the directory; if one does, the cache is bypassed.
+    exp_tree_t canon = {};
+    for (size_t i = 0; i < vars_amount; i++) {
+        if (snprintf(canon.var_nametable_[i].name, MAX_NAME_LEN, "v%zu", i) >= MAX_NAME_LEN) {
+            bytes_dtor(&key);
+            return nth_derivative(root, var_id, order, nullptr);
+        }
+    }
+    canon.var_nametable_size_ = vars_amount;
+
+    char path[FILENAME_MAX] = "";
+    if (snprintf(path, sizeof(path), "%s/%016" PRIx64 "%s", cache->dir,
+                 fnv1a(key.data, key.size), CACHE_SUFFIX) >= (int) sizeof(path)) {
+        bytes_dtor(&key);
+        return nth_derivative(root, var_id, order, nullptr);
+    }
+
+    node_t* derivative = nullptr;
+    int fd = open(path, O_RDONLY);
+    struct stat st = {};
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t) st.st_size >= CACHE_HEADER_SIZE + key.size) {
+        size_t size = (size_t) st.st_size;
+        uint8_t* data = (uint8_t*) calloc(size, sizeof(uint8_t));
+
+        if (data != nullptr && read_all(fd, data, size) == NO_ERR &&
+            memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+            read_u64(data + sizeof(CACHE_MAGIC)) == key.size &&
+            memcmp(data + CACHE_HEADER_SIZE, key.data, key.size) == 0) {
+            size_t value_offset = CACHE_HEADER_SIZE + key.size;
+            canon.deserialize(data + value_offset, size - value_offset, &derivative);
+        }
+        free(data);
+    }
+
+    if (derivative != nullptr) {
+        futimens(fd, nullptr);
+        close(fd);
+        cache->hits++;
+
+        size_t inverse_map[MAX_VARS_AMOUNT] = {};
+        for (size_t i = 0; i < MAX_VARS_AMOUNT; i++) {
+            if (var_map[i] != SIZE_MAX) {
+                inverse_map[var_map[i]] = i;
+            }
+        }
+        remap_vars_r(derivative, inverse_map);
+        update_var_mask_r(derivative);
+
+        bytes_dtor(&key);
+        canon.dtor();
+        return derivative;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    cache->misses++;
+
+    derivative = nth_derivative(root, var_id, order, nullptr);
+    if (derivative == nullptr) {
+        bytes_dtor(&key);
+        canon.dtor();
+        return nullptr;
+    }
+    node_t* canon_derivative = copy_subtree(derivative);
+    bytes_t value = {};
+
+    if (canon_derivative != nullptr) {
+        remap_vars_r(canon_derivative, var_map);
+        if (canon.serialize(canon_derivative, false, &value) == NO_ERR &&
+            diff_cache_write(cache, path, &key, &value) == NO_ERR) {
+            cache->stores++;
+            cache->bytes += CACHE_HEADER_SIZE + key.size + value.size;
+            if (cache->bytes > cache->max_bytes) {
+                diff_cache_evict(cache);
+            }
+        }
+    }
+
+    delete_subtree_r(canon_derivative);
+    bytes_dtor(&value);
+    bytes_dtor(&key);
+    canon.dtor();
+    return derivative;
+}
+
+//===================================CANONICAL FORM==============================================
+// The key is the tree in preorder, one byte of type and the value of every node, with the
+// operands of + and * ordered by a hash that ignores variable names (cached in node->hash)
+// and variables numbered in order of appearance. Expressions equal up to commutation and
+// renaming get the same key, up to ties between operands of the same shape, which only
+// cost a miss.
+
+err_t exp_tree_t::canonical_key(node_t* root, size_t var_id, size_t order, size_t* var_map, size_t* vars_amount, bytes_t* key) {
+    assert(root != nullptr);
+    assert(var_map != nullptr);
+    assert(vars_amount != nullptr);
+    assert(key != nullptr);
+
+    if (var_id >= MAX_VARS_AMOUNT) {
+        LOG(ERROR, "Variable id %zu is out of the nametable\n", var_id);
+        return INVALID_VALUE_ERR;
+    }
+
+    for (size_t i = 0; i < MAX_VARS_AMOUNT; i++) {
+        var_map[i] = SIZE_MAX;
+    }
+    *vars_amount = 0;
+
+    shape_hash_r(root);
+    err_t error = canonical_key_r(root, var_map, vars_amount, key);
+    if (error != NO_ERR) {
+        return error;
+    }
+
+    uint8_t diff_bytes[2 * sizeof(uint64_t)] = {};
+    write_u64(diff_bytes, var_map[var_id]);
+    write_u64(diff_bytes + sizeof(uint64_t), order);
+    return bytes_append(key, diff_bytes, sizeof(diff_bytes));
+}
+
+err_t exp_tree_t::canonical_key_r(node_t* node, size_t* var_map, size_t* vars_amount, bytes_t* key) {
+    uint8_t record[1 + sizeof(uint64_t)] = {};
+
+    if (node == nullptr) {
+        record[0] = UINT8_MAX;
+        return bytes_append(key, record, 1);
+    }
+
+    uint64_t payload = 0;
+    if (node->type == VAR) {
+        size_t var_id = (size_t) node->value;
+        assert(var_id < MAX_VARS_AMOUNT);
+
+        if (var_map[var_id] == SIZE_MAX) {
+            var_map[var_id] = (*vars_amount)++;
+        }
+        payload = var_map[var_id];
+    }
+    else {
+        memcpy(&payload, &node->value, sizeof(payload));
+    }
+    record[0] = (uint8_t) node->type;
+    write_u64(record + 1, payload);
+
+    err_t error = bytes_append(key, record, sizeof(record));
+    if (error != NO_ERR) {
+        return error;
+    }
+
+    node_t* first = node->left;
+    node_t* second = node->right;
+    if (is_commutative(node) && first->hash > second->hash) {
+        first = node->right;
+        second = node->left;
+    }
+
+    error = canonical_key_r(first, var_map, vars_amount, key);
+    if (error != NO_ERR) {
+        return error;
+    }
+    return canonical_key_r(second, var_map, vars_amount, key);
+}
+
+uint64_t exp_tree_t::shape_hash_r(node_t* node) {
+    if (node == nullptr) return 0;
+
+    shape_hash_r(node->left);
+    shape_hash_r(node->right);
+
+    if (node->type == VAR) {
+        node_t var = {};
+        var.type = VAR;
+        node->hash = node_hash(&var);
+    }
+    else if (is_commutative(node) && node->left->hash > node->right->hash) {
+        node_t sorted = *node;
+        sorted.left = node->right;
+        sorted.right = node->left;
+        node->hash = node_hash(&sorted);
+    }
+    else {
+        node->hash = node_hash(node);
+    }
+    return node->hash;
+}
+
+bool exp_tree_t::is_commutative(node_t* node) {
+    return node->type == OP && ((int) node->value == ADD || (int) node->value == MUL) &&
+           node->left != nullptr && node->right != nullptr;
+}
+
+void exp_tree_t::remap_vars_r(node_t* node, const size_t* var_map) {
+    if (node == nullptr) return;
+
+    if (node->type == VAR) {
+        node->value = (double) var_map[(size_t) node->value];
+    }
+
+    remap_vars_r(node->left, var_map);
+    remap_vars_r(node->right, var_map);
+}
+
+//===================================FILES=======================================================
+
+static err_t diff_cache_write(diff_cache_t* cache, const char* path, bytes_t* key, bytes_t* value) {
+    char tmp_path[FILENAME_MAX] = "";
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/.tmpXXXXXX", cache->dir) >= (int) sizeof(tmp_path)) {
+        return FILE_ERR;
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        LOG(ERROR, "Failed to create a temporary file in %s\n" STRERROR(errno), cache->dir);
+        return FILE_ERR;
+    }
+
+    uint8_t header[CACHE_HEADER_SIZE] = {};
+    memcpy(header, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    write_u64(header + sizeof(CACHE_MAGIC), key->size);
+
+    err_t error = write_all(fd, header, sizeof(header));
+    if (error == NO_ERR) error = write_all(fd, key->data, key->size);
+    if (error == NO_ERR) error = write_all(fd, value->data, value->size);
+    close(fd);
+
+    if (error == NO_ERR && rename(tmp_path, path) != 0) {
+        LOG(ERROR, "Failed to rename %s\n" STRERROR(errno), tmp_path);
+        error = FILE_ERR;
+    }
+    if (error != NO_ERR) {
+        unlink(tmp_path);
+    }
+    return error;
+}
+
+static void diff_cache_evict(diff_cache_t* cache) {
+    char lock_path[FILENAME_MAX] = "";
+    if (snprintf(lock_path, sizeof(lock_path), "%s/%s", cache->dir, CACHE_LOCK_NAME) >= (int) sizeof(lock_path)) {
+        return;
+    }
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        LOG(ERROR, "Failed to lock %s\n" STRERROR(errno), lock_path);
+        if (lock_fd >= 0) close(lock_fd);
+        return;
+    }
+
+    DIR* dir = opendir(cache->dir);
+    cache_file_t* files = nullptr;
+    size_t files_amount = 0;
+    size_t files_capacity = 0;
+    size_t total_size = 0;
+
+    for (struct dirent* ent = (dir != nullptr) ? readdir(dir) : nullptr; ent != nullptr; ent = readdir(dir)) {
+        size_t len = strlen(ent->d_name);
+        size_t suffix_len = strlen(CACHE_SUFFIX);
+        if (len <= suffix_len || strcmp(ent->d_name + len - suffix_len, CACHE_SUFFIX) != 0) continue;
+
+        if (files_amount == files_capacity) {
+            files_capacity = (files_capacity == 0) ? 64 : files_capacity * 2;
+            cache_file_t* new_files = (cache_file_t*) realloc(files, files_capacity * sizeof(cache_file_t));
+            if (new_files == nullptr) break;
+            files = new_files;
+        }
+
+        cache_file_t* file = &files[files_amount];
+        if (snprintf(file->name, sizeof(file->name), "%s/%s", cache->dir, ent->d_name) >= (int) sizeof(file->name)) continue;
+
+        struct stat st = {};
+        if (stat(file->name, &st) != 0) continue;
+        file->size = (size_t) st.st_size;
+        file->mtime = st.st_mtim;
+        total_size += file->size;
+        files_amount++;
+    }
+    if (dir != nullptr) {
+        closedir(dir);
+    }
+
+    if (total_size > cache->max_bytes) {
+        size_t target_size = cache->max_bytes / 100 * CACHE_EVICT_PERCENT;
+        qsort(files, files_amount, sizeof(cache_file_t), cmp_mtime);
+        for (size_t i = 0; i < files_amount && total_size > target_size; i++) {
+            if (unlink(files[i].name) == 0) {
+                total_size -= files[i].size;
+                cache->evictions++;
+            }
+        }
+    }
+
+    cache->bytes = total_size;
+
+    free(files);
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+static int cmp_mtime(const void* a, const void* b) {
+    const struct timespec* ta = &((const cache_file_t*) a)->mtime;
+    const struct timespec* tb = &((const cache_file_t*) b)->mtime;
+
+    if (ta->tv_sec != tb->tv_sec) return (ta->tv_sec < tb->tv_sec) ? -1 : 1;
+    if (ta->tv_nsec != tb->tv_nsec) return (ta->tv_nsec < tb->tv_nsec) ? -1 : 1;
+    return 0;
+}
+
+static err_t write_all(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            LOG(ERROR, "Failed to write a cache entry\n" STRERROR(errno));
+            return FILE_ERR;
+        }
+        data += written;
+        size -= (size_t) written;
+    }
+    return NO_ERR;
+}
+
+static err_t read_all(int fd, uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t was_read = read(fd, data, size);
+        if (was_read < 0 && errno == EINTR) continue;
+        if (was_read <= 0) {
+            return FILE_ERR;
+        }
+        data += was_read;
+        size -= (size_t) was_read;
+    }
+    return NO_ERR;
+}
+
+static uint64_t fnv1a(const uint8_t* data, size_t size) {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+static void write_u64(uint8_t* dst, uint64_t value) {
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        dst[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static uint64_t read_u64(const uint8_t* src) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        value |= (uint64_t) src[i] << (8 * i);
+    }
+    return value;
+}
@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <math.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+//===================================DUAL NUMBERS================================================
+// Forward-mode evaluation: every node yields (value, d value / d var_id) in one walk,
+// so f'(x) at a point costs about two evaluations of f and no derivative tree.
+
+dual_t exp_tree_t::evaluate_dual(node_t* node, const double* vars, size_t var_id) {
+    assert(vars != nullptr);
+
+    if (node == nullptr) {
+        return {NAN, NAN};
+    }
+
+    switch (node->type) {
+        case NUM:
+            return {node->value, 0};
+        case VAR:
+            return {vars[(size_t) node->value], ((size_t) node->value == var_id) ? 1.0 : 0.0};
+        case OP:
+            break;
+        default:
+            return {NAN, NAN};
+    }
+
+    // A constant subtree has no tangent, even where its own derivative breaks down, as
+    // arcch(1) or arcsin(1) do: 0 * inf would make it NaN.
+    if (!depends_on(node, var_id)) {
+        return {evaluate(node, vars), 0};
+    }
+
+    if (is_function(node->value)) {
+        node_t* arg = (node->left != nullptr) ? node->left : node->right;
+        return apply_dual_operation(node->value, {NAN, NAN}, evaluate_dual(arg, vars, var_id));
+    }
+
+    dual_t val_r = evaluate_dual(node->right, vars, var_id);
+    if (node->left == nullptr && ((int) node->value == ADD || (int) node->value == SUB)) {
+        return apply_dual_operation(node->value, {0, 0}, val_r);
+    }
+    return apply_dual_operation(node->value, evaluate_dual(node->left, vars, var_id), val_r);
+}
+
+dual_t exp_tree_t::apply_dual_operation(double op_type, dual_t l, dual_t r) {
+    switch ((int) op_type) {
+        case ADD:
+            return {l.val + r.val, l.der + r.der};
+        case SUB:
+            return {l.val - r.val, l.der - r.der};
+        case MUL:
+            return {l.val * r.val, l.der * r.val + l.val * r.der};
+        case DIV:
+            return {l.val / r.val, (l.der * r.val - l.val * r.der) / (r.val * r.val)};
+        case POW: {
+            double val = fast_pow(l.val, r.val);
+            // r.der == 0 without -Wfloat-equal: a NaN tangent takes the general rule.
+            if (fabs(r.der) <= 0) {
+                return {val, r.val * fast_pow(l.val, r.val - 1) * l.der};
+            }
+            return {val, val * (r.der * log(l.val) + r.val * l.der / l.val)};
+        }
+        case SIN:
+            return {sin(r.val), cos(r.val) * r.der};
+        case COS:
+            return {cos(r.val), -sin(r.val) * r.der};
+        case TG: {
+            double cos_val = cos(r.val);
+            return {tan(r.val), r.der / (cos_val * cos_val)};
+        }
+        case CTG: {
+            double sin_val = sin(r.val);
+            return {1 / tan(r.val), -r.der / (sin_val * sin_val)};
+        }
+        case SH:
+            return {sinh(r.val), cosh(r.val) * r.der};
+        case CH:
+            return {cosh(r.val), sinh(r.val) * r.der};
+        case TH: {
+            double ch_val = cosh(r.val);
+            return {tanh(r.val), r.der / (ch_val * ch_val)};
+        }
+        case CTH: {
+            double sh_val = sinh(r.val);
+            return {1 / tanh(r.val), -r.der / (sh_val * sh_val)};
+        }
+        case ARCSIN:
+            return {asin(r.val), r.der / sqrt(1 - r.val * r.val)};
+        case ARCCOS:
+            return {acos(r.val), -r.der / sqrt(1 - r.val * r.val)};
+        case ARCTG:
+            return {atan(r.val), r.der / (1 + r.val * r.val)};
+        case ARCCTG:
+            return {M_PI / 2 - atan(r.val), -r.der / (1 + r.val * r.val)};
+        case ARCSH:
+            return {asinh(r.val), r.der / sqrt(r.val * r.val + 1)};
+        case ARCCH:
+            return {acosh(r.val), r.der / sqrt(r.val * r.val - 1)};
+        case ARCTH:
+            return {atanh(r.val), r.der / (1 - r.val * r.val)};
+        case ARCCTH:
+            return {atanh(1 / r.val), r.der / (1 - r.val * r.val)};
+        case LOG: {
+            double ln_l = log(l.val);
+            double ln_r = log(r.val);
+            return {ln_r / ln_l, (r.der / r.val * ln_l - ln_r * l.der / l.val) / (ln_l * ln_l)};
+        }
+        case LN:
+            return {log(r.val), r.der / r.val};
+        case EXP: {
+            double val = exp(r.val);
+            return {val, val * r.der};
+        }
+        default:
+            LOG(ERROR, "Undefined operation %d(%lf)\n", (int) op_type, op_type);
+            return {NAN, NAN};
+    }
+}
@@ -1,14 +1,29 @@
 #include <errno.h>
+#include <math.h>
 #include <string.h>
 #include <assert.h>
 #include "expression_tree.h"
 #include "logger.h"
+#include "trace.h"
 
 const size_t MAX_FILENAME_LEN = 40;
 const size_t COMMAND_SIZE = 100;
 
 const char* FILENAME = "tree";
 
+// Binding strength of the grammar: a unary minus or a negative number binds tighter than
+// * and /, a call tighter than ^.
+const int INFIX_SUM     = 1;
+const int INFIX_PRODUCT = 2;
+const int INFIX_UNARY   = 3;
+const int INFIX_POWER   = 4;
+const int INFIX_PRIMARY = 5;
+const int INFIX_CALL    = 6;
+
+static int infix_precedence(node_t* node);
+static const char* function_name(double value);
+static void print_number(FILE* ostream, double value);
+
 static FILE** get_dump_ostream() {
     static FILE* file = nullptr;
     return &file;
@@ -74,6 +89,14 @@ void exp_tree_t::print_inorder(FILE* ostream, node_t* node, int parent_precedenc
         return;
     }
 
+    if (print_cse_ != nullptr && node != print_cse_root_) {
+        size_t temp_id = cse_temp_id(print_cse_, node);
+        if (temp_id != SIZE_MAX) {
+            fprintf(ostream, "t_{%zu}", temp_id);
+            return;
+        }
+    }
+
     int current_precedence = 0;
 
     switch (node->type) {
@@ -92,6 +115,7 @@ void exp_tree_t::print_inorder(FILE* ostream, node_t* node, int parent_precedenc
        (int) node->type  == OP     && (
        (int) node->value == DIV    ||
        (int) node->value == LN     ||
+       (int) node->value == EXP    ||
        (int) node->value == LOG    ||
        (int) node->value == SIN    ||
        (int) node->value == COS    ||
@@ -218,6 +242,36 @@ void exp_tree_t::print_inorder(FILE* ostream, node_t* node, int parent_precedenc
                     fprintf(ostream, "}");
                     break;
                 }
+                case EXP: {
+                    fprintf(ostream, "e^{");
+                    print_inorder(ostream, node->left, current_precedence);
+                    fprintf(ostream, "}");
+                    break;
+                }
+                case ARCSH: {
+                    fprintf(ostream, "\\operatorname{arsinh}{");
+                    print_inorder(ostream, node->left, current_precedence);
+                    fprintf(ostream, "}");
+                    break;
+                }
+                case ARCCH: {
+                    fprintf(ostream, "\\operatorname{arcosh}{");
+                    print_inorder(ostream, node->left, current_precedence);
+                    fprintf(ostream, "}");
+                    break;
+                }
+                case ARCTH: {
+                    fprintf(ostream, "\\operatorname{artanh}{");
+                    print_inorder(ostream, node->left, current_precedence);
+                    fprintf(ostream, "}");
+                    break;
+                }
+                case ARCCTH: {
+                    fprintf(ostream, "\\operatorname{arcoth}{");
+                    print_inorder(ostream, node->left, current_precedence);
+                    fprintf(ostream, "}");
+                    break;
+                }
                 default:
                     print_operator(ostream, node->value);
                     break;
@@ -309,12 +363,58 @@ void exp_tree_t::print_to_tex(FILE* ostream, node_t* node) {
 void exp_tree_t::print_exp_to_tex(FILE* ostream, node_t* node) {
     assert(ostream != nullptr);
     assert(node != nullptr);
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_TEX);
 
     fprintf(ostream, "$ ");
     print_inorder(ostream, node, 0);
     fprintf(ostream, " $\n\n");
 }
 
+void exp_tree_t::print_cse_to_tex(FILE* ostream, node_t* root) {
+    print_tex_formulas(ostream, root, true, "\n\n");
+    fprintf(ostream, "\n\n");
+}
+
+void exp_tree_t::print_tex_line(FILE* ostream, node_t* root, bool cse) {
+    print_tex_formulas(ostream, root, cse, " ");
+    fprintf(ostream, "\n");
+}
+
+// The temporaries of the common subexpressions come first, every formula between $ signs
+// and the formulas joined by separator.
+void exp_tree_t::print_tex_formulas(FILE* ostream, node_t* root, bool cse, const char* separator) {
+    assert(ostream != nullptr);
+    assert(root != nullptr);
+    assert(separator != nullptr);
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_TEX);
+
+    cse_t temps = {};
+    if (cse && cse_ctor(&temps, root) == NO_ERR) {
+        print_cse_ = &temps;
+        for (size_t i = 0; i < temps.nodes_amount; i++) {
+            if (temps.temp_ids[i] == SIZE_MAX) continue;
+
+            print_cse_root_ = temps.nodes[i];
+            fprintf(ostream, "$ t_{%zu} = ", temps.temp_ids[i]);
+            print_inorder(ostream, temps.nodes[i], 0);
+            fprintf(ostream, " $%s", separator);
+        }
+    }
+
+    print_cse_root_ = root;
+    fprintf(ostream, "$ ");
+    print_inorder(ostream, root, 0);
+    fprintf(ostream, " $");
+
+    if (print_cse_ != nullptr) {
+        print_cse_ = nullptr;
+        cse_dtor(&temps);
+    }
+    print_cse_root_ = nullptr;
+}
+
 void exp_tree_t::print_derivative_to_tex(FILE* ostream, node_t* node) {
     assert(ostream != nullptr);
     assert(node != nullptr);
@@ -328,6 +428,8 @@ void exp_tree_t::print_derivative_to_tex(FILE* ostream, node_t* node) {
 
 void exp_tree_t::dump(node_t* root) {
     assert(root != nullptr);
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_DUMP);
 
     FILE* ostream = *get_dump_ostream();
     if (ostream == nullptr) {
@@ -538,6 +640,131 @@ void exp_tree_t::print_operator(FILE* ostream, double value) {
     };
 }
 
+//===================================TEXT========================================================
+// Infix text that the parser reads back into an equal tree: brackets only where the
+// precedence or the left associativity of the grammar needs them. A call as the base of a
+// power is bracketed too, since the parser reads f(x)^2 as f(x^2).
+
+void exp_tree_t::print_infix(FILE* ostream, node_t* root) {
+    assert(ostream != nullptr);
+    assert(root != nullptr);
+
+    print_infix_r(ostream, root, 0);
+}
+
+void exp_tree_t::print_infix_r(FILE* ostream, node_t* node, int min_precedence) {
+    bool brackets = infix_precedence(node) < min_precedence;
+    if (brackets) fprintf(ostream, "(");
+
+    switch (node->type) {
+        case NUM:
+            print_number(ostream, node->value);
+            break;
+        case VAR:
+            fprintf(ostream, "%s", var_nametable_[(size_t) node->value].name);
+            break;
+        case OP:
+            switch ((int) node->value) {
+                case ADD:
+                case SUB:
+                    if (node->left != nullptr) {
+                        print_infix_r(ostream, node->left, INFIX_SUM);
+                        fprintf(ostream, " ");
+                    }
+                    fprintf(ostream, ((int) node->value == ADD) ? "+" : "-");
+                    if (node->left != nullptr) {
+                        fprintf(ostream, " ");
+                    }
+                    print_infix_r(ostream, node->right, (node->left != nullptr) ? INFIX_PRODUCT : INFIX_UNARY);
+                    break;
+                case MUL:
+                case DIV:
+                    print_infix_r(ostream, node->left, INFIX_PRODUCT);
+                    fprintf(ostream, ((int) node->value == MUL) ? " * " : " / ");
+                    print_infix_r(ostream, node->right, INFIX_UNARY);
+                    break;
+                case POW:
+                    print_infix_r(ostream, node->left, is_function(node->left->value) && node->left->type == OP ?
+                                                       INFIX_CALL : INFIX_PRIMARY);
+                    fprintf(ostream, "^");
+                    print_infix_r(ostream, node->right, INFIX_UNARY);
+                    break;
+                case LOG:
+                    // The grammar has no two-argument calls.
+                    fprintf(ostream, "ln(");
+                    print_infix_r(ostream, node->right, 0);
+                    fprintf(ostream, ") / ln(");
+                    print_infix_r(ostream, node->left, 0);
+                    fprintf(ostream, ")");
+                    break;
+                default:
+                    fprintf(ostream, "%s(", function_name(node->value));
+                    print_infix_r(ostream, node->left, 0);
+                    fprintf(ostream, ")");
+                    break;
+            }
+            break;
+        default:
+            LOG(ERROR, "Unknown node type %d\n", node->type);
+            break;
+    }
+
+    if (brackets) fprintf(ostream, ")");
+}
+
+static int infix_precedence(node_t* node) {
+    switch (node->type) {
+        case NUM:
+            return signbit(node->value) ? INFIX_UNARY : INFIX_PRIMARY;
+        case VAR:
+            return INFIX_PRIMARY;
+        case OP:
+            break;
+        default:
+            return INFIX_PRIMARY;
+    }
+
+    switch ((int) node->value) {
+        case ADD:
+        case SUB:
+            return (node->left == nullptr) ? INFIX_UNARY : INFIX_SUM;
+        case MUL:
+        case DIV:
+        case LOG:
+            return INFIX_PRODUCT;
+        case POW:
+            return INFIX_POWER;
+        default:
+            return INFIX_PRIMARY;
+    }
+}
+
+static const char* function_name(double value) {
+    for (size_t i = 0; i < func_name_table_len; i++) {
+        if (func_name_table[i].code == (int) value) {
+            return func_name_table[i].name;
+        }
+    }
+    return "?";
+}
+
+// The shortest of %.15g..%.17g that reads back to the same double. The grammar has no
+// infinities, a folded 1/0 is printed back as one.
+static void print_number(FILE* ostream, double value) {
+    if (!isfinite(value)) {
+        fprintf(ostream, isnan(value) ? "(0 / 0)" : (value > 0) ? "(1 / 0)" : "(-1 / 0)");
+        return;
+    }
+
+    char str[32] = "";
+    for (int precision = 15; precision <= 17; precision++) {
+        snprintf(str, sizeof(str), "%.*g", precision, value);
+        double read = strtod(str, nullptr);
+        if (memcmp(&read, &value, sizeof(value)) == 0) break;
+    }
+    fprintf(ostream, "%s", str);
+}
+
 //======================================================================================
 
 int exp_tree_t::def_operator(char* op) {
@@ -0,0 +1,684 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t EGRAPH_NONE = (size_t) -1;
+const size_t EGRAPH_INIT_CAPACITY = 256;
+
+const size_t EGRAPH_MAX_NODES = 20000;
+const size_t EGRAPH_MAX_ITERATIONS = 8;
+const double EGRAPH_MAX_TIME_MS = 50;
+
+const double FLOP_COST = 1;
+const double DIV_COST = 4;
+const double CALL_COST = 20;
+
+// Rules that only make sense when the old form is kept: they do not simplify by
+// themselves, but open the way to cheaper forms, like x^2 -> x*x or factoring.
+const rewrite_rule_t EGRAPH_RULES[] = {
+    {"+ a b",           "+ b a"},
+    {"* a b",           "* b a"},
+    {"+ + a b c",       "+ a + b c"},
+    {"+ a + b c",       "+ + a b c"},
+    {"* * a b c",       "* a * b c"},
+    {"* a * b c",       "* * a b c"},
+    {"+ * a b * a c",   "* a + b c"},
+    {"- * a b * a c",   "* a - b c"},
+    {"+ a * a b",       "* a + b 1"},
+    {"- a b",           "+ a - _ b"},
+    {"* - _ a b",       "- _ * a b"},
+    {"- _ * a b",       "* - _ a b"},
+    {"/ * a b c",       "* a / b c"},
+    {"* a / b c",       "/ * a b c"},
+    {"^ a 2",           "* a a"},
+    {"^ a 3",           "* * a a a"},
+    {"^ a 4",           "* ^ a 2 ^ a 2"},
+    {"^ a -1",          "/ 1 a"},
+    {"^ a -2",          "/ 1 * a a"},
+};
+
+const size_t EGRAPH_RULES_AMOUNT = sizeof(EGRAPH_RULES) / sizeof(EGRAPH_RULES[0]);
+
+typedef struct {
+    pattern_token_t pattern[MAX_PATTERN_TOKENS];
+    pattern_token_t replacement[MAX_PATTERN_TOKENS];
+} egraph_rule_t;
+
+typedef struct {
+    size_t rule;
+    size_t eclass;
+    size_t captures[MAX_PATTERN_CAPTURES];
+} egraph_match_t;
+
+typedef struct {
+    egraph_match_t* matches;
+    size_t size;
+    size_t capacity;
+    size_t max_size;
+} match_list_t;
+
+static double get_time_ms();
+static uint64_t enode_hash(egraph_t* egraph, enode_t* node);
+static bool enode_equal(egraph_t* egraph, enode_t* node1, enode_t* node2);
+static double op_cost(double op);
+
+static err_t egraph_ctor(egraph_t* egraph);
+static void egraph_dtor(egraph_t* egraph);
+static size_t egraph_find(egraph_t* egraph, size_t eclass);
+static size_t egraph_add(egraph_t* egraph, type_t type, double value, size_t left, size_t right);
+static bool egraph_union(egraph_t* egraph, size_t eclass1, size_t eclass2);
+static size_t* egraph_lookup(egraph_t* egraph, enode_t* node);
+static err_t egraph_grow_table(egraph_t* egraph);
+static err_t egraph_index_classes(egraph_t* egraph);
+
+static size_t compile_egraph_rules(egraph_rule_t* rules);
+static err_t egraph_search(egraph_t* egraph, const egraph_rule_t* rules, size_t rules_amount, match_list_t* list,
+                           double deadline);
+static err_t ematch_r(egraph_t* egraph, const pattern_token_t* tokens, size_t pos, size_t* stack, size_t depth,
+                      egraph_match_t* match, match_list_t* list);
+static size_t* ematch_leaf(egraph_t* egraph, const pattern_token_t* tokens, size_t pos, size_t eclass, egraph_match_t* match, bool* bound);
+static size_t egraph_instantiate_r(egraph_t* egraph, const pattern_token_t* tokens, size_t* pos, const size_t* captures);
+static err_t egraph_best(egraph_t* egraph, size_t* best, double* costs);
+
+//===================================E-GRAPH=====================================================
+// optimize_egraph() is an optional, slower alternative to optimize() for derivatives that
+// are evaluated many times. The tree is put into an e-graph, where the rules of
+// REWRITE_RULES and EGRAPH_RULES only add equal forms and never remove the old ones, so
+// the rewriting can not get stuck in a form a greedy pass would end in. After the budget
+// is spent the cheapest tree by expression_cost() is extracted.
+
+node_t* exp_tree_t::optimize_egraph(node_t* root, const egraph_budget_t* budget) {
+    if (root == nullptr) return nullptr;
+
+    egraph_budget_t default_budget = {EGRAPH_MAX_NODES, EGRAPH_MAX_ITERATIONS, EGRAPH_MAX_TIME_MS};
+    if (budget == nullptr) {
+        budget = &default_budget;
+    }
+    double start = get_time_ms();
+
+    egraph_rule_t* rules = (egraph_rule_t*) calloc(REWRITE_RULES_AMOUNT + EGRAPH_RULES_AMOUNT, sizeof(egraph_rule_t));
+    egraph_t egraph = {};
+    match_list_t list = {};
+    list.max_size = budget->max_nodes;
+
+    if (rules == nullptr || egraph_ctor(&egraph) != NO_ERR) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        free(rules);
+        egraph_dtor(&egraph);
+        return copy_subtree(root);
+    }
+    size_t rules_amount = compile_egraph_rules(rules);
+
+    size_t root_class = egraph_add_tree_r(&egraph, root);
+    err_t error = (root_class != EGRAPH_NONE) ? egraph_rebuild(&egraph) : MEM_ALLOC_ERR;
+
+    size_t iteration = 0;
+    for (; iteration < budget->max_iterations && error == NO_ERR; iteration++) {
+        list.size = 0;
+        error = egraph_search(&egraph, rules, rules_amount, &list, start + budget->max_time_ms);
+
+        size_t old_size = egraph.size;
+        bool changed = false;
+        for (size_t i = 0; i < list.size && error == NO_ERR && egraph.size < budget->max_nodes; i++) {
+            size_t pos = 0;
+            size_t eclass = egraph_instantiate_r(&egraph, rules[list.matches[i].rule].replacement, &pos,
+                                                 list.matches[i].captures);
+            if (eclass == EGRAPH_NONE) {
+                error = MEM_ALLOC_ERR;
+                break;
+            }
+            changed |= egraph_union(&egraph, list.matches[i].eclass, eclass);
+        }
+        if (error == NO_ERR) {
+            error = egraph_rebuild(&egraph);
+        }
+
+        if (!changed && egraph.size == old_size) {
+            LOG(INFO, "E-graph saturated after %zu iterations\n", iteration + 1);
+            break;
+        }
+        if (egraph.size >= budget->max_nodes || get_time_ms() - start > budget->max_time_ms) {
+            LOG(INFO, "E-graph budget is spent after %zu iterations, %zu nodes\n", iteration + 1, egraph.size);
+            break;
+        }
+    }
+
+    node_t* result = nullptr;
+    size_t* best = (size_t*) calloc(egraph.size, sizeof(size_t));
+    double* costs = (double*) calloc(egraph.size, sizeof(double));
+    if (best != nullptr && costs != nullptr && egraph_best(&egraph, best, costs) == NO_ERR) {
+        result = egraph_extract_r(&egraph, egraph_find(&egraph, root_class), best);
+        update_var_mask_r(result);
+    }
+    if (result == nullptr) {
+        LOG(ERROR, "Failed to extract from e-graph, returning a copy\n");
+        result = copy_subtree(root);
+    }
+
+    free(best);
+    free(costs);
+    free(list.matches);
+    free(rules);
+    egraph_dtor(&egraph);
+    return result;
+}
+
+// FLOPs of one evaluation, every call of a library function counts as CALL_COST of them.
+double exp_tree_t::expression_cost(node_t* root) {
+    if (root == nullptr || root->type != OP) return 0;
+
+    return op_cost(root->value) + expression_cost(root->left) + expression_cost(root->right);
+}
+
+static double op_cost(double op) {
+    switch ((int) op) {
+        case ADD:
+        case SUB:
+        case MUL:
+            return FLOP_COST;
+        case DIV:
+            return DIV_COST;
+        default:
+            return CALL_COST;
+    }
+}
+
+size_t exp_tree_t::egraph_add_tree_r(egraph_t* egraph, node_t* node) {
+    assert(egraph != nullptr);
+
+    if (node == nullptr) return EGRAPH_NONE;
+
+    size_t left = egraph_add_tree_r(egraph, node->left);
+    size_t right = egraph_add_tree_r(egraph, node->right);
+    if ((node->left != nullptr && left == EGRAPH_NONE) || (node->right != nullptr && right == EGRAPH_NONE)) {
+        return EGRAPH_NONE;
+    }
+    return egraph_add(egraph, node->type, node->value, left, right);
+}
+
+// Restores the invariants after unions: children point to class representatives, equal
+// nodes are in one class and are stored once, and every class whose value is a known
+// constant holds that number.
+err_t exp_tree_t::egraph_rebuild(egraph_t* egraph) {
+    assert(egraph != nullptr);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        memset(egraph->table, 0xff, egraph->table_capacity * sizeof(size_t));
+        memset(egraph->has_constant, 0, egraph->size * sizeof(bool));
+
+        for (size_t i = 0; i < egraph->size; i++) {
+            enode_t* node = &egraph->nodes[i];
+            if (node->dead) continue;
+
+            for (size_t j = 0; j < 2; j++) {
+                if (node->children[j] != EGRAPH_NONE) node->children[j] = egraph_find(egraph, node->children[j]);
+            }
+
+            size_t* slot = egraph_lookup(egraph, node);
+            if (*slot == EGRAPH_NONE) {
+                *slot = i;
+                continue;
+            }
+            changed |= egraph_union(egraph, *slot, i);
+            node->dead = true;
+        }
+
+        if (changed) continue;
+
+        for (size_t i = 0; i < egraph->size; i++) {
+            enode_t* node = &egraph->nodes[i];
+            size_t eclass = egraph_find(egraph, i);
+            if (node->dead || egraph->has_constant[eclass]) continue;
+
+            if (node->type == NUM) {
+                egraph->has_constant[eclass] = true;
+                egraph->constants[eclass] = node->value;
+            }
+        }
+
+        for (size_t i = 0; i < egraph->size; i++) {
+            enode_t node = egraph->nodes[i];
+            size_t eclass = egraph_find(egraph, i);
+            if (node.dead || node.type != OP || egraph->has_constant[eclass]) continue;
+
+            double values[2] = {NAN, NAN};
+            bool constant = true;
+            for (size_t j = 0; j < 2; j++) {
+                if (node.children[j] == EGRAPH_NONE) continue;
+                constant &= egraph->has_constant[node.children[j]];
+                values[j] = egraph->constants[node.children[j]];
+            }
+            if (node.children[0] == EGRAPH_NONE && ((int) node.value == ADD || (int) node.value == SUB)) {
+                values[0] = 0;
+            }
+            if (!constant) continue;
+
+            double value = is_function(node.value) ? apply_operation(node.value, NAN, values[0])
+                                                   : apply_operation(node.value, values[0], values[1]);
+            if (!isfinite(value)) continue;
+
+            size_t number = egraph_add(egraph, NUM, value, EGRAPH_NONE, EGRAPH_NONE);
+            if (number == EGRAPH_NONE) {
+                return MEM_ALLOC_ERR;
+            }
+            changed |= egraph_union(egraph, eclass, number);
+            eclass = egraph_find(egraph, eclass);
+            egraph->has_constant[eclass] = true;
+            egraph->constants[eclass] = value;
+        }
+    }
+    return egraph_index_classes(egraph);
+}
+
+node_t* exp_tree_t::egraph_extract_r(egraph_t* egraph, size_t eclass, const size_t* best) {
+    assert(egraph != nullptr);
+    assert(best != nullptr);
+
+    if (eclass == EGRAPH_NONE) return nullptr;
+
+    enode_t* node = &egraph->nodes[best[egraph_find(egraph, eclass)]];
+    node_t* left = egraph_extract_r(egraph, node->children[0], best);
+    node_t* right = egraph_extract_r(egraph, node->children[1], best);
+    return new_node(node->type, node->value, left, right, nullptr, ROOT);
+}
+
+//===================================SEARCH======================================================
+
+static size_t compile_egraph_rules(egraph_rule_t* rules) {
+    size_t rules_amount = 0;
+
+    for (size_t i = 0; i < REWRITE_RULES_AMOUNT + EGRAPH_RULES_AMOUNT; i++) {
+        const rewrite_rule_t* rule = (i < REWRITE_RULES_AMOUNT) ? &REWRITE_RULES[i] : &EGRAPH_RULES[i - REWRITE_RULES_AMOUNT];
+        size_t pattern_size = 0;
+        size_t replacement_size = 0;
+
+        if (!parse_pattern(rule->pattern, rules[rules_amount].pattern, &pattern_size) ||
+            rules[rules_amount].pattern[0].kind != PATTERN_OP ||
+            !parse_pattern(rule->replacement, rules[rules_amount].replacement, &replacement_size)) {
+            LOG(ERROR, "Invalid rewrite rule \"%s\" -> \"%s\"\n", rule->pattern, rule->replacement);
+            continue;
+        }
+        rules_amount++;
+    }
+    return rules_amount;
+}
+
+// All matches are found before any of them is applied, so every rule sees the same graph.
+static err_t egraph_search(egraph_t* egraph, const egraph_rule_t* rules, size_t rules_amount, match_list_t* list,
+                           double deadline) {
+    for (size_t rule = 0; rule < rules_amount && get_time_ms() < deadline; rule++) {
+        const pattern_token_t* tokens = rules[rule].pattern;
+
+        for (size_t i = 0; i < egraph->size; i++) {
+            enode_t* node = &egraph->nodes[i];
+            if (node->dead || node->type != OP || (int) node->value != (int) tokens[0].value) continue;
+
+            egraph_match_t match = {};
+            match.rule = rule;
+            match.eclass = egraph_find(egraph, i);
+            for (size_t j = 0; j < MAX_PATTERN_CAPTURES; j++) {
+                match.captures[j] = EGRAPH_NONE;
+            }
+
+            size_t stack[MAX_PATTERN_TOKENS] = {node->children[1], node->children[0]};
+            err_t error = ematch_r(egraph, tokens, 1, stack, 2, &match, list);
+            if (error != NO_ERR) {
+                return error;
+            }
+            if (list->size >= list->max_size) {
+                return NO_ERR;
+            }
+        }
+    }
+    return NO_ERR;
+}
+
+static err_t ematch_r(egraph_t* egraph, const pattern_token_t* tokens, size_t pos, size_t* stack, size_t depth,
+                      egraph_match_t* match, match_list_t* list) {
+    if (depth == 0) {
+        if (list->size >= list->max_size) {
+            return NO_ERR;
+        }
+        if (list->size == list->capacity) {
+            size_t capacity = (list->capacity == 0) ? EGRAPH_INIT_CAPACITY : list->capacity * 2;
+            egraph_match_t* matches = (egraph_match_t*) realloc(list->matches, capacity * sizeof(egraph_match_t));
+            if (matches == nullptr) {
+                LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+                return MEM_ALLOC_ERR;
+            }
+            list->matches = matches;
+            list->capacity = capacity;
+        }
+        list->matches[list->size++] = *match;
+        return NO_ERR;
+    }
+
+    size_t eclass = stack[depth - 1];
+    pattern_token_t token = tokens[pos];
+
+    if (token.kind != PATTERN_OP) {
+        bool bound = false;
+        size_t* capture = ematch_leaf(egraph, tokens, pos, eclass, match, &bound);
+        if (capture == nullptr) {
+            return NO_ERR;
+        }
+        err_t error = ematch_r(egraph, tokens, pos + 1, stack, depth - 1, match, list);
+        if (bound) {
+            *capture = EGRAPH_NONE;
+        }
+        return error;
+    }
+
+    if (eclass == EGRAPH_NONE) {
+        return NO_ERR;
+    }
+    for (size_t i = egraph->class_start[eclass]; i < egraph->class_start[eclass + 1]; i++) {
+        enode_t* node = &egraph->nodes[egraph->class_nodes[i]];
+        if (node->type != OP || (int) node->value != (int) token.value) continue;
+
+        stack[depth - 1] = node->children[1];
+        stack[depth] = node->children[0];
+        err_t error = ematch_r(egraph, tokens, pos + 1, stack, depth + 1, match, list);
+        stack[depth - 1] = eclass;
+        if (error != NO_ERR) {
+            return error;
+        }
+    }
+    return NO_ERR;
+}
+
+// Matches a leaf token against a class. Returns nullptr on mismatch, otherwise the
+// capture slot, which *bound tells to be released after the match.
+static size_t* ematch_leaf(egraph_t* egraph, const pattern_token_t* tokens, size_t pos, size_t eclass, egraph_match_t* match, bool* bound) {
+    pattern_token_t token = tokens[pos];
+    static size_t no_capture = 0;
+
+    switch (token.kind) {
+        case PATTERN_NIL:
+            return (eclass == EGRAPH_NONE) ? &no_capture : nullptr;
+        case PATTERN_NUM:
+            if (eclass == EGRAPH_NONE || !egraph->has_constant[eclass] ||
+                !(fabs(egraph->constants[eclass] - token.value) <= NUM_EPSILON * fabs(token.value))) {
+                return nullptr;
+            }
+            return &no_capture;
+        case PATTERN_ANY: {
+            if (eclass == EGRAPH_NONE) return nullptr;
+
+            size_t* capture = &match->captures[(size_t) token.value];
+            if (*capture == EGRAPH_NONE) {
+                *capture = eclass;
+                *bound = true;
+                return capture;
+            }
+            return (egraph_find(egraph, *capture) == eclass) ? capture : nullptr;
+        }
+        case PATTERN_OP:
+            // Operations are walked by ematch_r().
+            return nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+static size_t egraph_instantiate_r(egraph_t* egraph, const pattern_token_t* tokens, size_t* pos, const size_t* captures) {
+    pattern_token_t token = tokens[(*pos)++];
+
+    switch (token.kind) {
+        case PATTERN_NUM:
+            return egraph_add(egraph, NUM, token.value, EGRAPH_NONE, EGRAPH_NONE);
+        case PATTERN_ANY:
+            if (captures[(size_t) token.value] == EGRAPH_NONE) return EGRAPH_NONE;
+            return egraph_find(egraph, captures[(size_t) token.value]);
+        case PATTERN_OP: {
+            bool left_nil = tokens[*pos].kind == PATTERN_NIL;
+            size_t left = egraph_instantiate_r(egraph, tokens, pos, captures);
+            bool right_nil = tokens[*pos].kind == PATTERN_NIL;
+            size_t right = egraph_instantiate_r(egraph, tokens, pos, captures);
+            if ((!left_nil && left == EGRAPH_NONE) || (!right_nil && right == EGRAPH_NONE)) {
+                return EGRAPH_NONE;
+            }
+            return egraph_add(egraph, OP, token.value, left, right);
+        }
+        case PATTERN_NIL:
+        default:
+            return EGRAPH_NONE;
+    }
+}
+
+// Cheapest node of every class. Costs only go down, and a node is always dearer than
+// its children, so this converges and the chosen nodes form a tree.
+static err_t egraph_best(egraph_t* egraph, size_t* best, double* costs) {
+    for (size_t i = 0; i < egraph->size; i++) {
+        costs[i] = INFINITY;
+        best[i] = EGRAPH_NONE;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < egraph->size; i++) {
+            enode_t* node = &egraph->nodes[i];
+            if (node->dead) continue;
+
+            double cost = (node->type == OP) ? op_cost(node->value) : 0;
+            for (size_t j = 0; j < 2; j++) {
+                if (node->children[j] != EGRAPH_NONE) cost += costs[egraph_find(egraph, node->children[j])];
+            }
+
+            size_t eclass = egraph_find(egraph, i);
+            if (cost < costs[eclass]) {
+                costs[eclass] = cost;
+                best[eclass] = i;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < egraph->size; i++) {
+        if (egraph_find(egraph, i) == i && !egraph->nodes[i].dead && best[i] == EGRAPH_NONE) {
+            return FORMAT_ERR;
+        }
+    }
+    return NO_ERR;
+}
+
+//===================================STORAGE=====================================================
+
+static err_t egraph_ctor(egraph_t* egraph) {
+    assert(egraph != nullptr);
+
+    egraph->capacity = EGRAPH_INIT_CAPACITY;
+    egraph->nodes = (enode_t*) calloc(egraph->capacity, sizeof(enode_t));
+    egraph->parents = (size_t*) calloc(egraph->capacity, sizeof(size_t));
+    egraph->has_constant = (bool*) calloc(egraph->capacity, sizeof(bool));
+    egraph->constants = (double*) calloc(egraph->capacity, sizeof(double));
+
+    egraph->table_capacity = EGRAPH_INIT_CAPACITY * 2;
+    egraph->table = (size_t*) calloc(egraph->table_capacity, sizeof(size_t));
+
+    if (egraph->nodes == nullptr || egraph->parents == nullptr || egraph->has_constant == nullptr ||
+        egraph->constants == nullptr || egraph->table == nullptr) {
+        return MEM_ALLOC_ERR;
+    }
+    memset(egraph->table, 0xff, egraph->table_capacity * sizeof(size_t));
+    return NO_ERR;
+}
+
+static void egraph_dtor(egraph_t* egraph) {
+    assert(egraph != nullptr);
+
+    free(egraph->nodes);
+    free(egraph->parents);
+    free(egraph->has_constant);
+    free(egraph->constants);
+    free(egraph->table);
+    free(egraph->class_nodes);
+    free(egraph->class_start);
+    *egraph = {};
+}
+
+static size_t egraph_find(egraph_t* egraph, size_t eclass) {
+    size_t root = eclass;
+    while (egraph->parents[root] != root) {
+        root = egraph->parents[root];
+    }
+    while (egraph->parents[eclass] != root) {
+        size_t next = egraph->parents[eclass];
+        egraph->parents[eclass] = root;
+        eclass = next;
+    }
+    return root;
+}
+
+static bool egraph_union(egraph_t* egraph, size_t eclass1, size_t eclass2) {
+    eclass1 = egraph_find(egraph, eclass1);
+    eclass2 = egraph_find(egraph, eclass2);
+    if (eclass1 == eclass2) {
+        return false;
+    }
+
+    if (eclass1 < eclass2) {
+        egraph->parents[eclass2] = eclass1;
+    }
+    else {
+        egraph->parents[eclass1] = eclass2;
+    }
+    return true;
+}
+
+// Returns the class of an equal node if there is one, otherwise adds the node.
+static size_t egraph_add(egraph_t* egraph, type_t type, double value, size_t left, size_t right) {
+    enode_t node = {type, value, {left, right}, false};
+    for (size_t j = 0; j < 2; j++) {
+        if (node.children[j] != EGRAPH_NONE) node.children[j] = egraph_find(egraph, node.children[j]);
+    }
+
+    size_t* slot = egraph_lookup(egraph, &node);
+    if (*slot != EGRAPH_NONE) {
+        return egraph_find(egraph, *slot);
+    }
+
+    if (egraph->size == egraph->capacity) {
+        size_t capacity = egraph->capacity * 2;
+        enode_t* nodes = (enode_t*) realloc(egraph->nodes, capacity * sizeof(enode_t));
+        if (nodes != nullptr) egraph->nodes = nodes;
+        size_t* parents = (size_t*) realloc(egraph->parents, capacity * sizeof(size_t));
+        if (parents != nullptr) egraph->parents = parents;
+        bool* has_constant = (bool*) realloc(egraph->has_constant, capacity * sizeof(bool));
+        if (has_constant != nullptr) egraph->has_constant = has_constant;
+        double* constants = (double*) realloc(egraph->constants, capacity * sizeof(double));
+        if (constants != nullptr) egraph->constants = constants;
+
+        if (nodes == nullptr || parents == nullptr || has_constant == nullptr || constants == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            return EGRAPH_NONE;
+        }
+        egraph->capacity = capacity;
+    }
+    if (egraph->size * 2 >= egraph->table_capacity) {
+        if (egraph_grow_table(egraph) != NO_ERR) {
+            return EGRAPH_NONE;
+        }
+        slot = egraph_lookup(egraph, &node);
+    }
+
+    size_t index = egraph->size++;
+    egraph->nodes[index] = node;
+    egraph->parents[index] = index;
+    egraph->has_constant[index] = false;
+    *slot = index;
+    return index;
+}
+
+static size_t* egraph_lookup(egraph_t* egraph, enode_t* node) {
+    size_t mask = egraph->table_capacity - 1;
+    size_t slot = (size_t) enode_hash(egraph, node) & mask;
+
+    while (egraph->table[slot] != EGRAPH_NONE && !enode_equal(egraph, &egraph->nodes[egraph->table[slot]], node)) {
+        slot = (slot + 1) & mask;
+    }
+    return &egraph->table[slot];
+}
+
+static err_t egraph_grow_table(egraph_t* egraph) {
+    size_t* table = (size_t*) calloc(egraph->table_capacity * 2, sizeof(size_t));
+    if (table == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+    free(egraph->table);
+    egraph->table = table;
+    egraph->table_capacity *= 2;
+    memset(egraph->table, 0xff, egraph->table_capacity * sizeof(size_t));
+
+    for (size_t i = 0; i < egraph->size; i++) {
+        if (egraph->nodes[i].dead) continue;
+
+        size_t* slot = egraph_lookup(egraph, &egraph->nodes[i]);
+        if (*slot == EGRAPH_NONE) *slot = i;
+    }
+    return NO_ERR;
+}
+
+// Lists the live nodes of every class: class_nodes[class_start[c] .. class_start[c + 1]).
+static err_t egraph_index_classes(egraph_t* egraph) {
+    free(egraph->class_nodes);
+    free(egraph->class_start);
+    egraph->class_nodes = (size_t*) calloc(egraph->size + 1, sizeof(size_t));
+    egraph->class_start = (size_t*) calloc(egraph->size + 2, sizeof(size_t));
+    if (egraph->class_nodes == nullptr || egraph->class_start == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+
+    for (size_t i = 0; i < egraph->size; i++) {
+        if (!egraph->nodes[i].dead) egraph->class_start[egraph_find(egraph, i) + 2]++;
+    }
+    for (size_t i = 2; i < egraph->size + 2; i++) {
+        egraph->class_start[i] += egraph->class_start[i - 1];
+    }
+    for (size_t i = 0; i < egraph->size; i++) {
+        if (!egraph->nodes[i].dead) egraph->class_nodes[egraph->class_start[egraph_find(egraph, i) + 1]++] = i;
+    }
+    return NO_ERR;
+}
+
+static uint64_t enode_hash(egraph_t* egraph, enode_t* node) {
+    uint64_t bits = 0;
+    memcpy(&bits, &node->value, sizeof(bits));
+
+    uint64_t hash = UINT64_C(0xcbf29ce484222325) ^ (uint64_t) node->type;
+    hash = (hash ^ bits) * UINT64_C(0x100000001b3);
+    for (size_t j = 0; j < 2; j++) {
+        size_t child = (node->children[j] == EGRAPH_NONE) ? EGRAPH_NONE : egraph_find(egraph, node->children[j]);
+        hash = (hash ^ (uint64_t) child) * UINT64_C(0x100000001b3);
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static bool enode_equal(egraph_t* egraph, enode_t* node1, enode_t* node2) {
+    if (node1->type != node2->type || memcmp(&node1->value, &node2->value, sizeof(double)) != 0) {
+        return false;
+    }
+    for (size_t j = 0; j < 2; j++) {
+        size_t child1 = (node1->children[j] == EGRAPH_NONE) ? EGRAPH_NONE : egraph_find(egraph, node1->children[j]);
+        size_t child2 = (node2->children[j] == EGRAPH_NONE) ? EGRAPH_NONE : egraph_find(egraph, node2->children[j]);
+        if (child1 != child2) return false;
+    }
+    return true;
+}
+
+static double get_time_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
@@ -4,12 +4,18 @@
 #include <math.h>
 #include "logger.h"
 #include "expression_tree.h"
+#include "trace.h"
 
 //===================================CTOR/DTOR===================================================
 
 void exp_tree_t::dtor() {
+    delete_token_tree_r(root_);
+    root_ = nullptr;
     free(tokens_);
     tokens_ = nullptr;
+    clear_diff_memo();
+    clear_dag();
+    var_nametable_size_ = 0;
 }
 
 void exp_tree_t::delete_tree(node_t* root) {
@@ -28,15 +34,42 @@ void exp_tree_t::delete_subtree_r(node_t* node) {
         delete_subtree_r(node->right);
     }
 
+    free_node(node);
+}
+
+void exp_tree_t::free_node(node_t* node) {
+    if (node == nullptr) {
+        return;
+    }
+    if (stats_.live_nodes > 0) stats_.live_nodes--;
+
+    if (node_pool_size_ < node_pool_capacity_) {
+        node->left = node_pool_;
+        node_pool_ = node;
+        node_pool_size_++;
+        return;
+    }
     free(node);
-    node = nullptr;
+}
+
+node_t* exp_tree_t::root() {
+    return root_;
 }
 
 node_t* exp_tree_t::new_node(type_t type, double value, node_t* left, node_t* right, node_t* parent, rel_t rel) {
-    node_t* new_node = (node_t*) calloc(sizeof(node_t), sizeof(char));
-    if (new_node == nullptr) {
+    node_t* new_node = node_pool_;
+    if (new_node != nullptr) {
+        node_pool_ = new_node->left;
+        node_pool_size_--;
+        memset(new_node, 0, sizeof(node_t));
+    }
+    else if ((new_node = (node_t*) calloc(sizeof(node_t), sizeof(char))) == nullptr) {
         return nullptr;
     }
+    stats_.allocated_nodes++;
+    if (++stats_.live_nodes > stats_.peak_live_nodes) {
+        stats_.peak_live_nodes = stats_.live_nodes;
+    }
 
     new_node->type = type;
     new_node->value = value;
@@ -48,6 +81,9 @@ node_t* exp_tree_t::new_node(type_t type, double value, node_t* left, node_t* ri
     new_node->left = left;
     if (left != nullptr) left->parent = new_node;
 
+    new_node->var_mask = ((left  != nullptr) ? left->var_mask  : 0) |
+                         ((right != nullptr) ? right->var_mask : 0);
+
     if (parent != nullptr) {
         switch (rel) {
             case RIGHT:
@@ -65,10 +101,41 @@ node_t* exp_tree_t::new_node(type_t type, double value, node_t* left, node_t* ri
     return new_node;
 }
 
+//===================================NODE POOL===================================================
+// A tree that lives through many expressions, as a worker of the server, keeps up to
+// `amount` freed nodes for the next ones instead of returning them to malloc. The pool
+// outlives dtor(), release_nodes() frees it.
+
+err_t exp_tree_t::reserve_nodes(size_t amount) {
+    node_pool_capacity_ = amount;
+    while (node_pool_size_ < amount) {
+        node_t* node = (node_t*) calloc(1, sizeof(node_t));
+        if (node == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            return MEM_ALLOC_ERR;
+        }
+        node->left = node_pool_;
+        node_pool_ = node;
+        node_pool_size_++;
+    }
+    return NO_ERR;
+}
+
+void exp_tree_t::release_nodes() {
+    while (node_pool_ != nullptr) {
+        node_t* next = node_pool_->left;
+        free(node_pool_);
+        node_pool_ = next;
+    }
+    node_pool_size_ = 0;
+    node_pool_capacity_ = 0;
+}
+
 //==========================================INIT==================================================
 
 err_t exp_tree_t::init(FILE* data_file) {
     assert(data_file != nullptr);
+    reset_stats();
 
     text_t text = {};
     if (text_ctor(&text, data_file) != TEXT_NO_ERRORS) {
@@ -77,9 +144,27 @@ err_t exp_tree_t::init(FILE* data_file) {
     }
 
     root_ = token_init(&text);
-    dump_tree();
     text_dtor(&text);
-    return NO_ERR;
+    return syntax_failed_ ? SYNTAX_ERR : NO_ERR;
+}
+
+err_t exp_tree_t::init(const char* expression) {
+    assert(expression != nullptr);
+    reset_stats();
+
+    text_t text = {};
+    text.symbols_amount = strlen(expression) + 1;
+
+    text.symbols = (unsigned char*) calloc(text.symbols_amount, sizeof(char));
+    if (text.symbols == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+    memcpy(text.symbols, expression, text.symbols_amount - 1);
+
+    root_ = token_init(&text);
+    text_dtor(&text);
+    return syntax_failed_ ? SYNTAX_ERR : NO_ERR;
 }
 
 node_t* exp_tree_t::new_initial_node_r(text_t* text, node_t* parent, size_t* index) {
@@ -196,8 +281,8 @@ void exp_tree_t::calculate_expression_r(node_t* node) {
 
         node->value = calculate_value(node->value, node->left, node->right);
 
-        free(node->left);
-        free(node->right);
+        free_node(node->left);
+        free_node(node->right);
 
         node->left = nullptr;
         node->right = nullptr;
@@ -209,6 +294,40 @@ double exp_tree_t::calculate_value(double op_type, node_t* node_l,  node_t* node
     double val_l = (node_l == nullptr) ? NAN : node_l->value;
     double val_r = (node_r == nullptr) ? NAN : node_r->value;
 
+    return apply_operation(op_type, val_l, val_r);
+}
+
+double exp_tree_t::evaluate(node_t* node, const double* vars) {
+    assert(vars != nullptr);
+
+    if (node == nullptr) {
+        return NAN;
+    }
+
+    switch (node->type) {
+        case NUM:
+            return node->value;
+        case VAR:
+            return vars[(size_t) node->value];
+        case OP:
+            break;
+        default:
+            return NAN;
+    }
+
+    if (is_function(node->value)) {
+        node_t* arg = (node->left != nullptr) ? node->left : node->right;
+        return apply_operation(node->value, NAN, evaluate(arg, vars));
+    }
+
+    double val_r = evaluate(node->right, vars);
+    if (node->left == nullptr && ((int) node->value == ADD || (int) node->value == SUB)) {
+        return apply_operation(node->value, 0, val_r);
+    }
+    return apply_operation(node->value, evaluate(node->left, vars), val_r);
+}
+
+double exp_tree_t::apply_operation(double op_type, double val_l, double val_r) {
     switch ((int) op_type) {
         case ADD:
             return val_l + val_r;
@@ -219,7 +338,7 @@ double exp_tree_t::calculate_value(double op_type, node_t* node_l,  node_t* node
         case DIV:
             return val_l / val_r;
         case POW:
-            return pow(val_l, val_r);
+            return fast_pow(val_l, val_r);
         case SIN:
             return sin(val_r);
         case COS:
@@ -251,52 +370,157 @@ double exp_tree_t::calculate_value(double op_type, node_t* node_l,  node_t* node
         case ARCTH:
             return atanh(val_r);
         case ARCCTH:
-            return atanh(val_r);
+            return atanh(1 / val_r);
         case LOG:
             return log(val_r) / log(val_l);
         case LN:
             return log(val_r);
+        case EXP:
+            return exp(val_r);
         default:
             LOG(ERROR, "Undefined operation %d(%lf)\n", (int) op_type, op_type);
             return NAN;
             break;
     }
+}
 
+bool exp_tree_t::is_function(double value) {
+    switch ((int) value) {
+        case LN:
+        case EXP:
+        case SIN:
+        case COS:
+        case TG:
+        case CTG:
+        case SH:
+        case CH:
+        case TH:
+        case CTH:
+        case ARCSIN:
+        case ARCCOS:
+        case ARCTG:
+        case ARCCTG:
+        case ARCSH:
+        case ARCCH:
+        case ARCTH:
+        case ARCCTH:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Most exponents are small integers, e.g. the 2 in every derivative of a quotient, and
+// those are multiplied out left to right over the bits; exponents +-1/2 become sqrt. The
+// test is negated so that NaN and infinite exponents go to pow() too.
+double fast_pow(double base, double exponent) {
+    double integral = round(exponent);
+    if (!(fabs(exponent - integral) < NUM_EPSILON) || fabs(integral) > MAX_INT_POWER) {
+        if (fabs(fabs(exponent) - 0.5) < NUM_EPSILON) {
+            return (exponent > 0) ? sqrt(base) : 1 / sqrt(base);
+        }
+        return pow(base, exponent);
+    }
+
+    size_t power = (size_t) fabs(integral);
+    if (power == 0) {
+        return 1;
+    }
+
+    size_t bit = 1;
+    while (bit * 2 <= power) bit *= 2;
+
+    double result = base;
+    for (bit /= 2; bit > 0; bit /= 2) {
+        result *= result;
+        if (power & bit) result *= base;
+    }
+    return (integral < 0) ? 1 / result : result;
 }
 
 //===================================DIFFERENTIATE================================================
 
-node_t* exp_tree_t::differentiate_expression(FILE* ostream) {
-    return differentiate(ostream, root_);
+node_t* exp_tree_t::differentiate_expression(FILE* ostream, size_t var_id) {
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_DIFFERENTIATE);
+    node_t* diff_root = differentiate_memo(ostream, root_, var_id);
+    update_var_mask_r(diff_root);
+    stats_.nodes_differentiated = count_nodes_r(diff_root);
+    return diff_root;
+}
+
+node_t* exp_tree_t::differentiate(node_t* root, size_t var_id) {
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_DIFFERENTIATE);
+    node_t* diff_root = differentiate_memo(nullptr, root, var_id);
+    update_var_mask_r(diff_root);
+    stats_.nodes_differentiated = count_nodes_r(diff_root);
+    return diff_root;
 }
 
-node_t* exp_tree_t::differentiate(FILE* ostream, node_t* node) {
+node_t* exp_tree_t::differentiate(FILE* ostream, node_t* node, size_t var_id) {
     if (node == nullptr) return nullptr;
 
     node_t* diff_root = new_node(OP, 0, nullptr, nullptr, nullptr, ROOT);
     if (diff_root == nullptr) return nullptr;
 
-    switch (node->type) {
-        case VAR: {
-            diff_root->type = NUM;
-            diff_root->value = 1;
+    if (!depends_on(node, var_id)) {
+        diff_root->type = NUM;
+        diff_root->value = 0;
+        if (ostream != nullptr) {
             fprintf(ostream, "Initial expression: \n\n");
             print_exp_to_tex(ostream, node);
-            fprintf(ostream, "We get that the derivative of variable: \n\n");
+            fprintf(ostream, "We get that the derivative of const is: \n\n");
             print_exp_to_tex(ostream, diff_root);
+        }
+        return diff_root;
+    }
+
+    if (diff_memo_active_ && node->type == OP) {
+        node_t* poly_derivative = find_poly_derivative(node, var_id);
+        if (poly_derivative != nullptr) {
+            free_node(diff_root);
+            if (ostream != nullptr) {
+                fprintf(ostream, "Initial expression: \n\n");
+                print_exp_to_tex(ostream, node);
+                fprintf(ostream, "It is a polynomial, so its derivative is: \n\n");
+                print_exp_to_tex(ostream, poly_derivative);
+            }
+            return poly_derivative;
+        }
+
+        node_t* memo_derivative = find_memo_derivative(node, var_id);
+        if (memo_derivative != nullptr) {
+            free_node(diff_root);
+            if (ostream != nullptr) {
+                fprintf(ostream, "Initial expression: \n\n");
+                print_exp_to_tex(ostream, node);
+                fprintf(ostream, "Its derivative was already found above: \n\n");
+                print_exp_to_tex(ostream, memo_derivative);
+            }
+            return memo_derivative;
+        }
+    }
+
+    switch (node->type) {
+        case VAR: {
+            diff_root->type = NUM;
+            diff_root->value = ((size_t) node->value == var_id) ? 1 : 0;
+            if (ostream != nullptr) {
+                fprintf(ostream, "Initial expression: \n\n");
+                print_exp_to_tex(ostream, node);
+                fprintf(ostream, "We get that the derivative of variable: \n\n");
+                print_exp_to_tex(ostream, diff_root);
+            }
             break;
         }
         case NUM: {
             diff_root->type = NUM;
             diff_root->value = 0;
-            fprintf(ostream, "Initial expression: \n\n");
-            print_exp_to_tex(ostream, node);
-            fprintf(ostream, "We get that the derivative of const is: \n\n");
-            print_exp_to_tex(ostream, diff_root);
             break;
         }
         case OP: {
-            differentiate_operation(ostream, node, diff_root);
+            differentiate_operation(ostream, node, diff_root, var_id);
             break;
         }
         default: {
@@ -304,10 +528,13 @@ node_t* exp_tree_t::differentiate(FILE* ostream, node_t* node) {
         }
     }
 
+    if (diff_memo_active_ && node->type == OP) {
+        memoize_derivative(node, var_id, diff_root);
+    }
     return diff_root;
 }
 
-void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op_node) {
+void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op_node, size_t var_id) {
     if (op_node == nullptr) return;
     if (node == nullptr) return;
 
@@ -317,16 +544,16 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
                 op_node->value = ADD;
                 op_node->left = nullptr;
 
-                op_node->right = differentiate(ostream, node->right);
+                op_node->right = differentiate(ostream, node->right, var_id);
                 op_node->right->parent = op_node;
                 break;
             }
 
             op_node->value = ADD;
 
-            op_node->right = differentiate(ostream, node->right);
+            op_node->right = differentiate(ostream, node->right, var_id);
             op_node->right->parent = op_node;
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             op_node->left->parent = op_node;
             break;
         case SUB:
@@ -334,16 +561,16 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
                 op_node->value = SUB;
                 op_node->left = nullptr;
 
-                op_node->right = differentiate(ostream, node->right);
+                op_node->right = differentiate(ostream, node->right, var_id);
                 op_node->right->parent = op_node;
                 break;
             }
 
             op_node->value = SUB;
 
-            op_node->right = differentiate(ostream, node->right);
+            op_node->right = differentiate(ostream, node->right, var_id);
             op_node->right->parent = op_node;
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             op_node->left->parent = op_node;
             break;
         case MUL:
@@ -360,11 +587,11 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             op_node->right->left->parent = op_node->right;
             if (op_node->right->left == nullptr) return;
 
-            op_node->left->left = differentiate(ostream, node->left);
+            op_node->left->left = differentiate(ostream, node->left, var_id);
             if (op_node->left->left == nullptr) return;
             op_node->left->left->parent = op_node->left;
 
-            op_node->right->right = differentiate(ostream, node->right);
+            op_node->right->right = differentiate(ostream, node->right, var_id);
             if (op_node->right->right == nullptr) return;
             op_node->right->right->parent = op_node->right;
 
@@ -374,7 +601,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
 
             if (new_node(OP, DIV, nullptr, nullptr, op_node, LEFT) == nullptr) return;
 
-            op_node->left->left = differentiate(ostream, node->left);
+            op_node->left->left = differentiate(ostream, node->left, var_id);
             if (op_node->left->left == nullptr) return;
             op_node->left->left->parent = op_node->left;
 
@@ -391,7 +618,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
 
             if (new_node(OP, MUL, nullptr, nullptr, op_node->right, LEFT) == nullptr) return;
 
-            op_node->right->left->left = differentiate(ostream, node->right);
+            op_node->right->left->left = differentiate(ostream, node->right, var_id);
             op_node->right->left->left->parent = op_node->right->left;
 
             op_node->right->left->right = copy_subtree(node->left);
@@ -400,9 +627,9 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case LOG:
             op_node->value = MUL;
 
-            if (new_node(OP, DIV, nullptr, nullptr, op_node, LEFT) == nullptr) return;
+            if (new_node(OP, DIV, nullptr, nullptr, op_node, RIGHT) == nullptr) return;
 
-            op_node->left = differentiate(ostream, node->right);
+            op_node->left = differentiate(ostream, node->right, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -427,7 +654,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
 
             if (new_node(OP, DIV, nullptr, nullptr, op_node, LEFT) == nullptr) return;
 
-            op_node->right = differentiate(ostream, node->left);
+            op_node->right = differentiate(ostream, node->left, var_id);
             if (op_node->right == nullptr) return;
             op_node->right->parent = op_node;
 
@@ -440,9 +667,9 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case EXP:
             op_node->value = MUL;
 
-            if (new_node(OP, EXP, nullptr, nullptr, op_node, LEFT) == nullptr) return;
+            if (new_node(OP, EXP, nullptr, nullptr, op_node, RIGHT) == nullptr) return;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -459,7 +686,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->left == nullptr) return;
             op_node->right->left->parent = op_node->right;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
             break;
@@ -469,7 +696,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             op_node->right = new_node(OP, MUL, nullptr, nullptr, op_node, RIGHT);
             if (op_node->right == nullptr) return;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -486,7 +713,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case TG:
             op_node->value = MUL;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -500,13 +727,10 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->right == nullptr) return;
 
             op_node->right->right->right = new_node(NUM, 2, nullptr, nullptr, op_node->right->right, RIGHT);
-            if (op_node->right->right == nullptr) return;
+            if (op_node->right->right->right == nullptr) return;
 
             op_node->right->right->left = new_node(OP, COS, nullptr, nullptr, op_node->right->right, LEFT);
-            if (op_node->right->right == nullptr) return;
-
-            op_node->right->right->left->right = nullptr;
-            if (op_node->right->right->left->right == nullptr) return;
+            if (op_node->right->right->left == nullptr) return;
 
             op_node->right->right->left->left = copy_subtree(node->left);
             if (op_node->right->right->left->left == nullptr) return;
@@ -515,7 +739,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case CTG:
             op_node->value = MUL;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -529,17 +753,14 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->right == nullptr) return;
 
             op_node->right->right->right = new_node(NUM, 2, nullptr, nullptr, op_node->right->right, RIGHT);
-            if (op_node->right->right == nullptr) return;
+            if (op_node->right->right->right == nullptr) return;
 
             op_node->right->right->left = new_node(OP, SIN, nullptr, nullptr, op_node->right->right, LEFT);
-            if (op_node->right->right == nullptr) return;
-
-            op_node->right->right->left->right = nullptr;
-            if (op_node->right->right->left->right == nullptr) return;
+            if (op_node->right->right->left == nullptr) return;
 
             op_node->right->right->left->left = copy_subtree(node->left);
             if (op_node->right->right->left->left == nullptr) return;
-            op_node->right->right->left->parent = op_node->right->right->left;
+            op_node->right->right->left->left->parent = op_node->right->right->left;
             break;
         case SH:
             op_node->value = MUL;
@@ -551,7 +772,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->left == nullptr) return;
             op_node->right->left->parent = op_node->right;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left  == nullptr) return;
             op_node->left->parent = op_node;
             break;
@@ -565,14 +786,14 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->left == nullptr) return;
             op_node->right->left->parent = op_node->right;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left  == nullptr) return;
             op_node->left->parent = op_node;
             break;
         case TH:
             op_node->value = MUL;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -586,23 +807,20 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->right == nullptr) return;
 
             op_node->right->right->right = new_node(NUM, 2, nullptr, nullptr, op_node->right->right, RIGHT);
-            if (op_node->right->right == nullptr) return;
+            if (op_node->right->right->right == nullptr) return;
 
             op_node->right->right->left = new_node(OP, CH, nullptr, nullptr, op_node->right->right, LEFT);
-            if (op_node->right->right == nullptr) return;
-
-            op_node->right->right->left->right = nullptr;
-            if (op_node->right->right->left->right == nullptr) return;
+            if (op_node->right->right->left == nullptr) return;
 
             op_node->right->right->left->left = copy_subtree(node->left);
-            if (op_node->right->right->left->left) return;
+            if (op_node->right->right->left->left == nullptr) return;
             op_node->right->right->left->left->parent = op_node->right->right->left;
             break;
         case CTH:
             op_node->value = MUL;
 
-            op_node->left = differentiate(ostream, node->left);
-            if (op_node->left) return;
+            op_node->left = differentiate(ostream, node->left, var_id);
+            if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
             op_node->right = new_node(OP, DIV, nullptr, nullptr, op_node, RIGHT);
@@ -615,22 +833,19 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             if (op_node->right->right == nullptr) return;
 
             op_node->right->right->right = new_node(NUM, 2, nullptr, nullptr, op_node->right->right, RIGHT);
-            if (op_node->right->right == nullptr) return;
+            if (op_node->right->right->right == nullptr) return;
 
             op_node->right->right->left = new_node(OP, SH, nullptr, nullptr, op_node->right->right, LEFT);
-            if (op_node->right->right == nullptr) return;
-
-            op_node->right->right->left->right = nullptr;
-            if (op_node->right->right->left->right == nullptr) return;
+            if (op_node->right->right->left == nullptr) return;
 
             op_node->right->right->left->left = copy_subtree(node->left);
-            if (op_node->right->right->left->left) return;
+            if (op_node->right->right->left->left == nullptr) return;
             op_node->right->right->left->left->parent = op_node->right->right->left;
             break;
         case ARCSIN:
             op_node->value = DIV;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -655,16 +870,14 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
 
             if (new_node(NUM, -1, nullptr, nullptr, op_node, LEFT) == nullptr) return;
 
-            node->value = ARCSIN;
-            op_node->right = differentiate(ostream, node);
-            node->value = ARCCOS;
+            op_node->right = differentiate_as(ostream, node, ARCSIN, var_id);
             if (op_node->right == nullptr) return;
             op_node->right->parent = op_node;
             break;
         case ARCTG:
             op_node->value = DIV;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -680,25 +893,23 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
 
             if (new_node(NUM, 2, nullptr, nullptr, op_node->right->right->right, RIGHT) == nullptr) return;
 
-            op_node->right->right->left = copy_subtree(node->left);
-            if (op_node->right->right->left == nullptr) return;
-            op_node->right->right->left->parent = op_node->right->right;
+            op_node->right->right->right->left = copy_subtree(node->left);
+            if (op_node->right->right->right->left == nullptr) return;
+            op_node->right->right->right->left->parent = op_node->right->right->right;
             break;
         case ARCCTG:
             op_node->value = MUL;
 
             if (new_node(NUM, -1, nullptr, nullptr, op_node, LEFT) == nullptr) return;
 
-            node->value = ARCTG;
-            op_node->right = differentiate(ostream, node);
-            node->value = ARCCTG;
+            op_node->right = differentiate_as(ostream, node, ARCTG, var_id);
             if (op_node->right == nullptr) return;
             op_node->right->parent = op_node;
             break;
         case ARCSH:
             op_node->value = DIV;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -721,7 +932,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case ARCCH:
             op_node->value = DIV;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -746,7 +957,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         case ARCTH:
             op_node->value = DIV;
 
-            op_node->left = differentiate(ostream, node->left);
+            op_node->left = differentiate(ostream, node->left, var_id);
             if (op_node->left == nullptr) return;
             op_node->left->parent = op_node;
 
@@ -763,8 +974,8 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
             op_node->right->right->left->parent = op_node->right->right;
             break;
         case POW: {
-            bool var_right = is_var_present_r(node->right);
-            bool var_left = is_var_present_r(node->left);
+            bool var_right = depends_on(node->right, var_id);
+            bool var_left = depends_on(node->left, var_id);
 
             if (var_left == false && var_right == false) {
                 op_node->type = NUM;
@@ -776,7 +987,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
                 op_node->value = MUL;
 
                 if (new_node(OP, MUL, nullptr, nullptr, op_node, RIGHT) == nullptr) return;
-                op_node->left = differentiate(ostream, node->left);
+                op_node->left = differentiate(ostream, node->left, var_id);
                 if (op_node->left == nullptr) return;
                 op_node->left->parent = op_node;
 
@@ -800,7 +1011,7 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
                 op_node->value = MUL;
 
                 if (new_node(OP, MUL, nullptr, nullptr, op_node, RIGHT) == nullptr) return;
-                op_node->left = differentiate(ostream, node->right);
+                op_node->left = differentiate(ostream, node->right, var_id);
                 if (op_node->left == nullptr) return;
                 op_node->left->parent = op_node;
 
@@ -834,11 +1045,11 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
                 if (op_node->right->right->right->right  == nullptr) return;
                 op_node->right->right->right->right->parent = op_node->right->right->right;
 
-                op_node->right->right->right->left = differentiate(ostream, node->left);
+                op_node->right->right->right->left = differentiate(ostream, node->left, var_id);
                 if (op_node->right->right->right->left == nullptr) return;
                 op_node->right->right->right->left->parent = op_node->right->right->right;
 
-                op_node->right->left->left = differentiate(ostream, node->right);
+                op_node->right->left->left = differentiate(ostream, node->right, var_id);
                 if (op_node->right->left->left == nullptr) return;
                 op_node->right->left->left->parent = op_node->right->left;
 
@@ -854,20 +1065,41 @@ void exp_tree_t::differentiate_operation(FILE* ostream, node_t* node, node_t* op
         default:
             break;
     }
-    fprintf(ostream, "Differentiating \n\n");
-    print_exp_to_tex(ostream, node);
-    fprintf(ostream, "We get \n\n");
-    print_exp_to_tex(ostream, op_node);
+    if (ostream != nullptr) {
+        fprintf(ostream, "Differentiating \n\n");
+        print_exp_to_tex(ostream, node);
+        fprintf(ostream, "We get \n\n");
+        print_exp_to_tex(ostream, op_node);
+    }
+}
+
+node_t* exp_tree_t::differentiate_as(FILE* ostream, node_t* node, op_t op, size_t var_id) {
+    node_t op_node = *node;
+    op_node.value = op;
+    op_node.hash = node_hash_r(&op_node);
+
+    return differentiate(ostream, &op_node, var_id);
 }
 
-bool exp_tree_t::is_var_present_r(node_t* node) {
+uint64_t exp_tree_t::var_bit(size_t var_id) {
+    return (uint64_t) 1 << (var_id % VAR_MASK_BITS);
+}
+
+bool exp_tree_t::depends_on(node_t* node, size_t var_id) {
     if (node == nullptr) return false;
 
-    if (node->type == VAR) {
-        return true;
-    }
+    return (node->var_mask & var_bit(var_id)) != 0;
+}
+
+uint64_t exp_tree_t::update_var_mask_r(node_t* node) {
+    if (node == nullptr) return 0;
 
-    return (is_var_present_r(node->left) || is_var_present_r(node->right));
+    uint64_t mask = (node->type == VAR) ? var_bit((size_t) node->value) : 0;
+    mask |= update_var_mask_r(node->left);
+    mask |= update_var_mask_r(node->right);
+
+    node->var_mask = mask;
+    return mask;
 }
 
 //===================================COPY================================================
@@ -876,11 +1108,13 @@ node_t* exp_tree_t::copy_subtree(node_t* node) {
     if (node == nullptr) {
         return nullptr;
     }
+    stats_.copy_subtree_calls++;
 
     node_t* _new_node = new_node(node->type, node->value, nullptr, nullptr, nullptr, ROOT);
     if (_new_node == nullptr) {
         return nullptr;
     }
+    _new_node->var_mask = node->var_mask;
 
     _new_node->left = copy_subtree(node->left);
     if (_new_node->left != nullptr) {
@@ -891,6 +1125,13 @@ node_t* exp_tree_t::copy_subtree(node_t* node) {
     if (_new_node->right != nullptr) {
         _new_node->right->parent = _new_node;
     }
+
+    // A copy is whole or nullptr.
+    if ((node->left != nullptr && _new_node->left == nullptr) ||
+        (node->right != nullptr && _new_node->right == nullptr)) {
+        delete_subtree_r(_new_node);
+        return nullptr;
+    }
     return _new_node;
 }
 
@@ -900,17 +1141,24 @@ node_t* exp_tree_t::optimize(node_t* node) {
     if (node == nullptr) {
         return nullptr;
     }
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_OPTIMIZE);
 
     bool change_flag = true;
-    bool basic_op_flag = false;
+    bool rewrite_flag = false;
 
     while (change_flag == true) {
+        stats_.optimizer_passes++;
         change_flag = false;
-        basic_op_flag = false;
+        rewrite_flag = false;
         change_flag |= calculations_optimization_r(node);
-        node = basic_operations_optimization_r(node, ROOT, &basic_op_flag);
-        change_flag |= basic_op_flag;
+        node = rewrite_r(node, &rewrite_flag);
+        change_flag |= rewrite_flag;
+    }
+    if (node != nullptr) {
+        node->parent = nullptr;
     }
+    stats_.nodes_optimized = count_nodes_r(node);
     return node;
 }
 
@@ -941,8 +1189,8 @@ bool exp_tree_t::calculations_optimization_r(node_t* node) {
 
         node->value = calculate_value(node->value, node->left, node->right);
 
-        free(node->left);
-        free(node->right);
+        free_node(node->left);
+        free_node(node->right);
 
         node->left = nullptr;
         node->right = nullptr;
@@ -952,202 +1200,7 @@ bool exp_tree_t::calculations_optimization_r(node_t* node) {
     return change_flag;
 }
 
-node_t* exp_tree_t::basic_operations_optimization_r(node_t* node, rel_t rel, bool* flag) {
-    if (node == nullptr) {
-        return nullptr;
-    }
-
-    if (node->left != nullptr) {
-        basic_operations_optimization_r(node->left, LEFT, flag);
-    }
-
-    if (node->right != nullptr) {
-        basic_operations_optimization_r(node->right, RIGHT, flag);
-    }
-
-    if (node->type == OP && node->left != nullptr && node->right != nullptr &&
-       (node->left->type == NUM || node->right->type == NUM)) {
-        if (node->left->type == NUM) {
-            if ((int) node->left->value == 0) {
-                node = null_val__optimization(node, LEFT, rel, flag);
-            }
-            else if ((int) node->left->value == 1) {
-                node = one_val_optimization(node, LEFT, rel, flag);
-            }
-        }
-        else if (node->right->type == NUM) {
-            if ((int) node->right->value == 0) {
-                node = null_val__optimization(node, RIGHT, rel, flag);
-            }
-            else if ((int) node->right->value == 1) {
-                node = one_val_optimization(node, RIGHT, rel, flag);
-            }
-        }
-    }
-    return node;
-}
-
-node_t* exp_tree_t::null_val__optimization(node_t* node, rel_t rel, rel_t parent_rel, bool* flag) {
-    if (node == nullptr) {
-        return nullptr;
-    }
-
-    switch ((int) node->value) {
-        case ADD:
-        case SUB:
-            if (parent_rel == RIGHT) {
-                *flag = true;
-                if (rel == LEFT) {
-                    node->parent->right = node->right;
-                    free(node->left);
-                    free(node);
-                }
-                else if (rel == RIGHT) {
-                    node->parent->right = node->left;
-                    free(node->right);
-                    free(node);
-                }
-            }
-            else if (parent_rel == LEFT) {
-                *flag = true;
-                if (rel == LEFT) {
-                    node->parent->left = node->right;
-                    free(node->left);
-                    free(node);
-                }
-                else if (rel == RIGHT) {
-                    node->parent->left = node->left;
-                    free(node->right);
-                    free(node);
-                }
-            }
-            else if (parent_rel == ROOT) {
-                *flag = true;
-                if (rel == LEFT) {
-                    node_t* new_root = node->right;
-                    free(node->left);
-                    free(node);
-                    new_root->parent = nullptr;
-                    return new_root;
-                }
-                else if (rel == RIGHT) {
-                    node_t* new_root = node->left;
-                    free(node->right);
-                    free(node);
-                    new_root->parent = nullptr;
-                    return new_root;
-                }
-            }
-            break;
-        case DIV:
-            if (rel == RIGHT) {
-                LOG(ERROR, "Division by zero err\n");
-                return nullptr;
-            }
-
-            [[fallthrough]];
-        case MUL:
-            *flag = true;
-            delete_subtree_r(node->right);
-            delete_subtree_r(node->left);
-
-            node->right = nullptr;
-            node->left = nullptr;
-
-            node->type = NUM;
-            node->value = 0;
-            break;
-        default:
-            break;
-    }
-    return node;
-}
-
-node_t* exp_tree_t::one_val_optimization(node_t* node, rel_t rel, rel_t parent_rel, bool* flag) {
-    if (node == nullptr) {
-        return nullptr;
-    }
-
-    switch ((int) node->value) {
-        case MUL:
-            *flag = true;
-            if (parent_rel == LEFT) {
-                if (rel == LEFT) {
-                    node->parent->left = node->right;
-                    free(node->left);
-                    free(node);
-                }
-                else if (rel == RIGHT) {
-                    node->parent->left = node->left;
-                    free(node->right);
-                    free(node);
-                }
-            }
-            else if (parent_rel == RIGHT) {
-                if (rel == LEFT) {
-                    node->parent->right = node->right;
-                    free(node->left);
-                    free(node);
-                }
-                else if (rel == RIGHT) {
-                    node->parent->right = node->left;
-                    free(node->right);
-                    free(node);
-                }
-            }
-            else if (parent_rel == ROOT) {
-                if (rel == LEFT) {
-                    node_t* new_root = node->right;
-                    free(node->left);
-                    free(node);
-                    new_root->parent = nullptr;
-                    return new_root;
-                }
-                else if (rel == RIGHT) {
-                    node_t* new_root = node->left;
-                    free(node->right);
-                    free(node);
-                    new_root->parent = nullptr;
-                    return new_root;
-                }
-            }
-            break;
-        case DIV:
-            if (rel == LEFT) return node;
-            *flag = true;
-            if (parent_rel == LEFT) {
-                node->parent->left = node->left;
-            }
-            else if (parent_rel == RIGHT) {
-                node->parent->right = node->left;
-            }
-            else if (parent_rel == ROOT) {
-                node_t* left = node->left;
-                free(node);
-                free(node->right);
-                if (left == nullptr) return nullptr;
-                left->parent = nullptr;
-                return node->left;
-            }
-            free(node->right);
-            free(node);
-            break;
-        case POW:
-            if (rel == RIGHT) {
-                *flag = true;
-                if (parent_rel == LEFT) {
-                    node->parent->left = node->left;
-                }
-                else if (parent_rel == RIGHT) {
-                    node->parent->right = node->left;
-                }
-
-                free(node->right);
-                free(node);
-            }
-            break;
-        default:
-            break;
-    }
-    return node;
+// Relative: 0 matches only 0, a folded 5^-48 is no zero.
+bool exp_tree_t::is_num_value(node_t* node, double value) {
+    return node != nullptr && node->type == NUM && fabs(node->value - value) <= NUM_EPSILON * fabs(value);
 }
@@ -0,0 +1,289 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t DAG_INIT_CAPACITY = 1024;
+const size_t DAG_MAX_NODES = 1 << 20;
+
+const size_t DAG_LEFT_VAR  = 1000;
+const size_t DAG_RIGHT_VAR = 1001;
+
+//===================================INCREMENTAL=================================================
+// update() hash-conses every parsed expression into a DAG that lives between calls: equal
+// subtrees of all versions are the same node, and derivatives are memoized per DAG node.
+// After an edit only the nodes on the path from the changed subtree to the root are new,
+// so only they are differentiated and simplified; the rest is found in dag_memo_.
+
+node_t* exp_tree_t::update(const char* expression, size_t var_id) {
+    assert(expression != nullptr);
+
+    node_t* old_root = root_;
+    node_t* old_tokens = tokens_;
+    size_t old_tokens_array_size = tokens_array_size_;
+
+    if (init(expression) != NO_ERR || root_ == nullptr) {
+        LOG(ERROR, "Failed to parse updated expression\n");
+        free(tokens_);
+        root_ = old_root;
+        tokens_ = old_tokens;
+        tokens_array_size_ = old_tokens_array_size;
+        return nullptr;
+    }
+
+    if (old_root != nullptr) {
+        node_t* new_tokens = tokens_;
+        size_t new_tokens_array_size = tokens_array_size_;
+        tokens_ = old_tokens;
+        tokens_array_size_ = old_tokens_array_size;
+        delete_token_tree_r(old_root);
+        free(old_tokens);
+        tokens_ = new_tokens;
+        tokens_array_size_ = new_tokens_array_size;
+    }
+
+    if (dag_.size > DAG_MAX_NODES) {
+        LOG(INFO, "DAG has %zu nodes, dropping it\n", dag_.size);
+        clear_dag();
+    }
+    if (dag_.entries == nullptr &&
+        (node_table_ctor(&dag_, DAG_INIT_CAPACITY) != NO_ERR ||
+         node_table_ctor(&dag_memo_, DAG_INIT_CAPACITY) != NO_ERR)) {
+        clear_dag();
+        return optimize(differentiate(root_, var_id));
+    }
+
+    node_t* old_dag_root = dag_root_;
+    dag_root_ = dag_intern_r(root_);
+    if (dag_root_ == nullptr) {
+        clear_dag();
+        return optimize(differentiate(root_, var_id));
+    }
+
+    size_t depth = 0;
+    node_t* changed = find_changed_subtree(old_dag_root, dag_root_, &depth);
+    if (changed == nullptr) {
+        LOG(INFO, "Expression has not changed\n");
+    }
+    else {
+        LOG(INFO, "Changed subtree at depth %zu\n", depth);
+    }
+
+    node_t* derivative = dag_derivative(dag_root_, var_id);
+    if (derivative == nullptr) {
+        clear_dag();
+        return optimize(differentiate(root_, var_id));
+    }
+
+    node_t* diff_root = dag_expand_r(derivative);
+    update_var_mask_r(diff_root);
+    return diff_root;
+}
+
+node_t* exp_tree_t::find_changed_subtree(node_t* old_root, node_t* new_root, size_t* depth) {
+    assert(depth != nullptr);
+
+    node_t* old_node = old_root;
+    node_t* new_node = new_root;
+    *depth = 0;
+
+    while (old_node != new_node) {
+        if (old_node == nullptr || new_node == nullptr || old_node->type != OP || new_node->type != OP ||
+            (int) old_node->value != (int) new_node->value) {
+            return new_node;
+        }
+
+        if (old_node->left == new_node->left) {
+            old_node = old_node->right;
+            new_node = new_node->right;
+        }
+        else if (old_node->right == new_node->right) {
+            old_node = old_node->left;
+            new_node = new_node->left;
+        }
+        else {
+            return new_node;
+        }
+        (*depth)++;
+    }
+    return nullptr;
+}
+
+void exp_tree_t::delete_token_tree_r(node_t* node) {
+    if (node == nullptr) return;
+
+    delete_token_tree_r(node->left);
+    delete_token_tree_r(node->right);
+
+    if (node < tokens_ || node >= tokens_ + tokens_array_size_) {
+        free_node(node);
+    }
+}
+
+//===================================DAG=========================================================
+// DAG nodes are node_t's whose children are already interned, so node_hash() and
+// node_equal_r() on them are O(1). parent is unused, the same node has many parents.
+
+node_t* exp_tree_t::dag_intern(type_t type, double value, node_t* left, node_t* right) {
+    node_t probe = {};
+    probe.type = type;
+    probe.value = value;
+    probe.left = left;
+    probe.right = right;
+    probe.hash = node_hash(&probe);
+
+    node_table_entry_t* entry = node_table_find(&dag_, &probe, 0);
+    if (entry != nullptr) {
+        return entry->key;
+    }
+
+    node_t* node = (node_t*) calloc(1, sizeof(node_t));
+    if (node == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return nullptr;
+    }
+    *node = probe;
+    node->var_mask = ((type == VAR) ? var_bit((size_t) value) : 0) |
+                     ((left  != nullptr) ? left->var_mask  : 0) |
+                     ((right != nullptr) ? right->var_mask : 0);
+
+    if (node_table_insert(&dag_, node, 0) == nullptr) {
+        free(node);
+        return nullptr;
+    }
+    return node;
+}
+
+node_t* exp_tree_t::dag_intern_r(node_t* node) {
+    if (node == nullptr) return nullptr;
+
+    node_t* left = dag_intern_r(node->left);
+    node_t* right = dag_intern_r(node->right);
+    if ((node->left != nullptr && left == nullptr) || (node->right != nullptr && right == nullptr)) {
+        return nullptr;
+    }
+    return dag_intern(node->type, node->value, left, right);
+}
+
+node_t* exp_tree_t::dag_num(double value) {
+    return dag_intern(NUM, value, nullptr, nullptr);
+}
+
+// Interns an operation with the same local simplifications optimize() makes, so every
+// new DAG node is simplified once, when it is created.
+node_t* exp_tree_t::dag_make(double op, node_t* left, node_t* right) {
+    if (left != nullptr && right != nullptr && left->type == NUM && right->type == NUM) {
+        return dag_num(apply_operation(op, left->value, right->value));
+    }
+
+    switch ((int) op) {
+        case ADD:
+            if (left == nullptr || is_num_value(left, 0)) return right;
+            if (is_num_value(right, 0)) return left;
+            break;
+        case SUB:
+            if (left == nullptr && right->type == NUM) return dag_num(-right->value);
+            if (is_num_value(right, 0)) return left;
+            if (is_num_value(left, 0)) return dag_make(SUB, nullptr, right);
+            break;
+        case MUL:
+            if (is_num_value(left, 0) || is_num_value(right, 0)) return dag_num(0);
+            if (is_num_value(left, 1)) return right;
+            if (is_num_value(right, 1)) return left;
+            break;
+        case DIV:
+            if (is_num_value(left, 0)) return dag_num(0);
+            if (is_num_value(right, 1)) return left;
+            break;
+        case POW:
+            if (is_num_value(right, 0)) return dag_num(1);
+            if (is_num_value(right, 1)) return left;
+            break;
+        default:
+            break;
+    }
+    return dag_intern(OP, op, left, right);
+}
+
+// d(op(L, R)) = d(op)/dL * dL + d(op)/dR * dR. The partials come from the ordinary rules
+// applied to op(DAG_LEFT_VAR, DAG_RIGHT_VAR), then the placeholders are replaced with L, R.
+node_t* exp_tree_t::dag_derivative(node_t* node, size_t var_id) {
+    assert(node != nullptr);
+
+    if (!depends_on(node, var_id)) return dag_num(0);
+    if (node->type == VAR) return dag_num(((size_t) node->value == var_id) ? 1 : 0);
+
+    node_table_entry_t* entry = node_table_find(&dag_memo_, node, var_id);
+    if (entry != nullptr) {
+        return entry->value;
+    }
+
+    node_t* operands[] = {node->left, node->right};
+    size_t placeholders[] = {DAG_LEFT_VAR, DAG_RIGHT_VAR};
+
+    node_t* local = new_node(OP, node->value,
+                             (node->left  != nullptr) ? new_node(VAR, DAG_LEFT_VAR,  nullptr, nullptr, nullptr, ROOT) : nullptr,
+                             (node->right != nullptr) ? new_node(VAR, DAG_RIGHT_VAR, nullptr, nullptr, nullptr, ROOT) : nullptr,
+                             nullptr, ROOT);
+    if (local == nullptr) return nullptr;
+    update_var_mask_r(local);
+
+    node_t* derivative = dag_num(0);
+    for (size_t i = 0; i < 2 && derivative != nullptr; i++) {
+        if (!depends_on(operands[i], var_id)) continue;
+
+        node_t* operand_derivative = dag_derivative(operands[i], var_id);
+        node_t* partial_tree = differentiate(nullptr, local, placeholders[i]);
+        node_t* partial = (partial_tree != nullptr) ? dag_substitute_r(partial_tree, node->left, node->right) : nullptr;
+        delete_subtree_r(partial_tree);
+
+        if (operand_derivative == nullptr || partial == nullptr) {
+            derivative = nullptr;
+            break;
+        }
+        derivative = dag_make(ADD, derivative, dag_make(MUL, partial, operand_derivative));
+    }
+    delete_subtree_r(local);
+
+    if (derivative == nullptr) return nullptr;
+
+    entry = node_table_insert(&dag_memo_, node, var_id);
+    if (entry != nullptr) {
+        entry->value = derivative;
+    }
+    return derivative;
+}
+
+node_t* exp_tree_t::dag_substitute_r(node_t* node, node_t* left, node_t* right) {
+    if (node == nullptr) return nullptr;
+
+    if (node->type == VAR) {
+        return ((size_t) node->value == DAG_LEFT_VAR) ? left : right;
+    }
+    if (node->type == NUM) {
+        return dag_num(node->value);
+    }
+
+    node_t* new_left = dag_substitute_r(node->left, left, right);
+    node_t* new_right = dag_substitute_r(node->right, left, right);
+    if ((node->left != nullptr && new_left == nullptr) || (node->right != nullptr && new_right == nullptr)) {
+        return nullptr;
+    }
+    return dag_make(node->value, new_left, new_right);
+}
+
+node_t* exp_tree_t::dag_expand_r(node_t* node) {
+    if (node == nullptr) return nullptr;
+
+    return new_node(node->type, node->value, dag_expand_r(node->left), dag_expand_r(node->right), nullptr, ROOT);
+}
+
+void exp_tree_t::clear_dag() {
+    for (size_t i = 0; i < dag_.capacity; i++) {
+        free(dag_.entries[i].key);
+    }
+    node_table_dtor(&dag_);
+    node_table_dtor(&dag_memo_);
+    dag_root_ = nullptr;
+}
@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const size_t MAX_INSTR_BYTES = 128;
+const size_t FRAME_BYTES = 32;
+const size_t NO_SLOT = (size_t) -1;
+
+typedef double (*jit_unary_t)(double);
+typedef double (*jit_binary_t)(double, double);
+
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} code_buf_t;
+
+static double jit_arcctg(double x);
+static double jit_arccth(double x);
+static double jit_log(double base, double x);
+static void* jit_callee(double op);
+
+static void emit_bytes(code_buf_t* buf, const unsigned char* bytes, size_t size);
+static void emit_byte(code_buf_t* buf, unsigned char byte);
+static void emit_u32(code_buf_t* buf, uint32_t value);
+static void emit_load(code_buf_t* buf, size_t xmm, bool from_vars, size_t index);
+static void emit_store(code_buf_t* buf, size_t slot);
+static void emit_call(code_buf_t* buf, void* callee);
+static void emit_one(code_buf_t* buf);
+static void emit_reciprocal(code_buf_t* buf);
+static bool emit_power(code_buf_t* buf, double exponent);
+static bool emit_instr(code_buf_t* buf, const program_t* program, const bool* constant, instr_t* instr, size_t* cached);
+
+//===================================JIT=========================================================
+// The bytecode of compile() is translated into straight-line SSE2 code: every instruction
+// loads its operands from the slots, computes into xmm0 and stores the result back, the
+// last stored value stays in xmm0 for the next instruction. Functions are calls to libm,
+// except for powers with a constant exponent that fast_pow() specializes, which are inlined.
+// Without an x86-64 Unix target or an executable page jit_execute() falls back to execute().
+//
+// Generated function: double f(const double* vars /* rdi */, double* slots /* rsi */),
+// vars are kept in r12 and slots in rbx.
+
+err_t exp_tree_t::jit_compile(node_t* root, jit_t* jit) {
+    assert(root != nullptr);
+    assert(jit != nullptr);
+
+    err_t error = compile(root, &jit->program);
+    if (error != NO_ERR) {
+        return error;
+    }
+    jit->func = nullptr;
+
+#ifdef JIT_X86_64
+    if (jit->program.slots_amount > INT32_MAX / sizeof(double)) {
+        LOG(INFO, "Too many slots for the JIT, using the interpreter\n");
+        return NO_ERR;
+    }
+
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t capacity = (jit->program.size + 1) * MAX_INSTR_BYTES + FRAME_BYTES;
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+
+    void* page = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        LOG(ERROR, "Failed to map a JIT page, using the interpreter\n" STRERROR(errno));
+        return NO_ERR;
+    }
+
+    bool* constant = (bool*) calloc(jit->program.slots_amount, sizeof(bool));
+    if (constant == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        munmap(page, capacity);
+        return NO_ERR;
+    }
+    for (size_t i = 0; i < jit->program.slots_amount; i++) {
+        constant[i] = true;
+    }
+    for (size_t i = 0; i < jit->program.size; i++) {
+        constant[jit->program.code[i].dst] = false;
+    }
+
+    code_buf_t buf = {(unsigned char*) page, 0, capacity};
+
+    // push rbx; push r12; sub rsp, 8; mov rbx, rsi; mov r12, rdi
+    static const unsigned char prologue[] = {0x53, 0x41, 0x54, 0x48, 0x83, 0xec, 0x08, 0x48, 0x89, 0xf3, 0x49, 0x89, 0xfc};
+    // add rsp, 8; pop r12; pop rbx; ret
+    static const unsigned char epilogue[] = {0x48, 0x83, 0xc4, 0x08, 0x41, 0x5c, 0x5b, 0xc3};
+
+    emit_bytes(&buf, prologue, sizeof(prologue));
+
+    size_t cached = NO_SLOT;
+    for (size_t i = 0; i < jit->program.size; i++) {
+        if (!emit_instr(&buf, &jit->program, constant, &jit->program.code[i], &cached)) {
+            free(constant);
+            munmap(page, capacity);
+            return NO_ERR;
+        }
+    }
+    free(constant);
+    if (cached != jit->program.result) {
+        emit_load(&buf, 0, false, jit->program.result);
+    }
+    emit_bytes(&buf, epilogue, sizeof(epilogue));
+
+    if (mprotect(page, capacity, PROT_READ | PROT_EXEC) != 0) {
+        LOG(ERROR, "Failed to make the JIT page executable, using the interpreter\n" STRERROR(errno));
+        munmap(page, capacity);
+        return NO_ERR;
+    }
+
+    jit->code = (unsigned char*) page;
+    jit->code_capacity = capacity;
+    jit->code_size = buf.size;
+    jit->func = (jit_func_t) page;
+    LOG(DEBUG, "JIT emitted %zu bytes for %zu instructions\n", jit->code_size, jit->program.size);
+#else
+    LOG(INFO, "No JIT for this target, using the interpreter\n");
+#endif
+    return NO_ERR;
+}
+
+double exp_tree_t::jit_execute(jit_t* jit, const double* vars) {
+    assert(jit != nullptr);
+    assert(vars != nullptr);
+
+    if (jit->func == nullptr) {
+        return execute(&jit->program, vars);
+    }
+    return jit->func(vars, jit->program.slots);
+}
+
+void jit_dtor(jit_t* jit) {
+    assert(jit != nullptr);
+
+#ifdef JIT_X86_64
+    if (jit->code != nullptr) {
+        munmap(jit->code, jit->code_capacity);
+    }
+#endif
+    jit->code = nullptr;
+    jit->code_capacity = 0;
+    jit->code_size = 0;
+    jit->func = nullptr;
+    program_dtor(&jit->program);
+}
+
+//===================================CODEGEN=====================================================
+// Fixed encodings are static arrays, the bytes that depend on operands go one by one:
+// -fstack-protector does not cover local arrays this short and -Wstack-protector says so.
+
+// *cached is the slot whose value is in xmm0. Returns false on an unknown operation.
+static bool emit_instr(code_buf_t* buf, const program_t* program, const bool* constant, instr_t* instr, size_t* cached) {
+    assert(buf->size + MAX_INSTR_BYTES <= buf->capacity);
+
+    if (instr->type == VAR) {
+        emit_load(buf, 0, true, (size_t) instr->value);
+        emit_store(buf, instr->dst);
+        *cached = instr->dst;
+        return true;
+    }
+
+    int op = (int) instr->value;
+    void* callee = nullptr;
+    unsigned char opcode = 0;
+    switch (op) {
+        case ADD:
+            opcode = 0x58;
+            break;
+        case SUB:
+            opcode = 0x5c;
+            break;
+        case MUL:
+            opcode = 0x59;
+            break;
+        case DIV:
+            opcode = 0x5e;
+            break;
+        default:
+            callee = jit_callee(instr->value);
+            if (callee == nullptr) {
+                LOG(ERROR, "Undefined operation %d, using the interpreter\n", op);
+                return false;
+            }
+            break;
+    }
+
+    if (exp_tree_t::is_function(instr->value) && op != LOG) {
+        if (*cached != instr->rhs) {
+            emit_load(buf, 0, false, instr->rhs);
+        }
+        emit_call(buf, callee);
+        if (op == CTG || op == CTH) {
+            emit_reciprocal(buf);
+        }
+        emit_store(buf, instr->dst);
+        *cached = instr->dst;
+        return true;
+    }
+
+    if (op == POW && constant[instr->rhs]) {
+        if (*cached == instr->lhs) {
+            // movsd xmm1, xmm0
+            static const unsigned char move[] = {0xf2, 0x0f, 0x10, 0xc8};
+            emit_bytes(buf, move, sizeof(move));
+        }
+        else {
+            emit_load(buf, 1, false, instr->lhs);
+        }
+        if (emit_power(buf, program->slots[instr->rhs])) {
+            emit_store(buf, instr->dst);
+            *cached = instr->dst;
+            return true;
+        }
+        *cached = NO_SLOT;
+    }
+
+    if (*cached == instr->rhs) {
+        // movsd xmm1, xmm0
+        static const unsigned char move[] = {0xf2, 0x0f, 0x10, 0xc8};
+        emit_bytes(buf, move, sizeof(move));
+    }
+    else {
+        emit_load(buf, 1, false, instr->rhs);
+    }
+    if (*cached != instr->lhs) {
+        emit_load(buf, 0, false, instr->lhs);
+    }
+
+    if (callee != nullptr) {
+        emit_call(buf, callee);
+    }
+    else {
+        // addsd/subsd/mulsd/divsd xmm0, xmm1
+        static const unsigned char prefix[] = {0xf2, 0x0f};
+        emit_bytes(buf, prefix, sizeof(prefix));
+        emit_byte(buf, opcode);
+        emit_byte(buf, 0xc1);
+    }
+    emit_store(buf, instr->dst);
+    *cached = instr->dst;
+    return true;
+}
+
+// xmm0 = xmm1 ^ exponent, in the same order of operations as fast_pow(). Returns false
+// for exponents fast_pow() passes on to pow().
+static bool emit_power(code_buf_t* buf, double exponent) {
+    double integral = round(exponent);
+    if (!(fabs(exponent - integral) < NUM_EPSILON) || fabs(integral) > MAX_INT_POWER) {
+        if (fabs(fabs(exponent) - 0.5) >= NUM_EPSILON) {
+            return false;
+        }
+        // sqrtsd xmm0, xmm1
+        static const unsigned char root[] = {0xf2, 0x0f, 0x51, 0xc1};
+        emit_bytes(buf, root, sizeof(root));
+        if (exponent < 0) {
+            emit_reciprocal(buf);
+        }
+        return true;
+    }
+
+    size_t power = (size_t) fabs(integral);
+    if (power == 0) {
+        emit_one(buf);
+        return true;
+    }
+
+    // movsd xmm0, xmm1
+    static const unsigned char move[] = {0xf2, 0x0f, 0x10, 0xc1};
+    // mulsd xmm0, xmm0
+    static const unsigned char square[] = {0xf2, 0x0f, 0x59, 0xc0};
+    // mulsd xmm0, xmm1
+    static const unsigned char multiply[] = {0xf2, 0x0f, 0x59, 0xc1};
+
+    size_t bit = 1;
+    while (bit * 2 <= power) bit *= 2;
+
+    emit_bytes(buf, move, sizeof(move));
+    for (bit /= 2; bit > 0; bit /= 2) {
+        emit_bytes(buf, square, sizeof(square));
+        if (power & bit) emit_bytes(buf, multiply, sizeof(multiply));
+    }
+    if (integral < 0) {
+        emit_reciprocal(buf);
+    }
+    return true;
+}
+
+// xmm0 = 1 / xmm0
+static void emit_reciprocal(code_buf_t* buf) {
+    // movsd xmm1, xmm0
+    static const unsigned char move[] = {0xf2, 0x0f, 0x10, 0xc8};
+    emit_bytes(buf, move, sizeof(move));
+    emit_one(buf);
+    // divsd xmm0, xmm1
+    static const unsigned char divide[] = {0xf2, 0x0f, 0x5e, 0xc1};
+    emit_bytes(buf, divide, sizeof(divide));
+}
+
+// mov rax, 1.0; movq xmm0, rax
+static void emit_one(code_buf_t* buf) {
+    static const unsigned char mov[] = {0x48, 0xb8};
+    emit_bytes(buf, mov, sizeof(mov));
+
+    double one = 1;
+    emit_bytes(buf, (const unsigned char*) &one, sizeof(one));
+
+    static const unsigned char movq[] = {0x66, 0x48, 0x0f, 0x6e, 0xc0};
+    emit_bytes(buf, movq, sizeof(movq));
+}
+
+// movsd xmm<xmm>, [rbx + index * 8] or [r12 + index * 8]
+static void emit_load(code_buf_t* buf, size_t xmm, bool from_vars, size_t index) {
+    unsigned char reg = (unsigned char) (xmm << 3);
+
+    if (from_vars) {
+        static const unsigned char load[] = {0xf2, 0x41, 0x0f, 0x10};
+        emit_bytes(buf, load, sizeof(load));
+        emit_byte(buf, (unsigned char) (0x84 | reg));
+        emit_byte(buf, 0x24);
+    }
+    else {
+        static const unsigned char load[] = {0xf2, 0x0f, 0x10};
+        emit_bytes(buf, load, sizeof(load));
+        emit_byte(buf, (unsigned char) (0x83 | reg));
+    }
+    emit_u32(buf, (uint32_t) (index * sizeof(double)));
+}
+
+// movsd [rbx + slot * 8], xmm0
+static void emit_store(code_buf_t* buf, size_t slot) {
+    static const unsigned char store[] = {0xf2, 0x0f, 0x11, 0x83};
+    emit_bytes(buf, store, sizeof(store));
+    emit_u32(buf, (uint32_t) (slot * sizeof(double)));
+}
+
+// mov rax, callee; call rax
+static void emit_call(code_buf_t* buf, void* callee) {
+    static const unsigned char mov[] = {0x48, 0xb8};
+    emit_bytes(buf, mov, sizeof(mov));
+
+    uint64_t address = (uint64_t) (uintptr_t) callee;
+    emit_bytes(buf, (const unsigned char*) &address, sizeof(address));
+
+    static const unsigned char call[] = {0xff, 0xd0};
+    emit_bytes(buf, call, sizeof(call));
+}
+
+static void emit_byte(code_buf_t* buf, unsigned char byte) {
+    emit_bytes(buf, &byte, sizeof(byte));
+}
+
+static void emit_u32(code_buf_t* buf, uint32_t value) {
+    emit_bytes(buf, (const unsigned char*) &value, sizeof(value));
+}
+
+static void emit_bytes(code_buf_t* buf, const unsigned char* bytes, size_t size) {
+    assert(buf->size + size <= buf->capacity);
+
+    memcpy(buf->data + buf->size, bytes, size);
+    buf->size += size;
+}
+
+//===================================CALLEES=====================================================
+// Same formulas as apply_operation(), CTG and CTH are tan and tanh followed by a reciprocal.
+
+static void* jit_callee(double op) {
+    switch ((int) op) {
+        case POW:    return (void*) (jit_binary_t) fast_pow;
+        case LOG:    return (void*) (jit_binary_t) jit_log;
+        case LN:     return (void*) (jit_unary_t) log;
+        case EXP:    return (void*) (jit_unary_t) exp;
+        case SIN:    return (void*) (jit_unary_t) sin;
+        case COS:    return (void*) (jit_unary_t) cos;
+        case TG:     return (void*) (jit_unary_t) tan;
+        case CTG:    return (void*) (jit_unary_t) tan;
+        case SH:     return (void*) (jit_unary_t) sinh;
+        case CH:     return (void*) (jit_unary_t) cosh;
+        case TH:     return (void*) (jit_unary_t) tanh;
+        case CTH:    return (void*) (jit_unary_t) tanh;
+        case ARCSIN: return (void*) (jit_unary_t) asin;
+        case ARCCOS: return (void*) (jit_unary_t) acos;
+        case ARCTG:  return (void*) (jit_unary_t) atan;
+        case ARCCTG: return (void*) (jit_unary_t) jit_arcctg;
+        case ARCSH:  return (void*) (jit_unary_t) asinh;
+        case ARCCH:  return (void*) (jit_unary_t) acosh;
+        case ARCTH:  return (void*) (jit_unary_t) atanh;
+        case ARCCTH: return (void*) (jit_unary_t) jit_arccth;
+        default:     return nullptr;
+    }
+}
+
+static double jit_arcctg(double x) {
+    return M_PI / 2 - atan(x);
+}
+
+static double jit_arccth(double x) {
+    return atanh(1 / x);
+}
+
+static double jit_log(double base, double x) {
+    return log(x) / log(base);
+}
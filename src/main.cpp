@@ -1,94 +1,314 @@
 #include <cstdlib>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 #include "expression_tree.h"
 #include "logger.h"
+#include "trace.h"
 
 const char* del_images = "./del_images.sh";
+const char* chrome_trace_suffix = ".json";
 
-int main() {
-    FILE* logger = fopen("data/logger.txt", "w");
+typedef enum {
+    FORMAT_TEXT = 0,
+    FORMAT_TEX  = 1,
+    FORMAT_JSON = 2,
+} format_t;
+
+typedef struct {
+    const char* var;
+    format_t format;
+    bool optimize;
+    FILE* dump;
+    FILE* report;
+    FILE* stats;
+    size_t reported;
+    size_t failed;
+} options_t;
+
+static bool process_stream(FILE* istream, const char* source, options_t* options);
+static bool process_expression(const char* expression, const char* source, size_t line, options_t* options);
+static void print_result(exp_tree_t* tree, node_t* derivative, const char* error, const char* expression,
+                         const char* source, size_t line, options_t* options);
+static bool parse_format(const char* name, format_t* format);
+static FILE* open_output(const char* path, const char* mode);
+static bool close_output(FILE* ostream, const char* path);
+
+//===================================DRIVER======================================================
+// diff [-x var] [-f text|tex|json] [-r] [-l log] [-d dump.html] [-w report.tex] [-s stats.jsonl]
+//      [-t trace.bin] [file...]
+// Reads one expression a line from the files, or from stdin if there are none or for "-",
+// and writes its derivative by var a line to stdout; a trailing '$' is optional, blank and
+// '#' lines are skipped. Nothing else is written unless asked: -l logs, -d dumps the trees
+// with their images, -w writes the step-by-step derivation, -s the stats of every
+// expression as a JSON line with its file and line, -t a trace along with its Chrome export
+// where every span carries the line of its expression. -r leaves the derivative as
+// differentiate() returns it. The exit code is 1 if an expression failed, 2 on bad usage.
+
+int main(int argc, char** argv) {
+    options_t options = {"x", FORMAT_TEXT, true, nullptr, nullptr, nullptr, 0, 0};
+    const char* log_path = nullptr;
+    const char* dump_path = nullptr;
+    const char* report_path = nullptr;
+    const char* stats_path = nullptr;
+    const char* trace_path = nullptr;
+
+    int option = 0;
+    while ((option = getopt(argc, argv, "x:f:rl:d:w:s:t:")) != -1) {
+        switch (option) {
+            case 'x': options.var = optarg;     break;
+            case 'r': options.optimize = false; break;
+            case 'l': log_path = optarg;        break;
+            case 'd': dump_path = optarg;       break;
+            case 'w': report_path = optarg;     break;
+            case 's': stats_path = optarg;      break;
+            case 't': trace_path = optarg;      break;
+            case 'f':
+                if (parse_format(optarg, &options.format)) break;
+                [[fallthrough]];
+            default:
+                fprintf(stderr, "usage: %s [-x var] [-f text|tex|json] [-r] [-l log] [-d dump.html] [-w report.tex] "
+                                "[-s stats.jsonl] [-t trace.bin] [file...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    FILE* logger = (log_path != nullptr) ? open_output(log_path, "w") : stderr;
     if (logger == nullptr) {
-        LOG(ERROR, "Failed to open a logger ostream\n");
         return 1;
     }
-
     LoggerSetFile(logger);
-    LoggerSetLevel(INFO);
+    LoggerSetLevel((log_path != nullptr) ? INFO : SILENT);
+    if (log_path != nullptr) {
+        LoggerStartAsync(0, LOG_BLOCK);
+    }
 
-    int system_execution_status = system(del_images);
-    if (system_execution_status == -1 || system_execution_status == 127) {
-        LOG(ERROR, "Failed to execute bash script %s\n", del_images);
+    bool ok = true;
+    if (dump_path != nullptr) {
+        int system_execution_status = system(del_images);
+        if (system_execution_status == -1 || system_execution_status == 127) {
+            LOG(ERROR, "Failed to execute bash script %s\n", del_images);
+        }
+        ok = (options.dump = open_output(dump_path, "wb")) != nullptr;
+    }
+    if (ok && report_path != nullptr) {
+        ok = (options.report = open_output(report_path, "w")) != nullptr;
+    }
+    if (ok && stats_path != nullptr) {
+        ok = (options.stats = open_output(stats_path, "w")) != nullptr;
+    }
+    if (ok && trace_path != nullptr) {
+        trace_start();
     }
 
-    FILE* file = fopen("data/dump.html", "wb");
-    if (file == nullptr) {
-        LOG(ERROR, "Failed to open a dump ostream\n");
-        return 1;
+    if (ok && optind == argc) {
+        ok = process_stream(stdin, "-", &options);
     }
+    for (int i = optind; ok && i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            ok = process_stream(stdin, "-", &options);
+            continue;
+        }
 
-    FILE* istream = fopen("data/input/data.txt", "r");
-    if (istream == nullptr) {
-        LOG(ERROR, "Failed to open an input data file\n");
-        return 1;
+        FILE* istream = fopen(argv[i], "r");
+        if (istream == nullptr) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            ok = false;
+            break;
+        }
+        ok = process_stream(istream, argv[i], &options);
+        fclose(istream);
     }
 
-    FILE* tex = fopen("data/output/exp.tex", "w");
-    if (tex == nullptr) {
-        LOG(ERROR, "Failed to open a tex file\n");
-        return 1;
+    if (trace_path != nullptr) {
+        trace_stop();
+
+        char chrome_trace_path[FILENAME_MAX] = "";
+        snprintf(chrome_trace_path, sizeof(chrome_trace_path), "%s%s", trace_path, chrome_trace_suffix);
+        FILE* chrome_trace = nullptr;
+        if (trace_write(trace_path) && (chrome_trace = open_output(chrome_trace_path, "w")) != nullptr) {
+            trace_export_chrome(trace_path, chrome_trace);
+            ok = close_output(chrome_trace, chrome_trace_path) && ok;
+        }
+    }
+
+    if (options.report != nullptr && options.reported != 0) {
+        fprintf(options.report, "\n\\end{document}\n");
+    }
+    ok = close_output(options.report, report_path) && ok;
+    ok = close_output(options.stats, stats_path) && ok;
+    ok = close_output(options.dump, dump_path) && ok;
+
+    if (fflush(stdout) == EOF) {
+        fprintf(stderr, "Failed to write stdout: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    if (log_path != nullptr) {
+        LoggerStopAsync();
+        ok = close_output(logger, log_path) && ok;
     }
+    return (ok && options.failed == 0) ? 0 : 1;
+}
+
+static bool process_stream(FILE* istream, const char* source, options_t* options) {
+    char* line = nullptr;
+    size_t capacity = 0;
+    ssize_t len = 0;
+
+    for (size_t line_number = 1; (len = getline(&line, &capacity, istream)) != -1; line_number++) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        const char* expression = line + strspn(line, " \t");
+        if (*expression == '\0' || *expression == '#') continue;
+
+        if (!process_expression(expression, source, line_number, options)) {
+            options->failed++;
+        }
+    }
+
+    bool ok = ferror(istream) == 0;
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", source, strerror(errno));
+    }
+    free(line);
+    return ok;
+}
+
+// A fresh tree for every expression: variable names and memos do not leak from one line
+// into the next, and a tree costs a calloc of its tokens.
+static bool process_expression(const char* expression, const char* source, size_t line, options_t* options) {
+    trace_set_expression(line);
+
     exp_tree_t tree = {};
+    if (options->dump != nullptr) {
+        tree.set_dump_ostream(options->dump);
+    }
+
+    if (tree.init(expression) != NO_ERR || tree.root() == nullptr) {
+        fprintf(stderr, "%s:%zu: syntax error in %s\n", source, line, expression);
+        print_result(&tree, nullptr, "syntax error", expression, source, line, options);
+        tree.dtor();
+        return false;
+    }
+
+    if (options->report != nullptr) {
+        tree.print_tree_to_tex(options->report, tree.root());
+        options->reported++;
+    }
+    if (options->dump != nullptr) {
+        tree.dump_tree();
+    }
+
+    // A variable the expression does not have gives a zero derivative.
+    node_t zero = {};
+    zero.type = NUM;
+
+    size_t var_id = 0;
+    node_t* derivative = &zero;
+    if (tree.find_var(options->var, &var_id)) {
+        derivative = (options->report != nullptr) ? tree.differentiate_expression(options->report, var_id)
+                                                   : tree.differentiate(tree.root(), var_id);
+        if (derivative != nullptr && options->optimize) {
+            derivative = tree.optimize(derivative);
+        }
+    }
+
+    if (derivative == nullptr) {
+        fprintf(stderr, "%s:%zu: failed to differentiate %s\n", source, line, expression);
+        print_result(&tree, nullptr, "failed to differentiate", expression, source, line, options);
+        tree.dtor();
+        return false;
+    }
 
-    tree.set_dump_ostream(file);
-    tree.init(istream);
-
-    tree.dump_tree();
-    node_t* new_root = tree.differentiate_expression(tex);
-    tree.dump(new_root);
-
-//     node_t node1 = {};
-//     node_t node2 = {};
-//     node_t node3 = {};
-//     node1.parent = nullptr;
-//     node1.right = &node2;
-//     node1.left = &node3;
-//
-//     node2.parent = &node1;
-//     node2.right = nullptr;
-//     node2.left = &node1;
-//
-//     node3.right = nullptr;
-//     node3.left = nullptr;
-//     node3.parent = &node1;
-//     tree.verify(&node1);
-
-    new_root = tree.optimize(new_root);
-    tree.print_exp_to_tex(tex, new_root);
-    tree.dump(new_root);
+    if (options->report != nullptr) {
+        tree.print_cse_to_tex(options->report, derivative);
+    }
+    if (options->dump != nullptr) {
+        tree.dump(derivative);
+    }
+    print_result(&tree, derivative, nullptr, expression, source, line, options);
+    if (options->stats != nullptr) {
+        fprintf(options->stats, "{\"file\": ");
+        print_json_string(options->stats, source);
+        fprintf(options->stats, ", \"line\": %zu, \"stats\": ", line);
+        tree.print_stats_json(options->stats);
+        fprintf(options->stats, "}\n");
+    }
 
+    if (derivative != &zero) {
+        tree.delete_tree(derivative);
+    }
     tree.dtor();
-    tree.delete_tree(new_root);
+    return true;
+}
 
-    fprintf(tex, "\n\\end{document}\n");
-    if (fclose(tex) == EOF) {
-        LOG(ERROR, "Failed to close tex file\n" STRERROR(errno));
-        return 1;
+// A failed expression is an empty line of text or TeX, so the output stays aligned with the
+// input, and an "error" member in JSON.
+static void print_result(exp_tree_t* tree, node_t* derivative, const char* error, const char* expression,
+                         const char* source, size_t line, options_t* options) {
+    switch (options->format) {
+        case FORMAT_TEXT:
+            if (derivative != nullptr) {
+                tree->print_infix(stdout, derivative);
+            }
+            fprintf(stdout, "\n");
+            break;
+        case FORMAT_TEX:
+            if (derivative != nullptr) {
+                tree->print_tex_line(stdout, derivative, options->optimize);
+            }
+            else {
+                fprintf(stdout, "\n");
+            }
+            break;
+        case FORMAT_JSON:
+            fprintf(stdout, "{\"file\": ");
+            print_json_string(stdout, source);
+            fprintf(stdout, ", \"line\": %zu, \"expression\": ", line);
+            print_json_string(stdout, expression);
+            // Variable names and numbers need no escaping.
+            if (derivative != nullptr) {
+                fprintf(stdout, ", \"derivative\": \"");
+                tree->print_infix(stdout, derivative);
+                fprintf(stdout, "\"}\n");
+            }
+            else {
+                fprintf(stdout, ", \"error\": \"%s\"}\n", error);
+            }
+            break;
+        default:
+            break;
     }
+}
 
-    if (fclose(file) == EOF) {
-        LOG(ERROR, "Failed to close html file\n" STRERROR(errno));
-        return 1;
+static bool parse_format(const char* name, format_t* format) {
+    const char* names[] = {"text", "tex", "json"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *format = (format_t) i;
+            return true;
+        }
     }
+    return false;
+}
 
-    if (fclose(istream) == EOF) {
-        LOG(ERROR, "Failed to close data file\n" STRERROR(errno));
-        return 1;
+static FILE* open_output(const char* path, const char* mode) {
+    FILE* ostream = fopen(path, mode);
+    if (ostream == nullptr) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
     }
+    return ostream;
+}
 
-    if (fclose(logger) == EOF) {
-        fprintf(stderr, "Failed to close tex file\n" STRERROR(errno));
-        return 1;
+static bool close_output(FILE* ostream, const char* path) {
+    if (ostream == nullptr) return true;
+
+    if (fclose(ostream) == EOF) {
+        fprintf(stderr, "Failed to close %s: %s\n", path, strerror(errno));
+        return false;
     }
-    return 0;
+    return true;
 }
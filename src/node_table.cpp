@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const uint64_t NULL_NODE_HASH = UINT64_C(0x51ed270b27a3f1c5);
+const size_t MIN_TABLE_CAPACITY = 16;
+
+static uint64_t mix_hash(uint64_t hash, uint64_t value);
+static uint64_t double_bits(double value);
+static size_t start_slot(uint64_t hash, size_t var_id, size_t mask);
+static err_t node_table_grow(node_table_t* table);
+
+//===================================HASH========================================================
+
+static uint64_t mix_hash(uint64_t hash, uint64_t value) {
+    hash ^= value + UINT64_C(0x9e3779b97f4a7c15) + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 31;
+    hash *= UINT64_C(0xbf58476d1ce4e5b9);
+    return hash ^ (hash >> 27);
+}
+
+static uint64_t double_bits(double value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+uint64_t node_hash(node_t* node) {
+    assert(node != nullptr);
+
+    uint64_t hash = mix_hash((uint64_t) node->type, double_bits(node->value));
+    hash = mix_hash(hash, (node->left  == nullptr) ? NULL_NODE_HASH : node->left->hash);
+    hash = mix_hash(hash, (node->right == nullptr) ? NULL_NODE_HASH : node->right->hash);
+    return hash;
+}
+
+uint64_t node_hash_r(node_t* node) {
+    if (node == nullptr) {
+        return NULL_NODE_HASH;
+    }
+
+    node_hash_r(node->left);
+    node_hash_r(node->right);
+
+    node->hash = node_hash(node);
+    return node->hash;
+}
+
+bool node_equal_r(node_t* node1, node_t* node2) {
+    if (node1 == node2) return true;
+    if (node1 == nullptr || node2 == nullptr) return false;
+
+    if (node1->type != node2->type || double_bits(node1->value) != double_bits(node2->value)) {
+        return false;
+    }
+    return node_equal_r(node1->left, node2->left) && node_equal_r(node1->right, node2->right);
+}
+
+//===================================TABLE=======================================================
+// Open addressing over structural hashes. Lookups use the hash cached in key->hash,
+// so node_hash_r() has to be run over a tree before its nodes are used as keys.
+
+static size_t start_slot(uint64_t hash, size_t var_id, size_t mask) {
+    return (size_t) mix_hash(hash, var_id) & mask;
+}
+
+err_t node_table_ctor(node_table_t* table, size_t capacity) {
+    assert(table != nullptr);
+
+    size_t real_capacity = MIN_TABLE_CAPACITY;
+    while (real_capacity < capacity * 2) {
+        real_capacity *= 2;
+    }
+
+    table->entries = (node_table_entry_t*) calloc(real_capacity, sizeof(node_table_entry_t));
+    if (table->entries == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+
+    table->capacity = real_capacity;
+    table->size = 0;
+    return NO_ERR;
+}
+
+void node_table_dtor(node_table_t* table) {
+    assert(table != nullptr);
+
+    free(table->entries);
+    table->entries = nullptr;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+node_table_entry_t* node_table_find(node_table_t* table, node_t* key, size_t var_id) {
+    assert(table != nullptr);
+    assert(key != nullptr);
+
+    if (table->entries == nullptr) {
+        return nullptr;
+    }
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = start_slot(key->hash, var_id, mask); table->entries[i].key != nullptr; i = (i + 1) & mask) {
+        node_table_entry_t* entry = &table->entries[i];
+        if (entry->hash == key->hash && entry->var_id == var_id && node_equal_r(entry->key, key)) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+node_table_entry_t* node_table_insert(node_table_t* table, node_t* key, size_t var_id) {
+    assert(table != nullptr);
+    assert(key != nullptr);
+
+    node_table_entry_t* entry = node_table_find(table, key, var_id);
+    if (entry != nullptr) {
+        return entry;
+    }
+
+    if ((table->size + 1) * 2 > table->capacity && node_table_grow(table) != NO_ERR) {
+        return nullptr;
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = start_slot(key->hash, var_id, mask);
+    while (table->entries[i].key != nullptr) {
+        i = (i + 1) & mask;
+    }
+
+    entry = &table->entries[i];
+    entry->hash = key->hash;
+    entry->key = key;
+    entry->var_id = var_id;
+    entry->value = nullptr;
+    entry->count = 0;
+    entry->index = SIZE_MAX;
+
+    table->size++;
+    return entry;
+}
+
+static err_t node_table_grow(node_table_t* table) {
+    assert(table != nullptr);
+
+    node_table_entry_t* old_entries = table->entries;
+    size_t old_capacity = table->capacity;
+
+    size_t new_capacity = (old_capacity == 0) ? MIN_TABLE_CAPACITY : old_capacity * 2;
+    table->entries = (node_table_entry_t*) calloc(new_capacity, sizeof(node_table_entry_t));
+    if (table->entries == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        table->entries = old_entries;
+        return MEM_ALLOC_ERR;
+    }
+    table->capacity = new_capacity;
+
+    size_t mask = new_capacity - 1;
+    for (size_t j = 0; j < old_capacity; j++) {
+        if (old_entries[j].key == nullptr) continue;
+
+        size_t i = start_slot(old_entries[j].hash, old_entries[j].var_id, mask);
+        while (table->entries[i].key != nullptr) {
+            i = (i + 1) & mask;
+        }
+        table->entries[i] = old_entries[j];
+    }
+
+    free(old_entries);
+    return NO_ERR;
+}
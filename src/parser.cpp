@@ -2,11 +2,13 @@
 #include <stdlib.h>
 #include "expression_tree.h"
 #include "logger.h"
+#include "trace.h"
 
+// The descent goes on to the end of the tokens, token_init() drops the tree afterwards.
 void exp_tree_t::syntax_error(size_t p, const char* func, size_t line) {
     LOG(ERROR, "Syntax error p = %zu, type = %d(val = %f) func: %s (%zu)\n",
                p, tokens_[p].type, tokens_[p].value, func, line);
-    exit(0);
+    syntax_failed_ = true;
 }
 
 node_t* exp_tree_t::get_e(size_t* p) {
@@ -62,7 +64,7 @@ node_t* exp_tree_t::get_p(size_t* p) {
 
         if (!(tokens_[*p].type == OP && (int) tokens_[*p].value == BRACKET_CLOSE)) {
             syntax_error(*p, __func__, __LINE__);
-            delete_subtree_r(val);
+            delete_token_tree_r(val);
             return nullptr;
         }
 
@@ -87,12 +89,14 @@ node_t* exp_tree_t::get_p(size_t* p) {
 }
 
 node_t* exp_tree_t::get_g() {
+    TRACE_FUNCTION();
+    phase_timer_t timer(&stats_, PHASE_PARSE);
     size_t p = 0;
     node_t* val = get_e(&p);
 
-    if (tokens_[p].type == OP && (int) tokens_[p].value != EOT) {
+    if (!(tokens_[p].type == OP && (int) tokens_[p].value == EOT)) {
         syntax_error(p, __func__, __LINE__);
-        delete_subtree_r(val);
+        delete_token_tree_r(val);
         val = nullptr;
     }
     return val;
@@ -0,0 +1,348 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const int POLY_MAX_DEGREE = 64;
+const int POLY_MAX_EXPANDED_DEGREE = 8;
+const size_t POLY_DIFF_INIT_CAPACITY = 16;
+
+static bool is_poly_exponent(node_t* node);
+static int node_degree(node_t* node, size_t var_id, int left, int right);
+static int polynomial_degree_r(node_t* node, size_t var_id);
+static err_t polynomial_r(node_t* node, size_t var_id, poly_t* poly);
+static err_t poly_mul(const poly_t* poly1, const poly_t* poly2, poly_t* product);
+
+//===================================POLYNOMIALS=================================================
+// A subtree is a polynomial in var_id when it is built from numbers, var_id, +, -, *,
+// division by a nonzero number and ^ with a natural exponent. Such subtrees are kept as
+// dense coefficient vectors: the derivative is a shift of the coefficients and the value
+// is found with Horner's scheme.
+
+err_t poly_ctor(poly_t* poly, size_t degree) {
+    assert(poly != nullptr);
+
+    poly->coefs = (double*) calloc(degree + 1, sizeof(double));
+    if (poly->coefs == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+    poly->degree = degree;
+    return NO_ERR;
+}
+
+void poly_dtor(poly_t* poly) {
+    assert(poly != nullptr);
+
+    free(poly->coefs);
+    poly->coefs = nullptr;
+    poly->degree = 0;
+}
+
+err_t poly_derivative(const poly_t* poly, poly_t* derivative) {
+    assert(poly != nullptr);
+    assert(derivative != nullptr);
+
+    err_t error = poly_ctor(derivative, (poly->degree > 0) ? poly->degree - 1 : 0);
+    if (error != NO_ERR) {
+        return error;
+    }
+
+    for (size_t i = 1; i <= poly->degree; i++) {
+        derivative->coefs[i - 1] = (double) i * poly->coefs[i];
+    }
+    return NO_ERR;
+}
+
+double poly_evaluate(const poly_t* poly, double x) {
+    assert(poly != nullptr);
+
+    double value = poly->coefs[poly->degree];
+    for (size_t i = poly->degree; i > 0; i--) {
+        value = value * x + poly->coefs[i - 1];
+    }
+    return value;
+}
+
+bool exp_tree_t::to_polynomial(node_t* node, size_t var_id, poly_t* poly) {
+    assert(node != nullptr);
+    assert(poly != nullptr);
+
+    if (polynomial_degree_r(node, var_id) < 0) {
+        return false;
+    }
+    return polynomial_r(node, var_id, poly) == NO_ERR;
+}
+
+// The tree is Horner's scheme, ((c_n*x + c_{n-1})*x + ...)*x + c_0, with every run of zero
+// coefficients folded into a power of x, so it is evaluated like poly_evaluate(). nullptr
+// if a node could not be allocated.
+node_t* exp_tree_t::polynomial_tree(const poly_t* poly, size_t var_id) {
+    assert(poly != nullptr);
+
+    size_t top = poly->degree;
+    while (top > 0 && !(fabs(poly->coefs[top]) > 0)) top--;
+
+    // A leading coefficient of +-1 is not multiplied, nullptr stands for it until x comes.
+    double lead = poly->coefs[top];
+    bool unit = top > 0 && fabs(fabs(lead) - 1) < NUM_EPSILON;
+    node_t* result = nullptr;
+    if (!unit && (result = new_node(NUM, lead, nullptr, nullptr, nullptr, ROOT)) == nullptr) {
+        return nullptr;
+    }
+
+    size_t power = top;
+    for (size_t i = top; i-- > 0;) {
+        double coef = poly->coefs[i];
+        if (!(fabs(coef) > 0) && i > 0) continue;
+
+        node_t* shift = poly_power(var_id, power - i);
+        if (result != nullptr) {
+            result = poly_op(MUL, result, shift);
+        }
+        else {
+            result = (lead < 0) ? poly_op(SUB, nullptr, shift) : shift;
+        }
+        if (result == nullptr) {
+            return nullptr;
+        }
+        power = i;
+
+        if (fabs(coef) > 0) {
+            result = poly_op((coef < 0) ? SUB : ADD, result, new_node(NUM, fabs(coef), nullptr, nullptr, nullptr, ROOT));
+            if (result == nullptr) {
+                return nullptr;
+            }
+        }
+    }
+
+    update_var_mask_r(result);
+    return result;
+}
+
+// An operation on the subtree built so far (or nullptr for unary minus) and a new right
+// operand, which is nullptr if it failed to allocate. On failure both are freed.
+node_t* exp_tree_t::poly_op(double op, node_t* left, node_t* right) {
+    node_t* node = (right != nullptr) ? new_node(OP, op, left, right, nullptr, ROOT) : nullptr;
+    if (node == nullptr) {
+        LOG(ERROR, "Failed to build a polynomial\n");
+        delete_subtree_r(left);
+        delete_subtree_r(right);
+    }
+    return node;
+}
+
+node_t* exp_tree_t::poly_power(size_t var_id, size_t power) {
+    node_t* var = new_node(VAR, (double) var_id, nullptr, nullptr, nullptr, ROOT);
+    if (power == 1 || var == nullptr) {
+        return var;
+    }
+    return poly_op(POW, var, new_node(NUM, (double) power, nullptr, nullptr, nullptr, ROOT));
+}
+
+//===================================DERIVATIVES=================================================
+// Before every differentiate() run the maximal polynomial subtrees of the tree are found
+// and differentiated in coefficient form; differentiate() takes their derivatives from
+// poly_diff_ instead of applying the rules to every MUL and POW inside them.
+
+int exp_tree_t::find_polynomials_r(node_t* node, size_t var_id) {
+    if (node == nullptr) return 0;
+
+    int left = find_polynomials_r(node->left, var_id);
+    int right = find_polynomials_r(node->right, var_id);
+    int degree = node_degree(node, var_id, left, right);
+
+    if (degree < 0) {
+        if (left > 0) add_poly_derivative(node->left, var_id);
+        if (right > 0) add_poly_derivative(node->right, var_id);
+    }
+    return degree;
+}
+
+void exp_tree_t::add_poly_derivative(node_t* node, size_t var_id) {
+    assert(node != nullptr);
+
+    if (node->type != OP) return;
+
+    if (poly_diff_.entries == nullptr && node_table_ctor(&poly_diff_, POLY_DIFF_INIT_CAPACITY) != NO_ERR) {
+        return;
+    }
+    node_table_entry_t* entry = node_table_insert(&poly_diff_, node, var_id);
+    if (entry == nullptr || entry->value != nullptr) {
+        return;
+    }
+
+    poly_t poly = {};
+    poly_t derivative = {};
+    if (polynomial_r(node, var_id, &poly) == NO_ERR && poly_derivative(&poly, &derivative) == NO_ERR) {
+        entry->value = polynomial_tree(&derivative, var_id);
+    }
+    poly_dtor(&poly);
+    poly_dtor(&derivative);
+}
+
+node_t* exp_tree_t::find_poly_derivative(node_t* node, size_t var_id) {
+    assert(node != nullptr);
+
+    if (poly_diff_.entries == nullptr) {
+        return nullptr;
+    }
+    node_table_entry_t* entry = node_table_find(&poly_diff_, node, var_id);
+    if (entry == nullptr || entry->value == nullptr) {
+        return nullptr;
+    }
+    return copy_subtree(entry->value);
+}
+
+void exp_tree_t::clear_poly_diff() {
+    if (poly_diff_.entries == nullptr) return;
+
+    for (size_t i = 0; i < poly_diff_.capacity; i++) {
+        delete_subtree_r(poly_diff_.entries[i].value);
+    }
+    node_table_dtor(&poly_diff_);
+}
+
+//===================================CONVERSION==================================================
+
+static bool is_poly_exponent(node_t* node) {
+    return node != nullptr && node->type == NUM && node->value >= 0 && node->value <= POLY_MAX_DEGREE &&
+           fabs(node->value - floor(node->value)) < NUM_EPSILON;
+}
+
+// Degree of the node from the degrees of its children, -1 if it is not a polynomial.
+// Powers of anything but x are expanded only up to a small degree: the coefficients of
+// (1 - x)^24 cancel each other and leave no correct digit of it at x = 1.6.
+static int node_degree(node_t* node, size_t var_id, int left, int right) {
+    assert(node != nullptr);
+
+    switch (node->type) {
+        case NUM:
+            return 0;
+        case VAR:
+            return ((size_t) node->value == var_id) ? 1 : -1;
+        case OP:
+            break;
+        default:
+            return -1;
+    }
+
+    if (left < 0 || right < 0 || node->right == nullptr) {
+        return -1;
+    }
+
+    int degree = -1;
+    switch ((int) node->value) {
+        case ADD:
+        case SUB:
+            degree = (left > right) ? left : right;
+            break;
+        case MUL:
+            if (node->left != nullptr) degree = left + right;
+            break;
+        case DIV:
+            if (node->left != nullptr && node->right->type == NUM && fabs(node->right->value) >= NUM_EPSILON) {
+                degree = left;
+            }
+            break;
+        case POW:
+            if (node->left != nullptr && is_poly_exponent(node->right)) {
+                degree = left * (int) node->right->value;
+                if (node->left->type != VAR && degree > POLY_MAX_EXPANDED_DEGREE) degree = -1;
+            }
+            break;
+        default:
+            break;
+    }
+    return (degree <= POLY_MAX_DEGREE) ? degree : -1;
+}
+
+static int polynomial_degree_r(node_t* node, size_t var_id) {
+    if (node == nullptr) return 0;
+
+    int left = polynomial_degree_r(node->left, var_id);
+    if (left < 0) {
+        return -1;
+    }
+    int right = polynomial_degree_r(node->right, var_id);
+    return node_degree(node, var_id, left, right);
+}
+
+// The subtree has to be a polynomial, see node_degree().
+static err_t polynomial_r(node_t* node, size_t var_id, poly_t* poly) {
+    if (node == nullptr) {
+        return poly_ctor(poly, 0);
+    }
+
+    if (node->type != OP) {
+        err_t error = poly_ctor(poly, (node->type == VAR) ? 1 : 0);
+        if (error == NO_ERR) {
+            poly->coefs[poly->degree] = (node->type == VAR) ? 1 : node->value;
+        }
+        return error;
+    }
+
+    poly_t left = {};
+    poly_t right = {};
+    err_t error = polynomial_r(node->left, var_id, &left);
+    if (error == NO_ERR) {
+        error = polynomial_r(node->right, var_id, &right);
+    }
+
+    switch ((int) node->value) {
+        case ADD:
+        case SUB: {
+            if (error != NO_ERR) break;
+            error = poly_ctor(poly, (left.degree > right.degree) ? left.degree : right.degree);
+            if (error != NO_ERR) break;
+            double sign = ((int) node->value == SUB) ? -1 : 1;
+            for (size_t i = 0; i <= left.degree; i++) poly->coefs[i] += left.coefs[i];
+            for (size_t i = 0; i <= right.degree; i++) poly->coefs[i] += sign * right.coefs[i];
+            break;
+        }
+        case MUL:
+            if (error == NO_ERR) error = poly_mul(&left, &right, poly);
+            break;
+        case DIV:
+            if (error != NO_ERR) break;
+            error = poly_ctor(poly, left.degree);
+            if (error != NO_ERR) break;
+            for (size_t i = 0; i <= left.degree; i++) poly->coefs[i] = left.coefs[i] / node->right->value;
+            break;
+        case POW: {
+            if (error != NO_ERR) break;
+            error = poly_ctor(poly, 0);
+            if (error == NO_ERR) poly->coefs[0] = 1;
+            for (size_t i = 0; i < (size_t) node->right->value && error == NO_ERR; i++) {
+                poly_t product = {};
+                error = poly_mul(poly, &left, &product);
+                poly_dtor(poly);
+                *poly = product;
+            }
+            break;
+        }
+        default:
+            error = FORMAT_ERR;
+            break;
+    }
+
+    poly_dtor(&left);
+    poly_dtor(&right);
+    return error;
+}
+
+static err_t poly_mul(const poly_t* poly1, const poly_t* poly2, poly_t* product) {
+    err_t error = poly_ctor(product, poly1->degree + poly2->degree);
+    if (error != NO_ERR) {
+        return error;
+    }
+
+    for (size_t i = 0; i <= poly1->degree; i++) {
+        for (size_t j = 0; j <= poly2->degree; j++) {
+            product->coefs[i + j] += poly1->coefs[i] * poly2->coefs[j];
+        }
+    }
+    return NO_ERR;
+}
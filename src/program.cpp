@@ -0,0 +1,105 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t ZERO_SLOT = 0;
+
+//===================================COMPILE=====================================================
+// One slot per distinct subtree of the CSE DAG, slot 0 is the constant 0 used as the left
+// operand of unary +/-. Constants are stored into their slots once here, so execute()
+// runs only VAR loads and operations, each shared value exactly once.
+
+err_t exp_tree_t::compile(node_t* root, program_t* program) {
+    assert(root != nullptr);
+    assert(program != nullptr);
+
+    cse_t cse = {};
+    if (cse_ctor(&cse, root) != NO_ERR) {
+        return MEM_ALLOC_ERR;
+    }
+
+    program->slots_amount = cse.nodes_amount + 1;
+    program->code = (instr_t*) calloc(cse.nodes_amount, sizeof(instr_t));
+    program->slots = (double*) calloc(program->slots_amount, sizeof(double));
+    if (program->code == nullptr || program->slots == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        program_dtor(program);
+        cse_dtor(&cse);
+        return MEM_ALLOC_ERR;
+    }
+
+    program->size = 0;
+    program->slots[ZERO_SLOT] = 0;
+
+    for (size_t i = 0; i < cse.nodes_amount; i++) {
+        node_t* node = cse.nodes[i];
+        size_t dst = i + 1;
+
+        if (node->type == NUM) {
+            program->slots[dst] = node->value;
+            continue;
+        }
+
+        instr_t* instr = &program->code[program->size++];
+        instr->type = node->type;
+        instr->value = node->value;
+        instr->dst = dst;
+        instr->lhs = ZERO_SLOT;
+        instr->rhs = ZERO_SLOT;
+
+        if (node->type != OP) continue;
+
+        if (is_function(node->value)) {
+            node_t* arg = (node->left != nullptr) ? node->left : node->right;
+            instr->rhs = cse_index(&cse, arg) + 1;
+            continue;
+        }
+
+        if (node->left != nullptr) {
+            instr->lhs = cse_index(&cse, node->left) + 1;
+        }
+        if (node->right != nullptr) {
+            instr->rhs = cse_index(&cse, node->right) + 1;
+        }
+    }
+
+    program->result = cse_index(&cse, root) + 1;
+
+    LOG(DEBUG, "Compiled %zu instructions, %zu slots\n", program->size, program->slots_amount);
+    cse_dtor(&cse);
+    return NO_ERR;
+}
+
+void program_dtor(program_t* program) {
+    assert(program != nullptr);
+
+    free(program->code);
+    program->code = nullptr;
+    free(program->slots);
+    program->slots = nullptr;
+
+    program->size = 0;
+    program->slots_amount = 0;
+}
+
+//===================================EXECUTE=====================================================
+
+double exp_tree_t::execute(program_t* program, const double* vars) {
+    assert(program != nullptr);
+    assert(vars != nullptr);
+
+    double* slots = program->slots;
+    for (size_t i = 0; i < program->size; i++) {
+        instr_t* instr = &program->code[i];
+
+        if (instr->type == VAR) {
+            slots[instr->dst] = vars[(size_t) instr->value];
+        }
+        else {
+            slots[instr->dst] = apply_operation(instr->value, slots[instr->lhs], slots[instr->rhs]);
+        }
+    }
+    return slots[program->result];
+}
@@ -0,0 +1,396 @@
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const size_t REWRITE_OPS_AMOUNT = EOT + 1;
+const size_t MATCH_INIT_CAPACITY = 128;
+
+// Patterns are written in prefix notation. a..h match any subtree (the same letter twice
+// matches equal subtrees), _ is an empty child, so "- _ a" is the unary minus.
+// optimize() assumes every argument is in the domain: rules such as "/ a a" -> "1",
+// "* 0 a" -> "0" or "exp ln a" -> "a" hold only where their left side is defined, so the
+// result may be defined where the original is not, e.g. exp(ln(x)) at x = -1.
+extern const rewrite_rule_t REWRITE_RULES[] = {
+    {"+ 0 a",                   "a"},
+    {"+ a 0",                   "a"},
+    {"- a 0",                   "a"},
+    {"- 0 a",                   "- _ a"},
+    {"* 0 a",                   "0"},
+    {"* a 0",                   "0"},
+    {"* 1 a",                   "a"},
+    {"* a 1",                   "a"},
+    {"/ 0 a",                   "0"},
+    {"/ a 1",                   "a"},
+    {"^ a 1",                   "a"},
+    {"^ a 0",                   "1"},
+    {"^ 1 a",                   "1"},
+
+    {"- _ - _ a",               "a"},
+    {"+ a - _ b",               "- a b"},
+    {"+ - _ a b",               "- b a"},
+    {"- a - _ b",               "+ a b"},
+    {"* - _ a - _ b",           "* a b"},
+    {"/ - _ a - _ b",           "/ a b"},
+    {"+ a a",                   "* 2 a"},
+    {"- a a",                   "0"},
+    {"* a a",                   "^ a 2"},
+    {"/ a a",                   "1"},
+    {"* a ^ a b",               "^ a + b 1"},
+    {"* ^ a b a",               "^ a + b 1"},
+    {"* ^ a b ^ a c",           "^ a + b c"},
+    {"/ 1 / 1 a",               "a"},
+
+    {"ln exp a",                "a"},
+    {"exp ln a",                "a"},
+    {"ln 1",                    "0"},
+    {"exp 0",                   "1"},
+    {"* exp a exp b",           "exp + a b"},
+    {"/ exp a exp b",           "exp - a b"},
+
+    {"sin 0",                   "0"},
+    {"cos 0",                   "1"},
+    {"tg 0",                    "0"},
+    {"sh 0",                    "0"},
+    {"ch 0",                    "1"},
+    {"sin - _ a",               "- _ sin a"},
+    {"cos - _ a",               "cos a"},
+    {"+ ^ sin a 2 ^ cos a 2",   "1"},
+    {"+ ^ cos a 2 ^ sin a 2",   "1"},
+    {"- ^ ch a 2 ^ sh a 2",     "1"},
+    {"/ sin a cos a",           "tg a"},
+    {"/ cos a sin a",           "ctg a"},
+};
+
+extern const size_t REWRITE_RULES_AMOUNT = sizeof(REWRITE_RULES) / sizeof(REWRITE_RULES[0]);
+static_assert(sizeof(REWRITE_RULES) / sizeof(REWRITE_RULES[0]) <= MAX_REWRITE_RULES, "exp_stats_t counts rewrites per rule");
+
+typedef struct {
+    pattern_token_t token;
+    size_t child;
+    size_t sibling;
+    int rule;
+} match_node_t;
+
+typedef struct {
+    match_node_t* nodes;
+    size_t size;
+    size_t capacity;
+    size_t roots[REWRITE_OPS_AMOUNT];
+    pattern_token_t (*replacements)[MAX_PATTERN_TOKENS];
+} rewriter_t;
+
+static const rewriter_t* get_rewriter();
+static bool compile_rules(rewriter_t* rewriter);
+static bool parse_pattern_r(const char** str, pattern_token_t* tokens, size_t* size);
+static bool next_token(const char** str, pattern_token_t* token);
+static size_t match_child(rewriter_t* rewriter, size_t parent, pattern_token_t token);
+static int match_r(const rewriter_t* rewriter, size_t match_node, node_t*** stack, size_t depth, node_t*** captures);
+static bool match_token(pattern_token_t token, node_t* node, node_t*** captures);
+
+//===================================REWRITE=====================================================
+// optimize() simplifies with the rules of REWRITE_RULES. They are compiled once into a
+// trie over the preorder of the patterns with one root per opcode, so all rules that
+// can match a node are tried in a single walk down the trie. rewrite_r() relinks the
+// children itself, the rules only say what a matched subtree is replaced with.
+
+node_t* exp_tree_t::rewrite_r(node_t* node, bool* flag) {
+    assert(flag != nullptr);
+
+    if (node == nullptr) return nullptr;
+
+    node->left = rewrite_r(node->left, flag);
+    if (node->left != nullptr) node->left->parent = node;
+
+    node->right = rewrite_r(node->right, flag);
+    if (node->right != nullptr) node->right->parent = node;
+
+    if (node->type != OP || node->value < 0 || (size_t) node->value >= REWRITE_OPS_AMOUNT) {
+        return node;
+    }
+
+    const rewriter_t* rewriter = get_rewriter();
+    size_t root = rewriter->roots[(size_t) node->value];
+    if (root == 0) {
+        return node;
+    }
+
+    node_t** stack[MAX_PATTERN_TOKENS] = {&node->right, &node->left};
+    node_t** captures[MAX_PATTERN_CAPTURES] = {};
+    int rule = match_r(rewriter, root, stack, 2, captures);
+    if (rule < 0) {
+        return node;
+    }
+
+    *flag = true;
+    stats_.rule_rewrites[rule]++;
+    return apply_rule(node, (size_t) rule, captures);
+}
+
+// The captured subtrees are cut out of the matched one and moved into the replacement,
+// everything else that was matched is deleted.
+node_t* exp_tree_t::apply_rule(node_t* node, size_t rule, node_t*** captures) {
+    assert(node != nullptr);
+    assert(captures != nullptr);
+
+    node_t* captured[MAX_PATTERN_CAPTURES] = {};
+    bool used[MAX_PATTERN_CAPTURES] = {};
+    for (size_t i = 0; i < MAX_PATTERN_CAPTURES; i++) {
+        if (captures[i] == nullptr) continue;
+        captured[i] = *captures[i];
+        *captures[i] = nullptr;
+    }
+
+    size_t pos = 0;
+    node_t* result = build_replacement_r(get_rewriter()->replacements[rule], &pos, captured, used);
+
+    for (size_t i = 0; i < MAX_PATTERN_CAPTURES; i++) {
+        if (!used[i]) delete_subtree_r(captured[i]);
+    }
+    delete_subtree_r(node);
+    return result;
+}
+
+node_t* exp_tree_t::build_replacement_r(const pattern_token_t* tokens, size_t* pos, node_t** captured, bool* used) {
+    pattern_token_t token = tokens[(*pos)++];
+
+    switch (token.kind) {
+        case PATTERN_NIL:
+            return nullptr;
+        case PATTERN_NUM:
+            return new_node(NUM, token.value, nullptr, nullptr, nullptr, ROOT);
+        case PATTERN_ANY: {
+            size_t slot = (size_t) token.value;
+            if (used[slot]) {
+                return copy_subtree(captured[slot]);
+            }
+            used[slot] = true;
+            return captured[slot];
+        }
+        case PATTERN_OP: {
+            node_t* left = build_replacement_r(tokens, pos, captured, used);
+            node_t* right = build_replacement_r(tokens, pos, captured, used);
+            return new_node(OP, token.value, left, right, nullptr, ROOT);
+        }
+        default:
+            return nullptr;
+    }
+}
+
+//===================================MATCHING====================================================
+
+static int match_r(const rewriter_t* rewriter, size_t match_node, node_t*** stack, size_t depth, node_t*** captures) {
+    if (depth == 0) {
+        return rewriter->nodes[match_node].rule;
+    }
+
+    node_t** slot = stack[depth - 1];
+    node_t* node = *slot;
+
+    for (size_t child = rewriter->nodes[match_node].child; child != 0; child = rewriter->nodes[child].sibling) {
+        pattern_token_t token = rewriter->nodes[child].token;
+        int rule = -1;
+
+        if (token.kind == PATTERN_OP) {
+            if (node == nullptr || node->type != OP || (int) node->value != (int) token.value) continue;
+
+            stack[depth - 1] = &node->right;
+            stack[depth] = &node->left;
+            rule = match_r(rewriter, child, stack, depth + 1, captures);
+            stack[depth - 1] = slot;
+        }
+        else if (token.kind == PATTERN_ANY && captures[(size_t) token.value] == nullptr) {
+            if (node == nullptr) continue;
+
+            captures[(size_t) token.value] = slot;
+            rule = match_r(rewriter, child, stack, depth - 1, captures);
+            if (rule < 0) {
+                captures[(size_t) token.value] = nullptr;
+            }
+        }
+        else if (match_token(token, node, captures)) {
+            rule = match_r(rewriter, child, stack, depth - 1, captures);
+        }
+
+        if (rule >= 0) {
+            return rule;
+        }
+    }
+    return -1;
+}
+
+static bool match_token(pattern_token_t token, node_t* node, node_t*** captures) {
+    switch (token.kind) {
+        case PATTERN_NIL:
+            return node == nullptr;
+        case PATTERN_NUM:
+            return node != nullptr && node->type == NUM && fabs(node->value - token.value) <= NUM_EPSILON * fabs(token.value);
+        case PATTERN_ANY:
+            return node != nullptr && node_equal_r(*captures[(size_t) token.value], node);
+        case PATTERN_OP:
+            // Operations are walked by match_r().
+            return false;
+        default:
+            return false;
+    }
+}
+
+//===================================COMPILATION=================================================
+
+// Compiled on first use; the initialization of a function-local static is thread-safe.
+static const rewriter_t* get_rewriter() {
+    static rewriter_t rewriter = {};
+    static const bool compiled = compile_rules(&rewriter);
+    (void) compiled;
+    return &rewriter;
+}
+
+// On allocation failure the rewriter is left without rules, so nothing matches.
+static bool compile_rules(rewriter_t* rewriter) {
+    assert(rewriter != nullptr);
+
+    rewriter->nodes = (match_node_t*) calloc(MATCH_INIT_CAPACITY, sizeof(match_node_t));
+    rewriter->replacements = (pattern_token_t (*)[MAX_PATTERN_TOKENS]) calloc(REWRITE_RULES_AMOUNT,
+                                                                             sizeof(rewriter->replacements[0]));
+    if (rewriter->nodes == nullptr || rewriter->replacements == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        free(rewriter->nodes);
+        free(rewriter->replacements);
+        *rewriter = {};
+        return false;
+    }
+    rewriter->capacity = MATCH_INIT_CAPACITY;
+    rewriter->size = 1;
+
+    for (size_t rule = 0; rule < REWRITE_RULES_AMOUNT; rule++) {
+        pattern_token_t pattern[MAX_PATTERN_TOKENS] = {};
+        size_t pattern_size = 0;
+        size_t replacement_size = 0;
+
+        if (!parse_pattern(REWRITE_RULES[rule].pattern, pattern, &pattern_size) || pattern[0].kind != PATTERN_OP ||
+            !parse_pattern(REWRITE_RULES[rule].replacement, rewriter->replacements[rule], &replacement_size)) {
+            LOG(ERROR, "Invalid rewrite rule \"%s\" -> \"%s\"\n", REWRITE_RULES[rule].pattern, REWRITE_RULES[rule].replacement);
+            continue;
+        }
+
+        size_t op = (size_t) pattern[0].value;
+        if (rewriter->roots[op] == 0) {
+            rewriter->roots[op] = match_child(rewriter, 0, pattern[0]);
+        }
+        size_t match_node = rewriter->roots[op];
+        for (size_t i = 1; i < pattern_size && match_node != 0; i++) {
+            match_node = match_child(rewriter, match_node, pattern[i]);
+        }
+        if (match_node != 0 && rewriter->nodes[match_node].rule < 0) {
+            rewriter->nodes[match_node].rule = (int) rule;
+        }
+    }
+    return true;
+}
+
+// Finds or appends the child of the trie node with this token. Index 0 means none.
+static size_t match_child(rewriter_t* rewriter, size_t parent, pattern_token_t token) {
+    size_t prev = 0;
+    for (size_t child = rewriter->nodes[parent].child; child != 0; child = rewriter->nodes[child].sibling) {
+        pattern_token_t child_token = rewriter->nodes[child].token;
+        if (child_token.kind == token.kind && fabs(child_token.value - token.value) < NUM_EPSILON) {
+            return child;
+        }
+        prev = child;
+    }
+
+    if (rewriter->size == rewriter->capacity) {
+        match_node_t* nodes = (match_node_t*) realloc(rewriter->nodes, rewriter->capacity * 2 * sizeof(match_node_t));
+        if (nodes == nullptr) {
+            LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+            return 0;
+        }
+        rewriter->nodes = nodes;
+        rewriter->capacity *= 2;
+    }
+
+    size_t index = rewriter->size++;
+    rewriter->nodes[index] = {token, 0, 0, -1};
+    if (prev == 0) {
+        rewriter->nodes[parent].child = index;
+    }
+    else {
+        rewriter->nodes[prev].sibling = index;
+    }
+    return index;
+}
+
+bool parse_pattern(const char* str, pattern_token_t* tokens, size_t* size) {
+    assert(str != nullptr);
+    assert(tokens != nullptr);
+    assert(size != nullptr);
+
+    *size = 0;
+    return parse_pattern_r(&str, tokens, size) && *str == '\0';
+}
+
+// Preorder with both children of every operation: functions get an empty right child.
+static bool parse_pattern_r(const char** str, pattern_token_t* tokens, size_t* size) {
+    if (*size == MAX_PATTERN_TOKENS) {
+        return false;
+    }
+
+    pattern_token_t token = {};
+    if (!next_token(str, &token)) {
+        return false;
+    }
+    tokens[(*size)++] = token;
+
+    if (token.kind != PATTERN_OP) {
+        return true;
+    }
+    if (!parse_pattern_r(str, tokens, size)) {
+        return false;
+    }
+    if (exp_tree_t::is_function(token.value)) {
+        if (*size == MAX_PATTERN_TOKENS) {
+            return false;
+        }
+        tokens[(*size)++] = {PATTERN_NIL, 0};
+        return true;
+    }
+    return parse_pattern_r(str, tokens, size);
+}
+
+static bool next_token(const char** str, pattern_token_t* token) {
+    while (**str == ' ') (*str)++;
+
+    char name[MAX_NAME_LEN] = "";
+    size_t len = strcspn(*str, " ");
+    if (len == 0 || len >= MAX_NAME_LEN) {
+        return false;
+    }
+    memcpy(name, *str, len);
+    *str += len;
+    while (**str == ' ') (*str)++;
+
+    if (strcmp(name, "_") == 0) {
+        *token = {PATTERN_NIL, 0};
+        return true;
+    }
+    if (len == 1 && name[0] >= 'a' && (size_t) (name[0] - 'a') < MAX_PATTERN_CAPTURES) {
+        *token = {PATTERN_ANY, (double) (name[0] - 'a')};
+        return true;
+    }
+    for (size_t i = 0; i < func_name_table_len; i++) {
+        if (strcmp(name, func_name_table[i].name) == 0) {
+            *token = {PATTERN_OP, (double) func_name_table[i].code};
+            return true;
+        }
+    }
+
+    char* end = nullptr;
+    double value = strtod(name, &end);
+    if (*end != '\0') {
+        return false;
+    }
+    *token = {PATTERN_NUM, value};
+    return true;
+}
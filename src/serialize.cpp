@@ -0,0 +1,538 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const uint8_t SERIAL_MAGIC[] = {'E', 'X', 'P', 'T'};
+const uint8_t SERIAL_VERSION = 1;
+const uint8_t SERIAL_DAG = 1;
+const size_t SERIAL_HEADER_SIZE = 16;
+const size_t SERIAL_RECORDS_OFFSET = 8;
+const size_t SERIAL_MAX_NODES = 1 << 20;
+
+const uint8_t SERIAL_NUM = 0;
+const uint8_t SERIAL_VAR = 1;
+const uint8_t SERIAL_OP  = 2;
+const uint8_t SERIAL_REF = 3;
+const uint8_t SERIAL_KIND_MASK = 3;
+const uint8_t SERIAL_HAS_LEFT  = 1 << 2;
+const uint8_t SERIAL_HAS_RIGHT = 1 << 3;
+
+static err_t bytes_reserve(bytes_t* bytes, size_t amount);
+static err_t put_byte(bytes_t* bytes, uint8_t byte);
+static err_t put_varint(bytes_t* bytes, uint64_t value);
+static err_t put_u64(bytes_t* bytes, uint64_t value);
+static err_t put_double(bytes_t* bytes, double value);
+static uint8_t get_byte(serial_reader_t* reader);
+static uint64_t get_varint(serial_reader_t* reader);
+static uint64_t get_u64(serial_reader_t* reader);
+static double get_double(serial_reader_t* reader);
+
+//===================================FORMAT======================================================
+// 16 byte header: "EXPT", version, flags, 2 reserved bytes, records amount (u64 LE).
+// Then the variable names (varint amount, varint length + bytes each) and the nodes in
+// preorder. A node is a tag byte: kind in the low 2 bits, presence of the left and right
+// child in bits 2 and 3, followed by a LE double (NUM), a varint var id (VAR) or an op
+// byte (OP). With SERIAL_DAG repeated subtrees are written once and then referenced by
+// the preorder index of their first record (REF + varint). Everything is read straight
+// from the buffer, so load() decodes the mmap'ed file in place.
+//
+// Trees do not share nodes, so a REF is read as a copy of a finished record. A chain of
+// them doubles the tree at every link: the copies are counted before they are made and a
+// file that would expand past SERIAL_MAX_NODES is rejected.
+
+err_t exp_tree_t::serialize(node_t* root, bool as_dag, bytes_t* bytes) {
+    assert(root != nullptr);
+    assert(bytes != nullptr);
+
+    node_table_t table = {};
+    if (as_dag) {
+        node_hash_r(root);
+        if (node_table_ctor(&table, count_nodes_r(root)) != NO_ERR) {
+            return MEM_ALLOC_ERR;
+        }
+    }
+
+    bytes->size = 0;
+    err_t error = bytes_reserve(bytes, SERIAL_HEADER_SIZE);
+    if (error == NO_ERR) {
+        memcpy(bytes->data, SERIAL_MAGIC, sizeof(SERIAL_MAGIC));
+        bytes->data[4] = SERIAL_VERSION;
+        bytes->data[5] = as_dag ? SERIAL_DAG : 0;
+        memset(bytes->data + 6, 0, SERIAL_HEADER_SIZE - 6);
+        bytes->size = SERIAL_HEADER_SIZE;
+
+        error = put_varint(bytes, var_nametable_size_);
+    }
+
+    for (size_t i = 0; i < var_nametable_size_ && error == NO_ERR; i++) {
+        size_t len = strnlen(var_nametable_[i].name, MAX_NAME_LEN);
+        error = put_varint(bytes, len);
+        if (error == NO_ERR) {
+            error = bytes_append(bytes, var_nametable_[i].name, len);
+        }
+    }
+
+    size_t records_amount = 0;
+    if (error == NO_ERR) {
+        error = serialize_node_r(bytes, as_dag ? &table : nullptr, root, &records_amount);
+    }
+    node_table_dtor(&table);
+
+    if (error != NO_ERR) {
+        return error;
+    }
+
+    size_t size = bytes->size;
+    bytes->size = SERIAL_RECORDS_OFFSET;
+    put_u64(bytes, records_amount);
+    bytes->size = size;
+
+    LOG(DEBUG, "Serialized %zu records into %zu bytes\n", records_amount, bytes->size);
+    return NO_ERR;
+}
+
+err_t exp_tree_t::serialize_node_r(bytes_t* bytes, node_table_t* table, node_t* node, size_t* records_amount) {
+    assert(node != nullptr);
+
+    if (table != nullptr) {
+        node_table_entry_t* entry = node_table_insert(table, node, 0);
+        if (entry == nullptr) {
+            return MEM_ALLOC_ERR;
+        }
+        if (entry->index != SIZE_MAX) {
+            if (put_byte(bytes, SERIAL_REF) != NO_ERR) {
+                return MEM_ALLOC_ERR;
+            }
+            return put_varint(bytes, entry->index);
+        }
+        entry->index = *records_amount;
+    }
+    (*records_amount)++;
+
+    uint8_t tag = (uint8_t) ((node->left  != nullptr) ? SERIAL_HAS_LEFT  : 0) |
+                  (uint8_t) ((node->right != nullptr) ? SERIAL_HAS_RIGHT : 0);
+
+    err_t error = NO_ERR;
+    switch (node->type) {
+        case NUM:
+            if ((error = put_byte(bytes, tag | SERIAL_NUM)) == NO_ERR) {
+                error = put_double(bytes, node->value);
+            }
+            break;
+        case VAR:
+            if ((error = put_byte(bytes, tag | SERIAL_VAR)) == NO_ERR) {
+                error = put_varint(bytes, (uint64_t) node->value);
+            }
+            break;
+        case OP:
+            if ((error = put_byte(bytes, tag | SERIAL_OP)) == NO_ERR) {
+                error = put_byte(bytes, (uint8_t) node->value);
+            }
+            break;
+        default:
+            LOG(ERROR, "Unknown node type %d\n", node->type);
+            return FORMAT_ERR;
+    }
+
+    if (error == NO_ERR && node->left != nullptr) {
+        error = serialize_node_r(bytes, table, node->left, records_amount);
+    }
+    if (error == NO_ERR && node->right != nullptr) {
+        error = serialize_node_r(bytes, table, node->right, records_amount);
+    }
+    return error;
+}
+
+err_t exp_tree_t::deserialize(const uint8_t* data, size_t size, node_t** root) {
+    return deserialize(data, size, root, false);
+}
+
+// With into_tokens the nodes are placed into a new tokens_ array, like a parsed tree,
+// and only the copies made for DAG references are allocated one by one.
+err_t exp_tree_t::deserialize(const uint8_t* data, size_t size, node_t** root, bool into_tokens) {
+    assert(data != nullptr);
+    assert(root != nullptr);
+
+    *root = nullptr;
+    if (size < SERIAL_HEADER_SIZE || memcmp(data, SERIAL_MAGIC, sizeof(SERIAL_MAGIC)) != 0) {
+        LOG(ERROR, "Not a serialized expression\n");
+        return FORMAT_ERR;
+    }
+    if (data[4] != SERIAL_VERSION) {
+        LOG(ERROR, "Unsupported format version %d\n", data[4]);
+        return FORMAT_ERR;
+    }
+
+    serial_reader_t reader = {};
+    reader.data = data;
+    reader.size = size;
+    reader.pos = SERIAL_RECORDS_OFFSET;
+    reader.records_amount = get_u64(&reader);
+    reader.vars_amount = get_varint(&reader);
+
+    if (reader.failed || reader.records_amount > size || reader.vars_amount > size) {
+        LOG(ERROR, "Corrupted header\n");
+        return FORMAT_ERR;
+    }
+
+    reader.records = (node_t**) calloc(reader.records_amount + 1, sizeof(node_t*));
+    reader.record_nodes = (size_t*) calloc(reader.records_amount + 1, sizeof(size_t));
+    reader.var_ids = (size_t*) calloc(reader.vars_amount + 1, sizeof(size_t));
+    if (into_tokens) {
+        reader.arena = (node_t*) calloc(reader.records_amount + 1, sizeof(node_t));
+    }
+    if (reader.records == nullptr || reader.record_nodes == nullptr || reader.var_ids == nullptr ||
+        (into_tokens && reader.arena == nullptr)) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        free(reader.records);
+        free(reader.record_nodes);
+        free(reader.var_ids);
+        free(reader.arena);
+        return MEM_ALLOC_ERR;
+    }
+    if (into_tokens) {
+        tokens_ = reader.arena;
+        tokens_array_size_ = reader.records_amount + 1;
+    }
+
+    for (size_t i = 0; i < reader.vars_amount && !reader.failed; i++) {
+        size_t len = get_varint(&reader);
+        if (reader.failed || len >= MAX_NAME_LEN || len > reader.size - reader.pos) {
+            reader.failed = true;
+            break;
+        }
+
+        char name[MAX_NAME_LEN] = "";
+        memcpy(name, reader.data + reader.pos, len);
+        reader.pos += len;
+
+        double index = find_name_in_nametable(name);
+        if (index < 0) {
+            if (var_nametable_size_ >= MAX_VARS_AMOUNT) {
+                LOG(ERROR, "Variable nametable is full\n");
+                reader.failed = true;
+                break;
+            }
+            index = add_name_to_nametable(name);
+        }
+        reader.var_ids[i] = (size_t) index;
+    }
+
+    node_t* node = reader.failed ? nullptr : deserialize_node_r(&reader);
+    free(reader.records);
+    free(reader.record_nodes);
+    free(reader.var_ids);
+
+    if (node == nullptr) {
+        LOG(ERROR, "Corrupted node stream at byte %zu\n", reader.pos);
+        return FORMAT_ERR;
+    }
+
+    update_var_mask_r(node);
+    *root = node;
+    return NO_ERR;
+}
+
+node_t* exp_tree_t::deserialize_node_r(serial_reader_t* reader) {
+    assert(reader != nullptr);
+
+    uint8_t tag = get_byte(reader);
+    if (reader->failed) return nullptr;
+
+    if ((tag & SERIAL_KIND_MASK) == SERIAL_REF) {
+        size_t index = get_varint(reader);
+        if (reader->failed || index >= reader->records_size || reader->record_nodes[index] == 0) {
+            reader->failed = true;
+            return nullptr;
+        }
+
+        reader->nodes_amount += reader->record_nodes[index];
+        if (reader->nodes_amount > SERIAL_MAX_NODES) {
+            LOG(ERROR, "References expand past %zu nodes\n", SERIAL_MAX_NODES);
+            reader->failed = true;
+            return nullptr;
+        }
+
+        node_t* copy = copy_subtree(reader->records[index]);
+        if (copy == nullptr) {
+            reader->failed = true;
+        }
+        return copy;
+    }
+
+    if (reader->records_size >= reader->records_amount) {
+        reader->failed = true;
+        return nullptr;
+    }
+
+    node_t* node = (reader->arena != nullptr) ? &reader->arena[reader->records_size] :
+                                                new_node(NUM, 0, nullptr, nullptr, nullptr, ROOT);
+    if (node == nullptr) {
+        reader->failed = true;
+        return nullptr;
+    }
+    size_t record = reader->records_size++;
+    size_t nodes_before = reader->nodes_amount++;
+    reader->records[record] = node;
+
+    switch (tag & SERIAL_KIND_MASK) {
+        case SERIAL_NUM:
+            node->value = get_double(reader);
+            break;
+        case SERIAL_VAR: {
+            size_t var_id = get_varint(reader);
+            if (var_id >= reader->vars_amount) {
+                reader->failed = true;
+                break;
+            }
+            node->type = VAR;
+            node->value = (double) reader->var_ids[var_id];
+            break;
+        }
+        case SERIAL_OP: {
+            uint8_t op = get_byte(reader);
+            if (op > ARCCTH) {
+                reader->failed = true;
+                break;
+            }
+            node->type = OP;
+            node->value = op;
+            break;
+        }
+        default:
+            reader->failed = true;
+            break;
+    }
+
+    if (!reader->failed && (tag & SERIAL_HAS_LEFT)) {
+        node->left = deserialize_node_r(reader);
+        if (node->left != nullptr) node->left->parent = node;
+    }
+    if (!reader->failed && (tag & SERIAL_HAS_RIGHT)) {
+        node->right = deserialize_node_r(reader);
+        if (node->right != nullptr) node->right->parent = node;
+    }
+
+    if (reader->failed) {
+        if (reader->arena != nullptr) {
+            delete_token_tree_r(node);
+        }
+        else {
+            delete_subtree_r(node);
+        }
+        return nullptr;
+    }
+    reader->record_nodes[record] = reader->nodes_amount - nodes_before;
+    return node;
+}
+
+//===================================FILES=======================================================
+
+err_t exp_tree_t::store(const char* path, node_t* root, bool as_dag) {
+    assert(path != nullptr);
+    assert(root != nullptr);
+
+    bytes_t bytes = {};
+    err_t error = serialize(root, as_dag, &bytes);
+    if (error != NO_ERR) {
+        bytes_dtor(&bytes);
+        return error;
+    }
+
+    FILE* ostream = fopen(path, "wb");
+    if (ostream == nullptr) {
+        LOG(ERROR, "Failed to open %s\n" STRERROR(errno), path);
+        bytes_dtor(&bytes);
+        return FILE_ERR;
+    }
+
+    if (fwrite(bytes.data, sizeof(uint8_t), bytes.size, ostream) != bytes.size) {
+        LOG(ERROR, "Failed to write %s\n" STRERROR(errno), path);
+        error = FILE_ERR;
+    }
+    if (fclose(ostream) != 0) {
+        error = FILE_ERR;
+    }
+
+    bytes_dtor(&bytes);
+    return error;
+}
+
+err_t exp_tree_t::load(const char* path) {
+    assert(path != nullptr);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG(ERROR, "Failed to open %s\n" STRERROR(errno), path);
+        return FILE_ERR;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        LOG(ERROR, "Failed to stat %s\n" STRERROR(errno), path);
+        close(fd);
+        return FILE_ERR;
+    }
+    size_t size = (size_t) st.st_size;
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG(ERROR, "Failed to map %s\n" STRERROR(errno), path);
+        return FILE_ERR;
+    }
+
+    // The expression held so far stays if the file does not load, as in update().
+    node_t* old_root = root_;
+    node_t* old_tokens = tokens_;
+    size_t old_tokens_array_size = tokens_array_size_;
+
+    node_t* root = nullptr;
+    err_t error = deserialize((const uint8_t*) data, size, &root, true);
+    munmap(data, size);
+
+    if (error != NO_ERR) {
+        if (tokens_ != old_tokens) {
+            free(tokens_);
+        }
+        tokens_ = old_tokens;
+        tokens_array_size_ = old_tokens_array_size;
+        return error;
+    }
+
+    node_t* new_tokens = tokens_;
+    size_t new_tokens_array_size = tokens_array_size_;
+    tokens_ = old_tokens;
+    tokens_array_size_ = old_tokens_array_size;
+    delete_token_tree_r(old_root);
+    free(old_tokens);
+
+    tokens_ = new_tokens;
+    tokens_array_size_ = new_tokens_array_size;
+    root_ = root;
+    return NO_ERR;
+}
+
+//===================================BYTES=======================================================
+
+void bytes_dtor(bytes_t* bytes) {
+    assert(bytes != nullptr);
+
+    free(bytes->data);
+    bytes->data = nullptr;
+    bytes->size = 0;
+    bytes->capacity = 0;
+}
+
+err_t bytes_append(bytes_t* bytes, const void* data, size_t size) {
+    assert(bytes != nullptr);
+    assert(data != nullptr);
+
+    if (bytes_reserve(bytes, size) != NO_ERR) {
+        return MEM_ALLOC_ERR;
+    }
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+    return NO_ERR;
+}
+
+static err_t bytes_reserve(bytes_t* bytes, size_t amount) {
+    if (bytes->size + amount <= bytes->capacity) {
+        return NO_ERR;
+    }
+
+    size_t capacity = (bytes->capacity == 0) ? 64 : bytes->capacity;
+    while (capacity < bytes->size + amount) {
+        capacity *= 2;
+    }
+
+    uint8_t* data = (uint8_t*) realloc(bytes->data, capacity);
+    if (data == nullptr) {
+        LOG(ERROR, "Memory allocation error\n" STRERROR(errno));
+        return MEM_ALLOC_ERR;
+    }
+    bytes->data = data;
+    bytes->capacity = capacity;
+    return NO_ERR;
+}
+
+static err_t put_byte(bytes_t* bytes, uint8_t byte) {
+    if (bytes_reserve(bytes, 1) != NO_ERR) {
+        return MEM_ALLOC_ERR;
+    }
+    bytes->data[bytes->size++] = byte;
+    return NO_ERR;
+}
+
+static err_t put_varint(bytes_t* bytes, uint64_t value) {
+    while (value >= 0x80) {
+        if (put_byte(bytes, (uint8_t) (value | 0x80)) != NO_ERR) {
+            return MEM_ALLOC_ERR;
+        }
+        value >>= 7;
+    }
+    return put_byte(bytes, (uint8_t) value);
+}
+
+static err_t put_u64(bytes_t* bytes, uint64_t value) {
+    if (bytes_reserve(bytes, sizeof(uint64_t)) != NO_ERR) {
+        return MEM_ALLOC_ERR;
+    }
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        bytes->data[bytes->size++] = (uint8_t) (value >> (8 * i));
+    }
+    return NO_ERR;
+}
+
+static err_t put_double(bytes_t* bytes, double value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_u64(bytes, bits);
+}
+
+static uint8_t get_byte(serial_reader_t* reader) {
+    if (reader->pos >= reader->size) {
+        reader->failed = true;
+        return 0;
+    }
+    return reader->data[reader->pos++];
+}
+
+static uint64_t get_varint(serial_reader_t* reader) {
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = get_byte(reader);
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    reader->failed = true;
+    return 0;
+}
+
+static uint64_t get_u64(serial_reader_t* reader) {
+    if (reader->size - reader->pos < sizeof(uint64_t)) {
+        reader->failed = true;
+        return 0;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        value |= (uint64_t) reader->data[reader->pos++] << (8 * i);
+    }
+    return value;
+}
+
+static double get_double(serial_reader_t* reader) {
+    uint64_t bits = get_u64(reader);
+    double value = 0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include "expression_tree.h"
+#include "logger.h"
+
+const char* PHASE_NAMES[PHASES_AMOUNT] = {"tokenize", "parse", "differentiate", "optimize", "tex", "dump"};
+
+static double get_time_ms();
+
+//===================================STATS=======================================================
+// Counters are updated where the work happens: new_node()/free_node() track the nodes,
+// rewrite_r() the rules, the public entry points of every phase hold a phase_timer_t.
+
+const exp_stats_t* exp_tree_t::stats() {
+    return &stats_;
+}
+
+// Nodes of the previous runs that are still alive stay counted as live.
+void exp_tree_t::reset_stats() {
+    size_t live_nodes = stats_.live_nodes;
+    stats_ = {};
+    stats_.live_nodes = live_nodes;
+    stats_.peak_live_nodes = live_nodes;
+}
+
+// One object on one line with no newline, the caller frames it.
+void exp_tree_t::print_stats_json(FILE* ostream) {
+    assert(ostream != nullptr);
+
+    fprintf(ostream, "{\"tokens\": %zu, ", stats_.tokens);
+    fprintf(ostream, "\"nodes_parsed\": %zu, ", stats_.nodes_parsed);
+    fprintf(ostream, "\"nodes_differentiated\": %zu, ", stats_.nodes_differentiated);
+    fprintf(ostream, "\"nodes_optimized\": %zu, ", stats_.nodes_optimized);
+    fprintf(ostream, "\"optimizer_passes\": %zu, ", stats_.optimizer_passes);
+    fprintf(ostream, "\"copy_subtree_calls\": %zu, ", stats_.copy_subtree_calls);
+    fprintf(ostream, "\"allocated_nodes\": %zu, ", stats_.allocated_nodes);
+    fprintf(ostream, "\"live_nodes\": %zu, ", stats_.live_nodes);
+    fprintf(ostream, "\"peak_live_nodes\": %zu, ", stats_.peak_live_nodes);
+
+    fprintf(ostream, "\"rule_rewrites\": {");
+    bool first = true;
+    for (size_t i = 0; i < REWRITE_RULES_AMOUNT; i++) {
+        if (stats_.rule_rewrites[i] == 0) continue;
+
+        char rule[2 * MAX_PATTERN_TOKENS * MAX_OP_LEN] = "";
+        snprintf(rule, sizeof(rule), "%s -> %s", REWRITE_RULES[i].pattern, REWRITE_RULES[i].replacement);
+        fprintf(ostream, "%s", first ? "" : ", ");
+        print_json_string(ostream, rule);
+        fprintf(ostream, ": %zu", stats_.rule_rewrites[i]);
+        first = false;
+    }
+    fprintf(ostream, "}, ");
+
+    fprintf(ostream, "\"phase_ms\": {");
+    for (size_t i = 0; i < PHASES_AMOUNT; i++) {
+        fprintf(ostream, "%s\"%s\": %.3f", (i == 0) ? "" : ", ", PHASE_NAMES[i], stats_.phase_ms[i]);
+    }
+    fprintf(ostream, "}}");
+}
+
+phase_timer_t::phase_timer_t(exp_stats_t* phase_stats, phase_t timed_phase) :
+    stats(phase_stats), phase(timed_phase), start_ms(0) {
+    if (stats->phase_depth[phase]++ == 0) {
+        start_ms = get_time_ms();
+    }
+}
+
+phase_timer_t::~phase_timer_t() {
+    if (--stats->phase_depth[phase] == 0) {
+        stats->phase_ms[phase] += get_time_ms() - start_ms;
+    }
+}
+
+static double get_time_ms() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
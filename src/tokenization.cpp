@@ -2,13 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <limits.h>
 #include "text_lib.h"
 #include "logger.h"
+#include "trace.h"
 #include "expression_tree.h"
 
 node_t* exp_tree_t::token_init(text_t* text) {
     assert(text != nullptr);
+    TRACE_FUNCTION();
 
     tokens_ = (node_t*) calloc(sizeof(node_t), text->symbols_amount);
     if (tokens_ == nullptr) {
@@ -16,8 +17,12 @@ node_t* exp_tree_t::token_init(text_t* text) {
         return nullptr;
     }
     tokens_array_size_ = text->symbols_amount;
+    syntax_failed_ = false;
 
     tokenize_text(text);
+    if (syntax_failed_) {
+        return nullptr;
+    }
 
 #ifdef DEBUG
     print_tokens_array();
@@ -25,7 +30,13 @@ node_t* exp_tree_t::token_init(text_t* text) {
 #endif /* DEBUG */
 
     root_ = link_tokens();
+    if (syntax_failed_) {
+        delete_token_tree_r(root_);
+        return nullptr;
+    }
     add_parents_rel_r(root_, nullptr);
+    update_var_mask_r(root_);
+    stats_.nodes_parsed = count_nodes_r(root_);
     return root_;
 }
 
@@ -46,6 +57,7 @@ void exp_tree_t::tokenize_text(text_t* text) {
         LOG(ERROR, "Text is nullptr\n");
         return;
     }
+    phase_timer_t timer(&stats_, PHASE_TOKENIZE);
 
     size_t ip = 0;
     size_t i = 0;
@@ -95,10 +107,17 @@ void exp_tree_t::tokenize_text(text_t* text) {
             parse_identificator(text, &ip, &tokens_[i]);
         }
         else {
-            printf("Syntax err %c(%d)  %zu\n", text->symbols[ip], text->symbols[ip], text->symbols_amount);
+            LOG(ERROR, "Syntax error: unexpected symbol %c(%d) at %zu\n", text->symbols[ip], text->symbols[ip], ip);
+            syntax_failed_ = true;
             return;
         }
         i++;
+        stats_.tokens++;
+    }
+
+    // Every token takes at least a symbol, the terminating zero leaves room for the '$'.
+    if (i == 0 || !(tokens_[i - 1].type == OP && (int) tokens_[i - 1].value == EOT)) {
+        initialize_op_node(&tokens_[i], EOT);
     }
 }
 
@@ -126,6 +145,7 @@ void exp_tree_t::parse_identificator(text_t* text, size_t* ip, node_t* node) {
 
     if (i == MAX_NAME_LEN) {
         LOG(ERROR, "Too long name error\n");
+        syntax_failed_ = true;
         return;
     }
 
@@ -162,6 +182,11 @@ double exp_tree_t::index_in_nametable(char* name) {
 double exp_tree_t::add_name_to_nametable(char* name) {
     assert(name != nullptr);
 
+    if (var_nametable_size_ == MAX_VARS_AMOUNT) {
+        LOG(ERROR, "More than %d variables\n", MAX_VARS_AMOUNT);
+        syntax_failed_ = true;
+        return 0;
+    }
     strncpy(var_nametable_[var_nametable_size_++].name, name, MAX_NAME_LEN);
     return var_nametable_size_ - 1;
 }
@@ -177,6 +202,19 @@ double exp_tree_t::find_name_in_nametable(char* name) {
     return -1;
 }
 
+bool exp_tree_t::find_var(const char* name, size_t* var_id) {
+    assert(name != nullptr);
+    assert(var_id != nullptr);
+
+    for (size_t i = 0; i < var_nametable_size_; i++) {
+        if (strncmp(var_nametable_[i].name, name, MAX_NAME_LEN) == 0) {
+            *var_id = i;
+            return true;
+        }
+    }
+    return false;
+}
+
 void exp_tree_t::print_var_nametable() {
     for (size_t i = 0; i < var_nametable_size_; i++) {
         printf("name[%zu]: %s\n", i, var_nametable_[i].name);
@@ -214,34 +252,26 @@ void exp_tree_t::parse_number(text_t* text, size_t* ip, node_t* node) {
     node->left = nullptr;
     node->type = NUM;
 
-    int num = 0;
-    while (text->symbols[*ip] >= '0' && text->symbols[*ip] <= '9') {
-        if (num > INT_MAX / 10) {
-            LOG(ERROR, "SYNTAX ERROR: Num is greater than MAX_INT");
-            return;
-        }
-        num = (num * 10) + (text->symbols[*ip] - '0');
-        (*ip)++;
-    }
-
-    if (text->symbols[*ip] != '.') {
-        node->value = (double) num;
-        return;
+    // N as in grammar.txt: what "%.17g" prints for a finite value, so printed trees read back.
+    // strtod() on its own would also take hex, "inf" and "nan".
+    size_t end = *ip;
+    while (isdigit(text->symbols[end])) end++;
+    if (text->symbols[end] == '.') {
+        end++;
+        while (isdigit(text->symbols[end])) end++;
     }
-    (*ip)++;
-
-    int dec = 0;
-    while (text->symbols[*ip] >= '0' && text->symbols[*ip] <= '9') {
-        if (num > INT_MAX / 10) {
-            LOG(ERROR, "SYNTAX ERROR: Num is greater than MAX_INT");
-            return;
+    if (text->symbols[end] == 'e' || text->symbols[end] == 'E') {
+        size_t exponent = end + 1;
+        if (text->symbols[exponent] == '+' || text->symbols[exponent] == '-') exponent++;
+        if (isdigit(text->symbols[exponent])) {
+            while (isdigit(text->symbols[exponent])) exponent++;
+            end = exponent;
         }
-
-        dec++;
-        num = (num * 10) + text->symbols[*ip] - '0';
-        (*ip)++;
     }
 
-    node->value = (dec == 0) ? (double) num : (double) num / dec;
-    return;
+    unsigned char next = text->symbols[end];
+    text->symbols[end] = '\0';
+    node->value = strtod((const char*) &text->symbols[*ip], nullptr);
+    text->symbols[end] = next;
+    *ip = end;
 }
@@ -1,11 +1,28 @@
 #include "expression_tree.h"
 #include "logger.h"
+#include "trace.h"
 
-// TODO - верификатор: нет циклов, все что не листья - операторы, у var, num нетс детей
+static bool is_ancestor(node_t* node, node_t* ancestor);
+
+//===================================VERIFICATION================================================
+// One walk over the parent links, without recursion and without extra memory. A child is
+// entered only when its parent link points back to the node it is reached from and the
+// two children differ, so no node is entered twice: that rules out cycles and shared
+// subtrees at once, and makes the parent links safe to climb back up.
+
+void exp_tree_t::set_verify_sampling(size_t period) {
+    verify_period_ = period;
+    verify_calls_ = 0;
+}
 
 err_t exp_tree_t::verify(node_t* root) {
+    if (verify_period_ == 0 || verify_calls_++ % verify_period_ != 0) {
+        return NO_ERR;
+    }
+    TRACE_FUNCTION();
+
     if (root == nullptr) {
-        LOG(WARNING, "Root is nullptr, tree does not exist");
+        LOG(WARNING, "Root is nullptr, tree does not exist\n");
         return NO_ERR;
     }
 
@@ -14,80 +31,94 @@ err_t exp_tree_t::verify(node_t* root) {
         return INVALID_ROOT_ERR;
     }
 
-    if (is_tree_acyclic_r(root, nullptr) == false) {
-        LOG(ERROR, "Tree is not acyclic\n");
-        return CYCLIC_LINKING_ERR;
-    }
+    node_t* prev = nullptr;
+    node_t* node = root;
+    while (node != nullptr) {
+        node_t* child = nullptr;
 
-    err_t tree_op_err_status = check_op_type_invariants_r(root);
-    if (tree_op_err_status != NO_ERR) {
-        LOG(ERROR, "Operator invariants errpor\n");
-        return tree_op_err_status;
-    }
-    return NO_ERR;
-}
-
-err_t exp_tree_t::check_op_type_invariants_r(node_t* node) {
-    if (node == nullptr) return NO_ERR;
-
-    err_t subtree_err = NO_ERR;
+        if (prev == node->parent) {
+            err_t err = check_node(node);
+            if (err != NO_ERR) return err;
 
-    if (node->right != nullptr) {
-        subtree_err = check_op_type_invariants_r(node->right);
-        if (subtree_err != NO_ERR) return subtree_err;
-    }
-
-    if (node->left != nullptr) {
-        subtree_err = check_op_type_invariants_r(node->left);
-        if (subtree_err != NO_ERR) return subtree_err;
-    }
-
-    if (node->type == NUM || node->type == VAR) {
-        if (!(node->right == nullptr && node->left == nullptr)) {
-            LOG(ERROR, "Node %p with type NUM/VAR cannot have childs\n", node);
-            return NUM_INVAR_ERR;
-        }
-    }
-
-    if (node->type == OP) {
-        if (is_unary(node->value) && (node->right == nullptr || node->left != nullptr)) {
-            LOG(ERROR, "Node %p(right child %p, left child %p) is unary op, it must have only right child",
-                        node, node->right, node->left);
-            return UN_OP_INVAR_ERR;
+            child = (node->left != nullptr) ? node->left : node->right;
         }
-        else if ((int) node->value != SUB && (int) node->value != ADD &&
-                (node->right == nullptr || node->left == nullptr)) {
-            LOG(ERROR, "Binary operator must have two childs\n");
-            return BIN_OP_INVAR_ERR;
+        else if (prev == node->left) {
+            child = node->right;
         }
-        else if ((int) node->value == SUB && node->right == nullptr) {
-            LOG(ERROR, "Operation SUB does not allow right null child\n");
-            return SUB_SYNTAX_ERR;
-        }
-        else if ((int) node->value == ADD && node->right == nullptr) {
-            LOG(ERROR, "Operation ADD does not allow right null child\n");
-            return ADD_SYNTAX_ERR;
+
+        if (child != nullptr && child->parent != node) {
+            if (child == node || is_ancestor(node, child)) {
+                LOG(ERROR, "Node %p links its ancestor %p\n", node, child);
+                return CYCLIC_LINKING_ERR;
+            }
+            LOG(ERROR, "Node %p links %p, whose parent is %p: the subtree is shared or the link is stale\n",
+                       node, child, child->parent);
+            return PARENT_LINK_ERR;
         }
+
+        prev = node;
+        node = (child != nullptr) ? child : node->parent;
     }
     return NO_ERR;
 }
 
-bool exp_tree_t::is_tree_acyclic_r(node_t* node, node_t* parent) {
-    if (node == nullptr) return true;
+// Arity of every op_t: ADD and SUB may be unary with the operand on the right, functions
+// keep their operand on the left.
+err_t exp_tree_t::check_node(node_t* node) {
+    if (node->left != nullptr && node->left == node->right) {
+        LOG(ERROR, "Node %p links %p as both children\n", node, node->left);
+        return SHARED_NODE_ERR;
+    }
 
-    if (node->parent != parent) {
-        return false;
+    switch (node->type) {
+        case NUM:
+        case VAR:
+            if (!(node->right == nullptr && node->left == nullptr)) {
+                LOG(ERROR, "Node %p with type NUM/VAR cannot have childs\n", node);
+                return NUM_INVAR_ERR;
+            }
+            if (node->type == VAR && !(node->value >= 0 && node->value < (double) var_nametable_size_)) {
+                LOG(ERROR, "Node %p refers to variable %g, there are %zu\n", node, node->value, var_nametable_size_);
+                return INVALID_VALUE_ERR;
+            }
+            return NO_ERR;
+        case OP:
+            break;
+        default:
+            LOG(ERROR, "Node %p has unknown type %d\n", node, node->type);
+            return INVALID_VALUE_ERR;
     }
 
-    bool is_acyclic_right = true;
-    bool is_acyclic_left = true;
+    if ((int) node->value < ADD || (int) node->value > ARCCTH) {
+        LOG(ERROR, "Node %p has unknown operator %g\n", node, node->value);
+        return INVALID_VALUE_ERR;
+    }
 
-    if (node->right != nullptr) {
-        is_acyclic_right = is_tree_acyclic_r(node->right, node);
+    if (is_function(node->value) && (node->left == nullptr || node->right != nullptr)) {
+        LOG(ERROR, "Node %p(right child %p, left child %p) is unary op, it must have only left child\n",
+                    node, node->right, node->left);
+        return UN_OP_INVAR_ERR;
+    }
+    else if ((int) node->value == SUB && node->right == nullptr) {
+        LOG(ERROR, "Operation SUB does not allow right null child\n");
+        return SUB_SYNTAX_ERR;
+    }
+    else if ((int) node->value == ADD && node->right == nullptr) {
+        LOG(ERROR, "Operation ADD does not allow right null child\n");
+        return ADD_SYNTAX_ERR;
     }
+    else if (!is_function(node->value) && (int) node->value != SUB && (int) node->value != ADD &&
+             (node->right == nullptr || node->left == nullptr)) {
+        LOG(ERROR, "Binary operator %p must have two childs\n", node);
+        return BIN_OP_INVAR_ERR;
+    }
+    return NO_ERR;
+}
 
-    if (node->left != nullptr) {
-        is_acyclic_left = is_tree_acyclic_r(node->left, node);
+// The parent links above a node are checked by the time it is reached.
+static bool is_ancestor(node_t* node, node_t* ancestor) {
+    for (; node != nullptr; node = node->parent) {
+        if (node == ancestor) return true;
     }
-    return is_acyclic_right && is_acyclic_left;
+    return false;
 }